@@ -0,0 +1,873 @@
+//------------------------------------------------------------------------------
+// File: benchmarks.cc
+// Author: Elvin Sindrilaru <esindril@cern.ch>
+//------------------------------------------------------------------------------
+
+/*******************************************************************************
+ * RadosVectMap                                                                *
+ * Copyright (C) 2015 CERN/Switzerland                                         *
+ *                                                                             *
+ * This program is free software: you can redistribute it and/or modify        *
+ * it under the terms of the GNU General Public License as published by        *
+ * the Free Software Foundation, either version 3 of the License, or           *
+ * (at your option) any later version.                                         *
+ *                                                                             *
+ * This program is distributed in the hope that it will be useful,             *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                *
+ * GNU General Public License for more details.                                *
+ *                                                                             *
+ * You should have received a copy of the GNU General Public License           *
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.        *
+ ******************************************************************************/
+
+//------------------------------------------------------------------------------
+// Benchmarks of the map operations against a local backend, so that they run
+// anywhere with the same code path as against a cluster. The environment
+// variable RVMAP_BENCH_LATENCY_US adds a latency to every backend operation
+// and RVMAP_BENCH_DIR selects the local-file backend in the given directory
+// instead of the memory one. RVMAP_BENCH_LARGE adds the sizes which need
+// several GB of memory. Run with --benchmark_out=<file>
+// --benchmark_out_format=json, or build the benchmarks_json target, to get
+// the results in JSON format. The backend does the IO from its own thread so
+// the benchmarks touching it are measured in wall-clock time.
+//------------------------------------------------------------------------------
+
+#include <new>
+#include <memory>
+#include <string>
+#include <vector>
+#include <random>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <unistd.h>
+#include <malloc.h>
+#include <benchmark/benchmark.h>
+#include "src/RadosMap.hh"
+#include "src/Backend.hh"
+#include "src/LocalIndex.hh"
+#include "src/SharedMap.hh"
+
+namespace {
+
+  //! Number of allocations done by the current thread, the backend does its
+  //! IO from its own thread which is not accounted
+  thread_local uint64_t gNumAllocs {0};
+}
+
+//------------------------------------------------------------------------------
+// Count the allocations of the benchmarks, kept out of line so the compiler
+// does not pair the inlined free() with the builtin operator new
+//------------------------------------------------------------------------------
+__attribute__((noinline)) void* operator new(size_t size)
+{
+  ++gNumAllocs;
+
+  if (void* ptr = malloc(size ? size : 1))
+    return ptr;
+
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* ptr) noexcept
+{
+  free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr, size_t) noexcept
+{
+  free(ptr);
+}
+
+namespace {
+
+  typedef rados::map<std::string, std::string> map_t;
+  const std::string COOKIE {"bench"};
+
+  //----------------------------------------------------------------------------
+  // Create the backend selected by the environment
+  //----------------------------------------------------------------------------
+  std::shared_ptr<rados::backend> MakeBackend()
+  {
+    const char* latency_env = getenv("RVMAP_BENCH_LATENCY_US");
+    const char* dir_env = getenv("RVMAP_BENCH_DIR");
+    std::chrono::microseconds latency(latency_env ? std::stoull(latency_env) : 0);
+
+    if (dir_env)
+      return std::make_shared<rados::file_backend>(dir_env, latency);
+
+    return std::make_shared<rados::memory_backend>(latency);
+  }
+
+  //----------------------------------------------------------------------------
+  // Build a key or value of the given size ending with the index
+  //----------------------------------------------------------------------------
+  std::string MakeString(const char* prefix, uint64_t index, uint64_t size)
+  {
+    std::string str = prefix + std::to_string(index);
+
+    if (str.length() < size)
+      str.insert(0, size - str.length(), 'x');
+
+    return str;
+  }
+
+  //----------------------------------------------------------------------------
+  // Fill a map with the given number of entries
+  //----------------------------------------------------------------------------
+  void FillMap(map_t& map, uint64_t map_size, uint64_t key_size,
+               uint64_t value_size)
+  {
+    const uint64_t batch_size {1000};
+    std::vector<std::pair<std::string, std::string>> entries;
+
+    for (uint64_t i = 0; i < map_size; ++i)
+    {
+      entries.emplace_back(MakeString("key_", i, key_size),
+                           MakeString("value_", i, value_size));
+
+      if ((entries.size() == batch_size) || (i + 1 == map_size))
+      {
+        (void) map.insert_many(entries);
+        entries.clear();
+      }
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  // Write a binary changelog object holding the given number of inserts
+  //----------------------------------------------------------------------------
+  uint64_t WriteChangeLog(rados::backend& store, const std::string& name,
+                          uint64_t num_entries, uint64_t key_size,
+                          uint64_t value_size)
+  {
+    std::string obj_id = "/map/" + name + "/" + COOKIE;
+    std::string data = rados::ChangeLog::Header();
+
+    for (uint64_t i = 0; i < num_entries; ++i)
+      rados::ChangeLog::EncodeInsert(MakeString("key_", i, key_size),
+                                     MakeString("value_", i, value_size), data);
+
+    librados::bufferlist chlog_data;
+    chlog_data.append(data);
+    rados::backend::omap_t omap;
+    omap["obj_epoch_key"].append(std::to_string(num_entries));
+    (void) store.remove(obj_id);
+    (void) store.write_full(obj_id, chlog_data);
+    (void) store.omap_set(obj_id, omap);
+    return data.length();
+  }
+}
+
+//------------------------------------------------------------------------------
+// Synchronous inserts into a map of a given size
+// Args: key size, value size, initial map size
+//------------------------------------------------------------------------------
+static void BM_Insert(benchmark::State& state)
+{
+  uint64_t key_size = state.range(0);
+  uint64_t value_size = state.range(1);
+  auto store = MakeBackend();
+  map_t map(store, "bench_insert", COOKIE, false);
+  FillMap(map, state.range(2), key_size, value_size);
+  uint64_t index = state.range(2);
+
+  for (auto _: state)
+  {
+    auto ret = map.insert(MakeString("key_", index, key_size),
+                          MakeString("value_", index, value_size));
+    benchmark::DoNotOptimize(ret);
+    ++index;
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_Insert)
+->ArgNames({"key", "value", "map"})
+->ArgsProduct({{16, 128}, {16, 1024}, {0, 100000}})
+->Unit(benchmark::kMicrosecond)
+->UseRealTime();
+
+//------------------------------------------------------------------------------
+// Allocations of the steady-state mutations and lookups on the thread using
+// the map, keys and values are longer than the small string buffer. The keys
+// and values are built up front, then either copied or moved in.
+// Args: 0 to copy the arguments, 1 to move them
+//------------------------------------------------------------------------------
+static void BM_MutationAllocs(benchmark::State& state)
+{
+  bool move = state.range(0);
+  uint64_t num_ops {20000};
+  auto store = MakeBackend();
+  map_t map(store, "bench_allocs", COOKIE, false);
+  FillMap(map, 1000, 32, 64);
+  std::vector<std::string> keys;
+  std::vector<std::string> values;
+
+  for (uint64_t i = 0; i < num_ops; ++i)
+  {
+    keys.push_back(MakeString("key_", 1000 + i, 32));
+    values.push_back(MakeString("value_", 1000 + i, 64));
+  }
+
+  uint64_t insert_allocs {0};
+  uint64_t erase_allocs {0};
+  uint64_t find_allocs {0};
+
+  for (auto _: state)
+  {
+    uint64_t start = gNumAllocs;
+
+    for (uint64_t i = 0; i < num_ops; ++i)
+    {
+      if (move)
+        (void) map.insert(std::move(keys[i]), std::move(values[i]));
+      else
+        (void) map.insert(keys[i], values[i]);
+    }
+
+    insert_allocs += gNumAllocs - start;
+    start = gNumAllocs;
+    char key[32];
+
+    for (uint64_t i = 0; i < num_ops; ++i)
+    {
+      std::string_view kview(key, snprintf(key, sizeof(key), "key_%lu", 1000 + i));
+      benchmark::DoNotOptimize(map.find(kview, map_t::consistency::local));
+    }
+
+    find_allocs += gNumAllocs - start;
+    state.PauseTiming();
+
+    for (uint64_t i = 0; i < num_ops; ++i)
+    {
+      keys[i] = MakeString("key_", 1000 + i, 32);
+      values[i] = MakeString("value_", 1000 + i, 64);
+    }
+
+    state.ResumeTiming();
+    start = gNumAllocs;
+
+    for (uint64_t i = 0; i < num_ops; ++i)
+      map.erase(keys[i]);
+
+    erase_allocs += gNumAllocs - start;
+  }
+
+  uint64_t num = state.iterations() * num_ops;
+  state.counters["allocs_per_insert"] = (double)insert_allocs / num;
+  state.counters["allocs_per_erase"] = (double)erase_allocs / num;
+  state.counters["allocs_per_find"] = (double)find_allocs / num;
+}
+
+BENCHMARK(BM_MutationAllocs)
+->ArgName("move")->Arg(0)->Arg(1)
+->Unit(benchmark::kMillisecond)
+->UseRealTime();
+
+//------------------------------------------------------------------------------
+// Synchronous erases from a map of a given size, the erased key is put back
+// outside of the timed region
+// Args: key size, value size, map size
+//------------------------------------------------------------------------------
+static void BM_Erase(benchmark::State& state)
+{
+  uint64_t key_size = state.range(0);
+  uint64_t value_size = state.range(1);
+  uint64_t map_size = std::max<uint64_t>(state.range(2), 1);
+  auto store = MakeBackend();
+  map_t map(store, "bench_erase", COOKIE, false);
+  FillMap(map, map_size, key_size, value_size);
+  uint64_t index {0};
+
+  for (auto _: state)
+  {
+    std::string key = MakeString("key_", index++ % map_size, key_size);
+    map.erase(key);
+    state.PauseTiming();
+    (void) map.insert(key, MakeString("value_", index, value_size));
+    state.ResumeTiming();
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_Erase)
+->ArgNames({"key", "value", "map"})
+->ArgsProduct({{16, 128}, {16, 1024}, {1000, 100000}})
+->Unit(benchmark::kMicrosecond)
+->UseRealTime();
+
+//------------------------------------------------------------------------------
+// Changelog replay done when a map is loaded without a snapshot
+// Args: key size, value size, number of entries
+//------------------------------------------------------------------------------
+static void BM_Replay(benchmark::State& state)
+{
+  auto store = MakeBackend();
+  uint64_t chlog_len = WriteChangeLog(*store, "bench_replay", state.range(2),
+                                      state.range(0), state.range(1));
+
+  for (auto _: state)
+  {
+    map_t map(store, "bench_replay", COOKIE);
+    benchmark::DoNotOptimize(map.size());
+  }
+
+  state.SetBytesProcessed(state.iterations() * chlog_len);
+  state.SetItemsProcessed(state.iterations() * state.range(2));
+  (void) store->remove("/map/bench_replay/" + COOKIE);
+}
+
+BENCHMARK(BM_Replay)
+->ArgNames({"key", "value", "entries"})
+->ArgsProduct({{16, 128}, {16, 1024}, {10000, 100000}})
+->Unit(benchmark::kMillisecond)
+->UseRealTime();
+
+//------------------------------------------------------------------------------
+// Commit of a writer whose epoch is behind because of another writer: the
+// commit fails on the epoch check, the writer catches up and commits again.
+// Every backend operation takes the given latency.
+// Args: latency in microseconds
+//------------------------------------------------------------------------------
+static void BM_ConflictRecovery(benchmark::State& state)
+{
+  auto store = std::make_shared<rados::memory_backend>(
+    std::chrono::microseconds(state.range(0)));
+  map_t other(store, "bench_conflict", COOKIE, false);
+  map_t map(store, "bench_conflict", COOKIE);
+  uint64_t index {0};
+
+  for (auto _: state)
+  {
+    state.PauseTiming();
+    (void) other.insert(MakeString("other_", index, 16), "value");
+    state.ResumeTiming();
+    auto ret = map.insert(MakeString("key_", index, 16), "value");
+    benchmark::DoNotOptimize(ret);
+    ++index;
+  }
+
+  state.counters["round_trips"] = benchmark::Counter(
+    map.latency(map_t::stage::round_trip).mCount, benchmark::Counter::kAvgIterations);
+}
+
+BENCHMARK(BM_ConflictRecovery)
+->ArgName("latency_us")
+->Arg(100)->Arg(1000)
+->Unit(benchmark::kMicrosecond)
+->UseRealTime();
+
+//------------------------------------------------------------------------------
+// Compaction of a changelog holding twice as many entries as the map
+// Args: key size, value size, map size
+//------------------------------------------------------------------------------
+static void BM_Compaction(benchmark::State& state)
+{
+  uint64_t key_size = state.range(0);
+  uint64_t value_size = state.range(1);
+  uint64_t map_size = state.range(2);
+  auto store = MakeBackend();
+
+  for (auto _: state)
+  {
+    state.PauseTiming();
+    (void) WriteChangeLog(*store, "bench_compact", map_size * 2, key_size,
+                          value_size);
+    std::unique_ptr<map_t> map {new map_t(store, "bench_compact", COOKIE, false)};
+    std::vector<std::string> keys;
+
+    for (uint64_t i = map_size; i < map_size * 2; ++i)
+      keys.push_back(MakeString("key_", i, key_size));
+
+    (void) map->erase_many(keys);
+    state.ResumeTiming();
+    benchmark::DoNotOptimize(map->compact());
+    state.PauseTiming();
+    map.reset();
+    state.ResumeTiming();
+  }
+
+  state.SetItemsProcessed(state.iterations() * map_size);
+}
+
+BENCHMARK(BM_Compaction)
+->ArgNames({"key", "value", "map"})
+->ArgsProduct({{16}, {16, 1024}, {1000, 10000, 100000}})
+->Unit(benchmark::kMillisecond)
+->UseRealTime();
+
+//------------------------------------------------------------------------------
+// Cold start of a compacted map i.e. snapshot load and replay of the tail
+// Args: key size, value size, map size
+//------------------------------------------------------------------------------
+static void BM_ColdStart(benchmark::State& state)
+{
+  uint64_t map_size = state.range(2);
+  auto store = MakeBackend();
+
+  {
+    map_t map(store, "bench_start", COOKIE);
+    FillMap(map, map_size, state.range(0), state.range(1));
+    (void) map.compact();
+
+    // Leave a tail of 10% of the map after the snapshot
+    for (uint64_t i = 0; i < map_size / 10; ++i)
+      (void) map.insert(MakeString("tail_", i, state.range(0)), "value");
+  }
+
+  for (auto _: state)
+  {
+    map_t map(store, "bench_start", COOKIE);
+    benchmark::DoNotOptimize(map.size());
+  }
+
+  state.SetItemsProcessed(state.iterations() * map_size);
+  map_t cleanup(store, "bench_start", COOKIE, false);
+}
+
+BENCHMARK(BM_ColdStart)
+->ArgNames({"key", "value", "map"})
+->ArgsProduct({{16}, {16, 1024}, {10000, 100000}})
+->Unit(benchmark::kMillisecond)
+->UseRealTime();
+
+//------------------------------------------------------------------------------
+// Full load of a map never compacted depending on the chunking of the reads,
+// the chunks are applied while the next ones are in flight
+// Args: chunk size in KB, number of reads in flight
+//------------------------------------------------------------------------------
+static void BM_StreamingLoad(benchmark::State& state)
+{
+  const uint64_t map_size {100000};
+  auto store = MakeBackend();
+  map_t::load_options load(state.range(0) * 1024, state.range(1));
+
+  {
+    map_t map(store, "bench_streaming_load", COOKIE);
+    FillMap(map, map_size, 16, 16);
+  }
+
+  for (auto _: state)
+  {
+    map_t map(store, "bench_streaming_load", COOKIE, true, false, "", load);
+    benchmark::DoNotOptimize(map.size());
+  }
+
+  state.SetItemsProcessed(state.iterations() * map_size);
+  map_t cleanup(store, "bench_streaming_load", COOKIE, false);
+}
+
+BENCHMARK(BM_StreamingLoad)
+->ArgNames({"chunk_kb", "inflight"})
+->ArgsProduct({{64, 1024, 1 << 20}, {1, 4}})
+->Unit(benchmark::kMillisecond)
+->UseRealTime();
+
+//------------------------------------------------------------------------------
+// Full load of a changelog read in a single chunk, its records decoded by a
+// given number of threads. The rate is the changelog size replayed per
+// second.
+// Args: replay threads
+//------------------------------------------------------------------------------
+static void BM_ParallelReplay(benchmark::State& state)
+{
+  const uint64_t map_size {200000};
+  auto store = MakeBackend();
+  map_t::load_options load(1 << 30, 1, state.range(0));
+  uint64_t log_size {0};
+
+  {
+    map_t map(store, "bench_parallel_replay", COOKIE);
+    FillMap(map, map_size, 16, 64);
+    log_size = map.stats().mLogSize;
+  }
+
+  for (auto _: state)
+  {
+    map_t map(store, "bench_parallel_replay", COOKIE, true, false, "", load);
+    benchmark::DoNotOptimize(map.size());
+  }
+
+  state.SetBytesProcessed(state.iterations() * log_size);
+  map_t cleanup(store, "bench_parallel_replay", COOKIE, false);
+}
+
+BENCHMARK(BM_ParallelReplay)
+->ArgName("threads")
+->RangeMultiplier(2)->Range(1, 8)
+->Unit(benchmark::kMillisecond)
+->UseRealTime();
+
+//------------------------------------------------------------------------------
+// Full load of a changelog in which every key is rewritten a number of times,
+// written directly to the backend as a map compacts such a changelog. Only
+// the last record of each key reaches the local map.
+// Args: writes per key
+//------------------------------------------------------------------------------
+static void BM_UpdateHeavyLoad(benchmark::State& state)
+{
+  const uint64_t map_size {10000};
+  uint64_t num_writes = state.range(0);
+  auto store = MakeBackend();
+  std::string obj_id = std::string("/map/bench_update_heavy/") + COOKIE;
+  std::string chlog = rados::ChangeLog::Header();
+
+  for (uint64_t round = 0; round < num_writes; ++round)
+  {
+    for (uint64_t i = 0; i < map_size; ++i)
+      rados::ChangeLog::EncodeInsert(MakeString("key_", i, 16),
+                                     MakeString("value_", round, 16), chlog);
+  }
+
+  librados::bufferlist chlog_data;
+  chlog_data.append(chlog);
+  std::map<std::string, librados::bufferlist> omap;
+  omap["obj_epoch_key"].append(std::to_string(map_size * num_writes));
+  (void) store->write_full(obj_id, chlog_data);
+  (void) store->omap_set(obj_id, omap);
+
+  for (auto _: state)
+  {
+    map_t map(store, "bench_update_heavy", COOKIE);
+    benchmark::DoNotOptimize(map.size());
+  }
+
+  state.SetItemsProcessed(state.iterations() * map_size);
+  state.SetBytesProcessed(state.iterations() * chlog.length());
+  map_t cleanup(store, "bench_update_heavy", COOKIE, false);
+}
+
+BENCHMARK(BM_UpdateHeavyLoad)
+->ArgName("writes")
+->Arg(1)->Arg(10)->Arg(100)
+->Unit(benchmark::kMillisecond)
+->UseRealTime();
+
+//------------------------------------------------------------------------------
+// Full load of a map never compacted whose keys were inserted in ascending
+// order, the records are appended to the index whatever the number of
+// replay threads
+// Args: map size, replay threads
+//------------------------------------------------------------------------------
+template <typename Index>
+static void BM_SortedLogLoad(benchmark::State& state)
+{
+  typedef rados::map<std::string, std::string, Index> index_map_t;
+  uint64_t map_size = state.range(0);
+  auto store = MakeBackend();
+  typename index_map_t::load_options load(4 << 20, 4, state.range(1));
+  std::string obj_id = std::string("/map/bench_sorted_log_load/") + COOKIE;
+  std::string chlog = rados::ChangeLog::Header();
+  char key[32];
+
+  for (uint64_t i = 0; i < map_size; ++i)
+  {
+    snprintf(key, sizeof(key), "k%014lu", i);
+    rados::ChangeLog::EncodeInsert(std::string(key), MakeString("value_", i, 16),
+                                   chlog);
+  }
+
+  librados::bufferlist chlog_data;
+  chlog_data.append(chlog);
+  std::map<std::string, librados::bufferlist> omap;
+  omap["obj_epoch_key"].append(std::to_string(map_size));
+  (void) store->write_full(obj_id, chlog_data);
+  (void) store->omap_set(obj_id, omap);
+
+  for (auto _: state)
+  {
+    index_map_t map(store, "bench_sorted_log_load", COOKIE, true, false, "",
+                    load);
+    benchmark::DoNotOptimize(map.size());
+  }
+
+  state.SetItemsProcessed(state.iterations() * map_size);
+  index_map_t cleanup(store, "bench_sorted_log_load", COOKIE, false);
+}
+
+BENCHMARK_TEMPLATE(BM_SortedLogLoad, std::map<std::string, std::string>)
+->ArgNames({"map", "threads"})->ArgsProduct({{25000, 200000}, {1, 4}})
+->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_SortedLogLoad, rados::flat_map<std::string, std::string>)
+->ArgNames({"map", "threads"})->ArgsProduct({{25000, 200000}, {1, 4}})
+->Unit(benchmark::kMillisecond)->UseRealTime();
+
+//------------------------------------------------------------------------------
+// Warm start of a map never compacted from the local cache file, compared to
+// BM_ColdStart. The cache is saved again when each map goes away, therefore
+// only the first start reads a tail.
+// Args: key size, value size, map size
+//------------------------------------------------------------------------------
+static void BM_WarmStart(benchmark::State& state)
+{
+  uint64_t map_size = state.range(2);
+  auto store = MakeBackend();
+  std::string cache_path = "/tmp/rvmap_bench_cache." + std::to_string(getpid());
+
+  {
+    map_t map(store, "bench_warm_start", COOKIE, true, false, cache_path);
+    FillMap(map, map_size, state.range(0), state.range(1));
+  }
+
+  for (auto _: state)
+  {
+    std::unique_ptr<map_t> map(new map_t(store, "bench_warm_start", COOKIE,
+                                         true, false, cache_path));
+    benchmark::DoNotOptimize(map->size());
+    state.PauseTiming();
+    map.reset();
+    state.ResumeTiming();
+  }
+
+  state.SetItemsProcessed(state.iterations() * map_size);
+  map_t cleanup(store, "bench_warm_start", COOKIE, false);
+  (void) unlink(cache_path.c_str());
+}
+
+BENCHMARK(BM_WarmStart)
+->ArgNames({"key", "value", "map"})
+->ArgsProduct({{16}, {16, 1024}, {10000, 100000}})
+->Unit(benchmark::kMillisecond)
+->UseRealTime();
+
+//------------------------------------------------------------------------------
+// Point lookups in a local index holding a given number of keys, all hits
+// in random order. The memory per entry is the growth of the heap while
+// loading the index, keys fit in the small string buffer.
+// Args: number of keys
+//------------------------------------------------------------------------------
+template <typename Index>
+static void BM_IndexLookup(benchmark::State& state)
+{
+  uint64_t num_keys = state.range(0);
+  auto make_key = [](uint64_t i) {
+    char key[24];
+    snprintf(key, sizeof(key), "k%014lu", i);
+    return std::string(key);
+  };
+  auto heap_used = []() {
+    struct mallinfo2 info = mallinfo2();
+    return (uint64_t)(info.uordblks + info.hblkhd);
+  };
+  uint64_t heap_start = heap_used();
+  Index index;
+
+  // Keys are loaded in order like from a snapshot
+  for (uint64_t i = 0; i < num_keys; ++i)
+    (void) index.insert(std::make_pair(make_key(i), i));
+
+  double bytes_per_entry = (double)(heap_used() - heap_start) / num_keys;
+  std::vector<std::string> keys;
+  std::minstd_rand rng(42);
+
+  for (uint64_t i = 0; i < 1024 * 1024; ++i)
+    keys.push_back(make_key(rng() % num_keys));
+
+  uint64_t pos {0};
+
+  for (auto _: state)
+  {
+    auto iter = index.find(keys[pos++ & (keys.size() - 1)]);
+    benchmark::DoNotOptimize(iter->second);
+  }
+
+  state.SetItemsProcessed(state.iterations());
+  state.counters["bytes_per_entry"] = bytes_per_entry;
+}
+
+//------------------------------------------------------------------------------
+// Index sizes of BM_IndexLookup. The 50M keys one needs several GB and is
+// only registered if RVMAP_BENCH_LARGE is set.
+//------------------------------------------------------------------------------
+static void IndexLookupArgs(benchmark::internal::Benchmark* bench)
+{
+  bench->ArgName("keys")->Arg(1 << 20)->Arg(10 << 20);
+
+  if (getenv("RVMAP_BENCH_LARGE"))
+    bench->Arg(50 << 20);
+}
+
+BENCHMARK_TEMPLATE(BM_IndexLookup, std::map<std::string, uint64_t>)
+->Apply(IndexLookupArgs);
+BENCHMARK_TEMPLATE(BM_IndexLookup, rados::flat_map<std::string, uint64_t>)
+->Apply(IndexLookupArgs);
+BENCHMARK_TEMPLATE(BM_IndexLookup, rados::hash_map<std::string, uint64_t>)
+->Apply(IndexLookupArgs);
+
+//------------------------------------------------------------------------------
+// Memory of a replica with path-like keys and a few distinct string values,
+// measured as the growth of the heap and as reported by memory_usage()
+// Args: number of keys
+//------------------------------------------------------------------------------
+template <typename Index>
+static void BM_IndexMemory(benchmark::State& state)
+{
+  uint64_t num_keys = state.range(0);
+  auto heap_used = []() {
+    struct mallinfo2 info = mallinfo2();
+    return (uint64_t)(info.uordblks + info.hblkhd);
+  };
+
+  for (auto _: state)
+  {
+    uint64_t heap_start = heap_used();
+    Index index;
+
+    for (uint64_t i = 0; i < num_keys; ++i)
+    {
+      std::string key = "/eos/user/data/run_" + std::to_string(i / 1000) +
+        "/file_" + std::to_string(i);
+      std::string value = MakeString("fsid_", i % 64, 48);
+      (void) index.insert_or_assign(key, std::move(value));
+    }
+
+    state.counters["bytes_per_entry"] =
+      (double)(heap_used() - heap_start) / num_keys;
+    state.counters["usage_per_entry"] =
+      (double)rados::index_memory_usage(index).total() / num_keys;
+  }
+}
+
+BENCHMARK_TEMPLATE(BM_IndexMemory, std::map<std::string, std::string>)
+->ArgName("keys")->Arg(1 << 20)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_IndexMemory, rados::hash_map<std::string, std::string>)
+->ArgName("keys")->Arg(1 << 20)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_IndexMemory, rados::arena_map<std::string, std::string>)
+->ArgName("keys")->Arg(1 << 20)->Unit(benchmark::kMillisecond);
+
+namespace {
+
+  //----------------------------------------------------------------------------
+  // Map whose readers and writer share a mutex
+  //----------------------------------------------------------------------------
+  class locked_map
+  {
+  public:
+    locked_map(std::shared_ptr<rados::backend> store, const std::string& name):
+      mMap(store, name, COOKIE, false)
+    {}
+
+    bool insert(std::string key, std::string value)
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      return mMap.insert(std::move(key), std::move(value)).second;
+    }
+
+    bool get(const std::string& key, std::string& value)
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      auto iter = mMap.find(key, map_t::consistency::local);
+
+      if (iter == mMap.end())
+        return false;
+
+      value = iter->second;
+      return true;
+    }
+
+  private:
+    std::mutex mMutex;
+    map_t mMap;
+  };
+
+  //----------------------------------------------------------------------------
+  // Map with lock-free readers
+  //----------------------------------------------------------------------------
+  class lock_free_map: public rados::shared_map<std::string, std::string>
+  {
+  public:
+    lock_free_map(std::shared_ptr<rados::backend> store, const std::string& name):
+      rados::shared_map<std::string, std::string>(store, name, COOKIE, false)
+    {}
+  };
+}
+
+//------------------------------------------------------------------------------
+// Point lookups from several threads while a writer keeps inserting new keys
+// in the background, the aggregate rate scales with the number of reader
+// threads only if the readers do not serialize with the writer.
+//------------------------------------------------------------------------------
+template <typename M>
+static void BM_ConcurrentLookup(benchmark::State& state)
+{
+  const uint64_t map_size {10000};
+  static std::unique_ptr<M> map;
+  static std::atomic<bool> done;
+  static std::thread writer;
+
+  if (state.thread_index() == 0)
+  {
+    map.reset(new M(MakeBackend(), "bench_concurrent_lookup"));
+
+    for (uint64_t i = 0; i < map_size; ++i)
+      (void) map->insert(MakeString("key_", i, 32), MakeString("value_", i, 64));
+
+    done = false;
+    writer = std::thread([&]() {
+        for (uint64_t i = map_size; !done; ++i)
+          (void) map->insert(MakeString("key_", i, 32), MakeString("value_", i, 64));
+      });
+  }
+
+  std::minstd_rand rng(state.thread_index());
+  std::string value;
+
+  for (auto _: state)
+  {
+    bool found = map->get(MakeString("key_", rng() % map_size, 32), value);
+    benchmark::DoNotOptimize(found);
+  }
+
+  state.SetItemsProcessed(state.iterations());
+
+  if (state.thread_index() == 0)
+  {
+    done = true;
+    writer.join();
+    map.reset();
+  }
+}
+
+BENCHMARK_TEMPLATE(BM_ConcurrentLookup, locked_map)
+->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_ConcurrentLookup, lock_free_map)
+->ThreadRange(1, 8)->UseRealTime();
+
+//------------------------------------------------------------------------------
+// Conversion of values to and from their string representation
+//------------------------------------------------------------------------------
+template <typename W>
+static void BM_ToString(benchmark::State& state)
+{
+  auto store = MakeBackend();
+  rados::map<std::string, W> map(store, "bench_conv", COOKIE, false);
+  W value = static_cast<W>(123456789.125);
+
+  for (auto _: state)
+    benchmark::DoNotOptimize(map.ToString(value));
+}
+
+template <typename W>
+static void BM_FromString(benchmark::State& state)
+{
+  auto store = MakeBackend();
+  rados::map<std::string, W> map(store, "bench_conv", COOKIE, false);
+  std::string sval = map.ToString(static_cast<W>(123456789.125));
+
+  for (auto _: state)
+    benchmark::DoNotOptimize(map.template FromString<W>(sval));
+}
+
+BENCHMARK_TEMPLATE(BM_ToString, uint64_t);
+BENCHMARK_TEMPLATE(BM_ToString, double);
+BENCHMARK_TEMPLATE(BM_ToString, float);
+BENCHMARK_TEMPLATE(BM_FromString, uint64_t);
+BENCHMARK_TEMPLATE(BM_FromString, double);
+BENCHMARK_TEMPLATE(BM_FromString, float);
+
+BENCHMARK_MAIN();
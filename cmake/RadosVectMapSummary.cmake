@@ -9,4 +9,5 @@ message(STATUS "Build type:        " ${CMAKE_BUILD_TYPE})
 message(STATUS "")
 message(STATUS "LibRados support:  " ${LIBRADOS_FOUND})
 message(STATUS "GTest support:     " ${GTEST_FOUND})
+message(STATUS "Benchmark support: " ${benchmark_FOUND})
 message(STATUS "----------------------------------------")
@@ -0,0 +1,871 @@
+//------------------------------------------------------------------------------
+// File: Backend.cc
+// Author: Elvin Sindrilaru <esindril@cern.ch>
+//------------------------------------------------------------------------------
+
+/*******************************************************************************
+ * RadosVectMap                                                                *
+ * Copyright (C) 2015 CERN/Switzerland                                         *
+ *                                                                             *
+ * This program is free software: you can redistribute it and/or modify        *
+ * it under the terms of the GNU General Public License as published by        *
+ * the Free Software Foundation, either version 3 of the License, or           *
+ * (at your option) any later version.                                         *
+ *                                                                             *
+ * This program is distributed in the hope that it will be useful,             *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                *
+ * GNU General Public License for more details.                                *
+ *                                                                             *
+ * You should have received a copy of the GNU General Public License           *
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.        *
+ ******************************************************************************/
+
+#include <cerrno>
+#include <cstdio>
+#include <cctype>
+#include <climits>
+#include <unistd.h>
+#include "Backend.hh"
+#include "RadosException.hh"
+
+namespace rados {
+
+  //----------------------------------------------------------------------------
+  // Add steps to a write operation
+  //----------------------------------------------------------------------------
+  void backend::write_op::create(bool exclusive)
+  {
+    step st(step::type::create);
+    st.mExclusive = exclusive;
+    mSteps.push_back(std::move(st));
+  }
+
+  void backend::write_op::omap_cmp(const omap_assert_t& assertions, int* prval)
+  {
+    step st(step::type::omap_cmp);
+    st.mPrval = prval;
+
+    for (auto&& elem: assertions)
+      st.mOmap[elem.first] = std::make_pair(elem.second.first.to_str(),
+                                            elem.second.second);
+
+    mSteps.push_back(std::move(st));
+  }
+
+  void backend::write_op::omap_set(const omap_t& kv)
+  {
+    step st(step::type::omap_set);
+
+    for (auto&& elem: kv)
+      st.mOmap[elem.first] = std::make_pair(elem.second.to_str(), 0);
+
+    mSteps.push_back(std::move(st));
+  }
+
+  void backend::write_op::append(const librados::bufferlist& bl)
+  {
+    step st(step::type::append);
+    st.mBuffer = bl.to_str();
+    mSteps.push_back(std::move(st));
+  }
+
+  void backend::write_op::append(std::string&& data)
+  {
+    step st(step::type::append);
+    st.mBuffer = std::move(data);
+    mSteps.push_back(std::move(st));
+  }
+
+  void backend::write_op::write_full(const librados::bufferlist& bl)
+  {
+    step st(step::type::write_full);
+    st.mBuffer = bl.to_str();
+    mSteps.push_back(std::move(st));
+  }
+
+  //----------------------------------------------------------------------------
+  // Add steps to a read operation
+  //----------------------------------------------------------------------------
+  void backend::read_op::omap_cmp(const omap_assert_t& assertions, int* prval)
+  {
+    step st(step::type::omap_cmp);
+    st.mPrval = prval;
+
+    for (auto&& elem: assertions)
+      st.mOmap[elem.first] = std::make_pair(elem.second.first.to_str(),
+                                            elem.second.second);
+
+    mSteps.push_back(std::move(st));
+  }
+
+  void backend::read_op::omap_get_vals_by_keys(const std::set<std::string>& keys,
+                                               omap_t* vals, int* prval)
+  {
+    step st(step::type::omap_get);
+    st.mPrval = prval;
+    st.mOmapOut = vals;
+
+    for (auto&& key: keys)
+      st.mOmap[key] = std::make_pair(std::string(), 0);
+
+    mSteps.push_back(std::move(st));
+  }
+
+  void backend::read_op::stat(uint64_t* psize, time_t* pmtime, int* prval)
+  {
+    step st(step::type::stat);
+    st.mPrval = prval;
+    st.mSize = psize;
+    st.mMtime = pmtime;
+    mSteps.push_back(std::move(st));
+  }
+
+  void backend::read_op::read(uint64_t off, uint64_t len, librados::bufferlist* bl,
+                              int* prval)
+  {
+    step st(step::type::read);
+    st.mPrval = prval;
+    st.mOff = off;
+    st.mLen = len;
+    st.mData = bl;
+    mSteps.push_back(std::move(st));
+  }
+
+  //----------------------------------------------------------------------------
+  // Completion of an asynchronous operation
+  //----------------------------------------------------------------------------
+  backend::completion::completion(callback_t cb):
+    mCallback(cb), mDone(false), mRet(0)
+  {}
+
+  void backend::completion::wait_for_complete()
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mCond.wait(lock, [&]() { return mDone; });
+  }
+
+  bool backend::completion::is_complete()
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mDone;
+  }
+
+  int backend::completion::get_return_value()
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mRet;
+  }
+
+  void backend::completion::complete(int ret)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mRet = ret;
+    }
+
+    if (mCallback)
+      mCallback(ret);
+
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mDone = true;
+    }
+
+    mCond.notify_all();
+  }
+
+  //----------------------------------------------------------------------------
+  // Convenience operations built on the compound ones
+  //----------------------------------------------------------------------------
+  int backend::stat(const std::string& obj_id, uint64_t* psize)
+  {
+    read_op op;
+    op.stat(psize, nullptr, nullptr);
+    return operate(obj_id, op);
+  }
+
+  int backend::read(const std::string& obj_id, librados::bufferlist& bl,
+                    uint64_t len, uint64_t off)
+  {
+    read_op op;
+    op.read(off, len, &bl, nullptr);
+    int ret = operate(obj_id, op);
+    return (ret < 0 ? ret : (int)bl.length());
+  }
+
+  int backend::omap_get_vals_by_keys(const std::string& obj_id,
+                                     const std::set<std::string>& keys,
+                                     omap_t* vals)
+  {
+    read_op op;
+    op.omap_get_vals_by_keys(keys, vals, nullptr);
+    return operate(obj_id, op);
+  }
+
+  int backend::write_full(const std::string& obj_id, const librados::bufferlist& bl)
+  {
+    write_op op;
+    op.write_full(bl);
+    return operate(obj_id, op);
+  }
+
+  int backend::omap_set(const std::string& obj_id, const omap_t& kv)
+  {
+    write_op op;
+    op.omap_set(kv);
+    return operate(obj_id, op);
+  }
+
+  //----------------------------------------------------------------------------
+  // RADOS backend
+  //----------------------------------------------------------------------------
+  rados_backend::rados_backend(librados::Rados& rados_cluster,
+                               const std::string& pool_name) noexcept(false)
+  {
+    if (rados_cluster.ioctx_create(pool_name.c_str(), mIoCtx))
+      throw RadosContainerException("unable to create ioctx for pool");
+  }
+
+  rados_backend::rados_backend(const librados::IoCtx& io_ctx):
+    mIoCtx(io_ctx)
+  {}
+
+  int rados_backend::operate(const std::string& obj_id, write_op& op)
+  {
+    librados::ObjectWriteOperation rados_op;
+    ToRados(op, rados_op);
+    return mIoCtx.operate(obj_id, &rados_op);
+  }
+
+  int rados_backend::operate(const std::string& obj_id, read_op& op)
+  {
+    librados::ObjectReadOperation rados_op;
+    ToRados(op, rados_op);
+    return mIoCtx.operate(obj_id, &rados_op, nullptr);
+  }
+
+  int rados_backend::aio_operate(const std::string& obj_id, write_op& op,
+                                 completion_ptr comp)
+  {
+    librados::ObjectWriteOperation rados_op;
+    ToRados(op, rados_op);
+    librados::AioCompletion* rados_comp = MakeCompletion(comp);
+    int ret = mIoCtx.aio_operate(obj_id, rados_comp, &rados_op);
+
+    if (ret)
+      rados_comp->release();
+
+    return ret;
+  }
+
+  int rados_backend::aio_operate(const std::string& obj_id, read_op& op,
+                                 completion_ptr comp)
+  {
+    librados::ObjectReadOperation rados_op;
+    ToRados(op, rados_op);
+    librados::AioCompletion* rados_comp = MakeCompletion(comp);
+    int ret = mIoCtx.aio_operate(obj_id, rados_comp, &rados_op, nullptr);
+
+    if (ret)
+      rados_comp->release();
+
+    return ret;
+  }
+
+  int rados_backend::remove(const std::string& obj_id)
+  {
+    return mIoCtx.remove(obj_id);
+  }
+
+  std::shared_ptr<update_channel> rados_backend::channel()
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    if (!mChannel)
+      mChannel = std::make_shared<rados_channel>(mIoCtx);
+
+    return mChannel;
+  }
+
+  void rados_backend::ToRados(write_op& op, librados::ObjectWriteOperation& rados_op)
+  {
+    for (auto&& st: op.mSteps)
+    {
+      switch (st.mType)
+      {
+        case step::type::create:
+          rados_op.create(st.mExclusive);
+          break;
+
+        case step::type::omap_cmp:
+        {
+          omap_assert_t assertions;
+
+          for (auto&& elem: st.mOmap)
+          {
+            assertions[elem.first].first.append(elem.second.first);
+            assertions[elem.first].second = elem.second.second;
+          }
+
+          rados_op.omap_cmp(assertions, st.mPrval);
+          break;
+        }
+
+        case step::type::omap_set:
+        {
+          omap_t kv;
+
+          for (auto&& elem: st.mOmap)
+            kv[elem.first].append(elem.second.first);
+
+          rados_op.omap_set(kv);
+          break;
+        }
+
+        case step::type::append:
+        case step::type::write_full:
+        {
+          librados::bufferlist bl;
+          bl.append(st.mBuffer);
+
+          if (st.mType == step::type::append)
+            rados_op.append(bl);
+          else
+            rados_op.write_full(bl);
+
+          break;
+        }
+
+        default:
+          break;
+      }
+    }
+  }
+
+  void rados_backend::ToRados(read_op& op, librados::ObjectReadOperation& rados_op)
+  {
+    for (auto&& st: op.mSteps)
+    {
+      switch (st.mType)
+      {
+        case step::type::omap_cmp:
+        {
+          omap_assert_t assertions;
+
+          for (auto&& elem: st.mOmap)
+          {
+            assertions[elem.first].first.append(elem.second.first);
+            assertions[elem.first].second = elem.second.second;
+          }
+
+          rados_op.omap_cmp(assertions, st.mPrval);
+          break;
+        }
+
+        case step::type::omap_get:
+        {
+          std::set<std::string> keys;
+
+          for (auto&& elem: st.mOmap)
+            keys.insert(elem.first);
+
+          rados_op.omap_get_vals_by_keys(keys, st.mOmapOut, st.mPrval);
+          break;
+        }
+
+        case step::type::stat:
+          rados_op.stat(st.mSize, st.mMtime, st.mPrval);
+          break;
+
+        case step::type::read:
+          rados_op.read(st.mOff, st.mLen, st.mData, st.mPrval);
+          break;
+
+        default:
+          break;
+      }
+    }
+  }
+
+  librados::AioCompletion* rados_backend::MakeCompletion(completion_ptr comp)
+  {
+    // The box keeps the backend completion alive until the callback, the
+    // librados completion is released once it forwarded the result
+    struct box
+    {
+      completion_ptr mComp;
+      librados::AioCompletion* mRadosComp;
+    };
+
+    box* arg = new box {comp, nullptr};
+    auto cb = [](librados::completion_t, void* varg) {
+      box* bx = static_cast<box*>(varg);
+      // Read through the completion we own, wrapping the impl in another
+      // AioCompletion would release it a second time
+      int ret = bx->mRadosComp->get_return_value();
+      bx->mRadosComp->release();
+      bx->mComp->complete(ret);
+      delete bx;
+    };
+
+    arg->mRadosComp = librados::Rados::aio_create_completion(arg, cb, nullptr);
+    return arg->mRadosComp;
+  }
+
+  //----------------------------------------------------------------------------
+  // Local backend
+  //----------------------------------------------------------------------------
+  local_backend::local_backend(const std::string& dir,
+                               std::chrono::microseconds latency):
+    mDir(dir), mLatency(latency), mStop(false),
+    mChannel(std::make_shared<local_channel>())
+  {
+    mWorker = std::thread(&local_backend::Worker, this);
+  }
+
+  local_backend::~local_backend()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mStop = true;
+    }
+
+    mCond.notify_all();
+    mWorker.join();
+  }
+
+  int local_backend::operate(const std::string& obj_id, write_op& op)
+  {
+    return Submit([this, obj_id, op]() { return DoWrite(obj_id, op); },
+                  nullptr, true);
+  }
+
+  int local_backend::operate(const std::string& obj_id, read_op& op)
+  {
+    return Submit([this, obj_id, op]() { return DoRead(obj_id, op); },
+                  nullptr, true);
+  }
+
+  int local_backend::aio_operate(const std::string& obj_id, write_op& op,
+                                 completion_ptr comp)
+  {
+    // Like for librados the operation can go away once submitted
+    return Submit([this, obj_id, op = std::move(op)]() {
+        return DoWrite(obj_id, op);
+      }, comp, false);
+  }
+
+  int local_backend::aio_operate(const std::string& obj_id, read_op& op,
+                                 completion_ptr comp)
+  {
+    return Submit([this, obj_id, op = std::move(op)]() {
+        return DoRead(obj_id, op);
+      }, comp, false);
+  }
+
+  int local_backend::remove(const std::string& obj_id)
+  {
+    return Submit([this, obj_id]() {
+        if (!GetObject(obj_id))
+          return -ENOENT;
+
+        mObjects.erase(obj_id);
+
+        if (!mDir.empty())
+        {
+          (void) unlink(GetPath(obj_id, ".omap").c_str());
+          (void) unlink(GetPath(obj_id, ".data").c_str());
+        }
+
+        return 0;
+      }, nullptr, true);
+  }
+
+  std::shared_ptr<update_channel> local_backend::channel()
+  {
+    return mChannel;
+  }
+
+  void local_backend::set_latency(std::chrono::microseconds latency)
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mLatency = latency;
+  }
+
+  //----------------------------------------------------------------------------
+  // Queue an operation or run it right away
+  //----------------------------------------------------------------------------
+  int local_backend::Submit(std::function<int()> exec, completion_ptr comp, bool sync)
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    // Nothing to wait for, the worker is not executing anything either as it
+    // does so with the mutex held
+    if (sync && mQueue.empty() && (mLatency.count() == 0))
+      return exec();
+
+    if (!comp)
+      comp = std::make_shared<completion>();
+
+    mQueue.push_back(request {std::move(exec), comp, std::chrono::steady_clock::now() + mLatency});
+    mCond.notify_all();
+
+    if (!sync)
+      return 0;
+
+    lock.unlock();
+    comp->wait_for_complete();
+    return comp->get_return_value();
+  }
+
+  //----------------------------------------------------------------------------
+  // Execute the queued operations once due
+  //----------------------------------------------------------------------------
+  void local_backend::Worker()
+  {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    while (true)
+    {
+      if (mQueue.empty())
+      {
+        if (mStop)
+          break;
+
+        mCond.wait(lock);
+        continue;
+      }
+
+      // The requests are due in submission order, the later ones overlap
+      // their latency with the ones before
+      auto due = mQueue.front().mDue;
+
+      if (!mStop && (std::chrono::steady_clock::now() < due))
+      {
+        mCond.wait_until(lock, due);
+        continue;
+      }
+
+      request req = std::move(mQueue.front());
+      mQueue.pop_front();
+      int ret = req.mExec();
+      lock.unlock();
+      req.mComp->complete(ret);
+      lock.lock();
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  // Apply a write operation
+  //----------------------------------------------------------------------------
+  int local_backend::DoWrite(const std::string& obj_id, const write_op& op)
+  {
+    object* obj = GetObject(obj_id);
+
+    // All the guards are evaluated before any of the mutations is applied
+    for (auto&& st: op.mSteps)
+    {
+      if (st.mType == step::type::create)
+      {
+        if (obj && st.mExclusive)
+          return -EEXIST;
+      }
+      else if (st.mType == step::type::omap_cmp)
+      {
+        int ret {0};
+
+        if (!obj)
+          ret = -ENOENT;
+        else
+        {
+          for (auto&& elem: st.mOmap)
+          {
+            if (elem.second.second != LIBRADOS_CMPXATTR_OP_EQ)
+            {
+              ret = -EINVAL;
+              break;
+            }
+
+            auto iter = obj->mOmap.find(elem.first);
+
+            if ((iter == obj->mOmap.end()) || (iter->second != elem.second.first))
+            {
+              ret = -ECANCELED;
+              break;
+            }
+          }
+        }
+
+        if (st.mPrval)
+          *st.mPrval = ret;
+
+        if (ret)
+          return ret;
+      }
+    }
+
+    if (!obj)
+      obj = &mObjects[obj_id];
+
+    uint64_t append_off = obj->mData.length();
+
+    for (auto&& st: op.mSteps)
+    {
+      if (st.mType == step::type::omap_set)
+      {
+        for (auto&& elem: st.mOmap)
+          obj->mOmap[elem.first] = elem.second.first;
+      }
+      else if (st.mType == step::type::append)
+      {
+        obj->mData += st.mBuffer;
+      }
+      else if (st.mType == step::type::write_full)
+      {
+        obj->mData = st.mBuffer;
+        append_off = UINT64_MAX;
+      }
+    }
+
+    obj->mMtime = time(nullptr);
+
+    // On failure the object is dropped from memory, the next access reloads
+    // it from its files as a restart would see it
+    if (!mDir.empty() && !Persist(obj_id, *obj, append_off))
+    {
+      (void) mObjects.erase(obj_id);
+      return -EIO;
+    }
+
+    return 0;
+  }
+
+  //----------------------------------------------------------------------------
+  // Apply a read operation
+  //----------------------------------------------------------------------------
+  int local_backend::DoRead(const std::string& obj_id, const read_op& op)
+  {
+    object* obj = GetObject(obj_id);
+
+    if (!obj)
+    {
+      for (auto&& st: op.mSteps)
+      {
+        if (st.mPrval)
+          *st.mPrval = -ENOENT;
+      }
+
+      return -ENOENT;
+    }
+
+    for (auto&& st: op.mSteps)
+    {
+      int ret {0};
+
+      if (st.mType == step::type::omap_cmp)
+      {
+        for (auto&& elem: st.mOmap)
+        {
+          auto iter = obj->mOmap.find(elem.first);
+
+          if (elem.second.second != LIBRADOS_CMPXATTR_OP_EQ)
+            ret = -EINVAL;
+          else if ((iter == obj->mOmap.end()) || (iter->second != elem.second.first))
+            ret = -ECANCELED;
+
+          if (ret)
+            break;
+        }
+      }
+      else if (st.mType == step::type::omap_get)
+      {
+        st.mOmapOut->clear();
+
+        for (auto&& elem: st.mOmap)
+        {
+          auto iter = obj->mOmap.find(elem.first);
+
+          if (iter != obj->mOmap.end())
+            (*st.mOmapOut)[elem.first].append(iter->second);
+        }
+      }
+      else if (st.mType == step::type::stat)
+      {
+        if (st.mSize)
+          *st.mSize = obj->mData.length();
+
+        if (st.mMtime)
+          *st.mMtime = obj->mMtime;
+      }
+      else if (st.mType == step::type::read)
+      {
+        st.mData->clear();
+
+        if (st.mOff < obj->mData.length())
+        {
+          uint64_t len = obj->mData.length() - st.mOff;
+
+          if (st.mLen && (st.mLen < len))
+            len = st.mLen;
+
+          st.mData->append(obj->mData.data() + st.mOff, len);
+        }
+      }
+
+      if (st.mPrval)
+        *st.mPrval = ret;
+
+      if (ret)
+        return ret;
+    }
+
+    return 0;
+  }
+
+  //----------------------------------------------------------------------------
+  // Get an object, loading it from its files if needed
+  //----------------------------------------------------------------------------
+  local_backend::object* local_backend::GetObject(const std::string& obj_id)
+  {
+    auto iter = mObjects.find(obj_id);
+
+    if (iter != mObjects.end())
+      return &iter->second;
+
+    if (mDir.empty())
+      return nullptr;
+
+    // The omap file is written last and records the committed data length
+    FILE* fomap = fopen(GetPath(obj_id, ".omap").c_str(), "rb");
+
+    if (!fomap)
+      return nullptr;
+
+    object obj;
+    uint64_t data_len {0}, mtime {0}, num_keys {0};
+    bool ok = (fread(&data_len, sizeof(data_len), 1, fomap) == 1) &&
+      (fread(&mtime, sizeof(mtime), 1, fomap) == 1) &&
+      (fread(&num_keys, sizeof(num_keys), 1, fomap) == 1);
+
+    for (uint64_t i = 0; ok && (i < num_keys); ++i)
+    {
+      uint64_t len[2];
+      ok = (fread(len, sizeof(len), 1, fomap) == 1);
+
+      if (ok)
+      {
+        std::string kv(len[0] + len[1], '\0');
+        ok = (fread(&kv[0], 1, kv.length(), fomap) == kv.length());
+        obj.mOmap[kv.substr(0, len[0])] = kv.substr(len[0]);
+      }
+    }
+
+    fclose(fomap);
+    FILE* fdata = fopen(GetPath(obj_id, ".data").c_str(), "rb");
+
+    if (ok && data_len)
+    {
+      obj.mData.resize(data_len);
+      ok = fdata && (fread(&obj.mData[0], 1, data_len, fdata) == data_len);
+    }
+
+    if (fdata)
+      fclose(fdata);
+
+    if (!ok)
+    {
+      fprintf(stderr, "Failed to load obj=%s from %s\n", obj_id.c_str(), mDir.c_str());
+      return nullptr;
+    }
+
+    // Drop the bytes of an append interrupted before its omap was written
+    if (truncate(GetPath(obj_id, ".data").c_str(), data_len) && data_len)
+      fprintf(stderr, "Failed to truncate data of obj=%s\n", obj_id.c_str());
+
+    obj.mMtime = mtime;
+    return &(mObjects[obj_id] = std::move(obj));
+  }
+
+  //----------------------------------------------------------------------------
+  // Write an object through to its files
+  //----------------------------------------------------------------------------
+  bool local_backend::Persist(const std::string& obj_id, const object& obj,
+                              uint64_t append_off)
+  {
+    std::string data_path = GetPath(obj_id, ".data");
+    std::string omap_path = GetPath(obj_id, ".omap");
+    bool ok {true};
+
+    if (append_off != obj.mData.length())
+    {
+      // Appends go to the end of the file, rewrites replace it
+      std::string tmp_path = data_path + ".tmp";
+      bool rewrite = (append_off == UINT64_MAX);
+      FILE* fdata = fopen(rewrite ? tmp_path.c_str() : data_path.c_str(),
+                          rewrite ? "wb" : "ab");
+      uint64_t off = (rewrite ? 0 : append_off);
+      ok = fdata && (fwrite(obj.mData.data() + off, 1, obj.mData.length() - off,
+                            fdata) == obj.mData.length() - off);
+
+      if (fdata)
+        ok = (fclose(fdata) == 0) && ok;
+
+      if (ok && rewrite)
+        ok = (rename(tmp_path.c_str(), data_path.c_str()) == 0);
+    }
+
+    if (ok)
+    {
+      std::string tmp_path = omap_path + ".tmp";
+      FILE* fomap = fopen(tmp_path.c_str(), "wb");
+      uint64_t hdr[3] {obj.mData.length(), (uint64_t)obj.mMtime, obj.mOmap.size()};
+      ok = fomap && (fwrite(hdr, sizeof(hdr), 1, fomap) == 1);
+
+      for (auto&& elem: obj.mOmap)
+      {
+        uint64_t len[2] {elem.first.length(), elem.second.length()};
+        ok = ok && (fwrite(len, sizeof(len), 1, fomap) == 1) &&
+          (fwrite(elem.first.data(), 1, len[0], fomap) == len[0]) &&
+          (fwrite(elem.second.data(), 1, len[1], fomap) == len[1]);
+      }
+
+      if (fomap)
+        ok = (fclose(fomap) == 0) && ok;
+
+      ok = ok && (rename(tmp_path.c_str(), omap_path.c_str()) == 0);
+    }
+
+    if (!ok)
+      fprintf(stderr, "Failed to write obj=%s to %s\n", obj_id.c_str(), mDir.c_str());
+
+    return ok;
+  }
+
+  //----------------------------------------------------------------------------
+  // Get the path of a file of an object
+  //----------------------------------------------------------------------------
+  std::string local_backend::GetPath(const std::string& obj_id,
+                                     const char* suffix) const
+  {
+    // Object ids contain slashes, escape anything but a safe set of chars
+    std::string path = mDir + "/";
+    char hex[4];
+
+    for (auto c: obj_id)
+    {
+      if (isalnum(static_cast<unsigned char>(c)) || (c == '.') || (c == '_') ||
+          (c == '-'))
+      {
+        path += c;
+      }
+      else
+      {
+        snprintf(hex, sizeof(hex), "%%%02X", static_cast<unsigned char>(c));
+        path += hex;
+      }
+    }
+
+    return path + suffix;
+  }
+}
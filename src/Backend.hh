@@ -0,0 +1,467 @@
+//------------------------------------------------------------------------------
+// File: Backend.hh
+// Author: Elvin Sindrilaru <esindril@cern.ch>
+//------------------------------------------------------------------------------
+
+/*******************************************************************************
+ * RadosVectMap                                                                *
+ * Copyright (C) 2015 CERN/Switzerland                                         *
+ *                                                                             *
+ * This program is free software: you can redistribute it and/or modify        *
+ * it under the terms of the GNU General Public License as published by        *
+ * the Free Software Foundation, either version 3 of the License, or           *
+ * (at your option) any later version.                                         *
+ *                                                                             *
+ * This program is distributed in the hope that it will be useful,             *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                *
+ * GNU General Public License for more details.                                *
+ *                                                                             *
+ * You should have received a copy of the GNU General Public License           *
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.        *
+ ******************************************************************************/
+
+#ifndef __RADOS_BACKEND_HH__
+#define __RADOS_BACKEND_HH__
+
+#include <map>
+#include <set>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <condition_variable>
+#include <rados/librados.hpp>
+#include "UpdateChannel.hh"
+
+namespace rados {
+
+  //----------------------------------------------------------------------------
+  //! Object store holding the maps. The operations mirror the subset of the
+  //! librados compound operations used by the containers: a write operation
+  //! is applied atomically and only if all its omap comparisons hold, a read
+  //! operation returns data matching the comparisons. Operations submitted
+  //! for the same object are applied in submission order, which is what the
+  //! pipelined appends rely on. Implementations must be thread-safe.
+  //----------------------------------------------------------------------------
+  class backend
+  {
+  public:
+    //! Omap comparisons, only LIBRADOS_CMPXATTR_OP_EQ is used
+    typedef std::map<std::string, std::pair<librados::bufferlist, int>> omap_assert_t;
+    //! Omap key value pairs
+    typedef std::map<std::string, librados::bufferlist> omap_t;
+
+    //--------------------------------------------------------------------------
+    //! Step of a compound operation
+    //--------------------------------------------------------------------------
+    struct step
+    {
+      enum class type { create, omap_cmp, omap_set, append, write_full,
+                        omap_get, stat, read };
+
+      step(type t):
+        mType(t), mExclusive(false), mOff(0), mLen(0), mPrval(nullptr),
+        mOmapOut(nullptr), mSize(nullptr), mMtime(nullptr), mData(nullptr)
+      {}
+
+      type mType; ///< type of the step
+      bool mExclusive; ///< create fails if the object exists
+      uint64_t mOff; ///< read offset
+      uint64_t mLen; ///< read length, 0 means up to the end
+      std::map<std::string, std::pair<std::string, int>> mOmap; ///< omap
+                                 ///< comparisons, values to set or keys to get
+      std::string mBuffer; ///< data to append or write
+      int* mPrval; ///< result of the step, may be null
+      omap_t* mOmapOut; ///< omap values read
+      uint64_t* mSize; ///< object size
+      time_t* mMtime; ///< object modification time
+      librados::bufferlist* mData; ///< data read
+    };
+
+    //--------------------------------------------------------------------------
+    //! Compound write operation
+    //--------------------------------------------------------------------------
+    class write_op
+    {
+    public:
+      //! Room for the usual compare, set and append steps
+      write_op()
+      {
+        mSteps.reserve(4);
+      }
+
+      void create(bool exclusive);
+      void omap_cmp(const omap_assert_t& assertions, int* prval);
+      void omap_set(const omap_t& kv);
+      void append(const librados::bufferlist& bl);
+      //! Append data handed over by the caller, without a copy
+      void append(std::string&& data);
+      void write_full(const librados::bufferlist& bl);
+
+      std::vector<step> mSteps; ///< steps in the order they were added
+    };
+
+    //--------------------------------------------------------------------------
+    //! Compound read operation
+    //--------------------------------------------------------------------------
+    class read_op
+    {
+    public:
+      //! Room for the usual compare, get, stat and read steps
+      read_op()
+      {
+        mSteps.reserve(4);
+      }
+
+      void omap_cmp(const omap_assert_t& assertions, int* prval);
+      void omap_get_vals_by_keys(const std::set<std::string>& keys,
+                                 omap_t* vals, int* prval);
+      void stat(uint64_t* psize, time_t* pmtime, int* prval);
+      void read(uint64_t off, uint64_t len, librados::bufferlist* bl, int* prval);
+
+      std::vector<step> mSteps; ///< steps in the order they were added
+    };
+
+    //--------------------------------------------------------------------------
+    //! Completion of an asynchronous operation. The callback, if any, runs
+    //! before the waiters are released.
+    //--------------------------------------------------------------------------
+    class completion
+    {
+    public:
+      //! Callback receiving the return value of the operation
+      typedef std::function<void(int)> callback_t;
+
+      completion(callback_t cb = nullptr);
+
+      //! Wait for the operation and the callback to complete
+      void wait_for_complete();
+
+      //! Check if the operation and the callback completed
+      bool is_complete();
+
+      //! Get the return value of the completed operation
+      int get_return_value();
+
+      //! Mark the operation as complete, called by the backend
+      void complete(int ret);
+
+    private:
+      callback_t mCallback; ///< callback of the owner
+      bool mDone; ///< operation and callback completed
+      int mRet; ///< return value of the operation
+      std::mutex mMutex; ///< mutex protecting the state
+      std::condition_variable mCond; ///< notified on completion
+    };
+
+    typedef std::shared_ptr<completion> completion_ptr;
+
+    //--------------------------------------------------------------------------
+    //! Destructor
+    //--------------------------------------------------------------------------
+    virtual ~backend() = default;
+
+    //--------------------------------------------------------------------------
+    //! Execute a write operation
+    //!
+    //! @param obj_id object id
+    //! @param op write operation
+    //!
+    //! @return 0 if successful, -ECANCELED if a comparison failed, otherwise
+    //!         a negative error code
+    //--------------------------------------------------------------------------
+    virtual int operate(const std::string& obj_id, write_op& op) = 0;
+
+    //--------------------------------------------------------------------------
+    //! Execute a read operation
+    //!
+    //! @param obj_id object id
+    //! @param op read operation
+    //!
+    //! @return 0 if successful, -ECANCELED if a comparison failed, otherwise
+    //!         a negative error code
+    //--------------------------------------------------------------------------
+    virtual int operate(const std::string& obj_id, read_op& op) = 0;
+
+    //--------------------------------------------------------------------------
+    //! Schedule a write operation. The operation is copied, the result
+    //! pointers it holds must stay valid until completion.
+    //!
+    //! @param obj_id object id
+    //! @param op write operation
+    //! @param comp completion of the operation
+    //!
+    //! @return 0 if scheduled, otherwise a negative error code
+    //--------------------------------------------------------------------------
+    virtual int aio_operate(const std::string& obj_id, write_op& op,
+                            completion_ptr comp) = 0;
+
+    //--------------------------------------------------------------------------
+    //! Schedule a read operation
+    //!
+    //! @param obj_id object id
+    //! @param op read operation
+    //! @param comp completion of the operation
+    //!
+    //! @return 0 if scheduled, otherwise a negative error code
+    //--------------------------------------------------------------------------
+    virtual int aio_operate(const std::string& obj_id, read_op& op,
+                            completion_ptr comp) = 0;
+
+    //--------------------------------------------------------------------------
+    //! Remove an object
+    //!
+    //! @param obj_id object id
+    //!
+    //! @return 0 if successful, otherwise a negative error code
+    //--------------------------------------------------------------------------
+    virtual int remove(const std::string& obj_id) = 0;
+
+    //--------------------------------------------------------------------------
+    //! Get the default channel used to announce updates of the objects
+    //!
+    //! @return update channel
+    //--------------------------------------------------------------------------
+    virtual std::shared_ptr<update_channel> channel() = 0;
+
+    //--------------------------------------------------------------------------
+    //! Get the size of an object
+    //!
+    //! @return 0 if successful, otherwise a negative error code
+    //--------------------------------------------------------------------------
+    int stat(const std::string& obj_id, uint64_t* psize);
+
+    //--------------------------------------------------------------------------
+    //! Read data from an object
+    //!
+    //! @param len length to read, 0 means up to the end
+    //!
+    //! @return number of bytes read if successful, otherwise a negative error
+    //!         code
+    //--------------------------------------------------------------------------
+    int read(const std::string& obj_id, librados::bufferlist& bl, uint64_t len,
+             uint64_t off);
+
+    //--------------------------------------------------------------------------
+    //! Get omap values of an object, missing keys are skipped
+    //!
+    //! @return 0 if successful, otherwise a negative error code
+    //--------------------------------------------------------------------------
+    int omap_get_vals_by_keys(const std::string& obj_id,
+                              const std::set<std::string>& keys, omap_t* vals);
+
+    //--------------------------------------------------------------------------
+    //! Replace the data of an object, creating it if needed
+    //!
+    //! @return 0 if successful, otherwise a negative error code
+    //--------------------------------------------------------------------------
+    int write_full(const std::string& obj_id, const librados::bufferlist& bl);
+
+    //--------------------------------------------------------------------------
+    //! Set omap values of an object, creating it if needed
+    //!
+    //! @return 0 if successful, otherwise a negative error code
+    //--------------------------------------------------------------------------
+    int omap_set(const std::string& obj_id, const omap_t& kv);
+  };
+
+  //----------------------------------------------------------------------------
+  //! Backend storing the objects in a RADOS pool
+  //----------------------------------------------------------------------------
+  class rados_backend: public backend
+  {
+  public:
+
+    //--------------------------------------------------------------------------
+    //! Constructor
+    //!
+    //! @param rados_cluster rados cluster
+    //! @param pool_name pool holding the objects
+    //--------------------------------------------------------------------------
+    rados_backend(librados::Rados& rados_cluster,
+                  const std::string& pool_name) noexcept(false);
+
+    //--------------------------------------------------------------------------
+    //! Constructor
+    //!
+    //! @param io_ctx io context of the pool holding the objects
+    //--------------------------------------------------------------------------
+    rados_backend(const librados::IoCtx& io_ctx);
+
+    int operate(const std::string& obj_id, write_op& op) override;
+    int operate(const std::string& obj_id, read_op& op) override;
+    int aio_operate(const std::string& obj_id, write_op& op,
+                    completion_ptr comp) override;
+    int aio_operate(const std::string& obj_id, read_op& op,
+                    completion_ptr comp) override;
+    int remove(const std::string& obj_id) override;
+    std::shared_ptr<update_channel> channel() override;
+
+  private:
+    //--------------------------------------------------------------------------
+    //! Convert operations to their librados counterpart
+    //--------------------------------------------------------------------------
+    static void ToRados(write_op& op, librados::ObjectWriteOperation& rados_op);
+    static void ToRados(read_op& op, librados::ObjectReadOperation& rados_op);
+
+    //--------------------------------------------------------------------------
+    //! Create a librados completion forwarding to a backend completion
+    //--------------------------------------------------------------------------
+    static librados::AioCompletion* MakeCompletion(completion_ptr comp);
+
+    librados::IoCtx mIoCtx; ///< io context
+    std::shared_ptr<update_channel> mChannel; ///< watch/notify channel
+    std::mutex mMutex; ///< mutex protecting the channel creation
+  };
+
+  //----------------------------------------------------------------------------
+  //! Backend keeping the objects in process, optionally written through to
+  //! local files. Operations are delayed by the configured latency, the
+  //! asynchronous ones overlap like requests in flight to a cluster would.
+  //----------------------------------------------------------------------------
+  class local_backend: public backend
+  {
+  public:
+
+    //--------------------------------------------------------------------------
+    //! Destructor
+    //--------------------------------------------------------------------------
+    virtual ~local_backend();
+
+    int operate(const std::string& obj_id, write_op& op) override;
+    int operate(const std::string& obj_id, read_op& op) override;
+    int aio_operate(const std::string& obj_id, write_op& op,
+                    completion_ptr comp) override;
+    int aio_operate(const std::string& obj_id, read_op& op,
+                    completion_ptr comp) override;
+    int remove(const std::string& obj_id) override;
+    std::shared_ptr<update_channel> channel() override;
+
+    //--------------------------------------------------------------------------
+    //! Set the latency added to every operation
+    //!
+    //! @param latency time between the submission and the execution
+    //--------------------------------------------------------------------------
+    void set_latency(std::chrono::microseconds latency);
+
+  protected:
+
+    //--------------------------------------------------------------------------
+    //! Constructor
+    //!
+    //! @param dir directory the objects are written through to, empty for
+    //!        in-memory only
+    //! @param latency latency added to every operation
+    //--------------------------------------------------------------------------
+    local_backend(const std::string& dir, std::chrono::microseconds latency);
+
+  private:
+    //--------------------------------------------------------------------------
+    //! Object contents
+    //--------------------------------------------------------------------------
+    struct object
+    {
+      std::string mData; ///< object data
+      std::map<std::string, std::string> mOmap; ///< object map
+      time_t mMtime; ///< modification time
+    };
+
+    //--------------------------------------------------------------------------
+    //! Operation waiting for its turn
+    //--------------------------------------------------------------------------
+    struct request
+    {
+      std::function<int()> mExec; ///< executes the operation
+      completion_ptr mComp; ///< completion of the operation
+      std::chrono::steady_clock::time_point mDue; ///< execution time
+    };
+
+    //--------------------------------------------------------------------------
+    //! Queue an operation, or run it right away if nothing is queued and
+    //! there is no latency to simulate
+    //--------------------------------------------------------------------------
+    int Submit(std::function<int()> exec, completion_ptr comp, bool sync);
+
+    //--------------------------------------------------------------------------
+    //! Execute the queued operations once due
+    //--------------------------------------------------------------------------
+    void Worker();
+
+    //--------------------------------------------------------------------------
+    //! Apply operations, called with the mutex held
+    //--------------------------------------------------------------------------
+    int DoWrite(const std::string& obj_id, const write_op& op);
+    int DoRead(const std::string& obj_id, const read_op& op);
+
+    //--------------------------------------------------------------------------
+    //! Get an object, loading it from its files if needed
+    //!
+    //! @return object or null if it does not exist
+    //--------------------------------------------------------------------------
+    object* GetObject(const std::string& obj_id);
+
+    //--------------------------------------------------------------------------
+    //! Write an object through to its files
+    //!
+    //! @param obj_id object id
+    //! @param obj object
+    //! @param append_off offset from which the data was appended, or the
+    //!        data length if it did not change, or UINT64_MAX if rewritten
+    //!
+    //! @return true if successful, otherwise false
+    //--------------------------------------------------------------------------
+    bool Persist(const std::string& obj_id, const object& obj,
+                 uint64_t append_off);
+
+    //--------------------------------------------------------------------------
+    //! Get the path of a file of an object
+    //--------------------------------------------------------------------------
+    std::string GetPath(const std::string& obj_id, const char* suffix) const;
+
+    std::string mDir; ///< directory of the object files, empty if none
+    std::chrono::microseconds mLatency; ///< latency added to the operations
+    std::map<std::string, object> mObjects; ///< objects indexed by id
+    std::deque<request> mQueue; ///< operations waiting for execution
+    bool mStop; ///< flag to stop the worker
+    std::mutex mMutex; ///< mutex protecting the objects and the queue
+    std::condition_variable mCond; ///< notified when the queue changes
+    std::thread mWorker; ///< thread executing the queued operations
+    std::shared_ptr<local_channel> mChannel; ///< in-process update channel
+  };
+
+  //----------------------------------------------------------------------------
+  //! Backend keeping the objects in memory, lost with the process
+  //----------------------------------------------------------------------------
+  class memory_backend: public local_backend
+  {
+  public:
+    memory_backend(std::chrono::microseconds latency = std::chrono::microseconds(0)):
+      local_backend("", latency)
+    {}
+  };
+
+  //----------------------------------------------------------------------------
+  //! Backend storing each object as a data file and an omap file in a local
+  //! directory. Objects survive the process, which allows to reload maps.
+  //! The omap file is replaced atomically and records the length of the
+  //! data, bytes appended by an operation interrupted before the omap was
+  //! written are dropped when the object is loaded.
+  //----------------------------------------------------------------------------
+  class file_backend: public local_backend
+  {
+  public:
+    file_backend(const std::string& dir,
+                 std::chrono::microseconds latency = std::chrono::microseconds(0)):
+      local_backend(dir, latency)
+    {}
+  };
+}
+
+#endif // __RADOS_BACKEND_HH__
@@ -0,0 +1,379 @@
+//------------------------------------------------------------------------------
+// File: ChangeLog.cc
+// Author: Elvin Sindrilaru <esindril@cern.ch>
+//------------------------------------------------------------------------------
+
+/*******************************************************************************
+ * RadosVectMap                                                                *
+ * Copyright (C) 2015 CERN/Switzerland                                         *
+ *                                                                             *
+ * This program is free software: you can redistribute it and/or modify        *
+ * it under the terms of the GNU General Public License as published by        *
+ * the Free Software Foundation, either version 3 of the License, or           *
+ * (at your option) any later version.                                         *
+ *                                                                             *
+ * This program is distributed in the hope that it will be useful,             *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                *
+ * GNU General Public License for more details.                                *
+ *                                                                             *
+ * You should have received a copy of the GNU General Public License           *
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.        *
+ ******************************************************************************/
+
+#include <cerrno>
+#include <algorithm>
+#include "ChangeLog.hh"
+
+namespace rados {
+
+  // Define the constants
+  const uint8_t ChangeLog::OP_INSERT {1};
+  const uint8_t ChangeLog::OP_ERASE {2};
+  const std::string ChangeLog::MAGIC {"RVMAPLOG"};
+  const uint8_t ChangeLog::VERSION {1};
+
+  //----------------------------------------------------------------------------
+  // Get the header of a binary changelog
+  //----------------------------------------------------------------------------
+  std::string ChangeLog::Header()
+  {
+    std::string hdr {MAGIC};
+    hdr.push_back(static_cast<char>(VERSION));
+    return hdr;
+  }
+
+  //----------------------------------------------------------------------------
+  // Detect the format of a changelog
+  //----------------------------------------------------------------------------
+  bool ChangeLog::ParseHeader(const char* data, uint64_t len, Format& format,
+                              uint64_t& hdr_len)
+  {
+    if ((len < MAGIC.length()) || MAGIC.compare(0, MAGIC.length(), data,
+                                                MAGIC.length()))
+    {
+      // No header - changelog written in text format
+      format = Format::Text;
+      hdr_len = 0;
+      return true;
+    }
+
+    if (len < MAGIC.length() + 1)
+      return false;
+
+    if (static_cast<uint8_t>(data[MAGIC.length()]) > VERSION)
+      return false;
+
+    format = Format::Binary;
+    hdr_len = MAGIC.length() + 1;
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  // Append a varint encoded value
+  //----------------------------------------------------------------------------
+  void ChangeLog::EncodeVarint(uint64_t value, std::string& out)
+  {
+    while (value >= 0x80)
+    {
+      out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+      value >>= 7;
+    }
+
+    out.push_back(static_cast<char>(value));
+  }
+
+  //----------------------------------------------------------------------------
+  // Decode a varint value
+  //----------------------------------------------------------------------------
+  bool ChangeLog::DecodeVarint(const char*& pos, const char* end, uint64_t& value)
+  {
+    const char* ptr = pos;
+    value = 0;
+
+    for (unsigned int shift = 0; shift < 64; shift += 7)
+    {
+      if (ptr == end)
+        return false;
+
+      uint8_t byte = static_cast<uint8_t>(*ptr++);
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+
+      if (!(byte & 0x80))
+      {
+        pos = ptr;
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  //----------------------------------------------------------------------------
+  // Decode the binary record starting at the given position
+  //----------------------------------------------------------------------------
+  int ChangeLog::DecodeRecord(const char*& pos, const char* end, Record& rec)
+  {
+    const char* ptr = pos;
+
+    if (ptr == end)
+      return -EAGAIN;
+
+    rec.mOp = static_cast<uint8_t>(*ptr++);
+
+    if ((rec.mOp != OP_INSERT) && (rec.mOp != OP_ERASE))
+      return -EINVAL;
+
+    // A varint is at most 10 bytes long, anything failing to decode when
+    // enough bytes are available is corrupted
+    uint64_t key_len;
+
+    if (!DecodeVarint(ptr, end, key_len))
+      return ((end - ptr) >= 10 ? -EINVAL : -EAGAIN);
+
+    if ((uint64_t)(end - ptr) < key_len)
+      return -EAGAIN;
+
+    rec.mKey = std::string_view(ptr, key_len);
+    ptr += key_len;
+    rec.mValue = std::string_view();
+
+    if (rec.mOp == OP_INSERT)
+    {
+      uint64_t value_len;
+
+      if (!DecodeVarint(ptr, end, value_len))
+        return ((end - ptr) >= 10 ? -EINVAL : -EAGAIN);
+
+      if ((uint64_t)(end - ptr) < value_len)
+        return -EAGAIN;
+
+      rec.mValue = std::string_view(ptr, value_len);
+      ptr += value_len;
+    }
+
+    pos = ptr;
+    return 0;
+  }
+
+  //----------------------------------------------------------------------------
+  // Decode the text entry starting at the given position
+  //----------------------------------------------------------------------------
+  int ChangeLog::DecodeTextRecord(const char*& pos, const char* end, Record& rec,
+                                  bool last)
+  {
+    const char* eol = static_cast<const char*>(memchr(pos, '\n', end - pos));
+
+    if (!eol)
+    {
+      if (!last || (pos == end))
+        return -EAGAIN;
+
+      eol = end;
+    }
+
+    // Split the line in whitespace separated tokens: op key [value]
+    std::string_view tokens[3];
+    std::string_view line(pos, eol - pos);
+    size_t num_tokens {0};
+    size_t start = line.find_first_not_of(" \t\r");
+
+    while ((start != std::string_view::npos) && (num_tokens < 3))
+    {
+      size_t stop = line.find_first_of(" \t\r", start);
+
+      if (stop == std::string_view::npos)
+        stop = line.length();
+
+      tokens[num_tokens++] = line.substr(start, stop - start);
+      start = line.find_first_not_of(" \t\r", stop);
+    }
+
+    rec.mOp = 0;
+    rec.mKey = tokens[1];
+    rec.mValue = tokens[2];
+
+    if (tokens[0] == "+")
+    {
+      if (num_tokens < 3)
+        return -EINVAL;
+
+      rec.mOp = OP_INSERT;
+    }
+    else if (tokens[0] == "-")
+    {
+      if (num_tokens < 2)
+        return -EINVAL;
+
+      rec.mOp = OP_ERASE;
+    }
+
+    pos = (eol == end ? end : eol + 1);
+    return 0;
+  }
+
+  //----------------------------------------------------------------------------
+  // Append a length-prefixed string field
+  //----------------------------------------------------------------------------
+  void ChangeLog::EncodeField(std::string_view value, std::string& out)
+  {
+    EncodeVarint(value.length(), out);
+    out.append(value.data(), value.length());
+  }
+
+  //----------------------------------------------------------------------------
+  // Decode a string field
+  //----------------------------------------------------------------------------
+  bool ChangeLog::DecodeField(std::string_view field, std::string& value)
+  {
+    value.assign(field.data(), field.length());
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  // ChangeLogReader constructor
+  //----------------------------------------------------------------------------
+  ChangeLogReader::ChangeLogReader(ChangeLog::Format format):
+    mFormat(format), mFinished(false), mOwnersBase(0), mCarryOff(0)
+  {}
+
+  //----------------------------------------------------------------------------
+  // Append data to be decoded
+  //----------------------------------------------------------------------------
+  void ChangeLogReader::Append(const librados::bufferlist& data, uint64_t off)
+  {
+    uint64_t owner = mOwnersBase + mOwners.size();
+    mOwners.push_back(data);
+
+    for (const auto& ptr: mOwners.back().buffers())
+    {
+      if (off >= ptr.length())
+      {
+        off -= ptr.length();
+        continue;
+      }
+
+      mSegments.push_back(Segment {ptr.c_str() + off, ptr.c_str() + ptr.length(),
+                                   owner});
+      off = 0;
+    }
+
+    if (mSegments.empty() || (mSegments.back().mOwner != owner))
+      mOwners.pop_back();
+  }
+
+  //----------------------------------------------------------------------------
+  // Decode record in the given range according to the format
+  //----------------------------------------------------------------------------
+  int ChangeLogReader::Decode(const char*& pos, const char* end,
+                              ChangeLog::Record& rec, bool last) const
+  {
+    if (mFormat == ChangeLog::Format::Binary)
+      return ChangeLog::DecodeRecord(pos, end, rec);
+
+    return ChangeLog::DecodeTextRecord(pos, end, rec, last);
+  }
+
+  //----------------------------------------------------------------------------
+  // Drop the front segment and release unreferenced bufferlists
+  //----------------------------------------------------------------------------
+  void ChangeLogReader::PopSegment()
+  {
+    mSegments.pop_front();
+    uint64_t owner = (mSegments.empty() ? mOwnersBase + mOwners.size() :
+                      mSegments.front().mOwner);
+
+    while (mOwnersBase < owner)
+    {
+      mOwners.pop_front();
+      mOwnersBase++;
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  // Decode next record
+  //----------------------------------------------------------------------------
+  int ChangeLogReader::Next(ChangeLog::Record& rec)
+  {
+    // Drop the carry bytes consumed by the previous call
+    if (mCarryOff)
+    {
+      mCarry.erase(0, mCarryOff);
+      mCarryOff = 0;
+    }
+
+    while (true)
+    {
+      if (mCarry.empty())
+      {
+        // Fast path - decode in place from the current segment
+        if (mSegments.empty())
+          return -EAGAIN;
+
+        Segment& seg = mSegments.front();
+        bool last = mFinished && (mSegments.size() == 1);
+        int ret = Decode(seg.mPos, seg.mEnd, rec, last);
+
+        // A decoded record points inside the segment which is only dropped
+        // by the next call, once the record is no longer used
+        if (ret != -EAGAIN)
+          return ret;
+
+        if (seg.mPos == seg.mEnd)
+        {
+          PopSegment();
+          continue;
+        }
+
+        // Record straddles the segment boundary
+        if (mSegments.size() == 1)
+          return (last ? -EINVAL : -EAGAIN);
+
+        mCarry.assign(seg.mPos, seg.mEnd - seg.mPos);
+        PopSegment();
+        continue;
+      }
+
+      // Slow path - decode from the carry buffer
+      const char* pos = mCarry.data();
+      bool last = mFinished && mSegments.empty();
+      int ret = Decode(pos, mCarry.data() + mCarry.length(), rec, last);
+
+      if (ret == 0)
+      {
+        // Give back the bytes copied beyond the end of the record, they all
+        // come from the front segment since the previous attempt failed
+        uint64_t excess = mCarry.data() + mCarry.length() - pos;
+
+        if (excess)
+        {
+          mSegments.front().mPos -= excess;
+          mCarry.resize(mCarry.length() - excess);
+        }
+
+        mCarryOff = mCarry.length();
+        return 0;
+      }
+
+      if (ret != -EAGAIN)
+        return ret;
+
+      if (!mSegments.empty() && (mSegments.front().mPos ==
+                                 mSegments.front().mEnd))
+      {
+        PopSegment();
+        continue;
+      }
+
+      if (mSegments.empty())
+        return (last ? -EINVAL : -EAGAIN);
+
+      // Grow the carry with more bytes from the front segment
+      Segment& seg = mSegments.front();
+      uint64_t len = std::min<uint64_t>(std::max<uint64_t>(mCarry.length(), 64),
+                                        seg.mEnd - seg.mPos);
+      mCarry.append(seg.mPos, len);
+      seg.mPos += len;
+    }
+  }
+}
@@ -0,0 +1,391 @@
+//------------------------------------------------------------------------------
+// File: ChangeLog.hh
+// Author: Elvin Sindrilaru <esindril@cern.ch>
+//------------------------------------------------------------------------------
+
+/*******************************************************************************
+ * RadosVectMap                                                                *
+ * Copyright (C) 2015 CERN/Switzerland                                         *
+ *                                                                             *
+ * This program is free software: you can redistribute it and/or modify        *
+ * it under the terms of the GNU General Public License as published by        *
+ * the Free Software Foundation, either version 3 of the License, or           *
+ * (at your option) any later version.                                         *
+ *                                                                             *
+ * This program is distributed in the hope that it will be useful,             *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                *
+ * GNU General Public License for more details.                                *
+ *                                                                             *
+ * You should have received a copy of the GNU General Public License           *
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.        *
+ ******************************************************************************/
+
+#ifndef __RADOS_CHANGELOG_HH__
+#define __RADOS_CHANGELOG_HH__
+
+#include <deque>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+#include <rados/librados.hpp>
+
+namespace rados {
+
+  //----------------------------------------------------------------------------
+  //! Encoding and decoding of the changelog entries
+  //!
+  //! The binary changelog starts with a header made of the MAGIC string
+  //! followed by one byte holding the format version. Each record is:
+  //!   opcode (1 byte) | varint key length | key [| varint value length | value]
+  //! where the value is present only for inserts. Numeric values are stored
+  //! as raw little-endian bytes.
+  //!
+  //! Changelogs written before the binary format have no header and hold one
+  //! "<op> <key> [<value>]" text line per entry. They are still loaded and
+  //! get converted to the binary format by the next compaction.
+  //----------------------------------------------------------------------------
+  class ChangeLog
+  {
+  public:
+
+    //! Format of the changelog
+    enum class Format { Text, Binary };
+
+    //! Record opcodes
+    static const uint8_t OP_INSERT;
+    static const uint8_t OP_ERASE;
+    //! Header magic and current format version
+    static const std::string MAGIC;
+    static const uint8_t VERSION;
+
+    //--------------------------------------------------------------------------
+    //! Decoded binary record pointing inside the changelog buffer
+    //--------------------------------------------------------------------------
+    struct Record
+    {
+      uint8_t mOp; ///< record opcode, 0 if unknown (text format only)
+      std::string_view mKey; ///< key
+      std::string_view mValue; ///< value, empty for erase
+    };
+
+    //--------------------------------------------------------------------------
+    //! Get the header of a binary changelog
+    //!
+    //! @return header string
+    //--------------------------------------------------------------------------
+    static std::string Header();
+
+    //--------------------------------------------------------------------------
+    //! Detect the format of a changelog based on its first bytes
+    //!
+    //! @param data start of the changelog
+    //! @param len length of the data
+    //! @param format detected format
+    //! @param hdr_len length of the header to be skipped
+    //!
+    //! @return true if successful, false if the header is incomplete or the
+    //!         version is not supported
+    //--------------------------------------------------------------------------
+    static bool ParseHeader(const char* data, uint64_t len, Format& format,
+                            uint64_t& hdr_len);
+
+    //--------------------------------------------------------------------------
+    //! Append a varint encoded value
+    //!
+    //! @param value value to be encoded
+    //! @param out output string
+    //--------------------------------------------------------------------------
+    static void EncodeVarint(uint64_t value, std::string& out);
+
+    //--------------------------------------------------------------------------
+    //! Decode a varint value
+    //!
+    //! @param pos current position, advanced past the varint if successful
+    //! @param end end of the buffer
+    //! @param value decoded value
+    //!
+    //! @return true if successful, false if the buffer ends before the varint
+    //!         or the varint is malformed
+    //--------------------------------------------------------------------------
+    static bool DecodeVarint(const char*& pos, const char* end, uint64_t& value);
+
+    //--------------------------------------------------------------------------
+    //! Decode the binary record starting at the given position
+    //!
+    //! @param pos current position, advanced to the next record if successful
+    //! @param end end of the buffer
+    //! @param rec decoded record
+    //!
+    //! @return 0 if successful, -EAGAIN if the buffer ends in the middle of
+    //!         the record, -EINVAL if the record is corrupted
+    //--------------------------------------------------------------------------
+    static int DecodeRecord(const char*& pos, const char* end, Record& rec);
+
+    //--------------------------------------------------------------------------
+    //! Decode the text entry starting at the given position
+    //!
+    //! @param pos current position, advanced to the next entry if successful
+    //! @param end end of the buffer
+    //! @param rec decoded record, empty lines are decoded as unknown records
+    //! @param last if true the buffer end also terminates the last entry
+    //!
+    //! @return 0 if successful, -EAGAIN if the buffer ends before the end of
+    //!         the line, -EINVAL if the entry is malformed
+    //--------------------------------------------------------------------------
+    static int DecodeTextRecord(const char*& pos, const char* end, Record& rec,
+                                bool last);
+
+    //--------------------------------------------------------------------------
+    //! Append a length-prefixed string field
+    //!
+    //! @param value string value
+    //! @param out output string
+    //--------------------------------------------------------------------------
+    static void EncodeField(std::string_view value, std::string& out);
+
+    static void EncodeField(const std::string& value, std::string& out)
+    {
+      EncodeField(std::string_view(value), out);
+    }
+
+    //--------------------------------------------------------------------------
+    //! Append a length-prefixed numeric field using its raw little-endian
+    //! representation
+    //!
+    //! @param value numeric value
+    //! @param out output string
+    //--------------------------------------------------------------------------
+    template <typename W>
+    static void EncodeField(W value, std::string& out);
+
+    //--------------------------------------------------------------------------
+    //! Decode a string field
+    //!
+    //! @param field field contents
+    //! @param value decoded value
+    //!
+    //! @return true if successful, otherwise false
+    //--------------------------------------------------------------------------
+    static bool DecodeField(std::string_view field, std::string& value);
+
+    //--------------------------------------------------------------------------
+    //! Decode a numeric field
+    //!
+    //! @param field field contents
+    //! @param value decoded value
+    //!
+    //! @return true if successful, false if the length does not match the type
+    //--------------------------------------------------------------------------
+    template <typename W>
+    static bool DecodeField(std::string_view field, W& value);
+
+    //--------------------------------------------------------------------------
+    //! Get an upper bound of the encoded size of a field, to reserve the
+    //! output before encoding
+    //!
+    //! @param value string or numeric value
+    //!
+    //! @return maximum number of bytes appended by EncodeField
+    //--------------------------------------------------------------------------
+    static size_t MaxFieldSize(std::string_view value)
+    {
+      return 10 + value.length();
+    }
+
+    static size_t MaxFieldSize(const std::string& value)
+    {
+      return 10 + value.length();
+    }
+
+    template <typename W>
+    static size_t MaxFieldSize(const W&)
+    {
+      return 10 + sizeof(W);
+    }
+
+    //--------------------------------------------------------------------------
+    //! Append an insert record
+    //!
+    //! @param key key
+    //! @param value value
+    //! @param out output string
+    //--------------------------------------------------------------------------
+    template <typename K, typename V>
+    static void EncodeInsert(const K& key, const V& value, std::string& out)
+    {
+      out.push_back(static_cast<char>(OP_INSERT));
+      EncodeField(key, out);
+      EncodeField(value, out);
+    }
+
+    //--------------------------------------------------------------------------
+    //! Append an erase record
+    //!
+    //! @param key key
+    //! @param out output string
+    //--------------------------------------------------------------------------
+    template <typename K>
+    static void EncodeErase(const K& key, std::string& out)
+    {
+      out.push_back(static_cast<char>(OP_ERASE));
+      EncodeField(key, out);
+    }
+
+  private:
+
+    //--------------------------------------------------------------------------
+    //! Unsigned integer type with the same size as W
+    //--------------------------------------------------------------------------
+    template <typename W>
+    struct RawType
+    {
+      typedef typename std::conditional<sizeof(W) == 1, uint8_t,
+        typename std::conditional<sizeof(W) == 2, uint16_t,
+          typename std::conditional<sizeof(W) == 4, uint32_t,
+            uint64_t>::type>::type>::type type;
+    };
+  };
+
+  //----------------------------------------------------------------------------
+  // Append a length-prefixed numeric field
+  //----------------------------------------------------------------------------
+  template <typename W>
+  void ChangeLog::EncodeField(W value, std::string& out)
+  {
+    static_assert(std::is_arithmetic<W>::value && (sizeof(W) <= 8),
+                  "unsupported field type");
+    typename RawType<W>::type raw;
+    memcpy(&raw, &value, sizeof(raw));
+    out.push_back(static_cast<char>(sizeof(W)));
+
+    for (size_t i = 0; i < sizeof(W); ++i)
+      out.push_back(static_cast<char>((static_cast<uint64_t>(raw) >> (8 * i)) & 0xff));
+  }
+
+  //----------------------------------------------------------------------------
+  // Decode a numeric field
+  //----------------------------------------------------------------------------
+  template <typename W>
+  bool ChangeLog::DecodeField(std::string_view field, W& value)
+  {
+    static_assert(std::is_arithmetic<W>::value && (sizeof(W) <= 8),
+                  "unsupported field type");
+
+    if (field.length() != sizeof(W))
+      return false;
+
+    uint64_t raw {0};
+
+    for (size_t i = 0; i < sizeof(W); ++i)
+      raw |= static_cast<uint64_t>(static_cast<uint8_t>(field[i])) << (8 * i);
+
+    typename RawType<W>::type raw_w = static_cast<typename RawType<W>::type>(raw);
+    memcpy(&value, &raw_w, sizeof(raw_w));
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  //! Sequential reader of changelog records stored in one or more
+  //! bufferlists. The records are decoded in place from the bufferlist
+  //! segments, without linearizing the data. Only records which straddle two
+  //! segments are copied into a small carry buffer. A decoded record stays
+  //! valid until the next call to Next.
+  //----------------------------------------------------------------------------
+  class ChangeLogReader
+  {
+  public:
+
+    //--------------------------------------------------------------------------
+    //! Constructor
+    //!
+    //! @param format format of the records
+    //--------------------------------------------------------------------------
+    ChangeLogReader(ChangeLog::Format format);
+
+    //--------------------------------------------------------------------------
+    //! Append data to be decoded. The data is not copied, the bufferlist
+    //! shares its buffers with the reader.
+    //!
+    //! @param data bufferlist holding records
+    //! @param off offset in the bufferlist from where to start
+    //--------------------------------------------------------------------------
+    void Append(const librados::bufferlist& data, uint64_t off = 0);
+
+    //--------------------------------------------------------------------------
+    //! Mark that no more data will be appended
+    //--------------------------------------------------------------------------
+    void Finish()
+    {
+      mFinished = true;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Decode next record
+    //!
+    //! @param rec decoded record
+    //!
+    //! @return 0 if successful, -EAGAIN if there is no complete record left,
+    //!         -EINVAL if the data is corrupted
+    //--------------------------------------------------------------------------
+    int Next(ChangeLog::Record& rec);
+
+    //--------------------------------------------------------------------------
+    //! Check if all the appended data was consumed
+    //!
+    //! @return true if no data is left, otherwise false
+    //--------------------------------------------------------------------------
+    bool Empty() const
+    {
+      for (const auto& seg: mSegments)
+      {
+        if (seg.mPos != seg.mEnd)
+          return false;
+      }
+
+      return (mCarry.length() == mCarryOff);
+    }
+
+  private:
+
+    //--------------------------------------------------------------------------
+    //! Contiguous piece of data belonging to one of the appended bufferlists
+    //--------------------------------------------------------------------------
+    struct Segment
+    {
+      const char* mPos; ///< current position in the segment
+      const char* mEnd; ///< end of the segment
+      uint64_t mOwner; ///< sequence number of the owning bufferlist
+    };
+
+    //--------------------------------------------------------------------------
+    //! Decode record in the given range according to the format
+    //!
+    //! @param pos current position, advanced to the next record if successful
+    //! @param end end of the buffer
+    //! @param rec decoded record
+    //! @param last true if there is no more data after end
+    //!
+    //! @return 0 if successful, -EAGAIN if incomplete, -EINVAL if corrupted
+    //--------------------------------------------------------------------------
+    int Decode(const char*& pos, const char* end, ChangeLog::Record& rec,
+               bool last) const;
+
+    //--------------------------------------------------------------------------
+    //! Drop the front segment and release the bufferlists no longer referenced
+    //--------------------------------------------------------------------------
+    void PopSegment();
+
+    ChangeLog::Format mFormat; ///< format of the records
+    bool mFinished; ///< no more data will be appended
+    std::deque<librados::bufferlist> mOwners; ///< bufferlists holding the data
+    uint64_t mOwnersBase; ///< sequence number of the first bufferlist
+    std::deque<Segment> mSegments; ///< segments not yet consumed
+    std::string mCarry; ///< bytes of a record straddling segments
+    uint64_t mCarryOff; ///< offset of the unconsumed bytes in the carry
+  };
+}
+
+#endif // __RADOS_CHANGELOG_HH__
@@ -0,0 +1,210 @@
+//------------------------------------------------------------------------------
+// File: GroupCommit.hh
+// Author: Elvin Sindrilaru <esindril@cern.ch>
+//------------------------------------------------------------------------------
+
+/*******************************************************************************
+ * RadosVectMap                                                                *
+ * Copyright (C) 2015 CERN/Switzerland                                         *
+ *                                                                             *
+ * This program is free software: you can redistribute it and/or modify        *
+ * it under the terms of the GNU General Public License as published by        *
+ * the Free Software Foundation, either version 3 of the License, or           *
+ * (at your option) any later version.                                         *
+ *                                                                             *
+ * This program is distributed in the hope that it will be useful,             *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                *
+ * GNU General Public License for more details.                                *
+ *                                                                             *
+ * You should have received a copy of the GNU General Public License           *
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.        *
+ ******************************************************************************/
+
+#ifndef __RADOS_GROUP_COMMIT_HH__
+#define __RADOS_GROUP_COMMIT_HH__
+
+#include <mutex>
+#include <algorithm>
+#include <condition_variable>
+#include "RadosMap.hh"
+
+namespace rados {
+
+  //----------------------------------------------------------------------------
+  //! Write combiner for a rados map shared by several threads. Mutations
+  //! coming from concurrent callers are gathered for a short window and then
+  //! committed by one of the callers (the leader) as a single batch i.e. one
+  //! epoch check and one changelog append. Every caller gets the result of
+  //! its own mutation.
+  //!
+  //! Once a map is wrapped by a group_commit object all the mutations must go
+  //! through it, the map itself is not thread-safe.
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index = std::map<K, V, std::less<>>>
+  class group_commit
+  {
+  public:
+    typedef typename map<K, V, Index>::mutation mutation_t;
+
+    //--------------------------------------------------------------------------
+    //! Constructor
+    //!
+    //! @param map rados map to which the mutations are committed
+    //! @param window time interval for gathering mutations in one batch
+    //! @param max_batch maximum number of mutations in one batch, the batch is
+    //!        committed right away when reached
+    //--------------------------------------------------------------------------
+    group_commit(map<K, V, Index>& map,
+                 std::chrono::microseconds window = std::chrono::microseconds(200),
+                 uint64_t max_batch = 1024):
+      mMap(map), mWindow(window), mMaxBatch(max_batch), mLeaderActive(false)
+    {}
+
+    //--------------------------------------------------------------------------
+    //! Copy constructor - disabled
+    //--------------------------------------------------------------------------
+    group_commit(const group_commit& other) = delete;
+
+    //--------------------------------------------------------------------------
+    //! Copy assignment operator - disabled
+    //--------------------------------------------------------------------------
+    group_commit& operator=(const group_commit& other) = delete;
+
+    //--------------------------------------------------------------------------
+    //! Destructor
+    //--------------------------------------------------------------------------
+    ~group_commit() = default;
+
+    //--------------------------------------------------------------------------
+    //! Insert new value
+    //!
+    //! @param key key
+    //! @param value value
+    //!
+    //! @return true if the element was inserted and committed, otherwise false
+    //--------------------------------------------------------------------------
+    bool insert(const K& key, const V& value)
+    {
+      mutation_t mut(mutation_t::type::insert, key, value);
+      return apply(mut) && mut.mApplied;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Erase key from map
+    //!
+    //! @param key key to be erased
+    //!
+    //! @return true if the element was erased and committed, otherwise false
+    //--------------------------------------------------------------------------
+    bool erase(const K& key)
+    {
+      mutation_t mut(mutation_t::type::erase, key);
+      return apply(mut) && mut.mApplied;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Apply mutation as part of the next group commit
+    //!
+    //! @param mut mutation to be applied, its mApplied flag is updated once
+    //!        the batch is committed
+    //!
+    //! @return true if the batch containing the mutation was committed,
+    //!         otherwise false
+    //--------------------------------------------------------------------------
+    bool apply(mutation_t& mut);
+
+    //--------------------------------------------------------------------------
+    //! Set the time interval for gathering mutations in one batch
+    //!
+    //! @param window new time interval
+    //--------------------------------------------------------------------------
+    void set_window(std::chrono::microseconds window)
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mWindow = window;
+    }
+
+  private:
+
+    //--------------------------------------------------------------------------
+    //! Mutation waiting to be committed
+    //--------------------------------------------------------------------------
+    struct request
+    {
+      request(mutation_t& mut):
+        mMutation(mut), mDone(false), mCommitted(false)
+      {}
+
+      mutation_t& mMutation; ///< mutation of the caller
+      bool mDone; ///< set once the batch is committed or failed
+      bool mCommitted; ///< true if the batch was committed
+    };
+
+    map<K, V, Index>& mMap; ///< map to which the mutations are committed
+    std::chrono::microseconds mWindow; ///< interval for gathering mutations
+    uint64_t mMaxBatch; ///< max number of mutations in one batch
+    bool mLeaderActive; ///< true if a caller is gathering or committing
+    std::vector<request*> mQueue; ///< mutations waiting for the next batch
+    std::mutex mMutex; ///< mutex protecting the queue
+    std::condition_variable mCond; ///< notified when a batch is done or full
+  };
+
+  //----------------------------------------------------------------------------
+  // Apply mutation as part of the next group commit
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool group_commit<K, V, Index>::apply(mutation_t& mut)
+  {
+    request req(mut);
+    std::unique_lock<std::mutex> lock(mMutex);
+    mQueue.push_back(&req);
+
+    if (mQueue.size() >= mMaxBatch)
+      mCond.notify_all();
+
+    while (!req.mDone)
+    {
+      if (mLeaderActive)
+      {
+        mCond.wait(lock);
+        continue;
+      }
+
+      // Become the leader, gather mutations and commit them
+      mLeaderActive = true;
+      (void) mCond.wait_for(lock, mWindow, [&]() {
+          return (mQueue.size() >= mMaxBatch);
+        });
+
+      std::vector<request*> group;
+      auto num = std::min<uint64_t>(mQueue.size(), mMaxBatch);
+      group.assign(mQueue.begin(), mQueue.begin() + num);
+      mQueue.erase(mQueue.begin(), mQueue.begin() + num);
+      lock.unlock();
+
+      std::vector<mutation_t> batch;
+      batch.reserve(group.size());
+
+      for (auto&& elem: group)
+        batch.push_back(elem->mMutation);
+
+      bool committed = mMap.apply_batch(batch);
+      lock.lock();
+
+      for (uint64_t i = 0; i < group.size(); ++i)
+      {
+        group[i]->mMutation.mApplied = batch[i].mApplied;
+        group[i]->mCommitted = committed;
+        group[i]->mDone = true;
+      }
+
+      mLeaderActive = false;
+      mCond.notify_all();
+    }
+
+    return req.mCommitted;
+  }
+}
+
+#endif // __RADOS_GROUP_COMMIT_HH__
@@ -0,0 +1,251 @@
+//------------------------------------------------------------------------------
+// File: LatencyHistogram.hh
+// Author: Elvin Sindrilaru <esindril@cern.ch>
+//------------------------------------------------------------------------------
+
+/*******************************************************************************
+ * RadosVectMap                                                                *
+ * Copyright (C) 2015 CERN/Switzerland                                         *
+ *                                                                             *
+ * This program is free software: you can redistribute it and/or modify        *
+ * it under the terms of the GNU General Public License as published by        *
+ * the Free Software Foundation, either version 3 of the License, or           *
+ * (at your option) any later version.                                         *
+ *                                                                             *
+ * This program is distributed in the hope that it will be useful,             *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                *
+ * GNU General Public License for more details.                                *
+ *                                                                             *
+ * You should have received a copy of the GNU General Public License           *
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.        *
+ ******************************************************************************/
+
+#ifndef __RADOS_LATENCY_HISTOGRAM_HH__
+#define __RADOS_LATENCY_HISTOGRAM_HH__
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <cstdint>
+#include <algorithm>
+
+namespace rados {
+
+  //----------------------------------------------------------------------------
+  //! Bucketing of the latency histograms. Values below 2^SUB_BITS have their
+  //! own bucket, above that every power of two is split into 2^SUB_BITS
+  //! buckets, which bounds the relative error to 2^-SUB_BITS (about 6%) over
+  //! the whole 64-bit range, like an HDR histogram with one significant digit.
+  //----------------------------------------------------------------------------
+  struct latency_buckets
+  {
+    static constexpr uint64_t SUB_BITS = 4;
+    static constexpr uint64_t SUB_COUNT = 1ull << SUB_BITS;
+    static constexpr uint64_t NUM_BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT;
+
+    //--------------------------------------------------------------------------
+    //! Get the bucket of a value
+    //--------------------------------------------------------------------------
+    static uint64_t index(uint64_t value)
+    {
+      if (value < SUB_COUNT)
+        return value;
+
+      uint64_t exp = 63 - __builtin_clzll(value);
+      uint64_t sub = (value >> (exp - SUB_BITS)) & (SUB_COUNT - 1);
+      return (exp - SUB_BITS + 1) * SUB_COUNT + sub;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Get the highest value falling in a bucket
+    //--------------------------------------------------------------------------
+    static uint64_t highest(uint64_t idx)
+    {
+      if (idx < SUB_COUNT)
+        return idx;
+
+      uint64_t exp = idx / SUB_COUNT + SUB_BITS - 1;
+      uint64_t sub = idx % SUB_COUNT;
+      uint64_t lowest = (SUB_COUNT + sub) << (exp - SUB_BITS);
+      return lowest + ((1ull << (exp - SUB_BITS)) - 1);
+    }
+  };
+
+  //----------------------------------------------------------------------------
+  //! Content of a latency histogram at a given moment. Latencies are in
+  //! nanoseconds.
+  //----------------------------------------------------------------------------
+  struct latency_snapshot
+  {
+    std::array<uint64_t, latency_buckets::NUM_BUCKETS> mCounts {}; ///< buckets
+    uint64_t mCount {0}; ///< number of values recorded
+    uint64_t mSum {0}; ///< sum of the values recorded
+    uint64_t mMax {0}; ///< highest value recorded
+
+    //--------------------------------------------------------------------------
+    //! Get a percentile of the values recorded
+    //!
+    //! @param quantile quantile between 0 and 1 e.g. 0.99 for the p99
+    //!
+    //! @return value such that the given fraction of the values is lower or
+    //!         equal, within the precision of the buckets, 0 if empty
+    //--------------------------------------------------------------------------
+    uint64_t percentile(double quantile) const
+    {
+      if (mCount == 0)
+        return 0;
+
+      uint64_t rank = std::max<uint64_t>(1, (uint64_t)(quantile * mCount + 0.5));
+      uint64_t seen {0};
+
+      for (uint64_t idx = 0; idx < mCounts.size(); ++idx)
+      {
+        seen += mCounts[idx];
+
+        if (seen >= rank)
+          return std::min(latency_buckets::highest(idx), mMax);
+      }
+
+      return mMax;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Get the mean of the values recorded, 0 if empty
+    //--------------------------------------------------------------------------
+    uint64_t mean() const
+    {
+      return (mCount ? mSum / mCount : 0);
+    }
+
+    //--------------------------------------------------------------------------
+    //! Get a summary in the "name value" per line text format, with the
+    //! latencies in microseconds
+    //!
+    //! @param prefix prefix added to the name of each value
+    //!
+    //! @return summary as text
+    //--------------------------------------------------------------------------
+    std::string to_string(const std::string& prefix = "") const
+    {
+      return (prefix + "count " + std::to_string(mCount) + "\n" +
+              prefix + "mean_us " + std::to_string(mean() / 1000) + "\n" +
+              prefix + "p50_us " + std::to_string(percentile(0.5) / 1000) + "\n" +
+              prefix + "p99_us " + std::to_string(percentile(0.99) / 1000) + "\n" +
+              prefix + "p999_us " + std::to_string(percentile(0.999) / 1000) + "\n" +
+              prefix + "max_us " + std::to_string(mMax / 1000) + "\n");
+    }
+
+    //--------------------------------------------------------------------------
+    //! Merge the values of another histogram e.g. of another shard
+    //--------------------------------------------------------------------------
+    latency_snapshot& operator+=(const latency_snapshot& other)
+    {
+      for (uint64_t idx = 0; idx < mCounts.size(); ++idx)
+        mCounts[idx] += other.mCounts[idx];
+
+      mCount += other.mCount;
+      mSum += other.mSum;
+      mMax = std::max(mMax, other.mMax);
+      return *this;
+    }
+  };
+
+  //----------------------------------------------------------------------------
+  //! Lock-free latency histogram. Recording a value costs a few relaxed
+  //! atomic operations on the bucket, the sum and the maximum, therefore any
+  //! thread can record without coordination. Taking a snapshot with reset
+  //! swaps every bucket with zero, a value recorded concurrently ends up
+  //! either in this snapshot or in the next one.
+  //----------------------------------------------------------------------------
+  class latency_histogram
+  {
+  public:
+
+    //--------------------------------------------------------------------------
+    //! Record a latency
+    //!
+    //! @param nsec latency in nanoseconds
+    //--------------------------------------------------------------------------
+    void record(uint64_t nsec)
+    {
+      mCounts[latency_buckets::index(nsec)].fetch_add(1, std::memory_order_relaxed);
+      mSum.fetch_add(nsec, std::memory_order_relaxed);
+      uint64_t max = mMax.load(std::memory_order_relaxed);
+
+      while ((nsec > max) &&
+             !mMax.compare_exchange_weak(max, nsec, std::memory_order_relaxed));
+    }
+
+    //--------------------------------------------------------------------------
+    //! Record the time elapsed since a given moment
+    //!
+    //! @param start moment the measured operation started
+    //--------------------------------------------------------------------------
+    void record_since(std::chrono::steady_clock::time_point start)
+    {
+      record(std::chrono::duration_cast<std::chrono::nanoseconds>
+             (std::chrono::steady_clock::now() - start).count());
+    }
+
+    //--------------------------------------------------------------------------
+    //! Get the content of the histogram
+    //!
+    //! @param reset if true the histogram is emptied, e.g. at the end of a
+    //!        reporting interval
+    //!
+    //! @return content of the histogram
+    //--------------------------------------------------------------------------
+    latency_snapshot snapshot(bool reset = false)
+    {
+      latency_snapshot snap;
+
+      for (uint64_t idx = 0; idx < latency_buckets::NUM_BUCKETS; ++idx)
+      {
+        snap.mCounts[idx] = (reset ?
+                             mCounts[idx].exchange(0, std::memory_order_relaxed) :
+                             mCounts[idx].load(std::memory_order_relaxed));
+        snap.mCount += snap.mCounts[idx];
+      }
+
+      snap.mSum = (reset ? mSum.exchange(0, std::memory_order_relaxed) :
+                   mSum.load(std::memory_order_relaxed));
+      snap.mMax = (reset ? mMax.exchange(0, std::memory_order_relaxed) :
+                   mMax.load(std::memory_order_relaxed));
+      return snap;
+    }
+
+  private:
+    //! Number of values per bucket
+    std::array<std::atomic<uint64_t>, latency_buckets::NUM_BUCKETS> mCounts {};
+    std::atomic<uint64_t> mSum {0}; ///< sum of the values recorded
+    std::atomic<uint64_t> mMax {0}; ///< highest value recorded
+  };
+
+  //----------------------------------------------------------------------------
+  //! Record the lifetime of the object in a latency histogram, for the
+  //! operations with several exit points
+  //----------------------------------------------------------------------------
+  class latency_timer
+  {
+  public:
+    latency_timer(latency_histogram& hist):
+      mHist(hist), mStart(std::chrono::steady_clock::now())
+    {}
+
+    ~latency_timer()
+    {
+      mHist.record_since(mStart);
+    }
+
+    latency_timer(const latency_timer& other) = delete;
+    latency_timer& operator=(const latency_timer& other) = delete;
+
+  private:
+    latency_histogram& mHist; ///< histogram to record into
+    std::chrono::steady_clock::time_point mStart; ///< creation time
+  };
+}
+
+#endif // __RADOS_LATENCY_HISTOGRAM_HH__
@@ -0,0 +1,1018 @@
+//------------------------------------------------------------------------------
+// File: LocalIndex.hh
+// Author: Elvin Sindrilaru <esindril@cern.ch>
+//------------------------------------------------------------------------------
+
+/*******************************************************************************
+ * RadosVectMap                                                                *
+ * Copyright (C) 2015 CERN/Switzerland                                         *
+ *                                                                             *
+ * This program is free software: you can redistribute it and/or modify        *
+ * it under the terms of the GNU General Public License as published by        *
+ * the Free Software Foundation, either version 3 of the License, or           *
+ * (at your option) any later version.                                         *
+ *                                                                             *
+ * This program is distributed in the hope that it will be useful,             *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                *
+ * GNU General Public License for more details.                                *
+ *                                                                             *
+ * You should have received a copy of the GNU General Public License           *
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.        *
+ ******************************************************************************/
+
+#ifndef __RADOS_LOCAL_INDEX_HH__
+#define __RADOS_LOCAL_INDEX_HH__
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <utility>
+#include <string_view>
+#include <type_traits>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <algorithm>
+#include <functional>
+
+//------------------------------------------------------------------------------
+// Containers which can hold the local replica of a rados map instead of the
+// default std::map. An index must provide the following subset of the
+// std::map interface:
+//
+//   iterator, value_type with first and second
+//   begin(), end(), size(), clear()
+//   find(key), count(key)
+//   insert(value_type) returning a pair of iterator and bool
+//   insert_or_assign(key, value)
+//   erase(key), erase(iterator)
+//
+// and specialise index_traits if it does not iterate in key order. Entries
+// known to be sorted are added through index_append, which falls back to
+// insert_or_assign. Lookups by std::string_view of string keys are forwarded
+// as such if the index supports heterogeneous lookup e.g. through a
+// transparent comparator, otherwise a key is built for the lookup.
+//------------------------------------------------------------------------------
+
+namespace rados {
+
+  //----------------------------------------------------------------------------
+  //! Properties of an index
+  //----------------------------------------------------------------------------
+  template <typename Index>
+  struct index_traits
+  {
+    //! Iteration follows the order of the keys
+    static constexpr bool ordered = true;
+  };
+
+  //----------------------------------------------------------------------------
+  //! Default hash of the hash table indexes, transparent for string keys so
+  //! that they can be looked up by std::string_view
+  //----------------------------------------------------------------------------
+  template <typename K>
+  struct index_hash: std::hash<K>
+  {};
+
+  template <>
+  struct index_hash<std::string>
+  {
+    typedef void is_transparent;
+
+    size_t operator()(std::string_view key) const
+    {
+      return std::hash<std::string_view>()(key);
+    }
+  };
+
+  //----------------------------------------------------------------------------
+  //! Sorted vector of entries. Lookups are binary searches over contiguous
+  //! memory and iterating is a linear scan, with no per-entry allocation.
+  //! Inserts and erases in the middle move the tail of the vector, therefore
+  //! it suits replicas which are read much more than they are written. Loading
+  //! a snapshot, whose entries are sorted, only appends.
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Compare = std::less<>>
+  class flat_map
+  {
+  public:
+    typedef std::pair<K, V> value_type;
+    typedef typename std::vector<value_type>::iterator iterator;
+    typedef typename std::vector<value_type>::const_iterator const_iterator;
+
+    iterator begin() { return mData.begin(); }
+    iterator end() { return mData.end(); }
+    const_iterator begin() const { return mData.begin(); }
+    const_iterator end() const { return mData.end(); }
+    size_t size() const { return mData.size(); }
+    size_t capacity() const { return mData.capacity(); }
+    bool empty() const { return mData.empty(); }
+    void clear() { mData.clear(); }
+    void reserve(size_t count) { mData.reserve(count); }
+
+    //--------------------------------------------------------------------------
+    //! Get the first entry whose key is not lower than the given one. Any
+    //! type comparable with the keys can be looked up with a transparent
+    //! comparator.
+    //--------------------------------------------------------------------------
+    template <typename Q, typename C = Compare,
+              typename = typename C::is_transparent>
+    iterator lower_bound(const Q& key)
+    {
+      return LowerBound(key);
+    }
+
+    iterator lower_bound(const K& key)
+    {
+      return LowerBound(key);
+    }
+
+    template <typename Q, typename C = Compare,
+              typename = typename C::is_transparent>
+    iterator find(const Q& key)
+    {
+      return Find(key);
+    }
+
+    iterator find(const K& key)
+    {
+      return Find(key);
+    }
+
+    template <typename Q, typename C = Compare,
+              typename = typename C::is_transparent>
+    size_t count(const Q& key)
+    {
+      return (Find(key) == mData.end() ? 0 : 1);
+    }
+
+    size_t count(const K& key)
+    {
+      return (Find(key) == mData.end() ? 0 : 1);
+    }
+
+    std::pair<iterator, bool> insert(const value_type& entry)
+    {
+      iterator iter = lower_bound(entry.first);
+
+      if ((iter != mData.end()) && !mComp(entry.first, iter->first))
+        return std::make_pair(iter, false);
+
+      return std::make_pair(mData.insert(iter, entry), true);
+    }
+
+    std::pair<iterator, bool> insert_or_assign(const K& key, V&& value)
+    {
+      iterator iter = lower_bound(key);
+
+      if ((iter != mData.end()) && !mComp(key, iter->first))
+      {
+        iter->second = std::move(value);
+        return std::make_pair(iter, false);
+      }
+
+      return std::make_pair(mData.emplace(iter, key, std::move(value)), true);
+    }
+
+    //--------------------------------------------------------------------------
+    //! Add an entry, at the end without a search if its key is greater than
+    //! the last key
+    //--------------------------------------------------------------------------
+    void append(const K& key, V&& value)
+    {
+      if (mData.empty() || mComp(mData.back().first, key))
+        mData.emplace_back(key, std::move(value));
+      else
+        (void) insert_or_assign(key, std::move(value));
+    }
+
+    template <typename Q, typename C = Compare,
+              typename = typename C::is_transparent>
+    size_t erase(const Q& key)
+    {
+      return Erase(key);
+    }
+
+    size_t erase(const K& key)
+    {
+      return Erase(key);
+    }
+
+    iterator erase(iterator iter)
+    {
+      return mData.erase(iter);
+    }
+
+  private:
+    std::vector<value_type> mData; ///< entries sorted by key
+    Compare mComp; ///< key comparison
+
+    template <typename Q>
+    iterator LowerBound(const Q& key)
+    {
+      // Appends in key order are the common case, check the back first
+      if (mData.empty() || mComp(mData.back().first, key))
+        return mData.end();
+
+      return std::lower_bound(mData.begin(), mData.end(), key,
+                              [this](const value_type& entry, const Q& k) {
+                                return mComp(entry.first, k);
+                              });
+    }
+
+    template <typename Q>
+    iterator Find(const Q& key)
+    {
+      iterator iter = LowerBound(key);
+
+      if ((iter != mData.end()) && !mComp(key, iter->first))
+        return iter;
+
+      return mData.end();
+    }
+
+    template <typename Q>
+    size_t Erase(const Q& key)
+    {
+      iterator iter = Find(key);
+
+      if (iter == mData.end())
+        return 0;
+
+      mData.erase(iter);
+      return 1;
+    }
+  };
+
+  //----------------------------------------------------------------------------
+  //! Open-addressing hash table with linear probing. The entries live in one
+  //! array next to a byte of control information each, holding part of the
+  //! hash so that most probes compare a byte instead of a key. Erasing shifts
+  //! the following entries of the probe sequence back, which keeps lookups
+  //! short without tombstones. Iteration is in no particular order and any
+  //! insert or erase invalidates the iterators.
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Hash = index_hash<K>>
+  class hash_map
+  {
+  public:
+    typedef std::pair<K, V> value_type;
+
+    //--------------------------------------------------------------------------
+    //! Forward iterator over the occupied slots
+    //--------------------------------------------------------------------------
+    class iterator
+    {
+    public:
+      typedef std::forward_iterator_tag iterator_category;
+      typedef typename hash_map::value_type value_type;
+      typedef std::ptrdiff_t difference_type;
+      typedef value_type* pointer;
+      typedef value_type& reference;
+
+      iterator():
+        mOwner(nullptr), mPos(0)
+      {}
+
+      iterator(hash_map* owner, size_t pos):
+        mOwner(owner), mPos(pos)
+      {
+        Skip();
+      }
+
+      reference operator*() const { return mOwner->mSlots[mPos]; }
+      pointer operator->() const { return &mOwner->mSlots[mPos]; }
+
+      iterator& operator++()
+      {
+        ++mPos;
+        Skip();
+        return *this;
+      }
+
+      iterator operator++(int)
+      {
+        iterator old = *this;
+        ++(*this);
+        return old;
+      }
+
+      bool operator==(const iterator& other) const { return mPos == other.mPos; }
+      bool operator!=(const iterator& other) const { return mPos != other.mPos; }
+
+    private:
+      friend class hash_map;
+
+      //! Move to the next occupied slot
+      void Skip()
+      {
+        while ((mPos < mOwner->mCtrl.size()) && !mOwner->mCtrl[mPos])
+          ++mPos;
+      }
+
+      hash_map* mOwner; ///< table iterated over
+      size_t mPos; ///< current slot
+    };
+
+    hash_map():
+      mSize(0), mMask(0)
+    {}
+
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, mCtrl.size()); }
+    size_t size() const { return mSize; }
+    size_t capacity() const { return mCtrl.size(); }
+    bool empty() const { return (mSize == 0); }
+
+    void clear()
+    {
+      mSlots.clear();
+      mCtrl.clear();
+      mSize = 0;
+      mMask = 0;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Make room for a number of entries without rehashing
+    //--------------------------------------------------------------------------
+    void reserve(size_t count)
+    {
+      size_t capacity = MIN_CAPACITY;
+
+      while (capacity * MAX_LOAD_NUM < count * MAX_LOAD_DEN)
+        capacity <<= 1;
+
+      if (capacity > mCtrl.size())
+        Rehash(capacity);
+    }
+
+    //--------------------------------------------------------------------------
+    //! Lookups by any type hashing and comparing like the keys are possible
+    //! with a transparent hash
+    //--------------------------------------------------------------------------
+    template <typename Q, typename H = Hash,
+              typename = typename H::is_transparent>
+    iterator find(const Q& key)
+    {
+      size_t pos;
+      return (Probe(key, pos) ? iterator(this, pos) : end());
+    }
+
+    iterator find(const K& key)
+    {
+      size_t pos;
+      return (Probe(key, pos) ? iterator(this, pos) : end());
+    }
+
+    template <typename Q, typename H = Hash,
+              typename = typename H::is_transparent>
+    size_t count(const Q& key)
+    {
+      size_t pos;
+      return (Probe(key, pos) ? 1 : 0);
+    }
+
+    size_t count(const K& key)
+    {
+      size_t pos;
+      return (Probe(key, pos) ? 1 : 0);
+    }
+
+    std::pair<iterator, bool> insert(const value_type& entry)
+    {
+      size_t pos;
+
+      if (Probe(entry.first, pos))
+        return std::make_pair(iterator(this, pos), false);
+
+      pos = Place(entry.first);
+      mSlots[pos].second = entry.second;
+      return std::make_pair(iterator(this, pos), true);
+    }
+
+    std::pair<iterator, bool> insert_or_assign(const K& key, V&& value)
+    {
+      size_t pos;
+      bool inserted = !Probe(key, pos);
+
+      if (inserted)
+        pos = Place(key);
+
+      mSlots[pos].second = std::move(value);
+      return std::make_pair(iterator(this, pos), inserted);
+    }
+
+    template <typename Q, typename H = Hash,
+              typename = typename H::is_transparent>
+    size_t erase(const Q& key)
+    {
+      return EraseKey(key);
+    }
+
+    size_t erase(const K& key)
+    {
+      return EraseKey(key);
+    }
+
+    void erase(iterator iter)
+    {
+      EraseSlot(iter.mPos);
+    }
+
+  private:
+    //! Minimum number of slots of a non-empty table
+    static constexpr size_t MIN_CAPACITY = 16;
+    //! Maximum load factor as a fraction
+    static constexpr size_t MAX_LOAD_NUM = 4;
+    static constexpr size_t MAX_LOAD_DEN = 5;
+
+    std::vector<value_type> mSlots; ///< entries, default value if empty
+    std::vector<uint8_t> mCtrl; ///< 0 if the slot is empty, else hash tag
+    size_t mSize; ///< number of entries
+    size_t mMask; ///< number of slots minus one
+    Hash mHash; ///< key hash
+
+    //--------------------------------------------------------------------------
+    //! Get the control byte of a hash, never 0
+    //--------------------------------------------------------------------------
+    static uint8_t Tag(size_t hash)
+    {
+      return (uint8_t)(0x80 | (hash >> (sizeof(size_t) * 8 - 7)));
+    }
+
+    //--------------------------------------------------------------------------
+    //! Look for a key
+    //!
+    //! @param key key to search for
+    //! @param pos slot of the key if found
+    //!
+    //! @return true if found, otherwise false
+    //--------------------------------------------------------------------------
+    template <typename Q>
+    bool Probe(const Q& key, size_t& pos) const
+    {
+      if (mSize == 0)
+        return false;
+
+      size_t hash = mHash(key);
+      uint8_t tag = Tag(hash);
+
+      for (pos = hash & mMask; mCtrl[pos]; pos = (pos + 1) & mMask)
+      {
+        if ((mCtrl[pos] == tag) && (mSlots[pos].first == key))
+          return true;
+      }
+
+      return false;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Take a free slot for a key known to be missing, growing if needed
+    //!
+    //! @return slot of the key
+    //--------------------------------------------------------------------------
+    size_t Place(const K& key)
+    {
+      if ((mSize + 1) * MAX_LOAD_DEN > mCtrl.size() * MAX_LOAD_NUM)
+        Rehash(std::max(MIN_CAPACITY, mCtrl.size() * 2));
+
+      size_t hash = mHash(key);
+      size_t pos = hash & mMask;
+
+      while (mCtrl[pos])
+        pos = (pos + 1) & mMask;
+
+      mCtrl[pos] = Tag(hash);
+      mSlots[pos].first = key;
+      ++mSize;
+      return pos;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Erase a key if present
+    //--------------------------------------------------------------------------
+    template <typename Q>
+    size_t EraseKey(const Q& key)
+    {
+      size_t pos;
+
+      if (!Probe(key, pos))
+        return 0;
+
+      EraseSlot(pos);
+      return 1;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Empty a slot and shift back the entries of its probe sequence
+    void EraseSlot(size_t pos)
+    {
+      size_t next = (pos + 1) & mMask;
+
+      while (mCtrl[next])
+      {
+        size_t home = mHash(mSlots[next].first) & mMask;
+
+        // The entry can fill the hole if its home is not after the hole
+        if (((next - home) & mMask) >= ((next - pos) & mMask))
+        {
+          mSlots[pos] = std::move(mSlots[next]);
+          mCtrl[pos] = mCtrl[next];
+          pos = next;
+        }
+
+        next = (next + 1) & mMask;
+      }
+
+      mSlots[pos] = value_type();
+      mCtrl[pos] = 0;
+      --mSize;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Move all the entries to a table with the given number of slots
+    //--------------------------------------------------------------------------
+    void Rehash(size_t capacity)
+    {
+      std::vector<value_type> old_slots(capacity);
+      std::vector<uint8_t> old_ctrl(capacity, 0);
+      old_slots.swap(mSlots);
+      old_ctrl.swap(mCtrl);
+      mMask = capacity - 1;
+
+      for (size_t i = 0; i < old_ctrl.size(); ++i)
+      {
+        if (!old_ctrl[i])
+          continue;
+
+        size_t pos = mHash(old_slots[i].first) & mMask;
+
+        while (mCtrl[pos])
+          pos = (pos + 1) & mMask;
+
+        mCtrl[pos] = old_ctrl[i];
+        mSlots[pos] = std::move(old_slots[i]);
+      }
+    }
+  };
+
+  //----------------------------------------------------------------------------
+  //! The hash table does not iterate in key order
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Hash>
+  struct index_traits<hash_map<K, V, Hash>>
+  {
+    static constexpr bool ordered = false;
+  };
+
+  //----------------------------------------------------------------------------
+  //! Hash table whose string keys and values are packed in large slabs
+  //! instead of one std::string each. Equal string values are interned i.e.
+  //! stored once and shared. The entries expose std::string_view keys and
+  //! values, or the numeric value itself, which stay valid until the entry
+  //! is modified or the slabs are reclaimed.
+  //!
+  //! Erased or overwritten strings leave dead bytes in the slabs, reclaim()
+  //! copies the live ones to new slabs. The map calls it after a compaction.
+  //----------------------------------------------------------------------------
+  template <typename K, typename V>
+  class arena_map
+  {
+    static_assert(std::is_same<K, std::string>::value,
+                  "arena_map needs string keys");
+
+  public:
+    //! Type of the stored value, a view in the slabs for strings
+    typedef typename std::conditional<std::is_same<V, std::string>::value,
+                                      std::string_view, V>::type stored_t;
+    typedef hash_map<std::string_view, stored_t> table_t;
+    typedef typename table_t::value_type value_type;
+    typedef typename table_t::iterator iterator;
+
+    //! Size of the slabs, longer strings get a slab of their own
+    static constexpr size_t SLAB_SIZE = 1 << 20;
+
+    arena_map():
+      mSlabFree(0), mSlabPos(nullptr), mArenaBytes(0), mDeadBytes(0)
+    {}
+
+    arena_map(arena_map&& other) = default;
+    arena_map& operator=(arena_map&& other) = default;
+
+    iterator begin() { return mTable.begin(); }
+    iterator end() { return mTable.end(); }
+    size_t size() const { return mTable.size(); }
+    size_t capacity() const { return mTable.capacity(); }
+    bool empty() const { return mTable.empty(); }
+    void reserve(size_t count) { mTable.reserve(count); }
+
+    //! Get the number of bytes reserved in slabs
+    uint64_t arena_bytes() const { return mArenaBytes; }
+
+    //! Get the number of slab bytes held by erased or overwritten strings
+    uint64_t dead_bytes() const { return mDeadBytes; }
+
+    //! Get the number of distinct string values
+    uint64_t interned_values() const { return mIntern.size(); }
+
+    void clear()
+    {
+      mTable.clear();
+      mIntern.clear();
+      mSlabs.clear();
+      mSlabFree = 0;
+      mSlabPos = nullptr;
+      mArenaBytes = mDeadBytes = 0;
+    }
+
+    iterator find(std::string_view key)
+    {
+      return mTable.find(key);
+    }
+
+    size_t count(std::string_view key)
+    {
+      return mTable.count(key);
+    }
+
+    std::pair<iterator, bool> insert(const std::pair<K, V>& entry)
+    {
+      auto iter = mTable.find(entry.first);
+
+      if (iter != mTable.end())
+        return std::make_pair(iter, false);
+
+      return mTable.insert(std::make_pair(Store(entry.first),
+                                          StoreValue(entry.second)));
+    }
+
+    std::pair<iterator, bool> insert_or_assign(const K& key, V&& value)
+    {
+      auto iter = mTable.find(key);
+
+      if (iter == mTable.end())
+        return mTable.insert(std::make_pair(Store(key), StoreValue(value)));
+
+      stored_t old_value = iter->second;
+      iter->second = StoreValue(value);
+      ReleaseValue(old_value);
+      return std::make_pair(iter, false);
+    }
+
+    size_t erase(std::string_view key)
+    {
+      auto iter = mTable.find(key);
+
+      if (iter == mTable.end())
+        return 0;
+
+      erase(iter);
+      return 1;
+    }
+
+    void erase(iterator iter)
+    {
+      std::string_view key = iter->first;
+      stored_t value = iter->second;
+      mTable.erase(iter);
+      mDeadBytes += key.length();
+      ReleaseValue(value);
+    }
+
+    //--------------------------------------------------------------------------
+    //! Copy the live strings to new slabs and free the old ones if at least
+    //! the given fraction of the bytes written to the slabs is dead. Invalidates iterators
+    //! and views.
+    //!
+    //! @param min_dead_ratio minimum fraction of dead bytes
+    //!
+    //! @return true if the slabs were reclaimed, otherwise false
+    //--------------------------------------------------------------------------
+    bool reclaim(double min_dead_ratio = 0)
+    {
+      // The free tail of the current slab is not wasted, compare to what is used
+      if ((mDeadBytes == 0) ||
+          (mDeadBytes < min_dead_ratio * (mArenaBytes - mSlabFree)))
+        return false;
+
+      arena_map fresh;
+      fresh.reserve(mTable.size());
+
+      for (auto&& entry: mTable)
+        (void) fresh.mTable.insert(std::make_pair(fresh.Store(entry.first),
+                                                  fresh.StoreValue(entry.second)));
+
+      *this = std::move(fresh);
+      return true;
+    }
+
+  private:
+    //! Distinct string values and their number of references
+    typedef hash_map<std::string_view, uint64_t> intern_t;
+
+    table_t mTable; ///< entries pointing into the slabs
+    intern_t mIntern; ///< interned string values
+    std::vector<std::unique_ptr<char[]>> mSlabs; ///< storage of the strings
+    size_t mSlabFree; ///< bytes left in the last slab
+    char* mSlabPos; ///< first free byte of the last slab
+    uint64_t mArenaBytes; ///< bytes reserved in slabs
+    uint64_t mDeadBytes; ///< bytes of strings no longer referenced
+
+    //--------------------------------------------------------------------------
+    //! Copy a string to the slabs
+    //--------------------------------------------------------------------------
+    std::string_view Store(std::string_view str)
+    {
+      if (str.empty())
+        return std::string_view();
+
+      // Long strings get a slab of their own, not wasting the current one
+      if (str.length() > SLAB_SIZE / 4)
+      {
+        mSlabs.emplace_back(new char[str.length()]);
+        mArenaBytes += str.length();
+        memcpy(mSlabs.back().get(), str.data(), str.length());
+        return std::string_view(mSlabs.back().get(), str.length());
+      }
+
+      if (str.length() > mSlabFree)
+      {
+        mSlabs.emplace_back(new char[SLAB_SIZE]);
+        mArenaBytes += SLAB_SIZE;
+        mSlabPos = mSlabs.back().get();
+        mSlabFree = SLAB_SIZE;
+      }
+
+      memcpy(mSlabPos, str.data(), str.length());
+      std::string_view stored(mSlabPos, str.length());
+      mSlabPos += str.length();
+      mSlabFree -= str.length();
+      return stored;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Store a value, strings are interned
+    //--------------------------------------------------------------------------
+    template <typename W>
+    stored_t StoreValue(const W& value)
+    {
+      if constexpr (std::is_same<stored_t, std::string_view>::value)
+      {
+        std::string_view str(value);
+        auto iter = mIntern.find(str);
+
+        if (iter != mIntern.end())
+        {
+          iter->second++;
+          return iter->first;
+        }
+
+        std::string_view stored = Store(str);
+        (void) mIntern.insert(std::make_pair(stored, uint64_t(1)));
+        return stored;
+      }
+      else
+      {
+        return value;
+      }
+    }
+
+    //--------------------------------------------------------------------------
+    //! Drop a reference to a value
+    //--------------------------------------------------------------------------
+    void ReleaseValue(const stored_t& value)
+    {
+      (void) value;
+
+      if constexpr (std::is_same<stored_t, std::string_view>::value)
+      {
+        auto iter = mIntern.find(value);
+
+        if ((iter != mIntern.end()) && (--iter->second == 0))
+        {
+          mDeadBytes += value.length();
+          mIntern.erase(iter);
+        }
+      }
+    }
+  };
+
+  //----------------------------------------------------------------------------
+  //! The arena table does not iterate in key order
+  //----------------------------------------------------------------------------
+  template <typename K, typename V>
+  struct index_traits<arena_map<K, V>>
+  {
+    static constexpr bool ordered = false;
+  };
+
+  //----------------------------------------------------------------------------
+  //! Memory used by a local index
+  //----------------------------------------------------------------------------
+  struct index_memory
+  {
+    uint64_t mEntries {0}; ///< number of entries
+    uint64_t mPayloadBytes {0}; ///< raw size of the keys and values
+    uint64_t mIndexBytes {0}; ///< container structure i.e. nodes or slots
+    uint64_t mHeapBytes {0}; ///< strings allocated out of the entries
+    uint64_t mArenaBytes {0}; ///< slabs of the arena storage
+    uint64_t mDeadBytes {0}; ///< slab bytes not referenced any more
+    uint64_t mInternedValues {0}; ///< distinct values in the arena
+
+    //! Get the total memory used
+    uint64_t total() const
+    {
+      return mIndexBytes + mHeapBytes + mArenaBytes;
+    }
+
+    //! Accumulate the usage of another index e.g. of another shard
+    index_memory& operator+=(const index_memory& other)
+    {
+      mEntries += other.mEntries;
+      mPayloadBytes += other.mPayloadBytes;
+      mIndexBytes += other.mIndexBytes;
+      mHeapBytes += other.mHeapBytes;
+      mArenaBytes += other.mArenaBytes;
+      mDeadBytes += other.mDeadBytes;
+      mInternedValues += other.mInternedValues;
+      return *this;
+    }
+  };
+
+  //----------------------------------------------------------------------------
+  //! Estimate the memory of the keys and values of an entry. Strings longer
+  //! than the small string buffer take an allocation of their own, the
+  //! malloc overhead is counted as 16 bytes.
+  //----------------------------------------------------------------------------
+  inline void AccountField(const std::string& str, index_memory& usage)
+  {
+    usage.mPayloadBytes += str.length();
+
+    if (str.capacity() > std::string().capacity())
+      usage.mHeapBytes += str.capacity() + 1 + 16;
+  }
+
+  inline void AccountField(std::string_view str, index_memory& usage)
+  {
+    usage.mPayloadBytes += str.length();
+  }
+
+  template <typename W>
+  inline void AccountField(const W& value, index_memory& usage)
+  {
+    (void) value;
+    usage.mPayloadBytes += sizeof(W);
+  }
+
+  template <typename Index>
+  void AccountEntries(const Index& index, index_memory& usage)
+  {
+    usage.mEntries = index.size();
+
+    for (auto&& entry: const_cast<Index&>(index))
+    {
+      AccountField(entry.first, usage);
+      AccountField(entry.second, usage);
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  //! Get the memory used by a node-based index like std::map, estimated with
+  //! 32 bytes of node header and 16 bytes of malloc overhead per entry.
+  //! Walks all the entries.
+  //----------------------------------------------------------------------------
+  template <typename Index>
+  index_memory index_memory_usage(const Index& index)
+  {
+    index_memory usage;
+    AccountEntries(index, usage);
+    usage.mIndexBytes = index.size() *
+      (sizeof(typename Index::value_type) + 32 + 16);
+    return usage;
+  }
+
+  //----------------------------------------------------------------------------
+  //! Get the memory used by a sorted vector index. Walks all the entries.
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Compare>
+  index_memory index_memory_usage(const flat_map<K, V, Compare>& index)
+  {
+    index_memory usage;
+    AccountEntries(index, usage);
+    usage.mIndexBytes = index.capacity() *
+      sizeof(typename flat_map<K, V, Compare>::value_type);
+    return usage;
+  }
+
+  //----------------------------------------------------------------------------
+  //! Get the memory used by a hash table index. Walks all the entries.
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Hash>
+  index_memory index_memory_usage(const hash_map<K, V, Hash>& index)
+  {
+    index_memory usage;
+    AccountEntries(index, usage);
+    usage.mIndexBytes = index.capacity() *
+      (sizeof(typename hash_map<K, V, Hash>::value_type) + 1);
+    return usage;
+  }
+
+  //----------------------------------------------------------------------------
+  //! Get the memory used by an arena index. Walks all the entries.
+  //----------------------------------------------------------------------------
+  template <typename K, typename V>
+  index_memory index_memory_usage(const arena_map<K, V>& index)
+  {
+    index_memory usage;
+    AccountEntries(index, usage);
+    // Interning table holds a view and a counter per distinct value
+    usage.mIndexBytes = index.capacity() *
+      (sizeof(typename arena_map<K, V>::value_type) + 1) +
+      index.interned_values() * 2 * (sizeof(std::string_view) + sizeof(uint64_t) + 1);
+    usage.mArenaBytes = index.arena_bytes();
+    usage.mDeadBytes = index.dead_bytes();
+    usage.mInternedValues = index.interned_values();
+    return usage;
+  }
+
+  //----------------------------------------------------------------------------
+  //! Release the memory no longer used by an index, a no-op by default
+  //!
+  //! @return true if memory was released, otherwise false
+  //----------------------------------------------------------------------------
+  template <typename Index>
+  bool index_reclaim(Index& index)
+  {
+    (void) index;
+    return false;
+  }
+
+  //----------------------------------------------------------------------------
+  //! Reclaim the slabs of an arena index once a quarter of them is dead
+  //----------------------------------------------------------------------------
+  template <typename K, typename V>
+  bool index_reclaim(arena_map<K, V>& index)
+  {
+    return index.reclaim(0.25);
+  }
+
+  //----------------------------------------------------------------------------
+  //! Add an entry to an index, expected to come after all of its keys when
+  //! the entries are added in sorted order. By default it is a plain insert.
+  //----------------------------------------------------------------------------
+  template <typename Index, typename K, typename V>
+  void index_append(Index& index, const K& key, V&& value)
+  {
+    (void) index.insert_or_assign(key, std::move(value));
+  }
+
+  //----------------------------------------------------------------------------
+  //! Append to a std::map with the end as hint, constant time if sorted
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Compare, typename Alloc>
+  void index_append(std::map<K, V, Compare, Alloc>& index, const K& key, V&& value)
+  {
+    size_t size = index.size();
+    auto iter = index.try_emplace(index.end(), key, std::move(value));
+
+    // Key already present, the value was left untouched
+    if (index.size() == size)
+      iter->second = std::move(value);
+  }
+
+  //----------------------------------------------------------------------------
+  //! Append to a sorted vector without a search if sorted
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Compare>
+  void index_append(flat_map<K, V, Compare>& index, const K& key, V&& value)
+  {
+    index.append(key, std::move(value));
+  }
+
+  //----------------------------------------------------------------------------
+  //! Look up a key in an index, directly if the index accepts the type of
+  //! the key given e.g. a std::string_view, otherwise through a key of type K
+  //----------------------------------------------------------------------------
+  template <typename K, typename Index, typename Q>
+  auto IndexFind(Index& index, const Q& key, int) -> decltype(index.find(key))
+  {
+    return index.find(key);
+  }
+
+  template <typename K, typename Index, typename Q>
+  typename Index::iterator IndexFind(Index& index, const Q& key, long)
+  {
+    return index.find(K(key));
+  }
+
+  template <typename K, typename Index, typename Q>
+  typename Index::iterator index_find(Index& index, const Q& key)
+  {
+    return IndexFind<K>(index, key, 0);
+  }
+}
+
+#endif // __RADOS_LOCAL_INDEX_HH__
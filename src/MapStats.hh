@@ -0,0 +1,211 @@
+//------------------------------------------------------------------------------
+// File: MapStats.hh
+// Author: Elvin Sindrilaru <esindril@cern.ch>
+//------------------------------------------------------------------------------
+
+/*******************************************************************************
+ * RadosVectMap                                                                *
+ * Copyright (C) 2015 CERN/Switzerland                                         *
+ *                                                                             *
+ * This program is free software: you can redistribute it and/or modify        *
+ * it under the terms of the GNU General Public License as published by        *
+ * the Free Software Foundation, either version 3 of the License, or           *
+ * (at your option) any later version.                                         *
+ *                                                                             *
+ * This program is distributed in the hope that it will be useful,             *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                *
+ * GNU General Public License for more details.                                *
+ *                                                                             *
+ * You should have received a copy of the GNU General Public License           *
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.        *
+ ******************************************************************************/
+
+#ifndef __RADOS_MAP_STATS_HH__
+#define __RADOS_MAP_STATS_HH__
+
+#include <atomic>
+#include <string>
+#include <cstdint>
+#include <functional>
+
+namespace rados {
+
+  //----------------------------------------------------------------------------
+  //! Snapshot of the runtime statistics of a map. The counters only grow
+  //! over the lifetime of the map while the gauges describe its current
+  //! state.
+  //----------------------------------------------------------------------------
+  struct map_stats
+  {
+    //! Callback receiving the name and the value of a statistic
+    typedef std::function<void(const std::string& name, uint64_t value,
+                               bool is_counter)> sink_t;
+
+    // Counters
+    uint64_t mInserts {0}; ///< number of insert requests
+    uint64_t mErases {0}; ///< number of erase requests
+    uint64_t mBatches {0}; ///< number of synchronous batches
+    uint64_t mLookups {0}; ///< number of lookups, all consistency levels
+    uint64_t mCommits {0}; ///< number of changelog appends committed
+    uint64_t mConflicts {0}; ///< number of commits failed on epoch missmatch
+    uint64_t mRetries {0}; ///< number of retries after an epoch missmatch
+    uint64_t mBytesAppended {0}; ///< bytes appended to the changelog
+    uint64_t mBytesRead {0}; ///< bytes of changelog and snapshots read
+    uint64_t mReplayEntries {0}; ///< changelog entries applied to the map
+    uint64_t mCatchUps {0}; ///< incremental updates from the changelog
+    uint64_t mFullReloads {0}; ///< full reloads i.e. snapshot and changelog
+    uint64_t mCacheLoads {0}; ///< start-ups from the local cache file
+    uint64_t mCompactions {0}; ///< number of compactions swapped in
+    uint64_t mCompactionUs {0}; ///< total duration of the compactions
+    // Gauges
+    uint64_t mEpoch {0}; ///< epoch of the local map
+    uint64_t mBaseEpoch {0}; ///< epoch of the snapshot the changelog starts from
+    uint64_t mLogSize {0}; ///< size of the changelog followed
+    uint64_t mLogEntries {0}; ///< number of entries in the changelog
+    uint64_t mMapSize {0}; ///< number of entries in the local map
+    uint64_t mQueuedBytes {0}; ///< changelog bytes fetched in the background
+                               ///< and not yet applied
+    uint64_t mLastSyncTime {0}; ///< Unix time in ms when the local map was
+                                ///< last known to match the remote one
+
+    //--------------------------------------------------------------------------
+    //! Export all the statistics, e.g. to a metrics pipeline
+    //!
+    //! @param sink callback invoked once per statistic
+    //--------------------------------------------------------------------------
+    void for_each(const sink_t& sink) const
+    {
+      sink("inserts", mInserts, true);
+      sink("erases", mErases, true);
+      sink("batches", mBatches, true);
+      sink("lookups", mLookups, true);
+      sink("commits", mCommits, true);
+      sink("conflicts", mConflicts, true);
+      sink("retries", mRetries, true);
+      sink("bytes_appended", mBytesAppended, true);
+      sink("bytes_read", mBytesRead, true);
+      sink("replay_entries", mReplayEntries, true);
+      sink("catch_ups", mCatchUps, true);
+      sink("full_reloads", mFullReloads, true);
+      sink("cache_loads", mCacheLoads, true);
+      sink("compactions", mCompactions, true);
+      sink("compaction_us", mCompactionUs, true);
+      sink("epoch", mEpoch, false);
+      sink("base_epoch", mBaseEpoch, false);
+      sink("log_size", mLogSize, false);
+      sink("log_entries", mLogEntries, false);
+      sink("map_size", mMapSize, false);
+      sink("queued_bytes", mQueuedBytes, false);
+      sink("last_sync_time_ms", mLastSyncTime, false);
+    }
+
+    //--------------------------------------------------------------------------
+    //! Get the statistics in the "name value" per line text format
+    //!
+    //! @param prefix prefix added to the name of each statistic
+    //!
+    //! @return statistics as text
+    //--------------------------------------------------------------------------
+    std::string to_string(const std::string& prefix = "") const
+    {
+      std::string out;
+      for_each([&](const std::string& name, uint64_t value, bool) {
+          out += prefix + name + " " + std::to_string(value) + "\n";
+        });
+      return out;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Accumulate the statistics of another map e.g. of another shard
+    //--------------------------------------------------------------------------
+    map_stats& operator+=(const map_stats& other)
+    {
+      mInserts += other.mInserts;
+      mErases += other.mErases;
+      mBatches += other.mBatches;
+      mLookups += other.mLookups;
+      mCommits += other.mCommits;
+      mConflicts += other.mConflicts;
+      mRetries += other.mRetries;
+      mBytesAppended += other.mBytesAppended;
+      mBytesRead += other.mBytesRead;
+      mReplayEntries += other.mReplayEntries;
+      mCatchUps += other.mCatchUps;
+      mFullReloads += other.mFullReloads;
+      mCacheLoads += other.mCacheLoads;
+      mCompactions += other.mCompactions;
+      mCompactionUs += other.mCompactionUs;
+      mEpoch += other.mEpoch;
+      mBaseEpoch += other.mBaseEpoch;
+      mLogSize += other.mLogSize;
+      mLogEntries += other.mLogEntries;
+      mMapSize += other.mMapSize;
+      mQueuedBytes += other.mQueuedBytes;
+
+      // The least recently synced map tells the staleness of the whole
+      if (!mLastSyncTime || (other.mLastSyncTime &&
+                             (other.mLastSyncTime < mLastSyncTime)))
+        mLastSyncTime = other.mLastSyncTime;
+
+      return *this;
+    }
+  };
+
+  //----------------------------------------------------------------------------
+  //! Counters updated on the hot paths of a map. They are relaxed atomics
+  //! since the background threads update some of them, an increment costs a
+  //! single uncontended atomic add.
+  //----------------------------------------------------------------------------
+  struct map_counters
+  {
+    std::atomic<uint64_t> mInserts {0};
+    std::atomic<uint64_t> mErases {0};
+    std::atomic<uint64_t> mBatches {0};
+    std::atomic<uint64_t> mCommits {0};
+    std::atomic<uint64_t> mConflicts {0};
+    std::atomic<uint64_t> mBytesAppended {0};
+    std::atomic<uint64_t> mBytesRead {0};
+    std::atomic<uint64_t> mReplayEntries {0};
+    std::atomic<uint64_t> mCatchUps {0};
+    std::atomic<uint64_t> mFullReloads {0};
+    std::atomic<uint64_t> mCacheLoads {0};
+    std::atomic<uint64_t> mCompactions {0};
+    std::atomic<uint64_t> mCompactionUs {0};
+
+    //--------------------------------------------------------------------------
+    //! Increment a counter
+    //!
+    //! @param counter counter to increment
+    //! @param value value to add
+    //--------------------------------------------------------------------------
+    static void add(std::atomic<uint64_t>& counter, uint64_t value = 1)
+    {
+      counter.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    //--------------------------------------------------------------------------
+    //! Copy the counters to a snapshot
+    //!
+    //! @param stats snapshot to fill in
+    //--------------------------------------------------------------------------
+    void copy_to(map_stats& stats) const
+    {
+      stats.mInserts = mInserts.load(std::memory_order_relaxed);
+      stats.mErases = mErases.load(std::memory_order_relaxed);
+      stats.mBatches = mBatches.load(std::memory_order_relaxed);
+      stats.mCommits = mCommits.load(std::memory_order_relaxed);
+      stats.mConflicts = mConflicts.load(std::memory_order_relaxed);
+      stats.mBytesAppended = mBytesAppended.load(std::memory_order_relaxed);
+      stats.mBytesRead = mBytesRead.load(std::memory_order_relaxed);
+      stats.mReplayEntries = mReplayEntries.load(std::memory_order_relaxed);
+      stats.mCatchUps = mCatchUps.load(std::memory_order_relaxed);
+      stats.mFullReloads = mFullReloads.load(std::memory_order_relaxed);
+      stats.mCacheLoads = mCacheLoads.load(std::memory_order_relaxed);
+      stats.mCompactions = mCompactions.load(std::memory_order_relaxed);
+      stats.mCompactionUs = mCompactionUs.load(std::memory_order_relaxed);
+    }
+  };
+}
+
+#endif // __RADOS_MAP_STATS_HH__
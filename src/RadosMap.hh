@@ -25,10 +25,20 @@
 #define __RADOS_MAP_HH__
 
 #include <map>
+#include <deque>
+#include <unordered_set>
+#include <vector>
+#include <memory>
+#include <future>
+#include <random>
 #include <cerrno>
 #include <climits>
 #include <string>
 #include <sstream>
+#include <algorithm>
+#include <numeric>
+#include <functional>
+#include <string_view>
 #include <cstdio>
 #include <utility>
 #include <cstdint>
@@ -36,20 +46,141 @@
 #include <typeinfo>
 #include <chrono>
 #include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include <rados/librados.hpp>
 #include "RadosException.hh"
+#include "ChangeLog.hh"
+#include "UpdateChannel.hh"
+#include "Backend.hh"
+#include "RetryPolicy.hh"
+#include "MapStats.hh"
+#include "LatencyHistogram.hh"
+#include "LocalIndex.hh"
+#include "ReplicaCache.hh"
 
 namespace rados {
 
   //----------------------------------------------------------------------------
   //! Rados map class which is backed-up by a object
+  //!
+  //! The local replica is held in an Index container, a std::map with a
+  //! transparent comparator by default so that string keys can be looked up
+  //! by std::string_view. rados::flat_map is a more compact ordered index for
+  //! replicas mostly read and rados::hash_map a faster unordered one for point
+  //! lookups, see LocalIndex.hh for the interface an index needs.
   //----------------------------------------------------------------------------
-  template<typename K, typename V>
+  template<typename K, typename V, typename Index = std::map<K, V, std::less<>>>
   class map
   {
-    typedef typename std::map<K, V>::iterator maplocal_iterator_t;
+    typedef typename Index::iterator maplocal_iterator_t;
 
   public:
+    //! Type of the key argument of the lookups, string keys can be looked up
+    //! by any std::string_view without building a std::string
+    typedef typename std::conditional<std::is_same<K, std::string>::value,
+                                      std::string_view, const K&>::type key_arg_t;
+
+    //--------------------------------------------------------------------------
+    //! Mutation to be applied to the map as part of a batch
+    //--------------------------------------------------------------------------
+    struct mutation
+    {
+      enum class type { insert, erase };
+
+      mutation(type op, K key, V value = V()):
+        mType(op), mKey(std::move(key)), mValue(std::move(value)), mApplied(false)
+      {}
+
+      type mType; ///< type of mutation
+      K mKey; ///< key to be inserted or erased
+      V mValue; ///< value to be inserted, ignored for erase
+      bool mApplied; ///< true if the mutation changed the map once committed
+    };
+
+    //--------------------------------------------------------------------------
+    //! Consistency level of the lookups
+    //--------------------------------------------------------------------------
+    enum class consistency
+    {
+      local, ///< answer from the local map as it is
+      bounded, ///< update first if the last sync is older than the bound
+      linearizable ///< check the remote epoch and update first if behind
+    };
+
+    //--------------------------------------------------------------------------
+    //! Operations and stages with a latency histogram
+    //--------------------------------------------------------------------------
+    enum class stage
+    {
+      insert, ///< synchronous insert, or submission in async mode
+      erase, ///< synchronous erase, or submission in async mode
+      update, ///< update from the remote changelog i.e. DoUpdate
+      compaction, ///< background compaction, snapshot and swap
+      local_update, ///< mutations applied to the local map and encoded
+      replay, ///< changelog entries read from the backend applied locally
+      round_trip, ///< backend operation of a commit or of an update
+      catch_up ///< update after a commit failed on epoch missmatch
+    };
+
+    //--------------------------------------------------------------------------
+    //! Options of the full loads of the map. The snapshot and the changelog
+    //! are read in chunks, several of them in flight, and each chunk is
+    //! applied while the next ones are still being read. The records of a
+    //! chunk are decoded by several threads.
+    //--------------------------------------------------------------------------
+    struct load_options
+    {
+      load_options(uint64_t chunk_size = 4 * 1024 * 1024,
+                   uint64_t max_inflight = 4,
+                   uint64_t replay_threads = 0):
+        mChunkSize(chunk_size), mMaxInflight(max_inflight),
+        mReplayThreads(replay_threads)
+      {}
+
+      uint64_t mChunkSize; ///< size of each read, bounds the memory used
+      uint64_t mMaxInflight; ///< maximum number of reads in flight
+      uint64_t mReplayThreads; ///< threads decoding a chunk, 0 for one per core
+    };
+
+    //--------------------------------------------------------------------------
+    //! Polling of the changelog in follower mode. The interval starts at the
+    //! minimum, doubles after every poll which found nothing new up to the
+    //! maximum and goes back to the minimum once new entries show up. Equal
+    //! bounds give a fixed interval.
+    //--------------------------------------------------------------------------
+    struct follow_options
+    {
+      follow_options(std::chrono::milliseconds min_interval =
+                     std::chrono::milliseconds(10),
+                     std::chrono::milliseconds max_interval =
+                     std::chrono::milliseconds(1000),
+                     uint64_t max_queued = WATCH_MAX_QUEUED):
+        mMinInterval(min_interval),
+        mMaxInterval(std::max(min_interval, max_interval)),
+        mMaxQueued(max_queued)
+      {}
+
+      std::chrono::milliseconds mMinInterval; ///< interval while the map changes
+      std::chrono::milliseconds mMaxInterval; ///< interval of an idle map
+      uint64_t mMaxQueued; ///< bytes fetched which may wait for a lookup,
+                           ///< past it the next lookup does a full update
+    };
+
+    //--------------------------------------------------------------------------
+    //! Lookup counters of a consistency level
+    //--------------------------------------------------------------------------
+    struct read_stats
+    {
+      read_stats():
+        mReads(0), mChecks(0), mRefreshes(0)
+      {}
+
+      uint64_t mReads; ///< number of lookups
+      uint64_t mChecks; ///< number of remote epoch checks i.e. round trips
+      uint64_t mRefreshes; ///< number of lookups which had to catch up
+    };
 
     //--------------------------------------------------------------------------
     //! Constructor
@@ -59,17 +190,44 @@ namespace rados {
     //! @param name name of the map
     //! @param cookie application identifier
     //! @param persist_obj persist backend obj. (delete or not obj. holding the map)
-    //!
-    //! TODO: add param weak consistency when all operations are done async.
-    //!
+    //! @param is_async if true, insert and erase return as soon as the local
+    //!        map is updated and the changes are committed in the background
+    //!        (weak consistency - single writer)
+    //! @param cache_path local file caching the replica, loaded at start-up
+    //!        and saved on destruction, empty for none. See save_cache.
+    //! @param load chunking of the full loads of the map
     //--------------------------------------------------------------------------
     map(librados::Rados& rados_cluster,
         const std::string& pool_name,
         const std::string& name,
         const std::string& cookie,
         bool persist_obj = true,
-        bool is_async = false) noexcept(false);
+        bool is_async = false,
+        const std::string& cache_path = "",
+        const load_options& load = load_options()) noexcept(false);
 
+    //--------------------------------------------------------------------------
+    //! Constructor
+    //!
+    //! @param store object store holding the map obj, shared by all the
+    //!        maps using it
+    //! @param name name of the map
+    //! @param cookie application identifier
+    //! @param persist_obj persist backend obj. (delete or not obj. holding the map)
+    //! @param is_async if true, insert and erase return as soon as the local
+    //!        map is updated and the changes are committed in the background
+    //!        (weak consistency - single writer)
+    //! @param cache_path local file caching the replica, loaded at start-up
+    //!        and saved on destruction, empty for none. See save_cache.
+    //! @param load chunking of the full loads of the map
+    //--------------------------------------------------------------------------
+    map(std::shared_ptr<backend> store,
+        const std::string& name,
+        const std::string& cookie,
+        bool persist_obj = true,
+        bool is_async = false,
+        const std::string& cache_path = "",
+        const load_options& load = load_options()) noexcept(false);
 
     //--------------------------------------------------------------------------
     //! Copy constructor - disabled
@@ -87,7 +245,8 @@ namespace rados {
     virtual ~map();
 
     //--------------------------------------------------------------------------
-    //! Insert new value
+    //! Insert new value. The key and the value are moved along to the local
+    //! map, pass rvalues to avoid any copy on the way in.
     //!
     //! @param key key
     //! @param value value
@@ -99,12 +258,25 @@ namespace rados {
     std::pair<maplocal_iterator_t, bool>
     insert(K key, V value);
 
+    //--------------------------------------------------------------------------
+    //! Insert new value constructed in place from the arguments of a
+    //! std::pair<K, V> constructor
+    //!
+    //! @return same as insert
+    //--------------------------------------------------------------------------
+    template <typename... Args>
+    std::pair<maplocal_iterator_t, bool> emplace(Args&&... args)
+    {
+      std::pair<K, V> entry(std::forward<Args>(args)...);
+      return insert(std::move(entry.first), std::move(entry.second));
+    }
+
     //--------------------------------------------------------------------------
     //! Erase key from map
     //!
     //! @param key key to be erased from the map
     //--------------------------------------------------------------------------
-    void erase(K key);
+    void erase(key_arg_t key);
 
     //--------------------------------------------------------------------------
     //! Erase entry pointed by iterator
@@ -113,39 +285,346 @@ namespace rados {
     //--------------------------------------------------------------------------
     void erase(maplocal_iterator_t iter);
 
+    //--------------------------------------------------------------------------
+    //! Apply a batch of mutations atomically. All the changes are committed
+    //! with a single epoch check, a single epoch increment and a single append
+    //! to the changelog. The mutations are applied in order, an insert of an
+    //! existing key or an erase of a missing key leave the map unchanged. On
+    //! epoch missmatch the whole batch is retried on the updated map.
+    //!
+    //! @param batch list of mutations, the mApplied flag of each of them is
+    //!        updated to reflect the outcome of the commit. The values of the
+    //!        inserts committed are moved into the map.
+    //!
+    //! @return true if batch committed, otherwise false
+    //--------------------------------------------------------------------------
+    bool apply_batch(std::vector<mutation>& batch);
+
+    //--------------------------------------------------------------------------
+    //! Insert several entries in one atomic operation
+    //!
+    //! @param entries list of key value pairs to be inserted
+    //!
+    //! @return true if batch committed, otherwise false
+    //--------------------------------------------------------------------------
+    bool insert_many(const std::vector<std::pair<K, V>>& entries);
+
+    //--------------------------------------------------------------------------
+    //! Insert several entries in one atomic operation, moving them
+    //!
+    //! @param entries list of key value pairs to be inserted
+    //!
+    //! @return true if batch committed, otherwise false
+    //--------------------------------------------------------------------------
+    bool insert_many(std::vector<std::pair<K, V>>&& entries);
+
+    //--------------------------------------------------------------------------
+    //! Erase several keys in one atomic operation
+    //!
+    //! @param keys list of keys to be erased
+    //!
+    //! @return true if batch committed, otherwise false
+    //--------------------------------------------------------------------------
+    bool erase_many(const std::vector<K>& keys);
+
+    //--------------------------------------------------------------------------
+    //! Insert new value asynchronously. The local map is updated right away
+    //! while the changelog append is pipelined with the other operations in
+    //! flight. If the map is not in async mode the insert is done synchronously.
+    //!
+    //! @param key key
+    //! @param value value
+    //!
+    //! @return future which becomes true once the insert is committed, or
+    //!         false if the key already existed or the commit failed
+    //--------------------------------------------------------------------------
+    std::shared_future<bool> aio_insert(K key, V value);
+
+    //--------------------------------------------------------------------------
+    //! Erase key from map asynchronously
+    //!
+    //! @param key key to be erased from the map
+    //!
+    //! @return future which becomes true once the erase is committed, or
+    //!         false if the key did not exist or the commit failed
+    //--------------------------------------------------------------------------
+    std::shared_future<bool> aio_erase(K key);
+
+    //--------------------------------------------------------------------------
+    //! Wait for all the asynchronous operations in flight to be committed.
+    //! Operations which failed because of an epoch missmatch are retried on
+    //! the updated map.
+    //!
+    //! @return true if all operations were committed, otherwise false
+    //--------------------------------------------------------------------------
+    bool flush();
+
+    //--------------------------------------------------------------------------
+    //! Compact the changelog right away. Compactions are normally triggered
+    //! automatically and run in the background, this waits for the compacted
+    //! changelog to be swapped in before returning.
+    //!
+    //! @return true if compaction successful, otherwise false
+    //--------------------------------------------------------------------------
+    bool compact();
+
+    //--------------------------------------------------------------------------
+    //! Enable watch mode. Every commit of this instance is announced on the
+    //! channel and the announcements of the other instances make a background
+    //! thread fetch the new changelog entries. The fetched entries are applied
+    //! to the local map by the next lookup, therefore read-only users stay up
+    //! to date without polling. Like for any local modification, iterators
+    //! obtained before a lookup may be invalidated by it.
+    //!
+    //! @param channel channel for the announcements, if null the RADOS
+    //!        watch/notify mechanism on the map object is used
+    //!
+    //! @return true if successful, otherwise false
+    //--------------------------------------------------------------------------
+    bool watch(std::shared_ptr<update_channel> channel = nullptr);
+
+    //--------------------------------------------------------------------------
+    //! Apply the updates fetched in the background in watch mode. Called by
+    //! all the lookups, a no-op if there is nothing new.
+    //!
+    //! @return true if successful, otherwise false
+    //--------------------------------------------------------------------------
+    bool refresh();
+
+    //--------------------------------------------------------------------------
+    //! Enable follower mode. The map becomes read-only: inserts, erases and
+    //! compactions fail and the map object is never removed. A background
+    //! thread polls the end of the changelog and the entries it fetches are
+    //! applied by the next lookup, like in watch mode. After a compaction
+    //! the map only rereads the trimmed changelog if it already covers the
+    //! new snapshot, otherwise it is reloaded. The staleness of the map is
+    //! given by last_sync() and the epoch, both exported by stats().
+    //!
+    //! @param opts polling interval
+    //!
+    //! @return true if successful, false if the pending changes could not be
+    //!         committed or the map is already in watch mode
+    //--------------------------------------------------------------------------
+    bool follow(const follow_options& opts = follow_options());
+
+    //--------------------------------------------------------------------------
+    //! Check if the map is read-only i.e. in follower mode
+    //--------------------------------------------------------------------------
+    bool is_read_only() const
+    {
+      return mReadOnly;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Get the time when the local map was last known to match the remote one
+    //--------------------------------------------------------------------------
+    std::chrono::steady_clock::time_point last_sync() const
+    {
+      return mLastSync;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Set the default consistency level of the lookups
+    //!
+    //! @param level consistency level
+    //! @param max_staleness maximum time since the last sync for the bounded
+    //!        level, ignored by the other levels
+    //--------------------------------------------------------------------------
+    void set_read_consistency(consistency level,
+                              std::chrono::milliseconds max_staleness =
+                              std::chrono::milliseconds(0));
+
+    //--------------------------------------------------------------------------
+    //! Get the lookup counters of a consistency level
+    //!
+    //! @param level consistency level
+    //!
+    //! @return counters of the level
+    //--------------------------------------------------------------------------
+    read_stats get_read_stats(consistency level) const
+    {
+      return mReadStats[static_cast<int>(level)];
+    }
+
+    //--------------------------------------------------------------------------
+    //! Set the policy used to retry the operations which failed because of an
+    //! epoch missmatch. By default they are retried right away and forever,
+    //! a backoff with jitter avoids retry storms when many writers share the
+    //! map. An operation on which the policy gives up fails.
+    //!
+    //! @param policy retry policy, if null the default one is restored
+    //--------------------------------------------------------------------------
+    void set_retry_policy(std::shared_ptr<retry_policy> policy);
+
+    //--------------------------------------------------------------------------
+    //! Limit the number of synchronous commits running at the same time. The
+    //! admission control is meant to be shared by all the instances of the
+    //! process writing to the same maps.
+    //!
+    //! @param ctrl admission control, if null commits are not limited
+    //--------------------------------------------------------------------------
+    void set_admission_control(std::shared_ptr<admission_control> ctrl);
+
+    //--------------------------------------------------------------------------
+    //! Get the number of retries due to an epoch missmatch
+    //!
+    //! @return number of retries
+    //--------------------------------------------------------------------------
+    uint64_t get_num_retries() const
+    {
+      return mNumRetries;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Get a snapshot of the runtime statistics. The counters are cheap to
+    //! update and can be read at any time, the gauges describing the local
+    //! map must be read by the thread using the map.
+    //!
+    //! @return statistics of the map
+    //--------------------------------------------------------------------------
+    map_stats stats() const;
+
+    //--------------------------------------------------------------------------
+    //! Get the memory used by the local map. Walks all the entries, like the
+    //! gauges of stats() it must be called by the thread using the map.
+    //!
+    //! @return memory used by the local index
+    //--------------------------------------------------------------------------
+    index_memory memory_usage() const
+    {
+      return index_memory_usage(mMap);
+    }
+
+    //--------------------------------------------------------------------------
+    //! Save the local map and the changelog position it covers to the cache
+    //! file given at construction. A map constructed later with the same
+    //! cache file loads it and only reads the changelog entries appended
+    //! since, unless a compaction dropped them in the meantime. Commits the
+    //! pending asynchronous operations first.
+    //!
+    //! @return true if successful, otherwise false
+    //--------------------------------------------------------------------------
+    bool save_cache();
+
+    //--------------------------------------------------------------------------
+    //! Get the epoch of the local map
+    //--------------------------------------------------------------------------
+    uint64_t epoch() const
+    {
+      return mEpoch;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Get the local index, e.g. to publish it to the readers of other
+    //! threads. Must be used by the thread using the map, any change made
+    //! through it bypasses the changelog.
+    //--------------------------------------------------------------------------
+    Index& local_index()
+    {
+      return mMap;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Get the latency histogram of an operation or stage. The histograms
+    //! can be read from any thread.
+    //!
+    //! @param st operation or stage
+    //! @param reset if true the histogram is emptied, e.g. at the end of a
+    //!        reporting interval
+    //!
+    //! @return content of the histogram, latencies in nanoseconds
+    //--------------------------------------------------------------------------
+    latency_snapshot latency(stage st, bool reset = false)
+    {
+      return mLatency[static_cast<int>(st)].snapshot(reset);
+    }
+
+    //--------------------------------------------------------------------------
+    //! Number of entries in map, using the default consistency level
+    //!
+    //! @return number of entries in map
+    //--------------------------------------------------------------------------
+    uint64_t size()
+    {
+      return size(mReadLevel);
+    }
+
     //--------------------------------------------------------------------------
     //! Number of entries in map
     //!
+    //! @param level consistency level of the lookup
+    //!
     //! @return number of entries in map
     //--------------------------------------------------------------------------
-    uint64_t size() const;
+    uint64_t size(consistency level);
+
+    //--------------------------------------------------------------------------
+    //! Count the elements with a specific key, using the default consistency
+    //! level
+    //!
+    //! @param key key to search for
+    //!
+    //! @return 1 if container contains an element whose key is equivalent to
+    //!         k, otherwise 0
+    //--------------------------------------------------------------------------
+    uint64_t count(key_arg_t key)
+    {
+      return count(key, mReadLevel);
+    }
 
     //--------------------------------------------------------------------------
     //! Count the elements with a specific key
     //!
     //! @param key key to search for
+    //! @param level consistency level of the lookup
     //!
     //! @return 1 if container contains an element whose key is equivalent to
     //!         k, otherwise 0
     //--------------------------------------------------------------------------
-    uint64_t count(const K& key) const;
+    uint64_t count(key_arg_t key, consistency level);
+
+    //--------------------------------------------------------------------------
+    //! Get iterator to element, using the default consistency level
+    //!
+    //! @param key key to be searched for
+    //!
+    //! @return an iterator to the element, if an element with the specified
+    //!         key is found, otherwise std::map::end
+    //--------------------------------------------------------------------------
+    maplocal_iterator_t find(key_arg_t key)
+    {
+      return find(key, mReadLevel);
+    }
 
     //--------------------------------------------------------------------------
     //! Get iterator to element
     //!
     //! @param key key to be searched for
+    //! @param level consistency level of the lookup
     //!
     //! @return an iterator to the element, if an element with the specified
     //!         key is found, otherwise std::map::end
     //--------------------------------------------------------------------------
-    maplocal_iterator_t find(const K& key);
+    maplocal_iterator_t find(key_arg_t key, consistency level);
 
     //--------------------------------------------------------------------------
-    //! Get iterator to beginning of local map
+    //! Get iterator to beginning of local map, using the default consistency
+    //! level
     //--------------------------------------------------------------------------
     maplocal_iterator_t begin()
     {
-       return mMap.begin();
+      return begin(mReadLevel);
+    }
+
+    //--------------------------------------------------------------------------
+    //! Get iterator to beginning of local map
+    //!
+    //! @param level consistency level of the iteration
+    //--------------------------------------------------------------------------
+    maplocal_iterator_t begin(consistency level)
+    {
+      (void) SyncForRead(level);
+      return mMap.begin();
     }
 
     //--------------------------------------------------------------------------
@@ -181,7 +660,7 @@ namespace rados {
     //! @return string representation of the object
     //--------------------------------------------------------------------------
     template <typename W>
-    std::string ToString(W value) const;
+    std::string ToString(const W& value) const;
 
     //--------------------------------------------------------------------------
     //! Convert string to type object
@@ -195,88 +674,560 @@ namespace rados {
 
   private:
 
+    //--------------------------------------------------------------------------
+    //! Asynchronous mutation in flight
+    //--------------------------------------------------------------------------
+    struct aio_op
+    {
+      aio_op(mutation&& mut):
+        mMutation(std::move(mut)), mOldValue(), mEpoch(0), mChLogLen(0),
+        mPrvalCmp(0), mComp(nullptr),
+        mPromise(), mFuture(mPromise.get_future().share()), mSubmit()
+      {}
+
+      mutation mMutation; ///< mutation to be committed
+      V mOldValue; ///< value of the key before an erase, used for roll back
+      uint64_t mEpoch; ///< epoch the operation expects to find remotely
+      uint64_t mChLogLen; ///< length of the changelog entry appended
+      int mPrvalCmp; ///< result of the epoch comparison
+      backend::completion_ptr mComp; ///< completion of the backend operation
+      std::promise<bool> mPromise; ///< set once the operation is committed
+      std::shared_future<bool> mFuture; ///< future handed out to the caller
+      std::chrono::steady_clock::time_point mSubmit; ///< submission time
+    };
+
+    //--------------------------------------------------------------------------
+    //! State of the background compaction
+    //--------------------------------------------------------------------------
+    enum class compaction_state { idle, running, swapped };
+
+    //--------------------------------------------------------------------------
+    //! Compaction done by the background worker i.e. a snapshot of the map
+    //! and the changelog trimmed to the entries not covered by it
+    //--------------------------------------------------------------------------
+    struct compaction
+    {
+      ChangeLog::Format mFormat; ///< format of the changelog being compacted
+      uint64_t mNumEntries; ///< number of entries in the trimmed changelog
+      uint64_t mTrimEntries; ///< number of entries covered by the snapshot
+      uint64_t mChLogOff; ///< changelog offset covered by the snapshot, then
+                          ///< length of the trimmed changelog once swapped
+      uint64_t mSnapEpoch; ///< epoch covered by the snapshot
+      uint64_t mEpoch; ///< epoch of the changelog when it was trimmed
+      uint64_t mBaseEpoch; ///< base epoch of the changelog being compacted
+    };
+
+    //--------------------------------------------------------------------------
+    //! Changelog entries fetched in the background in watch mode
+    //--------------------------------------------------------------------------
+    struct watch_chunk
+    {
+      uint64_t mFromEpoch; ///< epoch the entries apply to
+      uint64_t mFromOff; ///< changelog offset of the first entry
+      uint64_t mEpoch; ///< epoch reached once applied
+      uint64_t mBaseEpoch; ///< base epoch of the changelog
+      librados::bufferlist mData; ///< changelog entries
+    };
+
+    //--------------------------------------------------------------------------
+    //! State shared with the watch thread and the channel callback. It is
+    //! reference counted since a late notification may still be delivered
+    //! while the map is destroyed.
+    //--------------------------------------------------------------------------
+    struct watch_state
+    {
+      watch_state():
+        mNotifiedEpoch(0), mEpoch(0), mChLogOff(0), mBaseEpoch(0),
+        mReload(false), mStop(false), mDirty(false), mSyncTime(0),
+        mMinInterval(0), mMaxInterval(0), mQueued(0),
+        mMaxQueued(WATCH_MAX_QUEUED)
+      {}
+
+      std::mutex mMutex; ///< mutex protecting the state
+      std::condition_variable mCond; ///< notified on new announcements
+      uint64_t mNotifiedEpoch; ///< highest epoch announced
+      uint64_t mEpoch; ///< epoch the next fetch starts from
+      uint64_t mChLogOff; ///< changelog offset the next fetch starts from
+      uint64_t mBaseEpoch; ///< base epoch the next fetch expects
+      std::deque<watch_chunk> mChunks; ///< entries fetched, not yet applied
+      bool mReload; ///< changelog was compacted, a full update is needed
+      bool mStop; ///< flag to stop the watch thread
+      std::atomic<bool> mDirty; ///< there is something to apply
+      //! Steady clock ticks of the start of the last poll, the entries fetched
+      //! were up to date then. Stored after the entries, follower mode only.
+      std::atomic<int64_t> mSyncTime;
+      std::chrono::milliseconds mMinInterval; ///< minimum polling interval
+      std::chrono::milliseconds mMaxInterval; ///< maximum polling interval
+      uint64_t mQueued; ///< bytes of the chunks not yet applied
+      uint64_t mMaxQueued; ///< limit of the bytes not yet applied
+    };
+
     //! Declare class-wide constants
     static const std::string OBJ_EPOCH_KEY;
+    static const std::string OBJ_WRITER_KEY;
+    static const std::string OBJ_BASE_EPOCH_KEY;
+    static const std::string OBJ_PREV_BASE_EPOCH_KEY;
+    static const std::string OBJ_TRIM_OFF_KEY;
+    static const std::string OBJ_TRIM_ENTRIES_KEY;
+    static const std::string SNAPSHOT_SUFFIX;
     static const std::string CHLOG_INSERT_OP;
     static const std::string CHLOG_ERASE_OP;
     //! Ratio between nuber of entries in the map and the nuber of entries in
     //! changelog when a compaction is done
     static const float COMPACTION_RATIO;
-
-    std::map<K, V> mMap; ///< local representation of the map
+    //! Maximum number of asynchronous operations in flight
+    static const uint64_t AIO_MAX_INFLIGHT;
+    //! Maximum number of attempts to swap in a compacted changelog
+    static const uint64_t COMPACTION_SWAP_RETRIES;
+    //! Minimum number of bytes decoded by each replay worker
+    static const uint64_t REPLAY_MIN_WORKER_BYTES;
+    //! Superseded records are no longer looked for once a chunk has less than
+    //! one in this many of them
+    static const uint64_t REPLAY_MIN_SUPERSEDED;
+    //! Default limit of the changelog bytes fetched in the background which
+    //! wait for a lookup to apply them
+    static const uint64_t WATCH_MAX_QUEUED;
+
+    Index mMap; ///< local representation of the map
     std::string mObjId;  ///< object id that holds the map information
-    librados::IoCtx mIoCtx; ///< io context
+    std::shared_ptr<backend> mBackend; ///< object store holding the map
     bool mPersistObj; /// < persist backend object (CEPH)
+    std::string mCachePath; ///< local file caching the replica, if any
+    load_options mLoadOptions; ///< chunking of the full loads
     bool mIsAsync; ///< map is in async mode (weak consistency) - single user
+    bool mReadOnly; ///< map is in follower mode, it never writes
     uint64_t mEpoch; ///< current epoch of the local map
     uint64_t mChLogOff; ///< changelog offset of followed updates
     uint64_t mChLogNumLines; ///< number of entries in the changelog file
+    ChangeLog::Format mChLogFormat; ///< format of the changelog entries
+    std::string mWriterId; ///< unique id of this instance as a writer
+    std::deque<std::unique_ptr<aio_op>> mPending; ///< async operations in flight
+    uint64_t mBaseEpoch; ///< epoch of the snapshot the changelog starts from
+    std::thread mCompactThread; ///< background compaction worker
+    std::mutex mCompactMutex; ///< mutex protecting the compaction state
+    std::condition_variable mCompactCond; ///< notified on state changes
+    compaction_state mCompactState; ///< state of the background compaction
+    compaction mCompaction; ///< last compaction swapped in by the worker
+    bool mCompactFence; ///< writer must wait for the worker to swap
+    bool mCompactStop; ///< flag to stop the compaction worker
+    std::shared_ptr<update_channel> mChannel; ///< channel in watch mode
+    uint64_t mWatchHandle; ///< subscription handle in watch mode
+    std::shared_ptr<watch_state> mWatch; ///< state of the watch mode
+    std::thread mWatchThread; ///< thread fetching announced updates
+    consistency mReadLevel; ///< default consistency level of the lookups
+    std::chrono::milliseconds mMaxStaleness; ///< bound of the bounded level
+    //! Time when the local map was last known to match the remote one
+    std::chrono::steady_clock::time_point mLastSync;
+    read_stats mReadStats[3]; ///< lookup counters per consistency level
+    std::shared_ptr<retry_policy> mRetryPolicy; ///< policy of the retries
+    std::shared_ptr<admission_control> mAdmission; ///< commit admission control
+    std::atomic<uint64_t> mNumRetries; ///< number of retries done
+    uint64_t mAioRetries; ///< retries of the oldest async operation
+    map_counters mCounters; ///< runtime statistics
+    latency_histogram mLatency[8]; ///< latency histograms per stage
 
     //--------------------------------------------------------------------------
-    //! Insert complete callback
+    //! Submit a mutation asynchronously or commit it synchronously if the
+    //! map is not in async mode
     //!
-    //! @param func AioComplitionImpl object
-    //! @param arg arguments of the callback complition
+    //! @param mut mutation to be applied
+    //! @param applied set to true if the mutation changed the local map
+    //!
+    //! @return future holding the result of the commit
     //--------------------------------------------------------------------------
-    static void insert_complete_cb(librados::completion_t func, void* arg);
+    std::shared_future<bool> SubmitAio(mutation&& mut, bool& applied);
 
     //--------------------------------------------------------------------------
-    //! Update the local contents of the map and the epoch if necessary
+    //! Apply mutation to the local map and schedule the corresponding
+    //! changelog append after the operations already in flight
     //!
-    //! @return true if update successful, otherwise false
+    //! @param op asynchronous operation
+    //!
+    //! @return true if operation scheduled or not needed, otherwise false
     //--------------------------------------------------------------------------
-    bool DoUpdate();
+    bool StartAio(std::unique_ptr<aio_op>&& op);
 
     //--------------------------------------------------------------------------
-    //! Compaction of the changelog
+    //! Collect completed asynchronous operations and update the local view
+    //! of the changelog. Block until at most max_pending operations are still
+    //! in flight.
     //!
-    //! @return true if compaction successful, otherwise false
+    //! @param max_pending maximum number of operations left in flight
+    //!
+    //! @return true if successful, otherwise false
     //--------------------------------------------------------------------------
-    bool DoCompaction();
+    bool ReapAio(uint64_t max_pending);
 
     //--------------------------------------------------------------------------
-    //! Apply change log contents to the local map
+    //! Handle a failed asynchronous operation. All the operations scheduled
+    //! after it fail as well, therefore they are rolled back and, in case of
+    //! an epoch missmatch, resubmitted in order on the updated map.
     //!
-    //! @param buffer containing the changes
+    //! @param conflict true if the failure is due to an epoch missmatch
     //!
-    //! return true if successful, otherwise false
+    //! @return true if operations resubmitted, otherwise false
     //--------------------------------------------------------------------------
-    bool ApplyChangeLog(const std::string& chlog);
+    bool RetryAio(bool conflict);
 
     //--------------------------------------------------------------------------
-    //! Helper function to convert string to non-string object.
+    //! Wait before retrying an operation which failed because of an epoch
+    //! missmatch, as dictated by the retry policy
     //!
-    //! @param value string object to be converted
+    //! @param attempt number of retries of the operation, incremented
     //!
-    //! @return object obtained from converting the string to type W
+    //! @return true if the operation can be retried, false if the policy
+    //!         gave up on it
     //--------------------------------------------------------------------------
-    template <typename W>
-    bool HelperFromString(const std::string& sval, W& ret) const;
+    bool Backoff(uint64_t& attempt);
 
     //--------------------------------------------------------------------------
-    //! Helper function to convert string to a string.
-    //! Migth sound confugins but it's done like this so that the code compiles
-    //! when the return value is either a string or a numeric type.
-    //!
-    //! @param value string object to be converted
-    //!
-    //! @return object obtained from converting the string to type W
+    //! Get the latency histogram of an operation or stage
     //--------------------------------------------------------------------------
-    bool HelperFromString(const std::string& sval, std::string& ret) const;
+    latency_histogram& Latency(stage st)
+    {
+      return mLatency[static_cast<int>(st)];
+    }
 
     //--------------------------------------------------------------------------
-    //! Helper function to get string representation of an object which is not
-    //! a string.
-    //!
-    //! @param value obj to be converted
+    //! Update the local contents of the map and the epoch if necessary. The
+    //! epoch, size and new changelog entries come from a single read unless
+    //! the changelog was compacted.
     //!
-    //! @return string representation of the object
+    //! @return true if update successful, otherwise false
     //--------------------------------------------------------------------------
-    template <typename W>
-    bool HelperToString(W value, std::string& ret) const;
+    bool DoUpdate();
 
     //--------------------------------------------------------------------------
-    //! Helper function to get string representation of a string. :)
+    //! Trim the changelog to the entries not covered by the snapshot, done by
+    //! the background worker. The writer is fenced, the entries appended
+    //! after the snapshot was taken are read back and the changelog is
+    //! rewritten with them in a single epoch-validated write. Retried only on
+    //! foreign updates.
+    //!
+    //! @param comp compaction holding the snapshot details
+    //!
+    //! @return true if compaction successful, otherwise false
+    //--------------------------------------------------------------------------
+    bool DoCompaction(compaction& comp);
+
+    //--------------------------------------------------------------------------
+    //! Set or clear the fence which holds back new commits of the writer
+    //!
+    //! @param fence true to hold back commits, false to release them
+    //--------------------------------------------------------------------------
+    void SetCompactionFence(bool fence);
+
+    //--------------------------------------------------------------------------
+    //! Synchronise the writer with the background compaction. Wait while the
+    //! fence is up and adopt the layout of a changelog swapped in by the
+    //! worker, which avoids a full reload of a map that is up to date.
+    //--------------------------------------------------------------------------
+    void SyncCompaction();
+
+    //--------------------------------------------------------------------------
+    //! Trigger a background compaction if needed
+    //--------------------------------------------------------------------------
+    void MaybeCompact();
+
+    //--------------------------------------------------------------------------
+    //! Loop of the background compaction worker
+    //--------------------------------------------------------------------------
+    void CompactionWorker();
+
+    //--------------------------------------------------------------------------
+    //! Loop of the watch thread fetching the announced changelog entries
+    //--------------------------------------------------------------------------
+    void WatchWorker();
+
+    //--------------------------------------------------------------------------
+    //! Loop of the follower thread polling the changelog
+    //--------------------------------------------------------------------------
+    void FollowWorker();
+
+    //--------------------------------------------------------------------------
+    //! Queue a chunk fetched in the background, must be called with the
+    //! watch mutex held. Once the bytes queued exceed the limit they are
+    //! dropped and the next lookup does a full update instead.
+    //!
+    //! @param state watch state
+    //! @param chunk chunk following the cursor of the state
+    //--------------------------------------------------------------------------
+    void QueueChunk(watch_state& state, watch_chunk&& chunk) const;
+
+    //--------------------------------------------------------------------------
+    //! Fetch the changelog entries following the given position
+    //!
+    //! @param chunk fetched entries, mFrom* and mBaseEpoch give the position
+    //!
+    //! @return 0 if successful, -ESTALE if the changelog was compacted, other
+    //!         negative error otherwise
+    //--------------------------------------------------------------------------
+    int FetchChunk(watch_chunk& chunk);
+
+    //--------------------------------------------------------------------------
+    //! Make the next background fetch start from the local state and drop
+    //! the entries fetched so far
+    //--------------------------------------------------------------------------
+    void ResetWatchCursor();
+
+    //--------------------------------------------------------------------------
+    //! Bring the local map to the freshness required by a lookup
+    //!
+    //! @param level consistency level of the lookup
+    //!
+    //! @return true if successful, otherwise false
+    //--------------------------------------------------------------------------
+    bool SyncForRead(consistency level);
+
+    //--------------------------------------------------------------------------
+    //! Announce the current epoch in watch mode
+    //!
+    //! @param epoch epoch reached
+    //--------------------------------------------------------------------------
+    void Publish(uint64_t epoch);
+
+    //--------------------------------------------------------------------------
+    //! Build a snapshot of the map from a consistent read of the remote
+    //! snapshot and changelog and save it in its own object tagged with the
+    //! epoch it covers. Only uses the remote objects, never the local map, so
+    //! that it can run concurrently with the writer.
+    //!
+    //! @param comp compaction holding the snapshot details
+    //!
+    //! @return true if successful, otherwise false
+    //--------------------------------------------------------------------------
+    bool BuildCompaction(compaction& comp);
+
+    //--------------------------------------------------------------------------
+    //! Get the id of the object holding the snapshot of a given epoch
+    //!
+    //! @param snap_epoch epoch covered by the snapshot
+    //!
+    //! @return snapshot object id
+    //--------------------------------------------------------------------------
+    std::string GetSnapshotId(uint64_t snap_epoch) const;
+
+    //--------------------------------------------------------------------------
+    //! Read the snapshot of a given epoch and load it into a map
+    //!
+    //! @param snap_epoch epoch covered by the snapshot, 0 means there is no
+    //!        snapshot and the target is left empty
+    //! @param target map in which the snapshot is loaded
+    //!
+    //! @return 0 if successful, -ENOENT if the snapshot was removed in the
+    //!         meantime by a newer compaction, other negative error otherwise
+    //--------------------------------------------------------------------------
+    int ReadSnapshot(uint64_t snap_epoch, Index& target);
+
+    //--------------------------------------------------------------------------
+    //! Read a range of an object in chunks of the load options size, keeping
+    //! several reads in flight, and hand the chunks over in order
+    //!
+    //! @param obj_id object id
+    //! @param off start of the range, advanced past the chunks handed over
+    //! @param end end of the range
+    //! @param epoch if not empty, each chunk is read only if the remote epoch
+    //!        still has this value
+    //! @param consume function taking each chunk, returns false to stop
+    //!
+    //! @return 0 if successful, -ECANCELED on epoch missmatch, -EINVAL if
+    //!         stopped by the function, other negative error otherwise
+    //--------------------------------------------------------------------------
+    template <typename F>
+    int ReadChunks(const std::string& obj_id, uint64_t& off, uint64_t end,
+                   const std::string& epoch, F&& consume);
+
+    //--------------------------------------------------------------------------
+    //! Stream the changelog up to the current offset into the local map. The
+    //! chunks are validated against the epoch, if entries get appended in the
+    //! meantime the rest is validated against the new epoch as long as the
+    //! changelog was not compacted.
+    //!
+    //! @param epoch remote epoch of the changelog offset
+    //!
+    //! @return 0 if successful, -ECANCELED if the changelog was compacted,
+    //!         other negative error otherwise
+    //--------------------------------------------------------------------------
+    int LoadChangeLog(const std::string& epoch);
+
+    //--------------------------------------------------------------------------
+    //! Replay of a snapshot or changelog fed chunk by chunk. Most of a long
+    //! changelog is history overwritten by later records, in last writer wins
+    //! mode only the last record of each key within a range is decoded and
+    //! applied. Finding them costs a hash per record, therefore the search is
+    //! given up when a chunk has hardly any.
+    //--------------------------------------------------------------------------
+    struct replay_state
+    {
+      replay_state(bool last_writer_wins):
+        mLastWriterWins(last_writer_wins)
+      {}
+
+      bool mLastWriterWins; ///< skip the records superseded in the same range,
+                            ///< cleared if they are too few to pay off
+      bool mStarted {false}; ///< the header was parsed
+      ChangeLog::Format mFormat {ChangeLog::Format::Binary}; ///< record format
+      std::string mCarry; ///< bytes of a record straddling two chunks
+    };
+
+    //--------------------------------------------------------------------------
+    //! Apply the complete records of the next chunk of a snapshot or
+    //! changelog, the first chunk gives the format
+    //!
+    //! @param state state of the replay
+    //! @param data chunk contents
+    //! @param len chunk length
+    //! @param last true if there is no more data after this chunk
+    //! @param target map to which the changes are applied
+    //! @param num_entries incremented with the number of entries applied
+    //!
+    //! @return true if successful, otherwise false
+    //--------------------------------------------------------------------------
+    bool ReplayChunk(replay_state& state, const char* data, uint64_t len,
+                     bool last, Index& target, uint64_t& num_entries) const;
+
+    //--------------------------------------------------------------------------
+    //! Apply the complete records of a buffer in parallel. The buffer is
+    //! split on record boundaries in ranges of similar size, each worker
+    //! decodes a range. In last writer wins mode a worker decodes only the
+    //! last record of each key of its range, the replay stops doing so if few
+    //! records were skipped. The ranges are then applied one after the other,
+    //! so that the records reach the map in log order as in a sequential
+    //! replay and sorted ones are appended.
+    //!
+    //! @param data records
+    //! @param state state of the replay
+    //! @param last if true the end of the buffer also terminates the last
+    //!        text entry
+    //! @param target map to which the changes are applied
+    //! @param num_entries incremented with the number of entries replayed
+    //! @param used set to the length of the complete records
+    //!
+    //! @return true if successful, otherwise false
+    //--------------------------------------------------------------------------
+    bool ReplayRange(std::string_view data, replay_state& state, bool last,
+                     Index& target, uint64_t& num_entries, uint64_t& used) const;
+
+    //--------------------------------------------------------------------------
+    //! Get numeric value of an omap key
+    //!
+    //! @param omap omap values
+    //! @param key key to search for
+    //!
+    //! @return numeric value, 0 if the key is missing
+    //--------------------------------------------------------------------------
+    uint64_t GetOmapValue(const std::map<std::string, librados::bufferlist>& omap,
+                          const std::string& key) const;
+
+    //--------------------------------------------------------------------------
+    //! Convert changelog entries to the binary format
+    //!
+    //! @param data buffer containing the entries
+    //! @param format format of the entries
+    //! @param out output string
+    //! @param num_entries incremented with the number of entries converted
+    //!
+    //! @return true if successful, otherwise false
+    //--------------------------------------------------------------------------
+    bool EncodeChangeLog(const librados::bufferlist& data, ChangeLog::Format format,
+                         std::string& out, uint64_t& num_entries) const;
+
+    //--------------------------------------------------------------------------
+    //! Apply change log contents to a map. The entries are decoded in place
+    //! from the bufferlist segments without linearizing the buffer.
+    //!
+    //! @param data buffer containing the changes
+    //! @param off offset in the buffer from where to start
+    //! @param format format of the changes
+    //! @param target map to which the changes are applied
+    //! @param num_entries incremented with the number of entries applied
+    //!
+    //! return true if successful, otherwise false
+    //--------------------------------------------------------------------------
+    bool ApplyChangeLog(const librados::bufferlist& data, uint64_t off,
+                        ChangeLog::Format format, Index& target,
+                        uint64_t& num_entries) const;
+
+    //--------------------------------------------------------------------------
+    //! Apply the complete records of a reader to a map. Unless the reader is
+    //! finished, an incomplete last record waits for more data.
+    //!
+    //! @param reader reader of the records
+    //! @param format format of the records
+    //! @param target map to which the changes are applied
+    //! @param num_entries incremented with the number of entries applied
+    //!
+    //! return true if successful, otherwise false
+    //--------------------------------------------------------------------------
+    bool ApplyRecords(ChangeLogReader& reader, ChangeLog::Format format,
+                      Index& target, uint64_t& num_entries) const;
+
+    //--------------------------------------------------------------------------
+    //! Decode key or value field of a changelog entry
+    //!
+    //! @param field field contents
+    //! @param format format of the changelog
+    //! @param ret decoded object
+    //!
+    //! @return true if successful, otherwise false
+    //--------------------------------------------------------------------------
+    template <typename W>
+    bool DecodeEntryField(std::string_view field, ChangeLog::Format format,
+                          W& ret) const;
+
+    //--------------------------------------------------------------------------
+    //! Append changelog entry in the current changelog format
+    //!
+    //! @param op type of mutation
+    //! @param key key
+    //! @param value value, ignored for erase
+    //! @param out output string
+    //--------------------------------------------------------------------------
+    void AppendEntry(typename mutation::type op, const K& key, const V& value,
+                     std::string& out) const;
+
+    //--------------------------------------------------------------------------
+    //! Undo an insert applied to the local map, the value goes back to the
+    //! mutation
+    //!
+    //! @param mut insert mutation
+    //--------------------------------------------------------------------------
+    void UndoInsert(mutation& mut);
+
+    //--------------------------------------------------------------------------
+    //! Helper function to convert string to non-string object.
+    //!
+    //! @param value string object to be converted
+    //!
+    //! @return object obtained from converting the string to type W
+    //--------------------------------------------------------------------------
+    template <typename W>
+    bool HelperFromString(std::string_view sval, W& ret) const;
+
+    //--------------------------------------------------------------------------
+    //! Helper function to convert string to a string.
+    //! Migth sound confugins but it's done like this so that the code compiles
+    //! when the return value is either a string or a numeric type.
+    //!
+    //! @param value string object to be converted
+    //!
+    //! @return object obtained from converting the string to type W
+    //--------------------------------------------------------------------------
+    bool HelperFromString(std::string_view sval, std::string& ret) const;
+
+    //--------------------------------------------------------------------------
+    //! Helper function to get string representation of an object which is not
+    //! a string.
+    //!
+    //! @param value obj to be converted
+    //!
+    //! @return string representation of the object
+    //--------------------------------------------------------------------------
+    template <typename W>
+    bool HelperToString(const W& value, std::string& ret) const;
+
+    //--------------------------------------------------------------------------
+    //! Helper function to get string representation of a string. :)
     //! Might sound confusing but it's done like  this so that the code compiles
     //! when the return value is either a string or a numeric type.
     //!
@@ -284,16 +1235,55 @@ namespace rados {
     //!
     //! @return string representation of the object
     //--------------------------------------------------------------------------
-    bool HelperToString(std::string value, std::string& ret) const;
+    bool HelperToString(const std::string& value, std::string& ret) const;
 
     //--------------------------------------------------------------------------
-    //! Do a full map update with the values actually saved in the xattrs of
-    //! the object and update at the same time the epoch and size of the obj.
+    //! Append the text representation of a key or value, strings are
+    //! appended as they are without a temporary copy
+    //!
+    //! @param value key or value
+    //! @param out output string
+    //--------------------------------------------------------------------------
+    template <typename W>
+    void AppendText(const W& value, std::string& out) const
+    {
+      if constexpr (std::is_same<W, std::string>::value)
+        out += value;
+      else
+        out += ToString(value);
+    }
+
+    //--------------------------------------------------------------------------
+    //! Do a full map update by loading the snapshot and replaying the
+    //! changelog entries which follow it and update at the same time the
+    //! epoch and size of the obj.
     //!
     //! @return true if successful, otherwise false
     //--------------------------------------------------------------------------
     bool InitializeMap();
 
+    //--------------------------------------------------------------------------
+    //! Load the local map from the cache file and catch up with the changelog
+    //! entries appended since it was saved
+    //!
+    //! @return true if successful, false if there is no usable cache and the
+    //!         map must be fully loaded
+    //--------------------------------------------------------------------------
+    bool LoadCache();
+
+    //--------------------------------------------------------------------------
+    //! Call a function for each entry of an index in key order, whatever the
+    //! index, so that sorted indexes load the dump by appending
+    //!
+    //! @param index index to be dumped
+    //! @param func function taking the key and the value, returns false to
+    //!        stop
+    //!
+    //! @return false if stopped by the function, otherwise true
+    //--------------------------------------------------------------------------
+    template <typename F>
+    static bool DumpSorted(Index& index, F&& func);
+
     //--------------------------------------------------------------------------
     //! Decide if changlog needs compaction
     //!
@@ -304,34 +1294,101 @@ namespace rados {
   };
 
   // Define the constants
-  template <typename K, typename V>
-  const std::string map< K, V>::OBJ_EPOCH_KEY {"obj_epoch_key"};
+  template <typename K, typename V, typename Index>
+  const std::string map<K, V, Index>::OBJ_EPOCH_KEY {"obj_epoch_key"};
+
+  template <typename K, typename V, typename Index>
+  const std::string map<K, V, Index>::OBJ_WRITER_KEY {"obj_writer_key"};
+
+  template <typename K, typename V, typename Index>
+  const std::string map<K, V, Index>::OBJ_BASE_EPOCH_KEY {"obj_base_epoch_key"};
+
+  template <typename K, typename V, typename Index>
+  const std::string map<K, V, Index>::OBJ_PREV_BASE_EPOCH_KEY {"obj_prev_base_epoch_key"};
+
+  template <typename K, typename V, typename Index>
+  const std::string map<K, V, Index>::OBJ_TRIM_OFF_KEY {"obj_trim_off_key"};
+
+  template <typename K, typename V, typename Index>
+  const std::string map<K, V, Index>::OBJ_TRIM_ENTRIES_KEY {"obj_trim_entries_key"};
+
+  template <typename K, typename V, typename Index>
+  const std::string map<K, V, Index>::SNAPSHOT_SUFFIX {".snapshot."};
+
+  template <typename K, typename V, typename Index>
+  const std::string map<K, V, Index>::CHLOG_INSERT_OP {"+"};
 
-  template <typename K, typename V>
-  const std::string map< K, V>::CHLOG_INSERT_OP {"+"};
+  template <typename K, typename V, typename Index>
+  const std::string map<K, V, Index>::CHLOG_ERASE_OP {"-"};
 
-  template <typename K, typename V>
-  const std::string map< K, V>::CHLOG_ERASE_OP {"-"};
+  template <typename K, typename V, typename Index>
+  const float map<K, V, Index>::COMPACTION_RATIO {.2};
 
-  template <typename K, typename V>
-  const float map<K, V>::COMPACTION_RATIO {.2};
+  template <typename K, typename V, typename Index>
+  const uint64_t map<K, V, Index>::AIO_MAX_INFLIGHT {128};
+
+  template <typename K, typename V, typename Index>
+  const uint64_t map<K, V, Index>::COMPACTION_SWAP_RETRIES {3};
+
+  template <typename K, typename V, typename Index>
+  const uint64_t map<K, V, Index>::REPLAY_MIN_WORKER_BYTES {64 * 1024};
+
+  template <typename K, typename V, typename Index>
+  const uint64_t map<K, V, Index>::REPLAY_MIN_SUPERSEDED {8};
+
+  template <typename K, typename V, typename Index>
+  const uint64_t map<K, V, Index>::WATCH_MAX_QUEUED {64 * 1024 * 1024};
 
 
   //----------------------------------------------------------------------------
   // Constructor
   //----------------------------------------------------------------------------
-  template <typename K, typename V>
-  map<K, V>::map(librados::Rados& rados_cluster,
+  template <typename K, typename V, typename Index>
+  map<K, V, Index>::map(librados::Rados& rados_cluster,
                  const std::string& pool_name,
                  const std::string& name,
                  const std::string& cookie,
                  bool persist_obj,
-                 bool is_async) noexcept(false):
+                 bool is_async,
+                 const std::string& cache_path,
+                 const load_options& load) noexcept(false):
+    map(std::make_shared<rados_backend>(rados_cluster, pool_name), name, cookie,
+        persist_obj, is_async, cache_path, load)
+  {}
+
+  //----------------------------------------------------------------------------
+  // Constructor
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  map<K, V, Index>::map(std::shared_ptr<backend> store,
+                 const std::string& name,
+                 const std::string& cookie,
+                 bool persist_obj,
+                 bool is_async,
+                 const std::string& cache_path,
+                 const load_options& load) noexcept(false):
+    mBackend(store),
     mPersistObj(persist_obj),
+    mCachePath(cache_path),
+    mLoadOptions(load),
     mIsAsync(is_async),
+    mReadOnly(false),
     mEpoch(0),
     mChLogOff(0),
-    mChLogNumLines(0)
+    mChLogNumLines(0),
+    mChLogFormat(ChangeLog::Format::Binary),
+    mBaseEpoch(0),
+    mCompactState(compaction_state::idle),
+    mCompaction(),
+    mCompactFence(false),
+    mCompactStop(false),
+    mWatchHandle(0),
+    mReadLevel(consistency::local),
+    mMaxStaleness(0),
+    mLastSync(std::chrono::steady_clock::now()),
+    mRetryPolicy(std::make_shared<immediate_retry>()),
+    mNumRetries(0),
+    mAioRetries(0)
   {
     // Check that we support the provided template parameters
     if (!std::is_same<std::string, K>::value ||
@@ -348,649 +1405,2566 @@ namespace rados {
     std::ostringstream oss;
     oss << "/map/" << name << "/" << cookie;
     mObjId = oss.str();
-    ret = rados_cluster.ioctx_create(pool_name.c_str(), mIoCtx);
-
-    if (ret)
-      throw RadosContainerException("unable to create ioctx for pool");
+    std::random_device rd;
+    oss.str("");
+    oss << cookie << ":" << std::hex << rd() << rd();
+    mWriterId = oss.str();
 
     // Check if object exists, if not create it
     uint64_t psize;
-    time_t pmtime;
 
-    if (mIoCtx.stat(mObjId, &psize, &pmtime))
+    if (mBackend->stat(mObjId, &psize))
     {
-      if (mIoCtx.create(mObjId, true))
-        throw RadosContainerException("unable to create obj.");
-
-      // For new object set the epoch to 0
+      // For new object write the changelog header and set the epoch to 0
+      backend::write_op wr_op;
+      librados::bufferlist hdr_data;
       std::map<std::string, librados::bufferlist> init_omap;
+      hdr_data.append(ChangeLog::Header());
       init_omap[OBJ_EPOCH_KEY].append("0");
-      mIoCtx.omap_set(mObjId, init_omap);
+      wr_op.create(true);
+      wr_op.write_full(hdr_data);
+      wr_op.omap_set(init_omap);
+      ret = mBackend->operate(mObjId, wr_op);
+
+      if (ret == 0)
+        mChLogOff = hdr_data.length();
+      else if (ret != -EEXIST)
+        throw RadosContainerException("unable to create obj.");
     }
-    else
+
+    // Object created in the meantime by somebody else, start from the cache
+    // if there is a usable one
+    if (mChLogOff == 0)
     {
-      if (!InitializeMap())
+      if ((mCachePath.empty() || !LoadCache()) && !InitializeMap())
         throw RadosContainerException("unable to get omap");
     }
+
+    mCompactThread = std::thread(&map<K, V, Index>::CompactionWorker, this);
   }
 
   //----------------------------------------------------------------------------
   // Destructor
   //----------------------------------------------------------------------------
-  template <typename K, typename V>
-  map<K, V>::~map()
+  template <typename K, typename V, typename Index>
+  map<K, V, Index>::~map()
   {
-    if (!mPersistObj && mIoCtx.remove(mObjId))
-      throw RadosContainerException("unable to remove obj.");
+    if (mWatch)
+    {
+      if (mChannel)
+        mChannel->unsubscribe(mWatchHandle);
+
+      {
+        std::lock_guard<std::mutex> lock(mWatch->mMutex);
+        mWatch->mStop = true;
+      }
+
+      mWatch->mCond.notify_all();
+      mWatchThread.join();
+    }
+
+    if (!flush())
+      fprintf(stderr, "Failed to commit pending operations for %s\n", mObjId.c_str());
+    else if (mPersistObj && !mCachePath.empty() && !save_cache())
+      fprintf(stderr, "Failed to save cache of obj=%s\n", mObjId.c_str());
+
+    {
+      std::lock_guard<std::mutex> lock(mCompactMutex);
+      mCompactStop = true;
+    }
+
+    mCompactCond.notify_all();
+    mCompactThread.join();
+
+    // Note: a destructor must not throw, just report the failure
+    if (!mPersistObj && !mReadOnly)
+    {
+      // Remove the snapshot the remote changelog currently refers to
+      std::set<std::string> set_keys {OBJ_BASE_EPOCH_KEY};
+      std::map<std::string, librados::bufferlist> omap_epoch;
+
+      if (mBackend->omap_get_vals_by_keys(mObjId, set_keys, &omap_epoch) == 0)
+      {
+        uint64_t snap_epoch = GetOmapValue(omap_epoch, OBJ_BASE_EPOCH_KEY);
+
+        if (snap_epoch && mBackend->remove(GetSnapshotId(snap_epoch)))
+          fprintf(stderr, "Failed to remove snapshot of obj=%s\n", mObjId.c_str());
+      }
+
+      if (mBackend->remove(mObjId))
+        fprintf(stderr, "Failed to remove obj=%s\n", mObjId.c_str());
+    }
   }
 
   //----------------------------------------------------------------------------
   // Count the number of entries
   //----------------------------------------------------------------------------
-  template <typename K, typename V>
-  uint64_t map<K, V>::size() const
+  template <typename K, typename V, typename Index>
+  uint64_t map<K, V, Index>::size(consistency level)
   {
+    (void) SyncForRead(level);
     return mMap.size();
   }
 
   //----------------------------------------------------------------------------
   // Count the elements with a specific key
   //----------------------------------------------------------------------------
-  template<typename K, typename V>
-  uint64_t map<K, V>::count(const K& key) const
+  template <typename K, typename V, typename Index>
+  uint64_t map<K, V, Index>::count(key_arg_t key, consistency level)
   {
-    return mMap.count(key);
+    (void) SyncForRead(level);
+    return (index_find<K>(mMap, key) == mMap.end() ? 0 : 1);
   }
 
   //----------------------------------------------------------------------------
   // Get iterator to element
   //----------------------------------------------------------------------------
-  template <typename K, typename V>
-  typename std::map<K, V>::iterator
-  map<K, V>::find(const K& key)
+  template <typename K, typename V, typename Index>
+  typename Index::iterator
+  map<K, V, Index>::find(key_arg_t key, consistency level)
   {
-    return mMap.find(key);
+    (void) SyncForRead(level);
+    return index_find<K>(mMap, key);
   }
 
   //----------------------------------------------------------------------------
   // Insert new value
   //----------------------------------------------------------------------------
-  template <typename K, typename V>
-  std::pair<typename std::map<K, V>::iterator, bool>
-  map<K, V>::insert(K key, V value)
+  template <typename K, typename V, typename Index>
+  std::pair<typename Index::iterator, bool>
+  map<K, V, Index>::insert(K key, V value)
   {
-    auto response = mMap.insert(std::make_pair(key, value));
-
-    // Check local epoch matches remote epoch
-    int ret {1};
-    int prval_cmp;
-
-    // Prepare to changelog entry
-    std::ostringstream oss;
-    oss << CHLOG_INSERT_OP << " "
-        << ToString(key) << " "
-        << ToString(value) << std::endl;
-    librados::bufferlist chlog_data;
-    chlog_data.append(oss.str());
+    latency_timer timer(Latency(stage::insert));
 
-    while (ret)
+    if (mIsAsync)
     {
-      librados::ObjectWriteOperation wr_op;
-      std::map<std::string, std::pair<librados::bufferlist, int>> omap_assert;
-      librados::bufferlist epoch_buff;
-      epoch_buff.append(std::to_string(mEpoch));
-      omap_assert[OBJ_EPOCH_KEY] = std::make_pair(epoch_buff, LIBRADOS_CMPXATTR_OP_EQ);
-      wr_op.omap_cmp(omap_assert, &prval_cmp);
-
-      // Update epoch and changelog entry if local insert successful
-      std::map<std::string, librados::bufferlist> omap_upd;
-      librados::bufferlist buff_epoch;
+      // The mutation is handed over to the pipeline, keep the key to look
+      // up the entry
+      bool applied {false};
+      (void) SubmitAio(mutation(mutation::type::insert, key, std::move(value)),
+                       applied);
+      return std::make_pair(mMap.find(key), applied);
+    }
 
-      if (response.second)
-      {
-        buff_epoch.append(ToString<decltype(mEpoch)>(mEpoch + 1));
-        omap_upd.insert(std::make_pair(OBJ_EPOCH_KEY, buff_epoch));
-        wr_op.omap_set(omap_upd);
-        wr_op.append(chlog_data);
-      }
+    std::vector<mutation> batch;
+    batch.emplace_back(mutation::type::insert, std::move(key), std::move(value));
 
-      // Execute atomic operations asynchronously
-      std::string* arg {new std::string("testing ...")};
-      librados::AioCompletion* wr_comp =
-        librados::Rados::aio_create_completion(arg, nullptr, insert_complete_cb);
-      ret = mIoCtx.aio_operate(mObjId, wr_comp, &wr_op);
+    if (!apply_batch(batch))
+      return std::make_pair(mMap.end(), false);
 
-      if (ret)
-      {
-        fprintf(stderr, "Failed to schedule wr_aio for %s\n", __FUNCTION__);
-        wr_comp->release();
-        return std::make_pair(mMap.end(), false);
-      }
+    return std::make_pair(mMap.find(batch.front().mKey), batch.front().mApplied);
+  }
 
-      // Wait for completion and get result
-      // TODO: review this -> switch to safe rather than complete
-      //wr_comp->wait_for_safe();
-      wr_comp->wait_for_complete_and_cb();
-      ret = wr_comp->get_return_value();
-      wr_comp->release();
+  //----------------------------------------------------------------------------
+  // Erase entry pointed by iterator
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  void map<K, V, Index>::erase(typename Index::iterator iter)
+  {
+    erase(iter->first);
+  }
 
-      if (ret)
-      {
-        if (prval_cmp)
-        {
-          // Failed because of epoch missmatch - do an update and rerty
-          fprintf(stderr, "Failed insert because of epoch missmatch - retry\n");
+  //----------------------------------------------------------------------------
+  // Erase entry pointed by key
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  void map<K, V, Index>::erase(key_arg_t key)
+  {
+    latency_timer timer(Latency(stage::erase));
 
-          // Delete local insert if it was initially successful, if it wasn't
-          // it means the key was already in the map and we don't touch it
-          if (response.second)
-            mMap.erase(key);
+    if (mIsAsync)
+    {
+      bool applied {false};
+      (void) SubmitAio(mutation(mutation::type::erase, K(key)), applied);
+      return;
+    }
 
-          // Update map and retry
-          if (!DoUpdate())
-            return std::make_pair(mMap.end(), false);
+    std::vector<mutation> batch;
+    batch.emplace_back(mutation::type::erase, K(key));
+    (void) apply_batch(batch);
+  }
 
-          // Retry insert on the updated local map
-          response = mMap.insert(std::make_pair(key, value));
-        }
-        else
-        {
-          // Insert actually failed
-          fprintf(stderr, "Fatal error during insert key=%s - abort\n", key.c_str());
-          return std::make_pair(mMap.end(), false);
-        }
-      }
-      else
-      {
-        // Update the local view of the changelog if insert successful
-        if (response.second)
-        {
-          mEpoch++;
-          mChLogNumLines++;
-          mChLogOff += chlog_data.length();
-        }
-      }
-    }
+  //----------------------------------------------------------------------------
+  // Insert several entries in one atomic operation
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::insert_many(const std::vector<std::pair<K, V>>& entries)
+  {
+    std::vector<mutation> batch;
+    batch.reserve(entries.size());
 
-    // Everything is up to date, do compaction if necessary
-    if (NeedsCompaction() && !DoCompaction())
-      fprintf(stderr, "Failed compaction - retry\n");
+    for (auto&& entry: entries)
+      batch.emplace_back(mutation::type::insert, entry.first, entry.second);
 
-    return response;
+    return apply_batch(batch);
   }
 
   //----------------------------------------------------------------------------
-  // Erase entry pointed by iterator
+  // Insert several entries in one atomic operation, moving them
   //----------------------------------------------------------------------------
-  template <typename K, typename V>
-  void map<K, V>::erase(typename std::map<K, V>::iterator iter)
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::insert_many(std::vector<std::pair<K, V>>&& entries)
   {
-    erase(iter->first);
+    std::vector<mutation> batch;
+    batch.reserve(entries.size());
+
+    for (auto&& entry: entries)
+      batch.emplace_back(mutation::type::insert, std::move(entry.first),
+                         std::move(entry.second));
+
+    entries.clear();
+    return apply_batch(batch);
   }
 
   //----------------------------------------------------------------------------
-  // Erase entry pointed by key
+  // Erase several keys in one atomic operation
   //----------------------------------------------------------------------------
-  template <typename K, typename V>
-  void map<K, V>::erase(K key)
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::erase_many(const std::vector<K>& keys)
   {
+    std::vector<mutation> batch;
+    batch.reserve(keys.size());
+
+    for (auto&& key: keys)
+      batch.emplace_back(mutation::type::erase, key);
+
+    return apply_batch(batch);
+  }
+
+  //----------------------------------------------------------------------------
+  // Apply a batch of mutations atomically
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::apply_batch(std::vector<mutation>& batch)
+  {
+    if (batch.empty())
+      return true;
+
+    if (mReadOnly)
+    {
+      fprintf(stderr, "Map obj=%s is read-only\n", mObjId.c_str());
+      return false;
+    }
+
+    map_counters::add(mCounters.mBatches);
+
+    for (auto&& mut: batch)
+      map_counters::add(mut.mType == mutation::type::insert ?
+                        mCounters.mInserts : mCounters.mErases);
+
+    // Asynchronous operations in flight need to be committed first and
+    // starting from an up to date map avoids a conflict
+    if (!flush() || !refresh())
+      return false;
+
     int ret {1};
     int prval_cmp;
+    // Previous values of the entries touched by the batch, used to roll back
+    // the local map if the commit fails
+    std::vector<std::pair<mutation*, V>> undo;
+
+    // Roll back local modifications in reverse order, the inserted values go
+    // back to their mutation for the next attempt
+    auto rollback = [&]() {
+      for (auto it = undo.rbegin(); it != undo.rend(); ++it)
+      {
+        if (it->first->mType == mutation::type::insert)
+          UndoInsert(*it->first);
+        else
+          mMap.insert(std::make_pair(it->first->mKey, std::move(it->second)));
+      }
 
-    // Prepare the changelog entry
-    std::ostringstream oss;
-    oss << CHLOG_ERASE_OP << " "
-        << ToString(key)  << std::endl;
-    librados::bufferlist chlog_data;
-    chlog_data.append(oss.str());
+      undo.clear();
+    };
+
+    uint64_t attempt {0};
+    admission_control::guard admit(mAdmission.get());
+    // Encoding goes to a buffer reserved once for all the entries
+    size_t max_entries_size {0};
+
+    for (auto&& mut: batch)
+      max_entries_size += 2 + ChangeLog::MaxFieldSize(mut.mKey) +
+        ChangeLog::MaxFieldSize(mut.mValue);
 
     while (ret)
     {
+      // Pick up a changelog swapped in by the background compaction
+      SyncCompaction();
+
+      // Apply the mutations to the local map and prepare the changelog entries
+      auto start = std::chrono::steady_clock::now();
+      uint64_t num_lines {0};
+      std::string entries;
+      entries.reserve(max_entries_size);
+
+      for (auto& mut: batch)
+      {
+        auto iter = mMap.find(mut.mKey);
+
+        if (mut.mType == mutation::type::insert)
+        {
+          mut.mApplied = (iter == mMap.end());
+
+          if (!mut.mApplied)
+            continue;
+
+          // Encoded first, the value is then moved into the map
+          AppendEntry(mut.mType, mut.mKey, mut.mValue, entries);
+          undo.emplace_back(&mut, V());
+          mMap.insert(std::make_pair(mut.mKey, std::move(mut.mValue)));
+        }
+        else
+        {
+          mut.mApplied = (iter != mMap.end());
+
+          if (!mut.mApplied)
+            continue;
+
+          AppendEntry(mut.mType, mut.mKey, mut.mValue, entries);
+          undo.emplace_back(&mut, std::move(iter->second));
+          mMap.erase(iter);
+        }
+
+        num_lines++;
+      }
+
       // Check local epoch matches remote epoch
-      librados::ObjectWriteOperation wr_op;
+      backend::write_op wr_op;
       std::map<std::string, std::pair<librados::bufferlist, int>> omap_assert;
-      librados::bufferlist epoch;
-      epoch.append(std::to_string(mEpoch));
-      omap_assert[OBJ_EPOCH_KEY] = std::make_pair(epoch, LIBRADOS_CMPXATTR_OP_EQ);
+      librados::bufferlist epoch_buff;
+      epoch_buff.append(std::to_string(mEpoch));
+      omap_assert[OBJ_EPOCH_KEY] = std::make_pair(epoch_buff, LIBRADOS_CMPXATTR_OP_EQ);
       wr_op.omap_cmp(omap_assert, &prval_cmp);
 
-      // Update epoch
-      std::map<std::string, librados::bufferlist> omap_upd;
-      librados::bufferlist epoch_buff;
-      epoch_buff.append(ToString<decltype(mEpoch)>(mEpoch +  1));
-      omap_upd.insert(std::make_pair(OBJ_EPOCH_KEY, epoch_buff));
-      wr_op.omap_set(omap_upd);
-      wr_op.append(chlog_data);
+      // Update epoch and append the changelog entries only if the batch
+      // actually modified the local map. The entries are handed over to the
+      // operation.
+      uint64_t entries_len = entries.length();
+
+      if (num_lines)
+      {
+        std::map<std::string, librados::bufferlist> omap_upd;
+        librados::bufferlist buff_epoch;
+        buff_epoch.append(ToString<decltype(mEpoch)>(mEpoch + 1));
+        omap_upd.insert(std::make_pair(OBJ_EPOCH_KEY, buff_epoch));
+        omap_upd[OBJ_WRITER_KEY].append(mWriterId);
+        wr_op.omap_set(omap_upd);
+        wr_op.append(std::move(entries));
+      }
 
       // Execute atomic operations asynchronously
-      librados::AioCompletion* wr_comp = librados::Rados::aio_create_completion();
-      ret = mIoCtx.aio_operate(mObjId, wr_comp, &wr_op);
+      Latency(stage::local_update).record_since(start);
+      start = std::chrono::steady_clock::now();
+      auto wr_comp = std::make_shared<backend::completion>();
+      ret = mBackend->aio_operate(mObjId, wr_op, wr_comp);
 
       if (ret)
       {
         fprintf(stderr, "Failed to schedule wr_aio for %s\n", __FUNCTION__);
-        wr_comp->release();
-        return;
+        rollback();
+        return false;
       }
 
       // Wait for completion and get result
-      wr_comp->wait_for_safe();
+      wr_comp->wait_for_complete();
       ret = wr_comp->get_return_value();
-      wr_comp->release();
+      Latency(stage::round_trip).record_since(start);
 
       if (ret)
       {
+        rollback();
+
         if (prval_cmp)
         {
-          // Failed because of epoch missmatch - do an update and rerty
-          fprintf(stderr, "Failed erase because of epoch missmatch - retry\n");
+          // Failed because of epoch missmatch - do an update and retry. The
+          // admission slot is left to the others while backing off.
+          map_counters::add(mCounters.mConflicts);
+          admit.release();
+          bool retry = Backoff(attempt);
+          admit.acquire();
+
+          if (!retry)
+          {
+            fprintf(stderr, "Failed batch of %lu mutations because of epoch "
+                    "missmatch - give up after %lu retries\n", batch.size(),
+                    attempt - 1);
+            return false;
+          }
+
+          latency_timer timer(Latency(stage::catch_up));
 
-          // Update map and retry
           if (!DoUpdate())
-            return;
+            return false;
         }
         else
         {
           // Any other error is fatal
-          fprintf(stderr, "Fatal error during erase key=%s - abort\n", key.c_str());
-          return;
+          fprintf(stderr, "Fatal error during batch commit - abort\n");
+          return false;
         }
       }
-      else
+      else if (num_lines)
       {
         // Update the local view of the changelog
         mEpoch++;
-        mChLogNumLines++;
-        mChLogOff += chlog_data.length();
+        mChLogNumLines += num_lines;
+        mChLogOff += entries_len;
+        map_counters::add(mCounters.mCommits);
+        map_counters::add(mCounters.mBytesAppended, entries_len);
+        Publish(mEpoch);
+      }
+    }
+
+    // Everything is up to date, do compaction if necessary
+    mLastSync = std::chrono::steady_clock::now();
+    ResetWatchCursor();
+    MaybeCompact();
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  // Insert new value asynchronously
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  std::shared_future<bool> map<K, V, Index>::aio_insert(K key, V value)
+  {
+    bool applied {false};
+    return SubmitAio(mutation(mutation::type::insert, std::move(key),
+                              std::move(value)), applied);
+  }
+
+  //----------------------------------------------------------------------------
+  // Erase key from map asynchronously
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  std::shared_future<bool> map<K, V, Index>::aio_erase(K key)
+  {
+    bool applied {false};
+    return SubmitAio(mutation(mutation::type::erase, std::move(key)), applied);
+  }
+
+  //----------------------------------------------------------------------------
+  // Wait for all the asynchronous operations in flight to be committed
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::flush()
+  {
+    if (mPending.empty())
+      return true;
+
+    if (!ReapAio(0))
+      return false;
+
+    // Everything is up to date, do compaction if necessary
+    MaybeCompact();
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  // Compact the changelog right away
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::compact()
+  {
+    if (mReadOnly)
+    {
+      fprintf(stderr, "Map obj=%s is read-only\n", mObjId.c_str());
+      return false;
+    }
+
+    if (!flush())
+      return false;
+
+    std::unique_lock<std::mutex> lock(mCompactMutex);
+
+    if (mCompactState == compaction_state::idle)
+    {
+      mCompactState = compaction_state::running;
+      mCompactCond.notify_all();
+    }
+
+    mCompactCond.wait(lock, [&]() {
+        return ((mCompactState == compaction_state::idle) ||
+                (mCompactState == compaction_state::swapped));
+      });
+
+    bool swapped = (mCompactState == compaction_state::swapped);
+    lock.unlock();
+    SyncCompaction();
+    return swapped;
+  }
+
+  //----------------------------------------------------------------------------
+  // Enable watch mode
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::watch(std::shared_ptr<update_channel> channel)
+  {
+    if (mWatch)
+      return true;
+
+    if (!channel)
+      channel = mBackend->channel();
+
+    // The callback only records the announced epoch, the state outlives the
+    // map if the channel delivers a notification during the destruction
+    std::shared_ptr<watch_state> state = std::make_shared<watch_state>();
+    auto cb = [state](uint64_t epoch) {
+      std::lock_guard<std::mutex> lock(state->mMutex);
+
+      if (epoch > state->mNotifiedEpoch)
+      {
+        state->mNotifiedEpoch = epoch;
+        state->mCond.notify_all();
+      }
+    };
+
+    if (!channel->subscribe(mObjId, cb, mWatchHandle))
+      return false;
+
+    std::atomic_store(&mChannel, channel);
+    mWatch = state;
+
+    // Catch up with the updates announced before the subscription
+    if (!flush() || !DoUpdate())
+      return false;
+
+    ResetWatchCursor();
+    mWatchThread = std::thread(&map<K, V, Index>::WatchWorker, this);
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  // Apply the updates fetched in the background in watch mode
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::refresh()
+  {
+    // Operations in flight notice any conflict by themselves
+    if (!mWatch || !mPending.empty())
+      return true;
+
+    // In follower mode a poll which found nothing new brings the last sync
+    // forward. The poll time is stored after the entries, so it is read
+    // first.
+    std::chrono::steady_clock::time_point sync_time {
+      std::chrono::steady_clock::duration(mWatch->mSyncTime.load())};
+
+    if (!mWatch->mDirty.load())
+    {
+      mLastSync = std::max(mLastSync, sync_time);
+      return true;
+    }
+
+    bool reload;
+    std::deque<watch_chunk> chunks;
+
+    {
+      std::lock_guard<std::mutex> lock(mWatch->mMutex);
+      chunks.swap(mWatch->mChunks);
+      mWatch->mQueued = 0;
+      reload = mWatch->mReload;
+      mWatch->mReload = false;
+      mWatch->mDirty = false;
+    }
+
+    SyncCompaction();
+    uint64_t old_lines = mChLogNumLines;
+
+    for (auto&& chunk: chunks)
+    {
+      if (reload)
+        break;
+
+      // Entries already known e.g. the ones committed by this instance
+      if ((chunk.mBaseEpoch == mBaseEpoch) && (chunk.mEpoch <= mEpoch))
+        continue;
+
+      if ((chunk.mFromEpoch != mEpoch) || (chunk.mFromOff != mChLogOff) ||
+          (chunk.mBaseEpoch != mBaseEpoch))
+      {
+        reload = true;
+        break;
+      }
+
+      auto start = std::chrono::steady_clock::now();
+
+      if (!ApplyChangeLog(chunk.mData, 0, mChLogFormat, mMap, mChLogNumLines))
+      {
+        fprintf(stderr, "Fatal error while applying changelog\n");
+        return false;
+      }
+
+      Latency(stage::replay).record_since(start);
+      mEpoch = chunk.mEpoch;
+      mChLogOff += chunk.mData.length();
+      map_counters::add(mCounters.mCatchUps);
+    }
+
+    map_counters::add(mCounters.mReplayEntries, mChLogNumLines - old_lines);
+
+    if (!reload)
+      mLastSync = std::max(mLastSync, sync_time);
+
+    bool ret = (!reload || DoUpdate());
+    ResetWatchCursor();
+    return ret;
+  }
+
+  //----------------------------------------------------------------------------
+  // Enable follower mode
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::follow(const follow_options& opts)
+  {
+    if (mWatch)
+    {
+      if (mReadOnly)
+        return true;
+
+      fprintf(stderr, "Map obj=%s is already in watch mode\n", mObjId.c_str());
+      return false;
+    }
+
+    // Changes of this instance are committed before it turns read-only
+    if (!flush() || !DoUpdate())
+      return false;
+
+    mReadOnly = true;
+    std::shared_ptr<watch_state> state = std::make_shared<watch_state>();
+    state->mMinInterval = opts.mMinInterval;
+    state->mMaxInterval = opts.mMaxInterval;
+    state->mMaxQueued = opts.mMaxQueued;
+    mWatch = state;
+    ResetWatchCursor();
+    mWatchThread = std::thread(&map<K, V, Index>::FollowWorker, this);
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  // Set the default consistency level of the lookups
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  void map<K, V, Index>::set_read_consistency(consistency level,
+                                       std::chrono::milliseconds max_staleness)
+  {
+    mReadLevel = level;
+    mMaxStaleness = max_staleness;
+  }
+
+  //----------------------------------------------------------------------------
+  // Bring the local map to the freshness required by a lookup
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::SyncForRead(consistency level)
+  {
+    read_stats& stats = mReadStats[static_cast<int>(level)];
+    stats.mReads++;
+
+    if (!refresh())
+      return false;
+
+    if ((level == consistency::local) ||
+        ((level == consistency::bounded) &&
+         (std::chrono::steady_clock::now() - mLastSync <= mMaxStaleness)))
+      return true;
+
+    // The remote epoch can only be compared once the operations in flight
+    // are committed
+    if (!flush())
+      return false;
+
+    uint64_t old_epoch = mEpoch;
+    uint64_t old_base = mBaseEpoch;
+    stats.mChecks++;
+
+    if (!DoUpdate())
+      return false;
+
+    if ((mEpoch != old_epoch) || (mBaseEpoch != old_base))
+    {
+      stats.mRefreshes++;
+      ResetWatchCursor();
+    }
+
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  // Make the next background fetch start from the local state
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  void map<K, V, Index>::ResetWatchCursor()
+  {
+    if (!mWatch)
+      return;
+
+    std::lock_guard<std::mutex> lock(mWatch->mMutex);
+    // Keep the fetched entries which follow the local state, so that a
+    // fetch done in the meantime is not lost
+    uint64_t epoch = mEpoch;
+    uint64_t off = mChLogOff;
+    auto iter = mWatch->mChunks.begin();
+
+    while ((iter != mWatch->mChunks.end()) && (iter->mFromEpoch == epoch) &&
+           (iter->mFromOff == off) && (iter->mBaseEpoch == mBaseEpoch))
+    {
+      epoch = iter->mEpoch;
+      off += iter->mData.length();
+      ++iter;
+    }
+
+    if (iter != mWatch->mChunks.end() || mWatch->mChunks.empty())
+    {
+      mWatch->mChunks.erase(iter, mWatch->mChunks.end());
+      mWatch->mEpoch = epoch;
+      mWatch->mChLogOff = off;
+      mWatch->mBaseEpoch = mBaseEpoch;
+    }
+
+    mWatch->mReload = false;
+    mWatch->mDirty = !mWatch->mChunks.empty();
+    mWatch->mCond.notify_all();
+  }
+
+  //----------------------------------------------------------------------------
+  // Announce the current epoch in watch mode
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  void map<K, V, Index>::Publish(uint64_t epoch)
+  {
+    std::shared_ptr<update_channel> channel = std::atomic_load(&mChannel);
+
+    if (channel)
+      channel->publish(mObjId, epoch);
+  }
+
+  //----------------------------------------------------------------------------
+  // Loop of the watch thread
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  void map<K, V, Index>::WatchWorker()
+  {
+    std::shared_ptr<watch_state> state = mWatch;
+    std::unique_lock<std::mutex> lock(state->mMutex);
+
+    while (true)
+    {
+      state->mCond.wait(lock, [&]() {
+          return (state->mStop || (!state->mReload &&
+                                   (state->mNotifiedEpoch > state->mEpoch)));
+        });
+
+      if (state->mStop)
+        break;
+
+      watch_chunk chunk;
+      chunk.mFromEpoch = state->mEpoch;
+      chunk.mFromOff = state->mChLogOff;
+      chunk.mBaseEpoch = state->mBaseEpoch;
+      lock.unlock();
+      int ret = FetchChunk(chunk);
+      lock.lock();
+
+      // The local map moved on in the meantime
+      if ((chunk.mFromEpoch != state->mEpoch) ||
+          (chunk.mFromOff != state->mChLogOff) ||
+          (chunk.mBaseEpoch != state->mBaseEpoch))
+        continue;
+
+      if (ret)
+      {
+        // Leave it to the next lookup to do a full update
+        state->mReload = true;
+        state->mDirty = true;
+        continue;
       }
+
+      if (chunk.mEpoch <= state->mEpoch)
+      {
+        // Announcement already covered by an earlier fetch
+        state->mNotifiedEpoch = state->mEpoch;
+        continue;
+      }
+
+      QueueChunk(*state, std::move(chunk));
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  // Loop of the follower thread
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  void map<K, V, Index>::FollowWorker()
+  {
+    std::shared_ptr<watch_state> state = mWatch;
+    std::chrono::milliseconds interval = state->mMinInterval;
+    std::unique_lock<std::mutex> lock(state->mMutex);
+
+    while (true)
+    {
+      state->mCond.wait_for(lock, interval, [&]() { return state->mStop; });
+
+      if (state->mStop)
+        break;
+
+      // Nothing to fetch until the next lookup did the full update
+      if (state->mReload)
+        continue;
+
+      watch_chunk chunk;
+      chunk.mFromEpoch = state->mEpoch;
+      chunk.mFromOff = state->mChLogOff;
+      chunk.mBaseEpoch = state->mBaseEpoch;
+      auto start = std::chrono::steady_clock::now();
+      lock.unlock();
+      int ret = FetchChunk(chunk);
+      lock.lock();
+
+      // The local map moved on in the meantime
+      if ((chunk.mFromEpoch != state->mEpoch) ||
+          (chunk.mFromOff != state->mChLogOff) ||
+          (chunk.mBaseEpoch != state->mBaseEpoch))
+        continue;
+
+      // A compaction changes the base epoch, while a map object created
+      // again starts over from a lower epoch. Either way the next lookup
+      // does a full update, which only rereads what it must.
+      if (ret || (chunk.mEpoch < state->mEpoch) ||
+          ((chunk.mEpoch == state->mEpoch) && chunk.mData.length()))
+      {
+        state->mReload = true;
+        state->mDirty = true;
+        interval = state->mMinInterval;
+        continue;
+      }
+
+      if (chunk.mEpoch > state->mEpoch)
+      {
+        QueueChunk(*state, std::move(chunk));
+        interval = state->mMinInterval;
+      }
+      else
+        interval = std::min(interval * 2, state->mMaxInterval);
+
+      state->mSyncTime = start.time_since_epoch().count();
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  // Queue a chunk fetched in the background
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  void map<K, V, Index>::QueueChunk(watch_state& state, watch_chunk&& chunk) const
+  {
+    state.mEpoch = chunk.mEpoch;
+    state.mChLogOff += chunk.mData.length();
+    state.mQueued += chunk.mData.length();
+    state.mChunks.push_back(std::move(chunk));
+    state.mDirty = true;
+
+    // Nobody applied the entries for a while, a full update costs no more
+    // than holding on to them
+    if (state.mQueued > state.mMaxQueued)
+    {
+      std::deque<watch_chunk>().swap(state.mChunks);
+      state.mQueued = 0;
+      state.mReload = true;
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  // Fetch the changelog entries following the given position
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  int map<K, V, Index>::FetchChunk(watch_chunk& chunk)
+  {
+    // Read the epochs and the entries up to the end of the changelog in one
+    // atomic operation, the entries match exactly the epoch read
+    int prval_get, prval_rd;
+    backend::read_op rd_op;
+    std::set<std::string> set_keys {OBJ_EPOCH_KEY, OBJ_BASE_EPOCH_KEY};
+    std::map<std::string, librados::bufferlist> omap_epoch;
+    rd_op.omap_get_vals_by_keys(set_keys, &omap_epoch, &prval_get);
+    rd_op.read(chunk.mFromOff, 0, &chunk.mData, &prval_rd);
+    int ret = mBackend->operate(mObjId, rd_op);
+
+    if (ret)
+    {
+      fprintf(stderr, "Failed to fetch changelog of obj=%s\n", mObjId.c_str());
+      return ret;
+    }
+
+    map_counters::add(mCounters.mBytesRead, chunk.mData.length());
+
+    if (GetOmapValue(omap_epoch, OBJ_BASE_EPOCH_KEY) != chunk.mBaseEpoch)
+      return -ESTALE;
+
+    chunk.mEpoch = GetOmapValue(omap_epoch, OBJ_EPOCH_KEY);
+    return 0;
+  }
+
+  //----------------------------------------------------------------------------
+  // Submit a mutation asynchronously
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  std::shared_future<bool>
+  map<K, V, Index>::SubmitAio(mutation&& mut, bool& applied)
+  {
+    if (!mIsAsync || mReadOnly)
+    {
+      std::promise<bool> promise;
+      std::vector<mutation> batch;
+      batch.emplace_back(std::move(mut));
+      applied = apply_batch(batch) && batch.front().mApplied;
+      promise.set_value(applied);
+      return promise.get_future().share();
+    }
+
+    map_counters::add(mut.mType == mutation::type::insert ?
+                      mCounters.mInserts : mCounters.mErases);
+    // Make room in the pipeline
+    (void) ReapAio(AIO_MAX_INFLIGHT - 1);
+    std::unique_ptr<aio_op> op {new aio_op(std::move(mut))};
+    std::shared_future<bool> future = op->mFuture;
+
+    if (StartAio(std::move(op)))
+      applied = (future.wait_for(std::chrono::seconds(0)) !=
+                 std::future_status::ready) || future.get();
+
+    // Do compaction if necessary
+    MaybeCompact();
+    return future;
+  }
+
+  //----------------------------------------------------------------------------
+  // Apply mutation locally and schedule the changelog append
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::StartAio(std::unique_ptr<aio_op>&& op)
+  {
+    SyncCompaction();
+    auto start = std::chrono::steady_clock::now();
+    mutation& mut = op->mMutation;
+    auto iter = mMap.find(mut.mKey);
+
+    mut.mApplied = ((mut.mType == mutation::type::insert) ==
+                    (iter == mMap.end()));
+
+    // Nothing to commit
+    if (!mut.mApplied)
+    {
+      op->mPromise.set_value(false);
+      return true;
+    }
+
+    // Encoded first, an inserted value is then moved into the map and given
+    // back to the mutation if the operation is rolled back
+    std::string entry;
+    entry.reserve(2 + ChangeLog::MaxFieldSize(mut.mKey) +
+                  ChangeLog::MaxFieldSize(mut.mValue));
+    AppendEntry(mut.mType, mut.mKey, mut.mValue, entry);
+    op->mChLogLen = entry.length();
+
+    if (mut.mType == mutation::type::insert)
+      mMap.insert(std::make_pair(mut.mKey, std::move(mut.mValue)));
+    else
+    {
+      op->mOldValue = std::move(iter->second);
+      mMap.erase(iter);
+    }
+
+    // The operation expects the epoch reached once all the operations in
+    // flight are committed. If there are operations in flight then the last
+    // writer must also be this instance, otherwise a foreign update which
+    // happened to bump the epoch to the same value would go unnoticed.
+    op->mEpoch = mEpoch + mPending.size();
+    backend::write_op wr_op;
+    std::map<std::string, std::pair<librados::bufferlist, int>> omap_assert;
+    librados::bufferlist epoch_buff;
+    epoch_buff.append(std::to_string(op->mEpoch));
+    omap_assert[OBJ_EPOCH_KEY] = std::make_pair(epoch_buff, LIBRADOS_CMPXATTR_OP_EQ);
+
+    if (!mPending.empty())
+    {
+      librados::bufferlist writer_buff;
+      writer_buff.append(mWriterId);
+      omap_assert[OBJ_WRITER_KEY] = std::make_pair(writer_buff, LIBRADOS_CMPXATTR_OP_EQ);
+    }
+
+    wr_op.omap_cmp(omap_assert, &op->mPrvalCmp);
+    std::map<std::string, librados::bufferlist> omap_upd;
+    omap_upd[OBJ_EPOCH_KEY].append(ToString<decltype(mEpoch)>(op->mEpoch + 1));
+    omap_upd[OBJ_WRITER_KEY].append(mWriterId);
+    wr_op.omap_set(omap_upd);
+    wr_op.append(std::move(entry));
+    // Failed operations are handled by the owner of the map. The map waits
+    // for all the completions before going away.
+    aio_op* pop = op.get();
+    latency_histogram* rtt = &Latency(stage::round_trip);
+    op->mComp = std::make_shared<backend::completion>([pop, rtt](int ret) {
+        rtt->record_since(pop->mSubmit);
+
+        if (ret == 0)
+          pop->mPromise.set_value(true);
+      });
+    Latency(stage::local_update).record_since(start);
+    op->mSubmit = std::chrono::steady_clock::now();
+
+    if (mBackend->aio_operate(mObjId, wr_op, op->mComp))
+    {
+      fprintf(stderr, "Failed to schedule wr_aio for %s\n", __FUNCTION__);
+      op->mComp = nullptr;
+
+      // Roll back local change
+      if (mut.mType == mutation::type::insert)
+        UndoInsert(mut);
+      else
+        mMap.insert(std::make_pair(mut.mKey, std::move(op->mOldValue)));
+
+      op->mPromise.set_value(false);
+      return false;
+    }
+
+    mPending.push_back(std::move(op));
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  // Collect completed asynchronous operations
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::ReapAio(uint64_t max_pending)
+  {
+    uint64_t old_epoch = mEpoch;
+
+    while (!mPending.empty())
+    {
+      aio_op* op = mPending.front().get();
+
+      if (mPending.size() > max_pending)
+        op->mComp->wait_for_complete();
+      else if (!op->mComp->is_complete())
+        break;
+
+      int ret = op->mComp->get_return_value();
+
+      if (ret)
+      {
+        if (!RetryAio(op->mPrvalCmp != 0))
+          return false;
+
+        continue;
+      }
+
+      // Update the local view of the changelog
+      mEpoch = op->mEpoch + 1;
+      mAioRetries = 0;
+      mChLogNumLines++;
+      mChLogOff += op->mChLogLen;
+      map_counters::add(mCounters.mCommits);
+      map_counters::add(mCounters.mBytesAppended, op->mChLogLen);
+      mPending.pop_front();
+    }
+
+    if (mEpoch > old_epoch)
+    {
+      mLastSync = std::chrono::steady_clock::now();
+      Publish(mEpoch);
+      ResetWatchCursor();
+    }
+
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  // Handle a failed asynchronous operation
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::RetryAio(bool conflict)
+  {
+    std::deque<std::unique_ptr<aio_op>> failed;
+    failed.swap(mPending);
+
+    // All the operations following the failed one are chained to its epoch,
+    // wait for them and roll back the local changes in reverse order
+    for (auto it = failed.rbegin(); it != failed.rend(); ++it)
+    {
+      mutation& mut = (*it)->mMutation;
+      (*it)->mComp->wait_for_complete();
+      (*it)->mComp = nullptr;
+
+      if (mut.mType == mutation::type::insert)
+        UndoInsert(mut);
+      else
+        mMap.insert(std::make_pair(mut.mKey, std::move((*it)->mOldValue)));
+    }
+
+    if (conflict)
+    {
+      // Failed because of epoch missmatch - do an update and resubmit
+      map_counters::add(mCounters.mConflicts);
+      bool updated {false};
+
+      if (!Backoff(mAioRetries))
+        fprintf(stderr, "Failed %lu async operations because of epoch "
+                "missmatch - give up after %lu retries\n", failed.size(),
+                mAioRetries - 1);
+      else
+      {
+        latency_timer timer(Latency(stage::catch_up));
+        updated = DoUpdate();
+      }
+
+      if (updated)
+      {
+        bool ret {true};
+
+        for (auto&& op: failed)
+        {
+          if (ret)
+            ret = StartAio(std::move(op));
+          else
+            op->mPromise.set_value(false);
+        }
+
+        return ret;
+      }
+    }
+    else
+    {
+      fprintf(stderr, "Fatal error during async commit - abort\n");
+    }
+
+    mAioRetries = 0;
+
+    for (auto&& op: failed)
+      op->mPromise.set_value(false);
+
+    return false;
+  }
+
+  //----------------------------------------------------------------------------
+  // Wait before retrying an operation which failed because of epoch missmatch
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::Backoff(uint64_t& attempt)
+  {
+    // The policy may be replaced while the compaction worker is using it
+    std::shared_ptr<retry_policy> policy = std::atomic_load(&mRetryPolicy);
+    attempt++;
+
+    if (policy->max_retries() && (attempt > policy->max_retries()))
+      return false;
+
+    mNumRetries++;
+    std::chrono::microseconds delay = policy->delay(attempt);
+
+    if (delay.count())
+      std::this_thread::sleep_for(delay);
+
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  // Set the retry policy
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  void map<K, V, Index>::set_retry_policy(std::shared_ptr<retry_policy> policy)
+  {
+    if (!policy)
+      policy = std::make_shared<immediate_retry>();
+
+    std::atomic_store(&mRetryPolicy, policy);
+  }
+
+  //----------------------------------------------------------------------------
+  // Set the admission control of the commits
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  void map<K, V, Index>::set_admission_control(std::shared_ptr<admission_control> ctrl)
+  {
+    mAdmission = ctrl;
+  }
+
+  //----------------------------------------------------------------------------
+  // Get a snapshot of the runtime statistics
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  map_stats map<K, V, Index>::stats() const
+  {
+    map_stats stats;
+    mCounters.copy_to(stats);
+    stats.mRetries = mNumRetries;
+
+    for (auto&& rd_stats: mReadStats)
+      stats.mLookups += rd_stats.mReads;
+
+    stats.mEpoch = mEpoch;
+    stats.mBaseEpoch = mBaseEpoch;
+    stats.mLogSize = mChLogOff;
+    stats.mLogEntries = mChLogNumLines;
+    stats.mMapSize = mMap.size();
+
+    if (mWatch)
+    {
+      std::lock_guard<std::mutex> lock(mWatch->mMutex);
+      stats.mQueuedBytes = mWatch->mQueued;
+    }
+
+    // The last sync happened that long before the current wall-clock time
+    stats.mLastSyncTime = std::chrono::duration_cast<std::chrono::milliseconds>(
+      (std::chrono::system_clock::now() -
+       std::chrono::duration_cast<std::chrono::system_clock::duration>(
+         std::chrono::steady_clock::now() - mLastSync)).time_since_epoch()).count();
+    return stats;
+  }
+
+  //----------------------------------------------------------------------------
+  // Get the full omap
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::InitializeMap()
+  {
+    int ret {1};
+    std::set<std::string> set_keys {OBJ_EPOCH_KEY, OBJ_BASE_EPOCH_KEY};
+    std::map<std::string, librados::bufferlist> omap_epoch;
+    uint64_t attempt {0};
+
+    while (ret)
+    {
+      int prval_sz, prval_get;
+      backend::read_op rd_stat;
+      omap_epoch.clear();
+      rd_stat.omap_get_vals_by_keys(set_keys, &omap_epoch, &prval_get);
+      rd_stat.stat(&mChLogOff, nullptr, &prval_sz);
+      ret = mBackend->operate(mObjId, rd_stat);
+
+      // Get the current remote epoch
+      if (ret)
+      {
+        // Highly unlikely
+        fprintf(stderr, "The epoch search or stat operation failed!\n");
+        return false;
+      }
+
+      // Convert remote epoch to numeric value if it exists
+      if (omap_epoch.find(OBJ_EPOCH_KEY) == omap_epoch.end())
+      {
+        fprintf(stderr, "Fatal error, epoch tag not found in object map!\n");
+        return false;
+      }
+
+      auto epoch_buff = omap_epoch[OBJ_EPOCH_KEY];
+      std::string epoch(epoch_buff.c_str(), epoch_buff.length());
+      mEpoch = FromString<uint64_t>(epoch);
+      // Changelogs never compacted have no base epoch i.e. no snapshot
+      mBaseEpoch = GetOmapValue(omap_epoch, OBJ_BASE_EPOCH_KEY);
+
+      // Load the snapshot the changelog starts from. It is removed only
+      // after the changelog was trimmed to a newer one, so just retry.
+      auto start = std::chrono::steady_clock::now();
+      ret = ReadSnapshot(mBaseEpoch, mMap);
+
+      if (ret == -ENOENT)
+      {
+        if (!Backoff(attempt))
+        {
+          fprintf(stderr, "Snapshot replaced during map read - give up\n");
+          return false;
+        }
+
+        continue;
+      }
+      else if (ret)
+      {
+        fprintf(stderr, "Fatal error while reading snapshot epoch=%lu\n",
+                mBaseEpoch);
+        return false;
+      }
+
+      // Stream the changelog entries following the snapshot up to the size
+      // matching the epoch
+      ret = LoadChangeLog(epoch);
+
+      if (ret == -ECANCELED)
+      {
+        if (!Backoff(attempt))
+        {
+          fprintf(stderr, "Failed omap read because of epoch missmatch - "
+                  "give up\n");
+          return false;
+        }
+
+        continue;
+      }
+      else if (ret)
+      {
+        fprintf(stderr, "Fatal error while loading changelog, ret=%i\n", ret);
+        return false;
+      }
+
+      Latency(stage::replay).record_since(start);
+      map_counters::add(mCounters.mReplayEntries, mChLogNumLines);
+      mLastSync = std::chrono::steady_clock::now();
+      fprintf(stderr, "Map epoch=%lu, snapshot epoch=%lu, log size=%lu, "
+              "map_size=%lu\n", mEpoch, mBaseEpoch, mChLogOff, mMap.size());
+    }
+
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  // Stream the changelog into the local map
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  int map<K, V, Index>::LoadChangeLog(const std::string& epoch)
+  {
+    int ret;
+    uint64_t off {0};
+    std::string cmp_epoch {epoch};
+    replay_state state(true);
+    mChLogNumLines = 0;
+
+    while (true)
+    {
+      ret = ReadChunks(mObjId, off, mChLogOff, cmp_epoch,
+                       [&](librados::bufferlist& chunk) {
+          return ReplayChunk(state, chunk.c_str(), chunk.length(), false,
+                             mMap, mChLogNumLines);
+        });
+
+      if (ret != -ECANCELED)
+        break;
+
+      // Entries appended in the meantime leave the part already read as it
+      // is, only a compaction rewrites it. The local map stays at the epoch
+      // of the offset, the next update reads the rest.
+      std::set<std::string> set_keys {OBJ_EPOCH_KEY, OBJ_BASE_EPOCH_KEY};
+      std::map<std::string, librados::bufferlist> omap_epoch;
+
+      if (mBackend->omap_get_vals_by_keys(mObjId, set_keys, &omap_epoch) ||
+          (omap_epoch.find(OBJ_EPOCH_KEY) == omap_epoch.end()))
+        return -EIO;
+
+      if (GetOmapValue(omap_epoch, OBJ_BASE_EPOCH_KEY) != mBaseEpoch)
+        return -ECANCELED;
+
+      auto epoch_buff = omap_epoch[OBJ_EPOCH_KEY];
+      cmp_epoch.assign(epoch_buff.c_str(), epoch_buff.length());
+    }
+
+    if (ret)
+      return ret;
+
+    if (!ReplayChunk(state, nullptr, 0, true, mMap, mChLogNumLines))
+      return -EINVAL;
+
+    if (state.mStarted)
+      mChLogFormat = state.mFormat;
+
+    return 0;
+  }
+
+  //----------------------------------------------------------------------------
+  // Read a range of an object in chunks
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  template <typename F>
+  int map<K, V, Index>::ReadChunks(const std::string& obj_id, uint64_t& off,
+                                   uint64_t end, const std::string& epoch,
+                                   F&& consume)
+  {
+    //! Chunk read in flight, the operation holds pointers to its members
+    struct chunk_read
+    {
+      backend::read_op mOp;
+      librados::bufferlist mData;
+      uint64_t mLen {0};
+      int mPrvalCmp {0};
+      int mPrvalRd {0};
+      backend::completion_ptr mComp;
+    };
+
+    int ret {0};
+    uint64_t next_off = off;
+    uint64_t chunk_size = std::max<uint64_t>(mLoadOptions.mChunkSize, 64);
+    uint64_t max_inflight = std::max<uint64_t>(mLoadOptions.mMaxInflight, 1);
+    std::deque<std::unique_ptr<chunk_read>> inflight;
+    std::map<std::string, std::pair<librados::bufferlist, int>> omap_assert;
+
+    if (!epoch.empty())
+    {
+      librados::bufferlist epoch_buff;
+      epoch_buff.append(epoch);
+      omap_assert[OBJ_EPOCH_KEY] = std::make_pair(epoch_buff, LIBRADOS_CMPXATTR_OP_EQ);
+    }
+
+    while (!ret)
+    {
+      // Keep the pipeline full, the chunks arriving while the previous ones
+      // are applied
+      while ((inflight.size() < max_inflight) && (next_off < end))
+      {
+        std::unique_ptr<chunk_read> rd(new chunk_read());
+        rd->mLen = std::min(chunk_size, end - next_off);
+
+        if (!omap_assert.empty())
+          rd->mOp.omap_cmp(omap_assert, &rd->mPrvalCmp);
+
+        rd->mOp.read(next_off, rd->mLen, &rd->mData, &rd->mPrvalRd);
+        rd->mComp = std::make_shared<backend::completion>();
+
+        if (mBackend->aio_operate(obj_id, rd->mOp, rd->mComp))
+        {
+          fprintf(stderr, "Failed to schedule rd_aio for %s\n", __FUNCTION__);
+          ret = -EIO;
+          break;
+        }
+
+        next_off += rd->mLen;
+        inflight.push_back(std::move(rd));
+      }
+
+      if (ret || inflight.empty())
+        break;
+
+      chunk_read& rd = *inflight.front();
+      rd.mComp->wait_for_complete();
+      ret = rd.mComp->get_return_value();
+
+      if (ret)
+      {
+        if (rd.mPrvalCmp)
+          ret = -ECANCELED;
+      }
+      else if (rd.mData.length() != rd.mLen)
+      {
+        fprintf(stderr, "Short read of obj=%s at offset=%lu\n", obj_id.c_str(),
+                off);
+        ret = -EIO;
+      }
+      else
+      {
+        map_counters::add(mCounters.mBytesRead, rd.mLen);
+        off += rd.mLen;
+
+        if (!consume(rd.mData))
+          ret = -EINVAL;
+      }
+
+      inflight.pop_front();
+    }
+
+    // The reads still in flight write to the buffers about to go away
+    for (auto&& rd: inflight)
+      rd->mComp->wait_for_complete();
+
+    return ret;
+  }
+
+  //----------------------------------------------------------------------------
+  // Apply the complete records of the next chunk of a snapshot or changelog
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::ReplayChunk(replay_state& state, const char* data,
+                                     uint64_t len, bool last, Index& target,
+                                     uint64_t& num_entries) const
+  {
+    if (!state.mStarted)
+    {
+      uint64_t hdr_len {0};
+
+      if (last && !len)
+        return true;
+
+      if (!ChangeLog::ParseHeader(data, len, state.mFormat, hdr_len))
+      {
+        fprintf(stderr, "Unsupported changelog format!\n");
+        return false;
+      }
+
+      state.mStarted = true;
+      data += hdr_len;
+      len -= hdr_len;
+    }
+
+    // Only the bytes of a record straddling two chunks are copied
+    std::string_view records(data, len);
+
+    if (!state.mCarry.empty())
+    {
+      state.mCarry.append(data, len);
+      records = state.mCarry;
+    }
+
+    uint64_t used {0};
+
+    if (!ReplayRange(records, state, last, target, num_entries, used))
+      return false;
+
+    if (state.mCarry.empty())
+      state.mCarry.assign(records.substr(used));
+    else
+      state.mCarry.erase(0, used);
+
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  // Apply the complete records of a buffer in parallel
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::ReplayRange(std::string_view data,
+                                     replay_state& state, bool last,
+                                     Index& target, uint64_t& num_entries,
+                                     uint64_t& used) const
+  {
+    //! Record decoded by a worker
+    struct replay_op
+    {
+      bool mErase;
+      K mKey;
+      V mValue;
+    };
+
+    ChangeLog::Format format = state.mFormat;
+    auto decode = [&](const char*& pos, const char* end, ChangeLog::Record& rec,
+                      bool last_rec) {
+      if (format == ChangeLog::Format::Binary)
+        return ChangeLog::DecodeRecord(pos, end, rec);
+
+      return ChangeLog::DecodeTextRecord(pos, end, rec, last_rec);
+    };
+
+    uint64_t num_workers = mLoadOptions.mReplayThreads;
+
+    if (num_workers == 0)
+      num_workers = std::max(1u, std::thread::hardware_concurrency());
+
+    num_workers = std::max<uint64_t>(1, std::min(num_workers, data.length() /
+                                                 REPLAY_MIN_WORKER_BYTES));
+
+    // Split the records in ranges of similar size. Binary records carry no
+    // marker, so the boundaries are found by skipping over the records. A
+    // single worker finds the end of the complete records itself.
+    int ret {-EAGAIN};
+    ChangeLog::Record rec;
+    const char* pos = data.data();
+    const char* end = pos + data.length();
+    uint64_t range_len = data.length() / num_workers;
+    std::vector<const char*> bounds {pos};
+    std::vector<uint64_t> range_entries {0};
+
+    while ((num_workers > 1) && ((ret = decode(pos, end, rec, last)) == 0))
+    {
+      range_entries.back()++;
+
+      if ((bounds.size() < num_workers) &&
+          ((uint64_t)(pos - bounds.back()) >= range_len))
+      {
+        bounds.push_back(pos);
+        range_entries.push_back(0);
+      }
+    }
+
+    if (ret != -EAGAIN)
+    {
+      fprintf(stderr, "Corrupted entry in changelog after %lu entries\n",
+              num_entries + std::accumulate(range_entries.begin(),
+                                            range_entries.end(), 0ul));
+      return false;
+    }
+
+    bounds.push_back(num_workers > 1 ? pos : end);
+    num_workers = range_entries.size();
+    // Binary fields have a single encoding per key, therefore the records
+    // superseded within a range are found on the raw bytes and never decoded
+    bool skip_superseded = (state.mLastWriterWins &&
+                            (format == ChangeLog::Format::Binary));
+    // Each worker decodes its range into a list of records in log order
+    std::vector<std::vector<replay_op>> parts(num_workers);
+    std::vector<char> failed(num_workers, 0);
+    std::vector<uint64_t> superseded(num_workers, 0);
+    auto worker = [&](uint64_t w) {
+      K key {};
+      V value {};
+      ChangeLog::Record wrec;
+      const char* wpos = bounds[w];
+      std::vector<ChangeLog::Record> recs;
+      parts[w].reserve(range_entries[w]);
+
+      // A single worker is already in log order and applies the records
+      auto emit = [&](const ChangeLog::Record& op) {
+        if (!DecodeEntryField(op.mKey, format, key) ||
+            ((op.mOp == ChangeLog::OP_INSERT) &&
+             !DecodeEntryField(op.mValue, format, value)))
+          return false;
+
+        if (num_workers > 1)
+          parts[w].push_back(replay_op {op.mOp == ChangeLog::OP_ERASE,
+                                        std::move(key), std::move(value)});
+        else if (op.mOp == ChangeLog::OP_ERASE)
+          (void) target.erase(key);
+        else
+          index_append(target, key, std::move(value));
+
+        return true;
+      };
+
+      if (skip_superseded)
+        recs.reserve(range_entries[w]);
+
+      // Only the last range may end with an incomplete record
+      int wret;
+      bool wlast = ((w + 1 < num_workers) || last);
+
+      while ((wret = decode(wpos, bounds[w + 1], wrec, wlast)) == 0)
+      {
+        if (num_workers == 1)
+          range_entries[w]++;
+
+        if ((wrec.mOp != ChangeLog::OP_INSERT) && (wrec.mOp != ChangeLog::OP_ERASE))
+        {
+          fprintf(stderr, "Found unkown action type in changlog\n");
+          continue;
+        }
+
+        if (skip_superseded)
+          recs.push_back(wrec);
+        else if (!emit(wrec))
+        {
+          failed[w] = 1;
+          return;
+        }
+      }
+
+      if (wret != -EAGAIN)
+      {
+        fprintf(stderr, "Corrupted entry in changelog after %lu entries\n",
+                num_entries + range_entries[w]);
+        failed[w] = 1;
+        return;
+      }
+
+      if (num_workers == 1)
+        bounds[1] = wpos;
+
+      // Scanned backwards the first record of a key is its last one. The
+      // survivors are then emitted in log order so that sorted logs are still
+      // appended to the index.
+      std::unordered_set<std::string_view> seen;
+      std::vector<char> keep(recs.size(), 0);
+      seen.reserve(recs.size());
+
+      for (uint64_t i = recs.size(); i-- > 0; )
+      {
+        keep[i] = seen.insert(recs[i].mKey).second;
+        superseded[w] += !keep[i];
+      }
+
+      for (uint64_t i = 0; i < recs.size(); ++i)
+      {
+        if (keep[i] && !emit(recs[i]))
+        {
+          failed[w] = 1;
+          return;
+        }
+      }
+    };
+
+    if (num_workers == 1)
+      worker(0);
+    else
+    {
+      std::vector<std::thread> threads;
+
+      for (uint64_t w = 1; w < num_workers; ++w)
+        threads.emplace_back(worker, w);
+
+      worker(0);
+
+      for (auto&& thread: threads)
+        thread.join();
+    }
+
+    if (std::find(failed.begin(), failed.end(), 1) != failed.end())
+      return false;
+
+    used = bounds.back() - data.data();
+    uint64_t chunk_entries = std::accumulate(range_entries.begin(),
+                                             range_entries.end(), 0ul);
+
+    if (skip_superseded &&
+        (std::accumulate(superseded.begin(), superseded.end(), 0ul) *
+         REPLAY_MIN_SUPERSEDED < chunk_entries))
+      state.mLastWriterWins = false;
+
+    // The records taken from the workers in range order are in log order,
+    // therefore sorted ones e.g. those of a snapshot are appended
+    for (uint64_t w = 0; w < num_workers; ++w)
+    {
+      for (auto&& op: parts[w])
+      {
+        if (op.mErase)
+          (void) target.erase(op.mKey);
+        else
+          index_append(target, op.mKey, std::move(op.mValue));
+      }
+
+      std::vector<replay_op>().swap(parts[w]);
+    }
+
+    num_entries += chunk_entries;
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  // Load the local map from the cache file and catch up with the changelog
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::LoadCache()
+  {
+    ReplicaCache cache;
+    int ret = cache.Open(mCachePath);
+
+    if (ret)
+    {
+      if (ret != -ENOENT)
+        fprintf(stderr, "Ignoring unusable cache file %s, ret=%i\n",
+                mCachePath.c_str(), ret);
+
+      return false;
+    }
+
+    const ReplicaCache::Header& hdr = cache.GetHeader();
+
+    if (hdr.mObjId != mObjId)
+    {
+      fprintf(stderr, "Cache file %s belongs to obj=%s\n", mCachePath.c_str(),
+              hdr.mObjId.c_str());
+      return false;
+    }
+
+    // A changelog with the same base which is shorter or older than the cache
+    // was recreated in the meantime. A different base is handled by the
+    // update, which reuses the cache if it covers the new snapshot.
+    uint64_t psize {0};
+    int prval_sz, prval_get;
+    std::set<std::string> set_keys {OBJ_EPOCH_KEY, OBJ_BASE_EPOCH_KEY};
+    std::map<std::string, librados::bufferlist> omap_epoch;
+    backend::read_op rd_stat;
+    rd_stat.omap_get_vals_by_keys(set_keys, &omap_epoch, &prval_get);
+    rd_stat.stat(&psize, nullptr, &prval_sz);
+
+    if (mBackend->operate(mObjId, rd_stat) ||
+        (omap_epoch.find(OBJ_EPOCH_KEY) == omap_epoch.end()))
+      return false;
+
+    if ((GetOmapValue(omap_epoch, OBJ_BASE_EPOCH_KEY) == hdr.mBaseEpoch) &&
+        ((GetOmapValue(omap_epoch, OBJ_EPOCH_KEY) < hdr.mEpoch) ||
+         (psize < hdr.mChLogOff)))
+    {
+      fprintf(stderr, "Cache file %s is ahead of obj=%s\n", mCachePath.c_str(),
+              mObjId.c_str());
+      return false;
+    }
+
+    // The entries are decoded in place from the mapped file
+    K key;
+    V value;
+    ChangeLog::Record rec;
+    uint64_t num_entries {0};
+    std::string_view records = cache.Records();
+    const char* pos = records.data();
+    const char* end = pos + records.length();
+    auto start = std::chrono::steady_clock::now();
+
+    while (pos != end)
+    {
+      if (ChangeLog::DecodeRecord(pos, end, rec) ||
+          (rec.mOp != ChangeLog::OP_INSERT) ||
+          !DecodeEntryField(rec.mKey, ChangeLog::Format::Binary, key) ||
+          !DecodeEntryField(rec.mValue, ChangeLog::Format::Binary, value))
+        break;
+
+      (void) mMap.insert_or_assign(key, std::move(value));
+      num_entries++;
+    }
+
+    if ((pos != end) || (num_entries != hdr.mNumEntries))
+    {
+      fprintf(stderr, "Corrupted cache file %s after %lu entries\n",
+              mCachePath.c_str(), num_entries);
+      mMap.clear();
+      return false;
+    }
+
+    Latency(stage::replay).record_since(start);
+    mEpoch = hdr.mEpoch;
+    mBaseEpoch = hdr.mBaseEpoch;
+    mChLogOff = hdr.mChLogOff;
+    mChLogNumLines = hdr.mChLogNumLines;
+    mChLogFormat = hdr.mChLogFormat;
+    map_counters::add(mCounters.mCacheLoads);
+    fprintf(stderr, "Map loaded from cache epoch=%lu, snapshot epoch=%lu, "
+            "log size=%lu, map_size=%lu\n", mEpoch, mBaseEpoch, mChLogOff,
+            mMap.size());
+
+    if (!DoUpdate())
+    {
+      mMap.clear();
+      mEpoch = mBaseEpoch = mChLogOff = mChLogNumLines = 0;
+      return false;
+    }
+
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  // Save the local map to the cache file
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::save_cache()
+  {
+    if (mCachePath.empty())
+    {
+      fprintf(stderr, "No cache file given for obj=%s\n", mObjId.c_str());
+      return false;
+    }
+
+    if (!flush())
+      return false;
+
+    SyncCompaction();
+    ReplicaCache::Header hdr;
+    hdr.mObjId = mObjId;
+    hdr.mEpoch = mEpoch;
+    hdr.mBaseEpoch = mBaseEpoch;
+    hdr.mChLogOff = mChLogOff;
+    hdr.mChLogNumLines = mChLogNumLines;
+    hdr.mChLogFormat = mChLogFormat;
+    hdr.mNumEntries = mMap.size();
+    ReplicaCacheWriter writer(mCachePath);
+
+    if (!writer.Open(hdr))
+      return false;
+
+    return (DumpSorted(mMap, [&](const auto& key, const auto& value) {
+          ChangeLog::EncodeInsert(key, value, writer.Buffer());
+          return writer.Flush();
+        }) && writer.Commit());
+  }
+
+  //----------------------------------------------------------------------------
+  // Update the local contents of the map and the epoch if necessary
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::DoUpdate()
+  {
+    std::map<std::string, librados::bufferlist> omap_epoch;
+    std::set<std::string> set_keys {OBJ_EPOCH_KEY, OBJ_BASE_EPOCH_KEY,
+        OBJ_PREV_BASE_EPOCH_KEY, OBJ_TRIM_OFF_KEY, OBJ_TRIM_ENTRIES_KEY};
+    latency_timer timer(Latency(stage::update));
+    SyncCompaction();
+
+    while (true)
+    {
+      // Get the current remote epoch, size and the changelog entries past the
+      // cached size in one read. The steps of a read operation see the same
+      // state of the object, therefore the entries match the epoch.
+      uint64_t psize {0};
+      int prval_omap, prval_stat, prval_rd;
+      librados::bufferlist chlog_data;
+      backend::read_op rd_op;
+      rd_op.omap_get_vals_by_keys(set_keys, &omap_epoch, &prval_omap);
+      rd_op.stat(&psize, nullptr, &prval_stat);
+      // A zero length reads up to the end of the object
+      rd_op.read(mChLogOff, 0, &chlog_data, &prval_rd);
+      auto start = std::chrono::steady_clock::now();
+
+      if (mBackend->operate(mObjId, rd_op) ||
+          (omap_epoch.find(OBJ_EPOCH_KEY) == omap_epoch.end()))
+      {
+        // Highly unlikely
+        fprintf(stderr, "The epoch value was not found in the map!\n");
+        return false;
+      }
+
+      Latency(stage::round_trip).record_since(start);
+
+      // Convert remote epoch to numeric value
+      auto epoch_buff = omap_epoch[OBJ_EPOCH_KEY];
+      uint64_t remote_epoch = FromString<uint64_t>(std::string(epoch_buff.c_str(),
+                                                               epoch_buff.length()));
+      uint64_t remote_base = GetOmapValue(omap_epoch, OBJ_BASE_EPOCH_KEY);
+
+      // The changelog was trimmed to a new snapshot. If the local map already
+      // covers the snapshot then the entries it was missing are still in the
+      // trimmed changelog, just shifted by the number of bytes dropped. They
+      // are read again from the shifted offset, and the entries counted so
+      // far lose those trimmed.
+      if ((mBaseEpoch != remote_base) && (mEpoch >= remote_base) &&
+          (mChLogFormat == ChangeLog::Format::Binary) &&
+          (mBaseEpoch == GetOmapValue(omap_epoch, OBJ_PREV_BASE_EPOCH_KEY)))
+      {
+        uint64_t trim_off = GetOmapValue(omap_epoch, OBJ_TRIM_OFF_KEY);
+
+        if (mChLogOff >= trim_off + ChangeLog::Header().length())
+        {
+          mChLogOff -= trim_off;
+          mBaseEpoch = remote_base;
+          mChLogNumLines -= std::min(mChLogNumLines, GetOmapValue(
+                                       omap_epoch, OBJ_TRIM_ENTRIES_KEY));
+          continue;
+        }
+      }
+
+      if ((mEpoch == remote_epoch) && (mBaseEpoch == remote_base))
+      {
+        mLastSync = std::chrono::steady_clock::now();
+        return true;
+      }
+      else if ((mEpoch < remote_epoch) && (mBaseEpoch == remote_base))
+      {
+        // Normal following of the changelog
+        if (mChLogOff + chlog_data.length() != psize)
+        {
+          fprintf(stderr, "Fatal error during update operation\n");
+          return false;
+        }
+
+        // Update cache changelog size to the current remote size
+        mChLogOff = psize;
+        uint64_t old_lines = mChLogNumLines;
+        map_counters::add(mCounters.mBytesRead, chlog_data.length());
+        start = std::chrono::steady_clock::now();
+
+        // Update local map using the info from the read changelog
+        if (!ApplyChangeLog(chlog_data, 0, mChLogFormat, mMap, mChLogNumLines))
+        {
+          fprintf(stderr, "Fatal error while applying changelog\n");
+          return false;
+        }
+
+        Latency(stage::replay).record_since(start);
+
+        map_counters::add(mCounters.mReplayEntries, mChLogNumLines - old_lines);
+        map_counters::add(mCounters.mCatchUps);
+
+        // Update the local epoch to the remote epoch
+        mEpoch = remote_epoch;
+        mLastSync = std::chrono::steady_clock::now();
+        return true;
+      }
+      else
+      {
+        // Update after compaction done by someone else and the local map is
+        // behind the snapshot - meaning a full reinitalisation of both the map
+        // and connected data structures
+        map_counters::add(mCounters.mFullReloads);
+
+        if (!InitializeMap())
+        {
+          fprintf(stderr, "Fatal error while re-initialising the map after "
+                  "a compaction operation\n");
+          return false;
+        }
+
+        return true;
+      }
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  // Trigger a background compaction or swap in a finished one
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  void map<K, V, Index>::MaybeCompact()
+  {
+    if (mReadOnly)
+      return;
+
+    SyncCompaction();
+    std::lock_guard<std::mutex> lock(mCompactMutex);
+
+    if ((mCompactState == compaction_state::idle) && NeedsCompaction())
+    {
+      mCompactState = compaction_state::running;
+      mCompactCond.notify_all();
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  // Synchronise the writer with the background compaction
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  void map<K, V, Index>::SyncCompaction()
+  {
+    std::unique_lock<std::mutex> lock(mCompactMutex);
+    mCompactCond.wait(lock, [&]() { return !mCompactFence; });
+
+    // Operations in flight still expect the old layout, they either fail and
+    // get resubmitted or they are reaped first
+    if ((mCompactState != compaction_state::swapped) || !mPending.empty())
+      return;
+
+    // The local map matches the compacted changelog only if it was up to date
+    // at the moment of the swap, otherwise the next update reloads it
+    if ((mCompaction.mEpoch == mEpoch) && (mCompaction.mBaseEpoch == mBaseEpoch))
+    {
+      mEpoch++;
+      mBaseEpoch = mCompaction.mSnapEpoch;
+      mChLogOff = mCompaction.mChLogOff;
+      mChLogNumLines = mCompaction.mNumEntries;
+      mChLogFormat = ChangeLog::Format::Binary;
+      ResetWatchCursor();
+    }
+
+    // The erased and overwritten entries are gone from the changelog as well,
+    // give their memory back too
+    (void) index_reclaim(mMap);
+    mCompactState = compaction_state::idle;
+  }
+
+  //----------------------------------------------------------------------------
+  // Set or clear the fence holding back new commits of the writer
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  void map<K, V, Index>::SetCompactionFence(bool fence)
+  {
+    std::lock_guard<std::mutex> lock(mCompactMutex);
+    mCompactFence = fence;
+    mCompactCond.notify_all();
+  }
+
+  //----------------------------------------------------------------------------
+  // Loop of the background compaction worker
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  void map<K, V, Index>::CompactionWorker()
+  {
+    std::unique_lock<std::mutex> lock(mCompactMutex);
+
+    while (true)
+    {
+      mCompactCond.wait(lock, [&]() {
+          return (mCompactStop || (mCompactState == compaction_state::running));
+        });
+
+      if (mCompactStop)
+        break;
+
+      lock.unlock();
+      compaction comp;
+      auto start = std::chrono::steady_clock::now();
+      bool done = (BuildCompaction(comp) && DoCompaction(comp));
+      lock.lock();
+
+      if (done)
+      {
+        Latency(stage::compaction).record_since(start);
+        map_counters::add(mCounters.mCompactions);
+        map_counters::add(mCounters.mCompactionUs,
+                          std::chrono::duration_cast<std::chrono::microseconds>
+                          (std::chrono::steady_clock::now() - start).count());
+        mCompaction = std::move(comp);
+        mCompactState = compaction_state::swapped;
+      }
+      else
+      {
+        mCompactState = compaction_state::idle;
+      }
+
+      mCompactFence = false;
+      mCompactCond.notify_all();
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  // Build a snapshot of the map and save it in its own object
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::BuildCompaction(compaction& comp)
+  {
+    // Read the epochs and the whole changelog in one atomic operation
+    int prval_get, prval_rd;
+    librados::bufferlist chlog_data;
+    backend::read_op rd_op;
+    std::set<std::string> set_keys {OBJ_EPOCH_KEY, OBJ_BASE_EPOCH_KEY};
+    std::map<std::string, librados::bufferlist> omap_epoch;
+    rd_op.omap_get_vals_by_keys(set_keys, &omap_epoch, &prval_get);
+    rd_op.read(0, 0, &chlog_data, &prval_rd);
+
+    if (mBackend->operate(mObjId, rd_op) ||
+        (omap_epoch.find(OBJ_EPOCH_KEY) == omap_epoch.end()))
+    {
+      fprintf(stderr, "Failed to read changelog for compaction\n");
+      return false;
+    }
+
+    map_counters::add(mCounters.mBytesRead, chlog_data.length());
+    comp.mSnapEpoch = GetOmapValue(omap_epoch, OBJ_EPOCH_KEY);
+    comp.mBaseEpoch = GetOmapValue(omap_epoch, OBJ_BASE_EPOCH_KEY);
+
+    // Nothing appended since the last snapshot
+    if (comp.mSnapEpoch == comp.mBaseEpoch)
+      return false;
+
+    // Replay the previous snapshot and the changelog in a private map
+    Index snapshot;
+
+    if (ReadSnapshot(comp.mBaseEpoch, snapshot))
+    {
+      fprintf(stderr, "Failed to read snapshot epoch=%lu for compaction\n",
+              comp.mBaseEpoch);
+      return false;
     }
 
-    // Local remove
-    mMap.erase(key);
+    char hdr[16];
+    uint64_t hdr_len {0};
+    uint64_t peek_len = std::min<uint64_t>(chlog_data.length(),
+                                           ChangeLog::MAGIC.length() + 1);
+    chlog_data.copy(0, peek_len, hdr);
 
-    // Everything is up to date, do compaction if necessary
-    if (NeedsCompaction() && !DoCompaction())
-      fprintf(stderr, "Failed compaction - retry\n");
+    if (!ChangeLog::ParseHeader(hdr, peek_len, comp.mFormat, hdr_len))
+    {
+      fprintf(stderr, "Unsupported changelog format!\n");
+      return false;
+    }
+
+    uint64_t num_entries {0};
+
+    if (!ApplyChangeLog(chlog_data, hdr_len, comp.mFormat, snapshot, num_entries))
+      return false;
+
+    comp.mChLogOff = chlog_data.length();
+    comp.mTrimEntries = num_entries;
+    std::string dump {ChangeLog::Header()};
+    (void) DumpSorted(snapshot, [&](const auto& key, const auto& value) {
+        ChangeLog::EncodeInsert(key, value, dump);
+        return true;
+      });
+
+    // The snapshot object is not referenced by anybody until the changelog
+    // is trimmed, therefore writing it does not block the writer
+    librados::bufferlist snap_data;
+    snap_data.append(dump);
+
+    if (mBackend->write_full(GetSnapshotId(comp.mSnapEpoch), snap_data))
+    {
+      fprintf(stderr, "Failed to write snapshot epoch=%lu\n", comp.mSnapEpoch);
+      return false;
+    }
+
+    fprintf(stdout, "Do compaction, snapshot epoch=%lu, size=%lu\n",
+            comp.mSnapEpoch, dump.length());
+    return true;
   }
 
   //----------------------------------------------------------------------------
-  // Get the full omap
+  // Trim the changelog to the entries not covered by the snapshot
   //----------------------------------------------------------------------------
-  template <typename K, typename V>
-  bool map<K, V>::InitializeMap()
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::DoCompaction(compaction& comp)
   {
-    int ret {1};
-    librados::bufferlist rd_buff;
-    librados::bufferlist chlog_data;
-    std::set<std::string> set_keys {OBJ_EPOCH_KEY};
-    std::map<std::string, librados::bufferlist> omap_epoch;
+    fprintf(stdout, "Do compaction, init chlog size=%lu\n", comp.mChLogOff);
+    int ret;
+    bool done {false};
+    bool snap_used {false};
+    uint64_t hdr_len = ChangeLog::Header().length();
 
-    while (ret)
-    {
-      int prval_sz, prval_get;
-      librados::ObjectReadOperation rd_stat;
-      rd_stat.omap_get_vals_by_keys(set_keys, &omap_epoch, &prval_get);
-      rd_stat.stat(&mChLogOff, nullptr, &prval_sz);
-      ret = mIoCtx.operate(mObjId, &rd_stat, &rd_buff);
+    // Hold back the writer for the duration of the swap. Appends to the
+    // object would anyway queue behind the rewrite, while racing with them
+    // would mean reading and rewriting the tail again for each lost attempt.
+    // The fence is lifted by the worker loop once the outcome is published.
+    SetCompactionFence(true);
 
-      // Get the current remote epoch
-      if (ret)
+    for (uint64_t attempt = 0; attempt < COMPACTION_SWAP_RETRIES; ++attempt)
+    {
+      // Read the current epochs and the entries appended after the snapshot
+      // was taken in one atomic operation
+      int prval_get, prval_rd;
+      librados::bufferlist tail_data;
+      backend::read_op rd_op;
+      std::set<std::string> set_keys {OBJ_EPOCH_KEY, OBJ_BASE_EPOCH_KEY};
+      std::map<std::string, librados::bufferlist> omap_epoch;
+      rd_op.omap_get_vals_by_keys(set_keys, &omap_epoch, &prval_get);
+      rd_op.read(comp.mChLogOff, 0, &tail_data, &prval_rd);
+
+      if (mBackend->operate(mObjId, rd_op) ||
+          (omap_epoch.find(OBJ_EPOCH_KEY) == omap_epoch.end()))
       {
-        // Highly unlikely
-        fprintf(stderr, "The epoch search or stat operation failed!\n");
-        return false;
+        fprintf(stderr, "Fatal error during compaction\n");
+        break;
       }
 
-      // Convert remote epoch to numeric value if it exists
-      if (omap_epoch.find(OBJ_EPOCH_KEY) == omap_epoch.end())
+      map_counters::add(mCounters.mBytesRead, tail_data.length());
+      auto epoch_buff = omap_epoch[OBJ_EPOCH_KEY];
+      comp.mEpoch = GetOmapValue(omap_epoch, OBJ_EPOCH_KEY);
+      uint64_t base_epoch = GetOmapValue(omap_epoch, OBJ_BASE_EPOCH_KEY);
+
+      // The changelog was trimmed after the snapshot was taken, possibly by
+      // another instance which built the very same snapshot
+      if (base_epoch != comp.mBaseEpoch)
       {
-        fprintf(stderr, "Fatal error, epoch tag not found in object map!\n");
-        return false;
+        snap_used = (base_epoch == comp.mSnapEpoch);
+        fprintf(stderr, "Compaction snapshot is stale - drop it\n");
+        break;
       }
 
-      auto epoch_buff = omap_epoch[OBJ_EPOCH_KEY];
-      mEpoch = FromString<uint64_t>(std::string(epoch_buff.c_str(),
-                                                epoch_buff.length()));
-
-      // Get the current offset of the object (i.e. changelog) and the entries
-      // provided that the epoch didn't change
-      int prval_cmp, prval_rd;
-      rd_buff.clear();
-      librados::ObjectReadOperation rd_op;
+      // Binary entries are encoded back to the same bytes, so followers can
+      // still use their offsets once shifted by the trimmed length
+      std::string tail {ChangeLog::Header()};
+      comp.mNumEntries = 0;
+
+      if (!EncodeChangeLog(tail_data, comp.mFormat, tail, comp.mNumEntries))
+        break;
+
+      librados::bufferlist chlog_data;
+      chlog_data.append(tail);
+
+      // Provided that the epoch is correct replace the changelog with the
+      // trimmed one and record the snapshot it starts from
+      int prval_cmp;
+      backend::write_op wr_op;
       std::map<std::string, std::pair<librados::bufferlist, int>> omap_assert;
       omap_assert[OBJ_EPOCH_KEY] = std::make_pair(epoch_buff, LIBRADOS_CMPXATTR_OP_EQ);
-      rd_op.omap_cmp(omap_assert, &prval_cmp);
-      rd_op.read(0, mChLogOff, &chlog_data, &prval_rd);
-
-      // Execute atomic operations asynchronously
-      librados::AioCompletion* rd_comp = librados::Rados::aio_create_completion();
-      ret = mIoCtx.aio_operate(mObjId, rd_comp, &rd_op, &rd_buff);
+      wr_op.omap_cmp(omap_assert, &prval_cmp);
+      wr_op.write_full(chlog_data);
+      std::map<std::string, librados::bufferlist> omap_upd;
+      omap_upd[OBJ_EPOCH_KEY].append(ToString<decltype(mEpoch)>(comp.mEpoch + 1));
+      omap_upd[OBJ_BASE_EPOCH_KEY].append(ToString<decltype(mEpoch)>(comp.mSnapEpoch));
+      omap_upd[OBJ_PREV_BASE_EPOCH_KEY].append(ToString<decltype(mEpoch)>(comp.mBaseEpoch));
+      omap_upd[OBJ_TRIM_OFF_KEY].append(ToString<decltype(mEpoch)>(
+          comp.mFormat == ChangeLog::Format::Binary ? comp.mChLogOff - hdr_len : 0));
+      omap_upd[OBJ_TRIM_ENTRIES_KEY].append(ToString<decltype(mEpoch)>(
+          comp.mTrimEntries));
+      // The swap is not a commit of the pipeline, operations chained on the
+      // epoch it replaces must fail
+      omap_upd[OBJ_WRITER_KEY].append(mWriterId + ":compaction");
+      wr_op.omap_set(omap_upd);
+      ret = mBackend->operate(mObjId, wr_op);
 
-      if (ret)
+      if (ret == 0)
       {
-        fprintf(stderr, "Failed to schedule rd_aio for %s\n", __FUNCTION__);
-        rd_comp->release();
-        return false;
+        comp.mChLogOff = chlog_data.length();
+        fprintf(stdout, "Do compaction, final chlog size=%lu\n", comp.mChLogOff);
+        Publish(comp.mEpoch + 1);
+        done = snap_used = true;
+        break;
       }
 
-      // Wait for completion and get result
-      rd_comp->wait_for_complete();
-      ret = rd_comp->get_return_value();
-      rd_comp->release();
-
-      if (ret)
+      if (!prval_cmp)
       {
-        if (prval_cmp)
-        {
-          fprintf(stderr, "Failed omap read because of epoch missmatch - retry\n");
-          omap_epoch.clear();
-          continue;
-        }
-        else
-        {
-          fprintf(stderr, "Fatal error during omap read operation\n");
-          return false;
-        }
+        fprintf(stderr, "Fatal error during compaction\n");
+        break;
       }
-      else
-      {
-        // Replay the changelog to populate local map
-        if (!ApplyChangeLog(std::string(chlog_data.c_str(), chlog_data.length())))
-        {
-          fprintf(stderr, "Fatal error while applying changelog!\n");
-          return false;
-        }
 
-        fprintf(stderr, "Map epoch=%lu, log size=%lu, map_size=%lu\n",
-                mEpoch, mChLogOff, mMap.size());
-      }
+      // Failed because of epoch missmatch - back off unless out of attempts
+      map_counters::add(mCounters.mConflicts);
+      uint64_t retries {attempt};
+
+      if ((attempt + 1 == COMPACTION_SWAP_RETRIES) || !Backoff(retries))
+        break;
     }
 
-    return true;
+    // Drop the snapshot which is no longer referenced, readers which still
+    // look for it retry with the new one
+    uint64_t unused_epoch = (done ? comp.mBaseEpoch : comp.mSnapEpoch);
+
+    if ((done || !snap_used) && unused_epoch &&
+        mBackend->remove(GetSnapshotId(unused_epoch)))
+      fprintf(stderr, "Failed to remove snapshot epoch=%lu\n", unused_epoch);
+
+    return done;
   }
 
   //----------------------------------------------------------------------------
-  // Update the local contents of the map and the epoch if necessary
+  // Get the id of the object holding the snapshot of a given epoch
   //----------------------------------------------------------------------------
-  template <typename K, typename V>
-  bool map<K, V>::DoUpdate()
+  template <typename K, typename V, typename Index>
+  std::string map<K, V, Index>::GetSnapshotId(uint64_t snap_epoch) const
   {
-    int ret {1};
-    int prval_cmp;
-    std::map<std::string, librados::bufferlist> omap_epoch;
-    std::set<std::string> set_keys {OBJ_EPOCH_KEY};
+    return mObjId + SNAPSHOT_SUFFIX + std::to_string(snap_epoch);
+  }
 
-    while (ret)
+  //----------------------------------------------------------------------------
+  // Call a function for each entry of an index in key order
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  template <typename F>
+  bool map<K, V, Index>::DumpSorted(Index& index, F&& func)
+  {
+    if (index_traits<Index>::ordered)
     {
-      // Get the current remote epoch
-      if (mIoCtx.omap_get_vals_by_keys(mObjId, set_keys, &omap_epoch))
-      {
-        // Highly unlikely
-        fprintf(stderr, "The epoch value was not found in the map!\n");
-        return false;
-      }
-
-      // Convert remote epoch to numeric value
-      auto epoch_buff = omap_epoch[OBJ_EPOCH_KEY];
-      uint64_t remote_epoch = FromString<uint64_t>(std::string(epoch_buff.c_str(),
-                                                               epoch_buff.length()));
-
-      if (mEpoch == remote_epoch)
-      {
-        return true;
-      }
-      else if (mEpoch < remote_epoch)
+      for (auto&& it: index)
       {
-        // Normal following of the changelog
-        uint64_t psize;
-
-        if (mIoCtx.stat(mObjId, &psize, nullptr))
-        {
-          // Highly unlikely
-          fprintf(stderr, "Count not stat remote object=%s\n", mObjId.c_str());
-          return false;
-        }
-
-        // Check that remote epoch is the same i.e. the size we just got
-        // is correct
-        librados::ObjectReadOperation rd_op;
-        std::map<std::string, std::pair<librados::bufferlist, int>> omap_assert;
-        librados::bufferlist epoch;
-        librados::bufferlist rd_buff;
-        epoch.append(std::to_string(remote_epoch));
-        omap_assert[OBJ_EPOCH_KEY] = std::make_pair(epoch, LIBRADOS_CMPXATTR_OP_EQ);
-        rd_op.omap_cmp(omap_assert, &prval_cmp);
-
-        // Read the changelog from the cached size to the current remote size
-        int prval_rd;
-        librados::bufferlist chlog_data;
-        rd_op.read(mChLogOff, psize - mChLogOff, &chlog_data, &prval_rd);
-
-        // Execute atomic operations asynchronously
-        librados::AioCompletion* rd_comp = librados::Rados::aio_create_completion();
-        ret = mIoCtx.aio_operate(mObjId, rd_comp, &rd_op, &rd_buff);
-
-        if (ret)
-        {
-          fprintf(stderr, "Failed to schedule rd_aio for %s\n", __FUNCTION__);
-          rd_comp->release();
+        if (!func(it.first, it.second))
           return false;
-        }
+      }
 
-        // Wait for completion and get result
-        rd_comp->wait_for_complete();
-        ret = rd_comp->get_return_value();
-        rd_comp->release();
+      return true;
+    }
 
-        if (ret)
-        {
-          // Failed due to epoch missmatch - retry
-          if (prval_cmp)
-          {
-            fprintf(stderr, "Failed update because of epoch missmatch - retry\n");
-            continue;
-          }
-          else
-          {
-            fprintf(stderr, "Fatal error during update operation\n");
-            return false;
-          }
-        }
+    std::vector<const typename Index::value_type*> entries;
+    entries.reserve(index.size());
 
-        // Update cache changelog size to the current remote size
-        mChLogOff = psize;
+    for (auto&& it: index)
+      entries.push_back(&it);
 
-        // Update local map using the info from the read changelog
-        if (!ApplyChangeLog(std::string(chlog_data.c_str(), chlog_data.length())))
-        {
-          fprintf(stderr, "Fatal error while applying changelog\n");
-          return false;
-        }
+    std::sort(entries.begin(), entries.end(), [](auto lhs, auto rhs) {
+        return (lhs->first < rhs->first);
+      });
 
-        // Update the local epoch to the remote epoch
-        mEpoch = remote_epoch;
-      }
-      else
-      {
-        // Update after compaction done by someone else - meaning a full
-        // reinitalisation of both the map and connected data structures
-        if (!InitializeMap())
-        {
-          fprintf(stderr, "Fatal error while re-initialising the map after "
-                  "a compaction operation\n");
-          return false;
-        }
-        else
-          break;
-      }
+    for (auto&& entry: entries)
+    {
+      if (!func(entry->first, entry->second))
+        return false;
     }
 
     return true;
   }
 
   //----------------------------------------------------------------------------
-  // Compact the changelog
+  // Read the snapshot of a given epoch and load it into a map
   //----------------------------------------------------------------------------
-  template <typename K, typename V>
-  bool map<K, V>::DoCompaction()
+  template <typename K, typename V, typename Index>
+  int map<K, V, Index>::ReadSnapshot(uint64_t snap_epoch, Index& target)
   {
-    fprintf(stdout, "Do compaction, init chlog size=%lu\n", mChLogOff);
-    int ret {1};
-    bool ret_upd {false};
-    std::ostringstream oss_dump;
+    target.clear();
 
-    while ((ret_upd = DoUpdate()) && ret)
-    {
-      oss_dump.str("");
-      oss_dump.clear();
+    if (snap_epoch == 0)
+      return 0;
 
-      for (auto&& it: mMap)
-      {
-        oss_dump << CHLOG_INSERT_OP << " "
-                 << ToString(it.first) << " "
-                 << ToString(it.second) << std::endl;
-      }
+    // Snapshots are never modified, only removed, so the chunks need no
+    // validation
+    uint64_t psize {0};
+    std::string snap_id = GetSnapshotId(snap_epoch);
+    int ret = mBackend->stat(snap_id, &psize);
 
-      librados::bufferlist chlog_data;
-      chlog_data.append(oss_dump.str());
+    if (ret)
+      return ret;
+
+    uint64_t off {0};
+    uint64_t num_entries {0};
+    replay_state state(false);
+    ret = ReadChunks(snap_id, off, psize, "", [&](librados::bufferlist& chunk) {
+        return (ReplayChunk(state, chunk.c_str(), chunk.length(), false, target,
+                            num_entries) &&
+                (state.mFormat == ChangeLog::Format::Binary));
+      });
+
+    if (!ret && (!ReplayChunk(state, nullptr, 0, true, target, num_entries) ||
+                 !state.mStarted))
+      ret = -EINVAL;
+
+    if (ret == -EINVAL)
+    {
+      fprintf(stderr, "Corrupted snapshot epoch=%lu\n", snap_epoch);
+      return -EINVAL;
+    }
 
-      // Provided that the epoch is correct truncate the changelog and
-      // re-populate it with the entries from the local map and update the epoch
-      int prval_cmp;
-      librados::ObjectWriteOperation wr_op;
-      std::map<std::string, std::pair<librados::bufferlist, int>> omap_assert;
-      librados::bufferlist epoch_buff;
-      epoch_buff.append(std::to_string(mEpoch));
-      omap_assert[OBJ_EPOCH_KEY] = std::make_pair(epoch_buff, LIBRADOS_CMPXATTR_OP_EQ);
-      wr_op.omap_cmp(omap_assert, &prval_cmp);
+    return ret;
+  }
 
-      // Compact changelog
-      wr_op.truncate(0);
-      wr_op.write_full(chlog_data);
+  //----------------------------------------------------------------------------
+  // Get numeric value of an omap key
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  uint64_t
+  map<K, V, Index>::GetOmapValue(const std::map<std::string, librados::bufferlist>& omap,
+                          const std::string& key) const
+  {
+    auto iter = omap.find(key);
 
-      // Update epoch to 0
-      std::map<std::string, librados::bufferlist> omap_upd;
-      epoch_buff.clear();
-      epoch_buff.append(ToString((int) 0));
-      omap_upd.insert(std::make_pair(OBJ_EPOCH_KEY, epoch_buff));
-      wr_op.omap_set(omap_upd);
+    if (iter == omap.end())
+      return 0;
 
-      // Execute atomic operations asynchronously
-      librados::AioCompletion* wr_comp = librados::Rados::aio_create_completion();
-      ret = mIoCtx.aio_operate(mObjId, wr_comp, &wr_op);
+    librados::bufferlist buff = iter->second;
+    return FromString<uint64_t>(std::string(buff.c_str(), buff.length()));
+  }
 
-      if (ret)
-      {
-        fprintf(stderr, "Failed to schedule wr_aio for %s\n", __FUNCTION__);
-        wr_comp->release();
-        return false;
-      }
+  //----------------------------------------------------------------------------
+  // Convert changelog entries to the binary format
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::EncodeChangeLog(const librados::bufferlist& data,
+                                  ChangeLog::Format format, std::string& out,
+                                  uint64_t& num_entries) const
+  {
+    int ret;
+    K key;
+    V value;
+    ChangeLog::Record rec;
+    ChangeLogReader reader(format);
+    reader.Append(data);
+    reader.Finish();
 
-      // Wait for completion and get return value
-      wr_comp->wait_for_safe();
-      ret = wr_comp->get_return_value();
-      wr_comp->release();
+    while ((ret = reader.Next(rec)) == 0)
+    {
+      if (rec.mOp == ChangeLog::OP_INSERT)
+      {
+        if (!DecodeEntryField(rec.mKey, format, key) ||
+            !DecodeEntryField(rec.mValue, format, value))
+          return false;
 
-      if (ret)
+        ChangeLog::EncodeInsert(key, value, out);
+      }
+      else if (rec.mOp == ChangeLog::OP_ERASE)
       {
-        if (prval_cmp)
-        {
-          fprintf(stderr, "Failed compaction because of epoch missmatch - "
-                  "retry\n");
-          continue;
-        }
-        else
-        {
-          fprintf(stderr, "Fatal error during compaction\n");
-          return false;;
-        }
+        if (!DecodeEntryField(rec.mKey, format, key))
+          return false;
+
+        ChangeLog::EncodeErase(key, out);
       }
       else
       {
-        mEpoch = 0;
-        mChLogNumLines = mMap.size();
-        mChLogOff = chlog_data.length();
-        fprintf(stdout, "Do compaction, final chlog size=%lu\n", mChLogOff);
-        return true;
+        continue;
       }
-    }
 
-    if (!ret_upd)
-    {
-      fprintf(stderr, "Failed update during compaction.\n");
-      return false;
+      num_entries++;
     }
 
-    return true;
+    return (ret == -EAGAIN);
   }
 
   //----------------------------------------------------------------------------
   // Apply changelog contents to the local map
   //----------------------------------------------------------------------------
-  template <typename K, typename V>
-  bool map<K, V>::ApplyChangeLog(const std::string& chlog)
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::ApplyChangeLog(const librados::bufferlist& data, uint64_t off,
+                                 ChangeLog::Format format,
+                                 Index& target,
+                                 uint64_t& num_entries) const
   {
     // If changelog data empty then return successful
-    if (chlog.empty())
+    if (data.length() <= off)
       return true;
 
+    ChangeLogReader reader(format);
+    reader.Append(data, off);
+    reader.Finish();
+    return ApplyRecords(reader, format, target, num_entries);
+  }
+
+  //----------------------------------------------------------------------------
+  // Apply the complete records of a reader to a map
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::ApplyRecords(ChangeLogReader& reader,
+                                      ChangeLog::Format format, Index& target,
+                                      uint64_t& num_entries) const
+  {
+    int ret;
     K key;
     V value;
-    std::string entry, skey, svalue, action;
-    std::istringstream iss(chlog);
-    std::istringstream iss_entry;
-    //fprintf(stderr, "chlog contents:\n%s\n", chlog.c_str());
+    ChangeLog::Record rec;
 
-    while (std::getline(iss, entry))
+    while ((ret = reader.Next(rec)) == 0)
     {
-      mChLogNumLines++;
-      iss_entry.str(entry);
-      iss_entry.clear();
-      iss_entry >> action >> skey >> svalue;
+      num_entries++;
 
-      if (iss.fail())
-        return false;
+      if ((rec.mOp != ChangeLog::OP_INSERT) && (rec.mOp != ChangeLog::OP_ERASE))
+      {
+        // Smth. really bad happened
+        fprintf(stderr, "Found unkown action type in changlog\n");
+        continue;
+      }
 
-      key = FromString<K>(skey);
+      if (!DecodeEntryField(rec.mKey, format, key))
+        return false;
 
-      if (action == CHLOG_INSERT_OP)
+      if (rec.mOp == ChangeLog::OP_INSERT)
       {
-        //fprintf(stderr, "Action=%s, key=%s, value=%s\n", action.c_str(),
-        //        skey.c_str(), svalue.c_str());
-        value = FromString<V>(svalue);
+        if (!DecodeEntryField(rec.mValue, format, value))
+          return false;
+
         // Note: whatever comes from the changelog is considered as the true
         // state, therefore it overwrites the local map if conflict exists
-        auto pair = std::make_pair(key, value);
-        auto ret_insert = mMap.insert(pair);
-
-        if (!ret_insert.second)
-        {
-          mMap.erase(key);
-          (void) mMap.insert(pair);
-        }
-      }
-      else if (action == CHLOG_ERASE_OP)
-      {
-        //fprintf(stderr, "Action=%s, key=%s\n", action.c_str(), skey.c_str());
-        (void) mMap.erase(key);
+        (void) target.insert_or_assign(key, std::move(value));
       }
       else
       {
-        // Smth. really bad happened
-        fprintf(stderr, "Found unkown action type in changlog\n");
+        (void) target.erase(key);
       }
     }
 
+    if (ret != -EAGAIN)
+    {
+      fprintf(stderr, "Corrupted entry in changelog after %lu entries\n",
+              num_entries);
+      return false;
+    }
+
     return true;
   }
 
+  //----------------------------------------------------------------------------
+  // Decode key or value field of a changelog entry
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  template <typename W>
+  bool map<K, V, Index>::DecodeEntryField(std::string_view field,
+                                   ChangeLog::Format format, W& ret) const
+  {
+    if (format == ChangeLog::Format::Binary)
+      return ChangeLog::DecodeField(field, ret);
+
+    return HelperFromString(field, ret);
+  }
+
+  //----------------------------------------------------------------------------
+  // Append changelog entry in the current changelog format
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  void map<K, V, Index>::AppendEntry(typename mutation::type op, const K& key,
+                              const V& value, std::string& out) const
+  {
+    if (mChLogFormat == ChangeLog::Format::Binary)
+    {
+      if (op == mutation::type::insert)
+        ChangeLog::EncodeInsert(key, value, out);
+      else
+        ChangeLog::EncodeErase(key, out);
+    }
+    else
+    {
+      out += (op == mutation::type::insert ? CHLOG_INSERT_OP : CHLOG_ERASE_OP);
+      out += ' ';
+      AppendText(key, out);
+
+      if (op == mutation::type::insert)
+      {
+        out += ' ';
+        AppendText(value, out);
+      }
+
+      out += '\n';
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  // Undo an insert applied to the local map
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  void map<K, V, Index>::UndoInsert(mutation& mut)
+  {
+    auto iter = mMap.find(mut.mKey);
+
+    if (iter != mMap.end())
+    {
+      mut.mValue = std::move(iter->second);
+      mMap.erase(iter);
+    }
+  }
 
   //----------------------------------------------------------------------------
   // Get string representation of the object
   //----------------------------------------------------------------------------
-  template <typename K, typename V>
+  template <typename K, typename V, typename Index>
   template <typename W>
-  std::string map<K, V>::ToString(W value) const
+  std::string map<K, V, Index>::ToString(const W& value) const
   {
     std::string ret;
 
@@ -1003,9 +3977,9 @@ namespace rados {
   //----------------------------------------------------------------------------
   // Helper function to get string representation of an object which is not
   //----------------------------------------------------------------------------
-  template <typename K, typename V>
+  template <typename K, typename V, typename Index>
   template <typename W>
-  bool map<K, V>::HelperToString(W value, std::string& ret) const
+  bool map<K, V, Index>::HelperToString(const W& value, std::string& ret) const
   {
     ret = std::to_string(value);
     return true;
@@ -1014,8 +3988,8 @@ namespace rados {
   //----------------------------------------------------------------------------
   // Helper function to get string representation of a string. :)
   //----------------------------------------------------------------------------
-  template <typename K, typename V>
-  bool map<K, V>::HelperToString(std::string value, std::string& ret) const
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::HelperToString(const std::string& value, std::string& ret) const
   {
     ret = value;
     return true;
@@ -1024,9 +3998,9 @@ namespace rados {
   //----------------------------------------------------------------------------
   // Convert string to required representation
   //----------------------------------------------------------------------------
-  template <typename K, typename V>
+  template <typename K, typename V, typename Index>
   template <typename W>
-  W map<K, V>::FromString(const std::string& sval) const
+  W map<K, V, Index>::FromString(const std::string& sval) const
   {
     W ret;
 
@@ -1039,24 +4013,24 @@ namespace rados {
   //----------------------------------------------------------------------------
   // Helper function to convert string to number representation
   //----------------------------------------------------------------------------
-  template <typename K, typename V>
+  template <typename K, typename V, typename Index>
   template <typename W>
-  bool map<K, V>::HelperFromString(const std::string& sval, W& ret) const
+  bool map<K, V, Index>::HelperFromString(std::string_view sval, W& ret) const
   {
     if (std::is_same<W, double>::value)
     {
-      ret = std::stod(sval, nullptr);
+      ret = std::stod(std::string(sval), nullptr);
       return true;
     }
     else if (std::is_same<W, float>::value)
     {
-      ret = std::stof(sval, nullptr);
+      ret = std::stof(std::string(sval), nullptr);
       return true;
     }
     else if (std::is_same<W, unsigned long long>::value ||
              std::is_same<W, uint64_t>::value)
     {
-      ret = std::stoull(sval, nullptr);
+      ret = std::stoull(std::string(sval), nullptr);
       return true;
     }
 
@@ -1066,37 +4040,23 @@ namespace rados {
   //----------------------------------------------------------------------------
   // Helper function to convert string to string representation
   //----------------------------------------------------------------------------
-  template <typename K, typename V>
+  template <typename K, typename V, typename Index>
   bool
-  map<K, V>::HelperFromString(const std::string& sval, std::string& ret) const
+  map<K, V, Index>::HelperFromString(std::string_view sval, std::string& ret) const
   {
-    ret = sval;
+    ret.assign(sval.data(), sval.length());
     return true;
   }
 
   //----------------------------------------------------------------------------
   // Decide if changlog need compaction
   //----------------------------------------------------------------------------
-  template <typename K, typename V>
-  bool map<K, V>::NeedsCompaction() const
+  template <typename K, typename V, typename Index>
+  bool map<K, V, Index>::NeedsCompaction() const
   {
     return ((float) mMap.size() / mChLogNumLines <= COMPACTION_RATIO);
   }
 
-
-  //----------------------------------------------------------------------------
-  // Insert complete callback
-  //----------------------------------------------------------------------------
-  template <typename K, typename V>
-  void map<K, V>::insert_complete_cb(librados::completion_t func, void* arg)
-  {
-    std::string* msg = static_cast<std::string*>(arg);
-    librados::AioCompletion comp {static_cast<librados::AioCompletionImpl*>(func)};
-    int ret = comp.get_return_value();
-    fprintf(stderr, "%s: Argument=%s and return_val=%i\n", __FUNCTION__,
-            msg->c_str(), ret);
-    delete msg;
-  }
 }
 
 #endif //__RADOS_MAP_HH__
@@ -0,0 +1,210 @@
+//------------------------------------------------------------------------------
+// File: ReplicaCache.cc
+// Author: Elvin Sindrilaru <esindril@cern.ch>
+//------------------------------------------------------------------------------
+
+/*******************************************************************************
+ * RadosVectMap                                                                *
+ * Copyright (C) 2015 CERN/Switzerland                                         *
+ *                                                                             *
+ * This program is free software: you can redistribute it and/or modify        *
+ * it under the terms of the GNU General Public License as published by        *
+ * the Free Software Foundation, either version 3 of the License, or           *
+ * (at your option) any later version.                                         *
+ *                                                                             *
+ * This program is distributed in the hope that it will be useful,             *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                *
+ * GNU General Public License for more details.                                *
+ *                                                                             *
+ * You should have received a copy of the GNU General Public License           *
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.        *
+ ******************************************************************************/
+
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ReplicaCache.hh"
+
+namespace rados {
+
+  // Define the constants
+  const std::string ReplicaCache::MAGIC {"RVMAPCACHE"};
+  const uint8_t ReplicaCache::VERSION {1};
+  const uint64_t ReplicaCacheWriter::BUFFER_SIZE {1 << 20};
+
+  //----------------------------------------------------------------------------
+  // Constructor
+  //----------------------------------------------------------------------------
+  ReplicaCache::ReplicaCache():
+    mData(nullptr), mLength(0), mRecordsOff(0), mHeader()
+  {}
+
+  //----------------------------------------------------------------------------
+  // Destructor
+  //----------------------------------------------------------------------------
+  ReplicaCache::~ReplicaCache()
+  {
+    if (mData)
+      (void) munmap(const_cast<char*>(mData), mLength);
+  }
+
+  //----------------------------------------------------------------------------
+  // Map a cache file in memory and parse its header
+  //----------------------------------------------------------------------------
+  int ReplicaCache::Open(const std::string& path)
+  {
+    int fd = open(path.c_str(), O_RDONLY);
+
+    if (fd < 0)
+      return -errno;
+
+    struct stat st;
+
+    if (fstat(fd, &st))
+    {
+      int ret = -errno;
+      (void) close(fd);
+      return ret;
+    }
+
+    if ((uint64_t)st.st_size <= MAGIC.length())
+    {
+      (void) close(fd);
+      return -EINVAL;
+    }
+
+    void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    (void) close(fd);
+
+    if (addr == MAP_FAILED)
+      return -errno;
+
+    // The records are decoded once from start to end
+    (void) madvise(addr, st.st_size, MADV_SEQUENTIAL);
+    mData = static_cast<const char*>(addr);
+    mLength = st.st_size;
+
+    if (MAGIC.compare(0, MAGIC.length(), mData, MAGIC.length()) ||
+        (static_cast<uint8_t>(mData[MAGIC.length()]) != VERSION))
+      return -EINVAL;
+
+    const char* pos = mData + MAGIC.length() + 1;
+    const char* end = mData + mLength;
+    uint64_t format, id_len;
+
+    if (!ChangeLog::DecodeVarint(pos, end, mHeader.mEpoch) ||
+        !ChangeLog::DecodeVarint(pos, end, mHeader.mBaseEpoch) ||
+        !ChangeLog::DecodeVarint(pos, end, mHeader.mChLogOff) ||
+        !ChangeLog::DecodeVarint(pos, end, mHeader.mChLogNumLines) ||
+        !ChangeLog::DecodeVarint(pos, end, format) ||
+        !ChangeLog::DecodeVarint(pos, end, mHeader.mNumEntries) ||
+        !ChangeLog::DecodeVarint(pos, end, id_len) ||
+        (format > 1) || ((uint64_t)(end - pos) < id_len))
+      return -EINVAL;
+
+    mHeader.mChLogFormat = (format ? ChangeLog::Format::Binary :
+                            ChangeLog::Format::Text);
+    mHeader.mObjId.assign(pos, id_len);
+    mRecordsOff = pos + id_len - mData;
+    return 0;
+  }
+
+  //----------------------------------------------------------------------------
+  // Encode a header
+  //----------------------------------------------------------------------------
+  void ReplicaCache::EncodeHeader(const Header& hdr, std::string& out)
+  {
+    out += MAGIC;
+    out.push_back(static_cast<char>(VERSION));
+    ChangeLog::EncodeVarint(hdr.mEpoch, out);
+    ChangeLog::EncodeVarint(hdr.mBaseEpoch, out);
+    ChangeLog::EncodeVarint(hdr.mChLogOff, out);
+    ChangeLog::EncodeVarint(hdr.mChLogNumLines, out);
+    ChangeLog::EncodeVarint(hdr.mChLogFormat == ChangeLog::Format::Binary ? 1 : 0,
+                            out);
+    ChangeLog::EncodeVarint(hdr.mNumEntries, out);
+    ChangeLog::EncodeField(hdr.mObjId, out);
+  }
+
+  //----------------------------------------------------------------------------
+  // Constructor
+  //----------------------------------------------------------------------------
+  ReplicaCacheWriter::ReplicaCacheWriter(const std::string& path):
+    mPath(path), mTmpPath(path + ".tmp." + std::to_string(getpid())),
+    mFile(nullptr)
+  {}
+
+  //----------------------------------------------------------------------------
+  // Destructor
+  //----------------------------------------------------------------------------
+  ReplicaCacheWriter::~ReplicaCacheWriter()
+  {
+    if (mFile)
+    {
+      (void) fclose(mFile);
+      (void) unlink(mTmpPath.c_str());
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  // Create the temporary file and write the header
+  //----------------------------------------------------------------------------
+  bool ReplicaCacheWriter::Open(const ReplicaCache::Header& hdr)
+  {
+    mFile = fopen(mTmpPath.c_str(), "wb");
+
+    if (!mFile)
+    {
+      fprintf(stderr, "Failed to create cache file %s, errno=%i\n",
+              mTmpPath.c_str(), errno);
+      return false;
+    }
+
+    mBuffer.reserve(BUFFER_SIZE + BUFFER_SIZE / 4);
+    ReplicaCache::EncodeHeader(hdr, mBuffer);
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  // Write the buffered records
+  //----------------------------------------------------------------------------
+  bool ReplicaCacheWriter::Flush(bool force)
+  {
+    if (!force && (mBuffer.length() < BUFFER_SIZE))
+      return true;
+
+    if (fwrite(mBuffer.data(), 1, mBuffer.length(), mFile) != mBuffer.length())
+    {
+      fprintf(stderr, "Failed to write cache file %s\n", mTmpPath.c_str());
+      return false;
+    }
+
+    mBuffer.clear();
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  // Write the remaining records, sync and rename the file
+  //----------------------------------------------------------------------------
+  bool ReplicaCacheWriter::Commit()
+  {
+    if (!Flush(true))
+      return false;
+
+    bool ok = ((fflush(mFile) == 0) && (fsync(fileno(mFile)) == 0));
+    ok = (fclose(mFile) == 0) && ok;
+    mFile = nullptr;
+
+    if (!ok || rename(mTmpPath.c_str(), mPath.c_str()))
+    {
+      fprintf(stderr, "Failed to commit cache file %s\n", mPath.c_str());
+      (void) unlink(mTmpPath.c_str());
+      return false;
+    }
+
+    return true;
+  }
+}
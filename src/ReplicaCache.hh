@@ -0,0 +1,193 @@
+//------------------------------------------------------------------------------
+// File: ReplicaCache.hh
+// Author: Elvin Sindrilaru <esindril@cern.ch>
+//------------------------------------------------------------------------------
+
+/*******************************************************************************
+ * RadosVectMap                                                                *
+ * Copyright (C) 2015 CERN/Switzerland                                         *
+ *                                                                             *
+ * This program is free software: you can redistribute it and/or modify        *
+ * it under the terms of the GNU General Public License as published by        *
+ * the Free Software Foundation, either version 3 of the License, or           *
+ * (at your option) any later version.                                         *
+ *                                                                             *
+ * This program is distributed in the hope that it will be useful,             *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                *
+ * GNU General Public License for more details.                                *
+ *                                                                             *
+ * You should have received a copy of the GNU General Public License           *
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.        *
+ ******************************************************************************/
+
+#ifndef __RADOS_REPLICA_CACHE_HH__
+#define __RADOS_REPLICA_CACHE_HH__
+
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <string_view>
+#include "ChangeLog.hh"
+
+namespace rados {
+
+  //----------------------------------------------------------------------------
+  //! Local file holding a copy of the replica of a map together with the
+  //! position in the changelog it covers, so that a restart only reads the
+  //! changelog entries appended since the file was saved.
+  //!
+  //! The file starts with the MAGIC string and one byte holding the format
+  //! version, followed by the varint encoded epoch, base epoch, changelog
+  //! offset, number of changelog entries, changelog format and number of
+  //! entries, then the length-prefixed id of the map object. The entries
+  //! follow as binary changelog insert records. The file is mapped in memory
+  //! and the records are decoded in place.
+  //----------------------------------------------------------------------------
+  class ReplicaCache
+  {
+  public:
+
+    //! Header magic and current format version
+    static const std::string MAGIC;
+    static const uint8_t VERSION;
+
+    //--------------------------------------------------------------------------
+    //! Position in the changelog covered by the cached replica
+    //--------------------------------------------------------------------------
+    struct Header
+    {
+      std::string mObjId; ///< id of the map object
+      uint64_t mEpoch {0}; ///< epoch of the replica
+      uint64_t mBaseEpoch {0}; ///< epoch of the snapshot the changelog starts from
+      uint64_t mChLogOff {0}; ///< changelog offset covered by the replica
+      uint64_t mChLogNumLines {0}; ///< number of entries in the changelog
+      ChangeLog::Format mChLogFormat {ChangeLog::Format::Binary}; ///< format
+      uint64_t mNumEntries {0}; ///< number of entries in the replica
+    };
+
+    //--------------------------------------------------------------------------
+    //! Constructor
+    //--------------------------------------------------------------------------
+    ReplicaCache();
+
+    //--------------------------------------------------------------------------
+    //! Destructor, unmaps the file
+    //--------------------------------------------------------------------------
+    ~ReplicaCache();
+
+    ReplicaCache(const ReplicaCache& other) = delete;
+    ReplicaCache& operator=(const ReplicaCache& other) = delete;
+
+    //--------------------------------------------------------------------------
+    //! Map a cache file in memory and parse its header
+    //!
+    //! @param path path of the cache file
+    //!
+    //! @return 0 if successful, -ENOENT if there is no such file, -EINVAL if
+    //!         it is not a cache file of a supported version, other negative
+    //!         error otherwise
+    //--------------------------------------------------------------------------
+    int Open(const std::string& path);
+
+    //--------------------------------------------------------------------------
+    //! Get the header of the opened file
+    //--------------------------------------------------------------------------
+    const Header& GetHeader() const
+    {
+      return mHeader;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Get the records of the opened file, valid until the object is
+    //! destroyed
+    //--------------------------------------------------------------------------
+    std::string_view Records() const
+    {
+      return std::string_view(mData + mRecordsOff, mLength - mRecordsOff);
+    }
+
+    //--------------------------------------------------------------------------
+    //! Encode a header
+    //!
+    //! @param hdr header
+    //! @param out output string
+    //--------------------------------------------------------------------------
+    static void EncodeHeader(const Header& hdr, std::string& out);
+
+  private:
+    const char* mData; ///< start of the mapping
+    uint64_t mLength; ///< length of the mapping
+    uint64_t mRecordsOff; ///< offset of the first record
+    Header mHeader; ///< decoded header
+  };
+
+  //----------------------------------------------------------------------------
+  //! Writer of a cache file. The file is written under a temporary name and
+  //! renamed once complete, therefore a crash never leaves a truncated cache
+  //! behind.
+  //----------------------------------------------------------------------------
+  class ReplicaCacheWriter
+  {
+  public:
+    //! Size of the buffered records written at once
+    static const uint64_t BUFFER_SIZE;
+
+    //--------------------------------------------------------------------------
+    //! Constructor
+    //!
+    //! @param path path of the cache file
+    //--------------------------------------------------------------------------
+    ReplicaCacheWriter(const std::string& path);
+
+    //--------------------------------------------------------------------------
+    //! Destructor, drops the temporary file unless committed
+    //--------------------------------------------------------------------------
+    ~ReplicaCacheWriter();
+
+    ReplicaCacheWriter(const ReplicaCacheWriter& other) = delete;
+    ReplicaCacheWriter& operator=(const ReplicaCacheWriter& other) = delete;
+
+    //--------------------------------------------------------------------------
+    //! Create the temporary file and write the header
+    //!
+    //! @param hdr header of the cache
+    //!
+    //! @return true if successful, otherwise false
+    //--------------------------------------------------------------------------
+    bool Open(const ReplicaCache::Header& hdr);
+
+    //--------------------------------------------------------------------------
+    //! Get the buffer the records are appended to
+    //--------------------------------------------------------------------------
+    std::string& Buffer()
+    {
+      return mBuffer;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Write the buffered records once they exceed BUFFER_SIZE
+    //!
+    //! @param force write them whatever their size
+    //!
+    //! @return true if successful, otherwise false
+    //--------------------------------------------------------------------------
+    bool Flush(bool force = false);
+
+    //--------------------------------------------------------------------------
+    //! Write the remaining records, sync the file and rename it to its final
+    //! name
+    //!
+    //! @return true if successful, otherwise false
+    //--------------------------------------------------------------------------
+    bool Commit();
+
+  private:
+    std::string mPath; ///< final path of the file
+    std::string mTmpPath; ///< path the file is written to
+    FILE* mFile; ///< file being written
+    std::string mBuffer; ///< records not yet written
+  };
+}
+
+#endif // __RADOS_REPLICA_CACHE_HH__
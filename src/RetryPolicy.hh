@@ -0,0 +1,236 @@
+//------------------------------------------------------------------------------
+// File: RetryPolicy.hh
+// Author: Elvin Sindrilaru <esindril@cern.ch>
+//------------------------------------------------------------------------------
+
+/*******************************************************************************
+ * RadosVectMap                                                                *
+ * Copyright (C) 2015 CERN/Switzerland                                         *
+ *                                                                             *
+ * This program is free software: you can redistribute it and/or modify        *
+ * it under the terms of the GNU General Public License as published by        *
+ * the Free Software Foundation, either version 3 of the License, or           *
+ * (at your option) any later version.                                         *
+ *                                                                             *
+ * This program is distributed in the hope that it will be useful,             *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                *
+ * GNU General Public License for more details.                                *
+ *                                                                             *
+ * You should have received a copy of the GNU General Public License           *
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.        *
+ ******************************************************************************/
+
+#ifndef __RADOS_RETRY_POLICY_HH__
+#define __RADOS_RETRY_POLICY_HH__
+
+#include <mutex>
+#include <chrono>
+#include <random>
+#include <cstdint>
+#include <algorithm>
+#include <condition_variable>
+
+namespace rados {
+
+  //----------------------------------------------------------------------------
+  //! Policy deciding how the operations which failed because of an epoch
+  //! missmatch are retried. A policy may be shared by several maps and used
+  //! from several threads.
+  //----------------------------------------------------------------------------
+  class retry_policy
+  {
+  public:
+
+    //--------------------------------------------------------------------------
+    //! Destructor
+    //--------------------------------------------------------------------------
+    virtual ~retry_policy() = default;
+
+    //--------------------------------------------------------------------------
+    //! Get the delay before a retry
+    //!
+    //! @param attempt number of the retry, starting from 1
+    //!
+    //! @return time to wait before retrying
+    //--------------------------------------------------------------------------
+    virtual std::chrono::microseconds delay(uint64_t attempt) = 0;
+
+    //--------------------------------------------------------------------------
+    //! Get the maximum number of retries of an operation
+    //!
+    //! @return maximum number of retries, 0 means unlimited
+    //--------------------------------------------------------------------------
+    virtual uint64_t max_retries() const
+    {
+      return 0;
+    }
+  };
+
+  //----------------------------------------------------------------------------
+  //! Retry right away and forever, the default behaviour
+  //----------------------------------------------------------------------------
+  class immediate_retry: public retry_policy
+  {
+  public:
+    std::chrono::microseconds delay(uint64_t attempt) override
+    {
+      (void) attempt;
+      return std::chrono::microseconds(0);
+    }
+  };
+
+  //----------------------------------------------------------------------------
+  //! Bounded exponential backoff with full jitter i.e. the delay is drawn
+  //! uniformly between zero and min(cap, base * 2^(attempt - 1)). The jitter
+  //! spreads the writers which collided so that they do not collide again.
+  //----------------------------------------------------------------------------
+  class exponential_backoff: public retry_policy
+  {
+  public:
+
+    //--------------------------------------------------------------------------
+    //! Constructor
+    //!
+    //! @param base delay bound of the first retry
+    //! @param cap maximum delay bound
+    //! @param max_retries maximum number of retries, 0 means unlimited
+    //--------------------------------------------------------------------------
+    exponential_backoff(std::chrono::microseconds base = std::chrono::microseconds(100),
+                        std::chrono::microseconds cap = std::chrono::microseconds(20000),
+                        uint64_t max_retries = 0):
+      mBase(base), mCap(cap), mMaxRetries(max_retries)
+    {}
+
+    std::chrono::microseconds delay(uint64_t attempt) override
+    {
+      thread_local std::minstd_rand rng {std::random_device()()};
+      uint64_t shift = std::min<uint64_t>(attempt ? attempt - 1 : 0, 30);
+      uint64_t bound = std::min<uint64_t>(mCap.count(), mBase.count() << shift);
+      std::uniform_int_distribution<uint64_t> dist(0, bound);
+      return std::chrono::microseconds(dist(rng));
+    }
+
+    uint64_t max_retries() const override
+    {
+      return mMaxRetries;
+    }
+
+  private:
+    std::chrono::microseconds mBase; ///< delay bound of the first retry
+    std::chrono::microseconds mCap; ///< maximum delay bound
+    uint64_t mMaxRetries; ///< maximum number of retries
+  };
+
+  //----------------------------------------------------------------------------
+  //! Admission control limiting the number of commits running at the same
+  //! time. Shared by the maps of a process which write to the same objects,
+  //! it keeps the writers in excess queued locally instead of letting them
+  //! collide on the epoch check.
+  //----------------------------------------------------------------------------
+  class admission_control
+  {
+  public:
+
+    //--------------------------------------------------------------------------
+    //! Constructor
+    //!
+    //! @param max_inflight maximum number of commits running at the same time
+    //--------------------------------------------------------------------------
+    admission_control(uint64_t max_inflight):
+      mMaxInflight(std::max<uint64_t>(max_inflight, 1)), mInflight(0), mWaits(0)
+    {}
+
+    //--------------------------------------------------------------------------
+    //! Wait for a free slot and take it
+    //--------------------------------------------------------------------------
+    void acquire()
+    {
+      std::unique_lock<std::mutex> lock(mMutex);
+
+      if (mInflight >= mMaxInflight)
+      {
+        mWaits++;
+        mCond.wait(lock, [&]() { return (mInflight < mMaxInflight); });
+      }
+
+      mInflight++;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Give back a slot
+    //--------------------------------------------------------------------------
+    void release()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mInflight--;
+      }
+
+      mCond.notify_one();
+    }
+
+    //--------------------------------------------------------------------------
+    //! Get the number of commits which had to wait for a slot
+    //--------------------------------------------------------------------------
+    uint64_t waits()
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      return mWaits;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Slot held for the lifetime of the object
+    //--------------------------------------------------------------------------
+    class guard
+    {
+    public:
+      guard(admission_control* ctrl):
+        mCtrl(ctrl), mHeld(false)
+      {
+        acquire();
+      }
+
+      ~guard()
+      {
+        release();
+      }
+
+      //! Take the slot again after a release
+      void acquire()
+      {
+        if (mCtrl && !mHeld)
+        {
+          mCtrl->acquire();
+          mHeld = true;
+        }
+      }
+
+      //! Give back the slot early e.g. while backing off
+      void release()
+      {
+        if (mCtrl && mHeld)
+        {
+          mCtrl->release();
+          mHeld = false;
+        }
+      }
+
+      guard(const guard& other) = delete;
+      guard& operator=(const guard& other) = delete;
+
+    private:
+      admission_control* mCtrl; ///< admission control, may be null
+      bool mHeld; ///< slot currently held
+    };
+
+  private:
+    uint64_t mMaxInflight; ///< maximum number of commits at the same time
+    uint64_t mInflight; ///< number of commits running
+    uint64_t mWaits; ///< number of commits which had to wait
+    std::mutex mMutex; ///< mutex protecting the counters
+    std::condition_variable mCond; ///< notified when a slot is freed
+  };
+}
+
+#endif // __RADOS_RETRY_POLICY_HH__
@@ -0,0 +1,578 @@
+//------------------------------------------------------------------------------
+// File: ShardedMap.hh
+// Author: Elvin Sindrilaru <esindril@cern.ch>
+//------------------------------------------------------------------------------
+
+/*******************************************************************************
+ * RadosVectMap                                                                *
+ * Copyright (C) 2015 CERN/Switzerland                                         *
+ *                                                                             *
+ * This program is free software: you can redistribute it and/or modify        *
+ * it under the terms of the GNU General Public License as published by        *
+ * the Free Software Foundation, either version 3 of the License, or           *
+ * (at your option) any later version.                                         *
+ *                                                                             *
+ * This program is distributed in the hope that it will be useful,             *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                *
+ * GNU General Public License for more details.                                *
+ *                                                                             *
+ * You should have received a copy of the GNU General Public License           *
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.        *
+ ******************************************************************************/
+
+#ifndef __RADOS_SHARDED_MAP_HH__
+#define __RADOS_SHARDED_MAP_HH__
+
+#include <mutex>
+#include <future>
+#include <memory>
+#include <vector>
+#include "RadosMap.hh"
+
+namespace rados {
+
+  //----------------------------------------------------------------------------
+  //! Rados map spread over several objects. Keys are hashed to one of the
+  //! shards, each of them being a rados map with its own object, epoch and
+  //! changelog. Writers of different shards never conflict, therefore the
+  //! write throughput scales with the number of shards.
+  //!
+  //! The number of shards is saved in a separate object when the map is
+  //! created and every instance must use the same value. Mutations are
+  //! atomic per shard only, a batch spanning several shards is committed as
+  //! one batch per shard. The object is thread-safe, mutations of different
+  //! shards run concurrently.
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index = std::map<K, V, std::less<>>>
+  class sharded_map
+  {
+  public:
+    typedef typename map<K, V, Index>::mutation mutation_t;
+    typedef typename map<K, V, Index>::key_arg_t key_arg_t;
+
+    //--------------------------------------------------------------------------
+    //! Constructor - the shards are loaded in parallel
+    //!
+    //! @param rados_cluster Rados cluster obj
+    //! @param pool_name name of the pool the map objs will be in
+    //! @param name name of the map
+    //! @param cookie application identifier
+    //! @param num_shards number of objects the map is spread over
+    //! @param persist_obj persist backend objs. (delete or not objs. holding
+    //!        the map)
+    //--------------------------------------------------------------------------
+    sharded_map(librados::Rados& rados_cluster,
+                const std::string& pool_name,
+                const std::string& name,
+                const std::string& cookie,
+                uint64_t num_shards,
+                bool persist_obj = true) noexcept(false);
+
+    //--------------------------------------------------------------------------
+    //! Constructor - the shards are loaded in parallel
+    //!
+    //! @param store object store holding the map objs
+    //! @param name name of the map
+    //! @param cookie application identifier
+    //! @param num_shards number of objects the map is spread over
+    //! @param persist_obj persist backend objs. (delete or not objs. holding
+    //!        the map)
+    //--------------------------------------------------------------------------
+    sharded_map(std::shared_ptr<backend> store,
+                const std::string& name,
+                const std::string& cookie,
+                uint64_t num_shards,
+                bool persist_obj = true) noexcept(false);
+
+    //--------------------------------------------------------------------------
+    //! Copy constructor - disabled
+    //--------------------------------------------------------------------------
+    sharded_map(const sharded_map& other) = delete;
+
+    //--------------------------------------------------------------------------
+    //! Copy assignment operator - disabled
+    //--------------------------------------------------------------------------
+    sharded_map& operator=(const sharded_map& other) = delete;
+
+    //--------------------------------------------------------------------------
+    //! Destructor
+    //--------------------------------------------------------------------------
+    virtual ~sharded_map();
+
+    //--------------------------------------------------------------------------
+    //! Insert new value
+    //!
+    //! @param key key
+    //! @param value value
+    //!
+    //! @return true if the element was inserted, otherwise false
+    //--------------------------------------------------------------------------
+    bool insert(const K& key, const V& value);
+
+    //--------------------------------------------------------------------------
+    //! Erase key from map
+    //!
+    //! @param key key to be erased from the map
+    //!
+    //! @return true if the element was erased, otherwise false
+    //--------------------------------------------------------------------------
+    bool erase(key_arg_t key);
+
+    //--------------------------------------------------------------------------
+    //! Insert several entries, committed as one batch per shard. The shards
+    //! are updated in parallel.
+    //!
+    //! @param entries list of key value pairs to be inserted
+    //!
+    //! @return true if all the batches committed, otherwise false
+    //--------------------------------------------------------------------------
+    bool insert_many(const std::vector<std::pair<K, V>>& entries);
+
+    //--------------------------------------------------------------------------
+    //! Erase several keys, committed as one batch per shard. The shards are
+    //! updated in parallel.
+    //!
+    //! @param keys list of keys to be erased
+    //!
+    //! @return true if all the batches committed, otherwise false
+    //--------------------------------------------------------------------------
+    bool erase_many(const std::vector<K>& keys);
+
+    //--------------------------------------------------------------------------
+    //! Get the value of a key
+    //!
+    //! @param key key to search for
+    //! @param value value of the key if found
+    //!
+    //! @return true if key found, otherwise false
+    //--------------------------------------------------------------------------
+    bool get(key_arg_t key, V& value);
+
+    //--------------------------------------------------------------------------
+    //! Count the elements with a specific key
+    //!
+    //! @param key key to search for
+    //!
+    //! @return 1 if the map contains the key, otherwise 0
+    //--------------------------------------------------------------------------
+    uint64_t count(key_arg_t key);
+
+    //--------------------------------------------------------------------------
+    //! Number of entries in map
+    //!
+    //! @return number of entries in all the shards
+    //--------------------------------------------------------------------------
+    uint64_t size();
+
+    //--------------------------------------------------------------------------
+    //! Get the runtime statistics summed over all the shards, the gauges
+    //! like the epoch are summed as well
+    //!
+    //! @return statistics of the map
+    //--------------------------------------------------------------------------
+    map_stats stats();
+
+    //--------------------------------------------------------------------------
+    //! Get the latency histogram of an operation or stage merged over all
+    //! the shards
+    //!
+    //! @param st operation or stage
+    //! @param reset if true the histograms are emptied
+    //!
+    //! @return content of the histogram, latencies in nanoseconds
+    //--------------------------------------------------------------------------
+    latency_snapshot latency(typename map<K, V, Index>::stage st, bool reset = false);
+
+    //--------------------------------------------------------------------------
+    //! Get the memory used by the local maps summed over all the shards
+    //!
+    //! @return memory used by the local indexes
+    //--------------------------------------------------------------------------
+    index_memory memory_usage();
+
+    //--------------------------------------------------------------------------
+    //! Get number of shards
+    //--------------------------------------------------------------------------
+    uint64_t num_shards() const
+    {
+      return mShards.size();
+    }
+
+    //--------------------------------------------------------------------------
+    //! Get the shard holding a key
+    //!
+    //! @param key key
+    //!
+    //! @return index of the shard
+    //--------------------------------------------------------------------------
+    uint64_t shard_of(key_arg_t key) const;
+
+  private:
+
+    //--------------------------------------------------------------------------
+    //! Shard of the map
+    //--------------------------------------------------------------------------
+    struct shard
+    {
+      std::unique_ptr<map<K, V, Index>> mMap; ///< map holding the keys of the shard
+      std::mutex mMutex; ///< mutex serializing the access to the shard
+    };
+
+    //! Declare class-wide constants
+    static const std::string OBJ_NUM_SHARDS_KEY;
+    static const std::string SHARDS_SUFFIX;
+
+    std::vector<std::unique_ptr<shard>> mShards; ///< shards of the map
+    std::string mObjId; ///< object id holding the number of shards
+    std::shared_ptr<backend> mBackend; ///< object store holding the map
+    bool mPersistObj; ///< persist backend objects
+
+    //--------------------------------------------------------------------------
+    //! Check or save the number of shards of the map
+    //!
+    //! @param num_shards number of shards requested
+    //!
+    //! @return true if number of shards matches, otherwise false
+    //--------------------------------------------------------------------------
+    bool CheckNumShards(uint64_t num_shards);
+
+    //--------------------------------------------------------------------------
+    //! Apply mutations grouped by shard, the shards are updated in parallel
+    //!
+    //! @param batches one batch of mutations per shard
+    //!
+    //! @return true if all the batches committed, otherwise false
+    //--------------------------------------------------------------------------
+    bool ApplyBatches(std::vector<std::vector<mutation_t>>& batches);
+  };
+
+  // Define the constants
+  template <typename K, typename V, typename Index>
+  const std::string sharded_map<K, V, Index>::OBJ_NUM_SHARDS_KEY {"obj_num_shards_key"};
+
+  template <typename K, typename V, typename Index>
+  const std::string sharded_map<K, V, Index>::SHARDS_SUFFIX {".shards"};
+
+  //----------------------------------------------------------------------------
+  // Constructor
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  sharded_map<K, V, Index>::sharded_map(librados::Rados& rados_cluster,
+                                 const std::string& pool_name,
+                                 const std::string& name,
+                                 const std::string& cookie,
+                                 uint64_t num_shards,
+                                 bool persist_obj) noexcept(false):
+    sharded_map(std::make_shared<rados_backend>(rados_cluster, pool_name), name,
+                cookie, num_shards, persist_obj)
+  {}
+
+  //----------------------------------------------------------------------------
+  // Constructor
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  sharded_map<K, V, Index>::sharded_map(std::shared_ptr<backend> store,
+                                 const std::string& name,
+                                 const std::string& cookie,
+                                 uint64_t num_shards,
+                                 bool persist_obj) noexcept(false):
+    mBackend(store),
+    mPersistObj(persist_obj)
+  {
+    if (num_shards == 0)
+      throw RadosContainerException("number of shards must be positive");
+
+    mObjId = "/map/" + name + "/" + cookie + SHARDS_SUFFIX;
+
+    if (!CheckNumShards(num_shards))
+      throw RadosContainerException("number of shards missmatch");
+
+    // Load all the shards in parallel, each of them reads its own object
+    std::vector<std::future<std::unique_ptr<map<K, V, Index>>>> loads;
+
+    for (uint64_t i = 0; i < num_shards; ++i)
+    {
+      std::string shard_name = name + "/shard" + std::to_string(i);
+      loads.push_back(std::async(std::launch::async, [&, shard_name]() {
+            return std::unique_ptr<map<K, V, Index>>(
+              new map<K, V, Index>(mBackend, shard_name, cookie, persist_obj));
+          }));
+    }
+
+    std::exception_ptr error;
+
+    for (auto&& load: loads)
+    {
+      std::unique_ptr<shard> shrd {new shard()};
+
+      try
+      {
+        shrd->mMap = load.get();
+      }
+      catch (...)
+      {
+        error = std::current_exception();
+      }
+
+      mShards.push_back(std::move(shrd));
+    }
+
+    if (error)
+      std::rethrow_exception(error);
+  }
+
+  //----------------------------------------------------------------------------
+  // Destructor
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  sharded_map<K, V, Index>::~sharded_map()
+  {
+    mShards.clear();
+
+    // Note: a destructor must not throw, just report the failure
+    if (!mPersistObj && mBackend->remove(mObjId))
+      fprintf(stderr, "Failed to remove obj=%s\n", mObjId.c_str());
+  }
+
+  //----------------------------------------------------------------------------
+  // Check or save the number of shards of the map
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool sharded_map<K, V, Index>::CheckNumShards(uint64_t num_shards)
+  {
+    // Try to create the object, it fails if the map already exists
+    backend::write_op wr_op;
+    std::map<std::string, librados::bufferlist> omap;
+    omap[OBJ_NUM_SHARDS_KEY].append(std::to_string(num_shards));
+    wr_op.create(true);
+    wr_op.omap_set(omap);
+    int ret = mBackend->operate(mObjId, wr_op);
+
+    if (ret == 0)
+      return true;
+
+    if (ret != -EEXIST)
+    {
+      fprintf(stderr, "Unable to create obj=%s\n", mObjId.c_str());
+      return false;
+    }
+
+    std::set<std::string> set_keys {OBJ_NUM_SHARDS_KEY};
+    omap.clear();
+
+    if (mBackend->omap_get_vals_by_keys(mObjId, set_keys, &omap) ||
+        (omap.find(OBJ_NUM_SHARDS_KEY) == omap.end()))
+    {
+      fprintf(stderr, "Number of shards not found for obj=%s\n", mObjId.c_str());
+      return false;
+    }
+
+    auto buff = omap[OBJ_NUM_SHARDS_KEY];
+
+    if (std::string(buff.c_str(), buff.length()) != std::to_string(num_shards))
+    {
+      fprintf(stderr, "Map has %s shards, requested %lu\n",
+              std::string(buff.c_str(), buff.length()).c_str(), num_shards);
+      return false;
+    }
+
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  // Get the shard holding a key
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  uint64_t sharded_map<K, V, Index>::shard_of(key_arg_t key) const
+  {
+    // FNV-1a hash, it must be the same for all the instances of the map
+    uint64_t hash {14695981039346656037ull};
+
+    for (auto&& c: key)
+    {
+      hash ^= static_cast<uint8_t>(c);
+      hash *= 1099511628211ull;
+    }
+
+    return hash % mShards.size();
+  }
+
+  //----------------------------------------------------------------------------
+  // Insert new value
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool sharded_map<K, V, Index>::insert(const K& key, const V& value)
+  {
+    shard& shrd = *mShards[shard_of(key)];
+    std::lock_guard<std::mutex> lock(shrd.mMutex);
+    return shrd.mMap->insert(key, value).second;
+  }
+
+  //----------------------------------------------------------------------------
+  // Erase key from map
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool sharded_map<K, V, Index>::erase(key_arg_t key)
+  {
+    std::vector<mutation_t> batch;
+    batch.emplace_back(mutation_t::type::erase, K(key));
+    shard& shrd = *mShards[shard_of(key)];
+    std::lock_guard<std::mutex> lock(shrd.mMutex);
+    return (shrd.mMap->apply_batch(batch) && batch.front().mApplied);
+  }
+
+  //----------------------------------------------------------------------------
+  // Insert several entries
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool sharded_map<K, V, Index>::insert_many(const std::vector<std::pair<K, V>>& entries)
+  {
+    std::vector<std::vector<mutation_t>> batches(mShards.size());
+
+    for (auto&& entry: entries)
+      batches[shard_of(entry.first)].emplace_back(
+        mutation_t::type::insert, entry.first, entry.second);
+
+    return ApplyBatches(batches);
+  }
+
+  //----------------------------------------------------------------------------
+  // Erase several keys
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool sharded_map<K, V, Index>::erase_many(const std::vector<K>& keys)
+  {
+    std::vector<std::vector<mutation_t>> batches(mShards.size());
+
+    for (auto&& key: keys)
+      batches[shard_of(key)].emplace_back(mutation_t::type::erase, key);
+
+    return ApplyBatches(batches);
+  }
+
+  //----------------------------------------------------------------------------
+  // Apply mutations grouped by shard
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool sharded_map<K, V, Index>::ApplyBatches(
+    std::vector<std::vector<mutation_t>>& batches)
+  {
+    std::vector<std::future<bool>> commits;
+
+    for (uint64_t i = 0; i < batches.size(); ++i)
+    {
+      if (batches[i].empty())
+        continue;
+
+      commits.push_back(std::async(std::launch::async, [this, &batches, i]() {
+            std::lock_guard<std::mutex> lock(mShards[i]->mMutex);
+            return mShards[i]->mMap->apply_batch(batches[i]);
+          }));
+    }
+
+    bool ret {true};
+
+    for (auto&& commit: commits)
+      ret = commit.get() && ret;
+
+    return ret;
+  }
+
+  //----------------------------------------------------------------------------
+  // Get the value of a key
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  bool sharded_map<K, V, Index>::get(key_arg_t key, V& value)
+  {
+    shard& shrd = *mShards[shard_of(key)];
+    std::lock_guard<std::mutex> lock(shrd.mMutex);
+    auto iter = shrd.mMap->find(key);
+
+    if (iter == shrd.mMap->end())
+      return false;
+
+    value = iter->second;
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  // Count the elements with a specific key
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  uint64_t sharded_map<K, V, Index>::count(key_arg_t key)
+  {
+    shard& shrd = *mShards[shard_of(key)];
+    std::lock_guard<std::mutex> lock(shrd.mMutex);
+    return shrd.mMap->count(key);
+  }
+
+  //----------------------------------------------------------------------------
+  // Number of entries in map
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  uint64_t sharded_map<K, V, Index>::size()
+  {
+    uint64_t sz {0};
+
+    for (auto&& shrd: mShards)
+    {
+      std::lock_guard<std::mutex> lock(shrd->mMutex);
+      sz += shrd->mMap->size();
+    }
+
+    return sz;
+  }
+
+  //----------------------------------------------------------------------------
+  // Get the runtime statistics summed over all the shards
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  map_stats sharded_map<K, V, Index>::stats()
+  {
+    map_stats stats;
+
+    for (auto&& shrd: mShards)
+    {
+      std::lock_guard<std::mutex> lock(shrd->mMutex);
+      stats += shrd->mMap->stats();
+    }
+
+    return stats;
+  }
+
+  //----------------------------------------------------------------------------
+  // Get the latency histogram merged over all the shards
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  latency_snapshot sharded_map<K, V, Index>::latency(typename map<K, V, Index>::stage st,
+                                              bool reset)
+  {
+    latency_snapshot snap;
+
+    // The histograms are lock-free, no need to lock the shards
+    for (auto&& shrd: mShards)
+      snap += shrd->mMap->latency(st, reset);
+
+    return snap;
+  }
+
+  //----------------------------------------------------------------------------
+  // Get the memory used summed over all the shards
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Index>
+  index_memory sharded_map<K, V, Index>::memory_usage()
+  {
+    index_memory usage;
+
+    for (auto&& shrd: mShards)
+    {
+      std::lock_guard<std::mutex> lock(shrd->mMutex);
+      usage += shrd->mMap->memory_usage();
+    }
+
+    return usage;
+  }
+}
+
+#endif // __RADOS_SHARDED_MAP_HH__
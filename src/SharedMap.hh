@@ -0,0 +1,548 @@
+//------------------------------------------------------------------------------
+// File: SharedMap.hh
+// Author: Elvin Sindrilaru <esindril@cern.ch>
+//------------------------------------------------------------------------------
+
+/*******************************************************************************
+ * RadosVectMap                                                                *
+ * Copyright (C) 2015 CERN/Switzerland                                         *
+ *                                                                             *
+ * This program is free software: you can redistribute it and/or modify        *
+ * it under the terms of the GNU General Public License as published by        *
+ * the Free Software Foundation, either version 3 of the License, or           *
+ * (at your option) any later version.                                         *
+ *                                                                             *
+ * This program is distributed in the hope that it will be useful,             *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                *
+ * GNU General Public License for more details.                                *
+ *                                                                             *
+ * You should have received a copy of the GNU General Public License           *
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.        *
+ ******************************************************************************/
+
+#ifndef __RADOS_SHARED_MAP_HH__
+#define __RADOS_SHARED_MAP_HH__
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <vector>
+#include "RadosMap.hh"
+#include "LocalIndex.hh"
+
+namespace rados {
+
+  //----------------------------------------------------------------------------
+  //! Local index readable by any number of threads without locks while one
+  //! thread modifies it, using the left-right technique. It holds two
+  //! instances of the inner index: the readers use the published one while
+  //! the writer modifies the other and logs its changes. Publishing swaps
+  //! the roles, waits for the readers to leave the previous instance, which
+  //! is tracked like epochs with two sets of reader counters, and replays the
+  //! log on it. Readers never wait, the writer waits for the readers which
+  //! entered before the swap i.e. views must be short lived.
+  //!
+  //! The writer side follows the interface of LocalIndex.hh so that it can
+  //! be the index of a rados::map, the readers go through read_view.
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Inner = std::map<K, V, std::less<>>>
+  class left_right_index
+  {
+    //! Counters of the readers inside each of the two versions, on their
+    //! own cache line to keep the readers of different threads apart
+    struct alignas(64) reader_slot
+    {
+      std::atomic<uint64_t> mCount[2];
+    };
+
+    //! Instance of the inner index with the tag it was published with
+    struct instance
+    {
+      Inner mIndex; ///< entries
+      uint64_t mTag {0}; ///< tag given when published e.g. map epoch
+    };
+
+  public:
+    typedef typename Inner::value_type value_type;
+    typedef typename Inner::iterator iterator;
+
+    //! Number of reader counters, the reader threads are spread over them
+    static constexpr size_t NUM_READER_SLOTS = 64;
+
+    //--------------------------------------------------------------------------
+    //! Lock-free access to the published instance. The instance does not
+    //! change for the lifetime of the view, the next publish waits for it
+    //! to go away.
+    //--------------------------------------------------------------------------
+    class read_view
+    {
+    public:
+      explicit read_view(left_right_index& owner):
+        mSlot(owner.Slot())
+      {
+        mVersion = owner.mVersionIdx.load();
+        mSlot.mCount[mVersion].fetch_add(1);
+        mInstance = &owner.mInstances[owner.mReadIdx.load()];
+      }
+
+      ~read_view()
+      {
+        mSlot.mCount[mVersion].fetch_sub(1, std::memory_order_release);
+      }
+
+      read_view(const read_view& other) = delete;
+      read_view& operator=(const read_view& other) = delete;
+
+      //! Get the published instance, it must only be read
+      Inner& index() const { return mInstance->mIndex; }
+
+      //! Get the tag the instance was published with
+      uint64_t tag() const { return mInstance->mTag; }
+
+      iterator begin() const { return mInstance->mIndex.begin(); }
+      iterator end() const { return mInstance->mIndex.end(); }
+      size_t size() const { return mInstance->mIndex.size(); }
+
+      template <typename Q>
+      iterator find(const Q& key) const
+      {
+        return index_find<K>(mInstance->mIndex, key);
+      }
+
+      template <typename Q>
+      size_t count(const Q& key) const
+      {
+        return (find(key) == end() ? 0 : 1);
+      }
+
+    private:
+      reader_slot& mSlot; ///< counters of the reader thread
+      uint64_t mVersion; ///< version the reader registered with
+      instance* mInstance; ///< instance read
+    };
+
+    left_right_index():
+      mSlots(new reader_slot[NUM_READER_SLOTS]), mReadIdx(0), mVersionIdx(0),
+      mResync(false), mDirty(false), mPublished(0)
+    {
+      for (size_t i = 0; i < NUM_READER_SLOTS; ++i)
+        mSlots[i].mCount[0] = mSlots[i].mCount[1] = 0;
+    }
+
+    left_right_index(const left_right_index& other) = delete;
+    left_right_index& operator=(const left_right_index& other) = delete;
+
+    // Writer side, the changes go to the instance not read
+
+    iterator begin() { return Write().begin(); }
+    iterator end() { return Write().end(); }
+    size_t size() const { return mInstances[1 - mReadIdx.load()].mIndex.size(); }
+
+    void clear()
+    {
+      Write().clear();
+      mOps.clear();
+      mResync = mDirty = true;
+    }
+
+    template <typename Q>
+    auto find(const Q& key) -> decltype(std::declval<Inner&>().find(key))
+    {
+      return Write().find(key);
+    }
+
+    template <typename Q>
+    auto count(const Q& key) -> decltype(std::declval<Inner&>().count(key))
+    {
+      return Write().count(key);
+    }
+
+    std::pair<iterator, bool> insert(const std::pair<K, V>& entry)
+    {
+      auto ret = Write().insert(entry);
+
+      if (ret.second)
+        Log(op_type::assign, entry.first, entry.second);
+
+      return ret;
+    }
+
+    std::pair<iterator, bool> insert_or_assign(const K& key, V&& value)
+    {
+      Log(op_type::assign, key, value);
+      return Write().insert_or_assign(key, std::move(value));
+    }
+
+    size_t erase(const K& key)
+    {
+      size_t num = Write().erase(key);
+
+      if (num)
+        Log(op_type::erase, key, V());
+
+      return num;
+    }
+
+    void erase(iterator iter)
+    {
+      Log(op_type::erase, K(iter->first), V());
+      Write().erase(iter);
+    }
+
+    //--------------------------------------------------------------------------
+    //! Make the changes visible to the readers. Waits for the readers of the
+    //! previously published instance to leave, then brings it up to date.
+    //! Must be called by the writer.
+    //!
+    //! @param tag tag of the new version e.g. map epoch
+    //--------------------------------------------------------------------------
+    void publish(uint64_t tag = 0)
+    {
+      uint64_t widx = 1 - mReadIdx.load();
+
+      if (!mDirty && (mInstances[1 - widx].mTag == tag))
+        return;
+
+      mInstances[widx].mTag = tag;
+      mReadIdx.store(widx);
+      // New readers go to the fresh instance, wait for the ones which might
+      // still read the previous one
+      uint64_t version = mVersionIdx.load();
+      WaitForReaders(1 - version);
+      mVersionIdx.store(1 - version);
+      WaitForReaders(version);
+      Inner& stale = mInstances[1 - widx].mIndex;
+
+      if (mResync)
+      {
+        stale.clear();
+
+        for (auto&& entry: mInstances[widx].mIndex)
+          (void) stale.insert_or_assign(K(entry.first), V(entry.second));
+      }
+      else
+      {
+        for (auto&& op: mOps)
+        {
+          if (op.mType == op_type::assign)
+            (void) stale.insert_or_assign(op.mKey, std::move(op.mValue));
+          else
+            (void) stale.erase(op.mKey);
+        }
+      }
+
+      mInstances[1 - widx].mTag = tag;
+      mOps.clear();
+      mResync = mDirty = false;
+      mPublished.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    //--------------------------------------------------------------------------
+    //! Get the number of versions published
+    //--------------------------------------------------------------------------
+    uint64_t num_published() const
+    {
+      return mPublished.load(std::memory_order_relaxed);
+    }
+
+    //--------------------------------------------------------------------------
+    //! Get the memory used by both instances, must be called by the writer
+    //--------------------------------------------------------------------------
+    index_memory memory_usage() const
+    {
+      index_memory usage = index_memory_usage(mInstances[0].mIndex);
+      usage += index_memory_usage(mInstances[1].mIndex);
+      return usage;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Release the memory no longer used by the instance written, the other
+    //! one gets the same treatment once it is rebuilt
+    //--------------------------------------------------------------------------
+    bool reclaim()
+    {
+      return index_reclaim(Write());
+    }
+
+  private:
+    enum class op_type { assign, erase };
+
+    //! Change not yet applied to the published instance
+    struct op
+    {
+      op_type mType;
+      K mKey;
+      V mValue;
+    };
+
+    std::unique_ptr<reader_slot[]> mSlots; ///< reader counters
+    instance mInstances[2]; ///< the two copies of the index
+    std::atomic<uint64_t> mReadIdx; ///< instance used by the readers
+    std::atomic<uint64_t> mVersionIdx; ///< counters new readers register in
+    std::vector<op> mOps; ///< changes to replay on the other instance
+    bool mResync; ///< the other instance is rebuilt instead of replaying
+    bool mDirty; ///< changes not yet published
+    std::atomic<uint64_t> mPublished; ///< number of versions published
+
+    //--------------------------------------------------------------------------
+    //! Get the instance modified by the writer
+    //--------------------------------------------------------------------------
+    Inner& Write()
+    {
+      return mInstances[1 - mReadIdx.load(std::memory_order_relaxed)].mIndex;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Record a change for the other instance. Once the log outgrows the
+    //! index rebuilding the other instance is cheaper than replaying.
+    //--------------------------------------------------------------------------
+    void Log(op_type type, const K& key, const V& value)
+    {
+      mDirty = true;
+
+      if (mResync)
+        return;
+
+      if (mOps.size() > Write().size() + 1024)
+      {
+        mOps.clear();
+        mOps.shrink_to_fit();
+        mResync = true;
+        return;
+      }
+
+      mOps.push_back(op {type, key, value});
+    }
+
+    //--------------------------------------------------------------------------
+    //! Get the counters of the calling thread
+    //--------------------------------------------------------------------------
+    reader_slot& Slot()
+    {
+      static std::atomic<size_t> next_slot {0};
+      static thread_local size_t slot = next_slot.fetch_add(1) % NUM_READER_SLOTS;
+      return mSlots[slot];
+    }
+
+    //--------------------------------------------------------------------------
+    //! Wait until no reader is registered in the given version
+    //--------------------------------------------------------------------------
+    void WaitForReaders(uint64_t version)
+    {
+      for (size_t i = 0; i < NUM_READER_SLOTS; ++i)
+      {
+        while (mSlots[i].mCount[version].load() != 0)
+          std::this_thread::yield();
+      }
+    }
+  };
+
+  //----------------------------------------------------------------------------
+  //! The left-right index iterates like its inner index
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Inner>
+  struct index_traits<left_right_index<K, V, Inner>>
+  {
+    static constexpr bool ordered = index_traits<Inner>::ordered;
+  };
+
+  template <typename K, typename V, typename Inner>
+  index_memory index_memory_usage(const left_right_index<K, V, Inner>& index)
+  {
+    return index.memory_usage();
+  }
+
+  template <typename K, typename V, typename Inner>
+  bool index_reclaim(left_right_index<K, V, Inner>& index)
+  {
+    return index.reclaim();
+  }
+
+  //----------------------------------------------------------------------------
+  //! Rados map shared by several threads. Lookups and iterations never take
+  //! a lock and never wait for the backend: they read the version of the
+  //! local map published after the last mutation or update, see
+  //! left_right_index. Mutations and updates are serialized by a mutex and
+  //! publish a new version once done, therefore the readers only see
+  //! committed changes.
+  //!
+  //! The reads are at the local consistency level, sync() catches up with
+  //! the remote changelog e.g. from a background thread.
+  //----------------------------------------------------------------------------
+  template <typename K, typename V, typename Inner = std::map<K, V, std::less<>>>
+  class shared_map
+  {
+  public:
+    typedef left_right_index<K, V, Inner> index_t;
+    typedef map<K, V, index_t> map_t;
+    typedef typename map_t::mutation mutation_t;
+    typedef typename map_t::key_arg_t key_arg_t;
+    typedef typename index_t::read_view view_t;
+
+    //--------------------------------------------------------------------------
+    //! Constructor
+    //!
+    //! @param rados_cluster Rados cluster obj
+    //! @param pool_name name of the pool the map obj will be in
+    //! @param name name of the map
+    //! @param cookie application identifier
+    //! @param persist_obj persist backend obj. (delete or not obj. holding
+    //!        the map)
+    //--------------------------------------------------------------------------
+    shared_map(librados::Rados& rados_cluster,
+               const std::string& pool_name,
+               const std::string& name,
+               const std::string& cookie,
+               bool persist_obj = true) noexcept(false):
+      shared_map(std::make_shared<rados_backend>(rados_cluster, pool_name), name,
+                 cookie, persist_obj)
+    {}
+
+    //--------------------------------------------------------------------------
+    //! Constructor
+    //!
+    //! @param store object store holding the map obj
+    //! @param name name of the map
+    //! @param cookie application identifier
+    //! @param persist_obj persist backend obj. (delete or not obj. holding
+    //!        the map)
+    //--------------------------------------------------------------------------
+    shared_map(std::shared_ptr<backend> store,
+               const std::string& name,
+               const std::string& cookie,
+               bool persist_obj = true) noexcept(false):
+      mMap(new map_t(store, name, cookie, persist_obj)),
+      mIndex(mMap->local_index())
+    {
+      mIndex.publish(mMap->epoch());
+    }
+
+    shared_map(const shared_map& other) = delete;
+    shared_map& operator=(const shared_map& other) = delete;
+
+    // Writers, serialized
+
+    //--------------------------------------------------------------------------
+    //! Insert new value
+    //!
+    //! @return true if the element was inserted, otherwise false
+    //--------------------------------------------------------------------------
+    bool insert(K key, V value)
+    {
+      return write([&](map_t& mp) {
+          return mp.insert(std::move(key), std::move(value)).second;
+        });
+    }
+
+    //--------------------------------------------------------------------------
+    //! Erase key from map
+    //!
+    //! @return true if the element was erased, otherwise false
+    //--------------------------------------------------------------------------
+    bool erase(key_arg_t key)
+    {
+      std::vector<mutation_t> batch;
+      batch.emplace_back(mutation_t::type::erase, K(key));
+      return (apply_batch(batch) && batch.front().mApplied);
+    }
+
+    //--------------------------------------------------------------------------
+    //! Apply a batch of mutations atomically, see map::apply_batch
+    //--------------------------------------------------------------------------
+    bool apply_batch(std::vector<mutation_t>& batch)
+    {
+      return write([&](map_t& mp) { return mp.apply_batch(batch); });
+    }
+
+    //--------------------------------------------------------------------------
+    //! Catch up with the remote changelog and publish the result
+    //!
+    //! @param level consistency level of the update, the default one checks
+    //!        the remote epoch
+    //--------------------------------------------------------------------------
+    void sync(typename map_t::consistency level = map_t::consistency::linearizable)
+    {
+      write([&](map_t& mp) { return mp.size(level); });
+    }
+
+    //--------------------------------------------------------------------------
+    //! Run a function on the underlying map under the writer lock and publish
+    //! the outcome, for the operations without a wrapper
+    //!
+    //! @param func function taking the map
+    //!
+    //! @return value returned by the function
+    //--------------------------------------------------------------------------
+    template <typename F>
+    auto write(F&& func) -> decltype(func(std::declval<map_t&>()))
+    {
+      std::lock_guard<std::mutex> lock(mWriteMutex);
+      struct publisher
+      {
+        ~publisher() { mOwner.mIndex.publish(mOwner.mMap->epoch()); }
+        shared_map& mOwner;
+      } pub {*this};
+      return func(*mMap);
+    }
+
+    // Readers, lock-free
+
+    //--------------------------------------------------------------------------
+    //! Get a view of the published version, to be kept short
+    //--------------------------------------------------------------------------
+    view_t read()
+    {
+      return view_t(mIndex);
+    }
+
+    //--------------------------------------------------------------------------
+    //! Get the value of a key
+    //!
+    //! @return true if key found, otherwise false
+    //--------------------------------------------------------------------------
+    bool get(key_arg_t key, V& value)
+    {
+      view_t view(mIndex);
+      auto iter = view.find(key);
+
+      if (iter == view.end())
+        return false;
+
+      value = V(iter->second);
+      return true;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Count the elements with a specific key
+    //--------------------------------------------------------------------------
+    uint64_t count(key_arg_t key)
+    {
+      return read().count(key);
+    }
+
+    //--------------------------------------------------------------------------
+    //! Number of entries in the published version
+    //--------------------------------------------------------------------------
+    uint64_t size()
+    {
+      return read().size();
+    }
+
+    //--------------------------------------------------------------------------
+    //! Get the epoch of the published version
+    //--------------------------------------------------------------------------
+    uint64_t epoch()
+    {
+      return read().tag();
+    }
+
+  private:
+    std::mutex mWriteMutex; ///< serializes the writers
+    std::unique_ptr<map_t> mMap; ///< map updated by the writers
+    index_t& mIndex; ///< local index of the map, read by the readers
+  };
+}
+
+#endif // __RADOS_SHARED_MAP_HH__
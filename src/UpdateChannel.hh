@@ -0,0 +1,294 @@
+//------------------------------------------------------------------------------
+// File: UpdateChannel.hh
+// Author: Elvin Sindrilaru <esindril@cern.ch>
+//------------------------------------------------------------------------------
+
+/*******************************************************************************
+ * RadosVectMap                                                                *
+ * Copyright (C) 2015 CERN/Switzerland                                         *
+ *                                                                             *
+ * This program is free software: you can redistribute it and/or modify        *
+ * it under the terms of the GNU General Public License as published by        *
+ * the Free Software Foundation, either version 3 of the License, or           *
+ * (at your option) any later version.                                         *
+ *                                                                             *
+ * This program is distributed in the hope that it will be useful,             *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the                *
+ * GNU General Public License for more details.                                *
+ *                                                                             *
+ * You should have received a copy of the GNU General Public License           *
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.        *
+ ******************************************************************************/
+
+#ifndef __RADOS_UPDATE_CHANNEL_HH__
+#define __RADOS_UPDATE_CHANNEL_HH__
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <functional>
+#include <rados/librados.hpp>
+
+namespace rados {
+
+  //----------------------------------------------------------------------------
+  //! Channel used by the writers of a map to announce the epoch reached
+  //! after each successful append and by the readers to be notified about
+  //! it. Notifications are best effort, a lost one only delays the refresh
+  //! until the next one or the next conflict.
+  //----------------------------------------------------------------------------
+  class update_channel
+  {
+  public:
+    //! Callback receiving the announced epoch
+    typedef std::function<void(uint64_t)> callback_t;
+
+    //--------------------------------------------------------------------------
+    //! Destructor
+    //--------------------------------------------------------------------------
+    virtual ~update_channel() = default;
+
+    //--------------------------------------------------------------------------
+    //! Subscribe to the updates of an object
+    //!
+    //! @param obj_id object id
+    //! @param cb callback called with the announced epoch, possibly from a
+    //!        different thread
+    //! @param handle handle of the subscription
+    //!
+    //! @return true if successful, otherwise false
+    //--------------------------------------------------------------------------
+    virtual bool subscribe(const std::string& obj_id, callback_t cb,
+                           uint64_t& handle) = 0;
+
+    //--------------------------------------------------------------------------
+    //! Cancel a subscription. No callback is running or called once it
+    //! returns.
+    //!
+    //! @param handle handle of the subscription
+    //--------------------------------------------------------------------------
+    virtual void unsubscribe(uint64_t handle) = 0;
+
+    //--------------------------------------------------------------------------
+    //! Announce a new epoch of an object without waiting for the subscribers
+    //!
+    //! @param obj_id object id
+    //! @param epoch epoch reached by the object
+    //--------------------------------------------------------------------------
+    virtual void publish(const std::string& obj_id, uint64_t epoch) = 0;
+  };
+
+  //----------------------------------------------------------------------------
+  //! Update channel based on the RADOS watch/notify mechanism
+  //----------------------------------------------------------------------------
+  class rados_channel: public update_channel
+  {
+  public:
+
+    //--------------------------------------------------------------------------
+    //! Constructor
+    //!
+    //! @param io_ctx io context of the pool holding the objects
+    //--------------------------------------------------------------------------
+    rados_channel(const librados::IoCtx& io_ctx):
+      mIoCtx(io_ctx)
+    {}
+
+    //--------------------------------------------------------------------------
+    //! Destructor
+    //--------------------------------------------------------------------------
+    virtual ~rados_channel()
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+
+      for (auto&& watch: mWatches)
+        (void) mIoCtx.unwatch2(watch.first);
+
+      WatchFlush();
+    }
+
+    //--------------------------------------------------------------------------
+    //! Subscribe to the updates of an object
+    //--------------------------------------------------------------------------
+    bool subscribe(const std::string& obj_id, callback_t cb,
+                   uint64_t& handle) override
+    {
+      std::unique_ptr<watcher> ctx {new watcher(mIoCtx, obj_id, cb)};
+
+      if (mIoCtx.watch2(obj_id, &handle, ctx.get()))
+      {
+        fprintf(stderr, "Failed to watch obj=%s\n", obj_id.c_str());
+        return false;
+      }
+
+      std::lock_guard<std::mutex> lock(mMutex);
+      mWatches[handle] = std::move(ctx);
+      return true;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Cancel a subscription
+    //--------------------------------------------------------------------------
+    void unsubscribe(uint64_t handle) override
+    {
+      std::unique_ptr<watcher> ctx;
+
+      {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto iter = mWatches.find(handle);
+
+        if (iter == mWatches.end())
+          return;
+
+        (void) mIoCtx.unwatch2(handle);
+        ctx = std::move(iter->second);
+        mWatches.erase(iter);
+      }
+
+      // The watcher goes away once its queued notifications are delivered
+      WatchFlush();
+    }
+
+    //--------------------------------------------------------------------------
+    //! Announce a new epoch of an object
+    //--------------------------------------------------------------------------
+    void publish(const std::string& obj_id, uint64_t epoch) override
+    {
+      librados::bufferlist bl;
+      bl.append(std::to_string(epoch));
+      librados::AioCompletion* comp = librados::Rados::aio_create_completion();
+
+      if (mIoCtx.aio_notify(obj_id, comp, bl, NOTIFY_TIMEOUT_MS, nullptr))
+        fprintf(stderr, "Failed to notify obj=%s\n", obj_id.c_str());
+
+      // The completion is kept alive by the operation in flight
+      comp->release();
+    }
+
+  private:
+    //! Time to wait for the watchers to acknowledge a notification
+    static constexpr uint64_t NOTIFY_TIMEOUT_MS {5000};
+
+    //--------------------------------------------------------------------------
+    //! Wait for the callbacks of the notifications already queued, unwatch2
+    //! does not wait for them
+    //--------------------------------------------------------------------------
+    void WatchFlush()
+    {
+      librados::Rados cluster;
+      librados::Rados::from_ioctx(mIoCtx, cluster);
+
+      if (cluster.watch_flush())
+        fprintf(stderr, "Failed to flush the watch callbacks\n");
+    }
+
+    //--------------------------------------------------------------------------
+    //! Watch context forwarding the notifications to the callback
+    //--------------------------------------------------------------------------
+    class watcher: public librados::WatchCtx2
+    {
+    public:
+      watcher(librados::IoCtx& io_ctx, const std::string& obj_id, callback_t cb):
+        mIoCtx(io_ctx), mObjId(obj_id), mCallback(cb)
+      {}
+
+      void handle_notify(uint64_t notify_id, uint64_t cookie,
+                         uint64_t notifier_id, librados::bufferlist& bl) override
+      {
+        (void) notifier_id;
+        std::string sepoch(bl.c_str(), bl.length());
+        librados::bufferlist reply;
+        mIoCtx.notify_ack(mObjId, notify_id, cookie, reply);
+
+        try
+        {
+          mCallback(std::stoull(sepoch));
+        }
+        catch (const std::exception& e)
+        {
+          fprintf(stderr, "Malformed notification for obj=%s\n", mObjId.c_str());
+        }
+      }
+
+      void handle_error(uint64_t cookie, int err) override
+      {
+        (void) cookie;
+        fprintf(stderr, "Watch error=%i for obj=%s\n", err, mObjId.c_str());
+      }
+
+    private:
+      librados::IoCtx& mIoCtx; ///< io context of the channel
+      std::string mObjId; ///< watched object id
+      callback_t mCallback; ///< callback of the subscriber
+    };
+
+    librados::IoCtx mIoCtx; ///< io context
+    std::map<uint64_t, std::unique_ptr<watcher>> mWatches; ///< active watches
+    std::mutex mMutex; ///< mutex protecting the watches
+  };
+
+  //----------------------------------------------------------------------------
+  //! In-process update channel, for maps living in the same process and for
+  //! testing. Notifications are delivered synchronously by the publisher.
+  //----------------------------------------------------------------------------
+  class local_channel: public update_channel
+  {
+  public:
+
+    //--------------------------------------------------------------------------
+    //! Constructor
+    //--------------------------------------------------------------------------
+    local_channel():
+      mNextHandle(1)
+    {}
+
+    //--------------------------------------------------------------------------
+    //! Subscribe to the updates of an object
+    //--------------------------------------------------------------------------
+    bool subscribe(const std::string& obj_id, callback_t cb,
+                   uint64_t& handle) override
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      handle = mNextHandle++;
+      mSubscribers[handle] = std::make_pair(obj_id, cb);
+      return true;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Cancel a subscription
+    //--------------------------------------------------------------------------
+    void unsubscribe(uint64_t handle) override
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      (void) mSubscribers.erase(handle);
+    }
+
+    //--------------------------------------------------------------------------
+    //! Announce a new epoch of an object
+    //--------------------------------------------------------------------------
+    void publish(const std::string& obj_id, uint64_t epoch) override
+    {
+      // Callbacks only queue the notification, call them with the lock held
+      // so that they do not run after unsubscribe returned
+      std::lock_guard<std::mutex> lock(mMutex);
+
+      for (auto&& sub: mSubscribers)
+      {
+        if (sub.second.first == obj_id)
+          sub.second.second(epoch);
+      }
+    }
+
+  private:
+    uint64_t mNextHandle; ///< next subscription handle
+    //! Subscribers indexed by handle
+    std::map<uint64_t, std::pair<std::string, callback_t>> mSubscribers;
+    std::mutex mMutex; ///< mutex protecting the subscribers
+  };
+}
+
+#endif // __RADOS_UPDATE_CHANNEL_HH__
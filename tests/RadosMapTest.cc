@@ -44,28 +44,44 @@ auto timethis(std::function<void()> exec_func)
 //------------------------------------------------------------------------------
 // Constructor
 //------------------------------------------------------------------------------
-RadosMapTest::RadosMapTest()
+RadosMapTest::RadosMapTest():
+  mConnected(false)
 {
   ReadConfiguration();
+  std::chrono::microseconds latency(std::stoull(mConfig["backend_latency_us"].empty() ?
+                                                "0" : mConfig["backend_latency_us"]));
 
-  if (mCluster.init(mConfig["user"].c_str()))
+  if (mConfig["backend"] == "memory")
   {
-    std::string msg = "Error while initializing cluster for user ";
-    msg += mConfig["user"];
-    throw std::invalid_argument(msg);
+    mBackend = std::make_shared<rados::memory_backend>(latency);
   }
+  else if (mConfig["backend"] == "file")
+  {
+    mBackend = std::make_shared<rados::file_backend>(mConfig["backend_dir"], latency);
+  }
+  else
+  {
+    if (mCluster.init(mConfig["user"].c_str()))
+    {
+      std::string msg = "Error while initializing cluster for user ";
+      msg += mConfig["user"];
+      throw std::invalid_argument(msg);
+    }
+
+    if (mCluster.conf_read_file(mConfig["ceph_config"].c_str()))
+      throw std::invalid_argument("Error while reading configuration file");
 
-  if (mCluster.conf_read_file(mConfig["ceph_config"].c_str()))
-    throw std::invalid_argument("Error while reading configuration file");
+    if (mCluster.connect())
+      throw std::runtime_error("Cannot connect to cluster");
 
-  if (mCluster.connect())
-    throw std::runtime_error("Cannot connect to cluster");
+    mConnected = true;
+    mBackend = std::make_shared<rados::rados_backend>(mCluster, mConfig["pool"]);
+  }
 
   auto init_duration = timethis([&] {
       try
       {
-        mMapSS = new rados::map<std::string, std::string>(mCluster,
-                                                          mConfig["pool"],
+        mMapSS = new rados::map<std::string, std::string>(mBackend,
                                                           mConfig["obj_name"],
                                                           mConfig["cookie"]);
       }
@@ -86,7 +102,10 @@ RadosMapTest::RadosMapTest()
 RadosMapTest::~RadosMapTest()
 {
   delete mMapSS;
-  mCluster.shutdown();
+  mBackend.reset();
+
+  if (mConnected)
+    mCluster.shutdown();
 }
 
 //------------------------------------------------------------------------------
@@ -24,9 +24,13 @@
 #ifndef __RADOS_MAP_TEST_HH__
 #define __RADOS_MAP_TEST_HH__
 
+#include <cmath>
+#include <numeric>
+#include <functional>
 #include <gtest/gtest.h>
 #include <rados/librados.hpp>
 #include "src/RadosMap.hh"
+#include "src/Backend.hh"
 
 #define ENV_CONF_FILE "TEST_CONF_FILE"
 
@@ -74,7 +78,9 @@ protected:
 
   void TearDown();
 
-  librados::Rados mCluster; ///< rados cluster object
+  librados::Rados mCluster; ///< rados cluster object, if the backend is rados
+  bool mConnected; ///< connected to the rados cluster
+  std::shared_ptr<rados::backend> mBackend; ///< object store used by the tests
   std::map<std::string, std::string> mConfig; ///< map with the config values
   rados::map<std::string, std::string>* mMapSS; ///< map used for testing
 
@@ -26,8 +26,19 @@
 #include <algorithm>
 #include <type_traits>
 #include <functional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <random>
+#include <filesystem>
+#include <fstream>
+#include <malloc.h>
+#include <sys/resource.h>
 #include <gtest/gtest.h>
 #include "RadosMapTest.hh"
+#include "src/GroupCommit.hh"
+#include "src/ShardedMap.hh"
+#include "src/SharedMap.hh"
 
 
 //------------------------------------------------------------------------------
@@ -47,7 +58,7 @@ TEST_F(RadosMapTest, DISABLED_CheckTemplateParam)
 {
   try
   {
-    rados::map<std::string, int> unsupp_map(mCluster, mConfig["pool"],
+    rados::map<std::string, int> unsupp_map(mBackend,
                                             mConfig["obj_name"], "cookie1", false);
   }
   catch (rados::RadosContainerException& e)
@@ -57,7 +68,7 @@ TEST_F(RadosMapTest, DISABLED_CheckTemplateParam)
 
   try
   {
-    rados::map<int, std::string> unsupp_map(mCluster, mConfig["pool"],
+    rados::map<int, std::string> unsupp_map(mBackend,
                                             mConfig["obj_name"], "cookie1", false);
   }
   catch (rados::RadosContainerException& e)
@@ -67,7 +78,7 @@ TEST_F(RadosMapTest, DISABLED_CheckTemplateParam)
 
   try
   {
-    rados::map<bool, std::string> unsupp_map(mCluster, mConfig["pool"],
+    rados::map<bool, std::string> unsupp_map(mBackend,
                                              mConfig["obj_name"], "cookie1", false);
   }
   catch (rados::RadosContainerException& e)
@@ -133,6 +144,2284 @@ TEST_F(RadosMapTest, DISABLED_EraseFromMap)
             info_stat.first, info_stat.second);
 }
 
+//------------------------------------------------------------------------------
+// Insert and erase a batch of elements in one atomic operation
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, BatchInsertErase)
+{
+  int num_entries {100};
+  std::vector<std::pair<std::string, std::string>> entries;
+  std::vector<std::string> keys;
+
+  for (int i = 0; i < num_entries; ++i)
+  {
+    keys.push_back("batch_key_" + std::to_string(i));
+    entries.push_back(std::make_pair(keys.back(),
+                                     "batch_value_" + std::to_string(i)));
+  }
+
+  auto init_size = mMapSS->size();
+  ASSERT_TRUE(mMapSS->insert_many(entries));
+  ASSERT_EQ(init_size + num_entries, mMapSS->size());
+
+  for (auto&& entry: entries)
+  {
+    auto it = mMapSS->find(entry.first);
+    ASSERT_TRUE(it != mMapSS->end());
+    ASSERT_EQ(entry.second, it->second);
+  }
+
+  // Mixed batch - inserting an existing key or erasing a missing one leaves
+  // the map unchanged
+  using mutation = rados::map<std::string, std::string>::mutation;
+  std::vector<mutation> batch;
+  batch.emplace_back(mutation::type::insert, keys[0], "other_value");
+  batch.emplace_back(mutation::type::erase, keys[1]);
+  batch.emplace_back(mutation::type::erase, keys[1]);
+  batch.emplace_back(mutation::type::insert, keys[1], "new_value");
+  ASSERT_TRUE(mMapSS->apply_batch(batch));
+  ASSERT_FALSE(batch[0].mApplied);
+  ASSERT_TRUE(batch[1].mApplied);
+  ASSERT_FALSE(batch[2].mApplied);
+  ASSERT_TRUE(batch[3].mApplied);
+  ASSERT_EQ("batch_value_0", mMapSS->find(keys[0])->second);
+  ASSERT_EQ("new_value", mMapSS->find(keys[1])->second);
+
+  ASSERT_TRUE(mMapSS->erase_many(keys));
+  ASSERT_EQ(init_size, mMapSS->size());
+
+  for (auto&& key: keys)
+    ASSERT_EQ(0, mMapSS->count(key));
+}
+
+//------------------------------------------------------------------------------
+// Insert throughput depending on the size of the batch
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, DISABLED_BatchInsertThroughput)
+{
+  int num_entries {10000};
+
+  for (int batch_size: {1, 10, 100, 1000, 10000})
+  {
+    std::vector<std::string> keys;
+    std::vector<std::pair<std::string, std::string>> entries;
+
+    auto duration = timethis([&] {
+        for (int i = 0; i < num_entries; ++i)
+        {
+          keys.push_back("tput_key_" + std::to_string(i));
+          entries.push_back(std::make_pair(keys.back(), "tput_value"));
+
+          if ((int)entries.size() == batch_size)
+          {
+            ASSERT_TRUE(mMapSS->insert_many(entries));
+            entries.clear();
+          }
+        }
+      });
+
+    fprintf(stdout, "Batch insert batch_size=%i, num_entries=%i, "
+            "throughput=%f keys/sec\n", batch_size, num_entries,
+            num_entries / (duration / 1e9));
+    ASSERT_TRUE(mMapSS->erase_many(keys));
+  }
+}
+
+//------------------------------------------------------------------------------
+// Pipelined asynchronous inserts and erases
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, AsyncInsertErase)
+{
+  int num_entries {500};
+  std::string obj_name = mConfig["obj_name"] + "_async";
+  rados::map<std::string, std::string> map_async(mBackend,
+                                                 obj_name, mConfig["cookie"],
+                                                 false, true);
+  rados::map<std::string, std::string> map_sync(mBackend,
+                                                obj_name, mConfig["cookie"]);
+  std::vector<std::shared_future<bool>> futures;
+
+  for (int i = 0; i < num_entries; ++i)
+  {
+    futures.push_back(map_async.aio_insert("async_key_" + std::to_string(i),
+                                           "async_value_" + std::to_string(i)));
+
+    // Concurrent writer forcing the pipeline to be resubmitted
+    if (i == num_entries / 2)
+    {
+      ASSERT_TRUE(map_sync.insert("sync_key", "sync_value").second);
+    }
+  }
+
+  // Inserting an existing key completes right away
+  auto dup = map_async.aio_insert("async_key_0", "other_value");
+  ASSERT_EQ(std::future_status::ready, dup.wait_for(std::chrono::seconds(0)));
+  ASSERT_FALSE(dup.get());
+
+  ASSERT_TRUE(map_async.flush());
+
+  for (auto&& future: futures)
+    ASSERT_TRUE(future.get());
+
+  for (int i = 0; i < num_entries; i += 2)
+    futures[i] = map_async.aio_erase("async_key_" + std::to_string(i));
+
+  ASSERT_TRUE(map_async.flush());
+
+  for (int i = 0; i < num_entries; i += 2)
+    ASSERT_TRUE(futures[i].get());
+
+  // A fresh instance sees the same contents
+  rados::map<std::string, std::string> map_check(mBackend,
+                                                 obj_name, mConfig["cookie"]);
+  ASSERT_EQ(map_async.size(), map_check.size());
+  ASSERT_EQ(num_entries / 2 + 1, (int)map_check.size());
+
+  for (auto&& elem: map_async)
+  {
+    auto it = map_check.find(elem.first);
+    ASSERT_TRUE(it != map_check.end());
+    ASSERT_EQ(elem.second, it->second);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Pipelined mutations racing with the compactions they trigger
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, AsyncCompaction)
+{
+  typedef rados::map<std::string, std::string> map_t;
+  auto store = std::make_shared<rados::memory_backend>(
+    std::chrono::microseconds(200));
+  std::string obj_name = mConfig["obj_name"] + "_async_compact";
+  map_t map_async(store, obj_name, mConfig["cookie"], false, true);
+  std::vector<std::shared_future<bool>> futures;
+
+  // Churn on a few keys triggers compactions in the background while the
+  // pipeline is full
+  for (int i = 0; i < 4000; ++i)
+  {
+    std::string key = "churn_" + std::to_string(i % 10);
+
+    if ((i / 10) % 2)
+      futures.push_back(map_async.aio_erase(key));
+    else
+      futures.push_back(map_async.aio_insert(key, std::to_string(i)));
+
+    if (i % 1000 == 999)
+    {
+      ASSERT_TRUE(map_async.compact());
+    }
+  }
+
+  for (int i = 0; i < 5; ++i)
+    futures.push_back(map_async.aio_insert("last_" + std::to_string(i), "value"));
+
+  ASSERT_TRUE(map_async.flush());
+
+  for (auto&& future: futures)
+    ASSERT_TRUE(future.get());
+
+  ASSERT_GT(map_async.stats().mCompactions, 1u);
+
+  // Operations chained on the pipeline must not take the swap for one of
+  // their own commits
+  std::string obj_id = "/map/" + obj_name + "/" + mConfig["cookie"];
+  auto get_writer = [&]() {
+    std::map<std::string, librados::bufferlist> omap;
+    EXPECT_EQ(0, store->omap_get_vals_by_keys(obj_id, {"obj_writer_key"}, &omap));
+    return omap["obj_writer_key"].to_str();
+  };
+
+  ASSERT_TRUE(map_async.compact());
+  std::string swap_writer = get_writer();
+  ASSERT_TRUE(map_async.aio_insert("after_swap", "value").get());
+  ASSERT_NE(swap_writer, get_writer());
+  map_async.erase("after_swap");
+
+  // A fresh instance replays the changelog to the same contents
+  map_t map_check(store, obj_name, mConfig["cookie"]);
+  ASSERT_EQ(5u, map_check.size());
+  ASSERT_EQ(map_async.size(), map_check.size());
+
+  for (auto&& elem: map_async)
+  {
+    auto it = map_check.find(elem.first);
+    ASSERT_TRUE(it != map_check.end());
+    ASSERT_EQ(elem.second, it->second);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Insert throughput of synchronous versus asynchronous mode
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, DISABLED_AsyncInsertThroughput)
+{
+  int num_entries {10000};
+  std::string obj_name = mConfig["obj_name"] + "_async_tput";
+
+  for (bool is_async: {false, true})
+  {
+    rados::map<std::string, std::string> map(mBackend,
+                                             obj_name, mConfig["cookie"],
+                                             false, is_async);
+    auto duration = timethis([&] {
+        for (int i = 0; i < num_entries; ++i)
+          map.insert("tput_key_" + std::to_string(i), "tput_value");
+
+        ASSERT_TRUE(map.flush());
+      });
+
+    fprintf(stdout, "Insert is_async=%i, num_entries=%i, "
+            "throughput=%f keys/sec\n", is_async, num_entries,
+            num_entries / (duration / 1e9));
+  }
+}
+
+//------------------------------------------------------------------------------
+// Concurrent inserts and erases through the group commit stage
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, GroupCommit)
+{
+  int num_threads {8};
+  int num_entries {100};
+  std::string obj_name = mConfig["obj_name"] + "_group";
+  rados::map<std::string, std::string> map(mBackend,
+                                           obj_name, mConfig["cookie"], false);
+  rados::group_commit<std::string, std::string> combiner(map);
+  std::vector<std::thread> threads;
+  std::vector<int> num_failed(num_threads, 0);
+
+  for (int t = 0; t < num_threads; ++t)
+  {
+    threads.emplace_back([&, t]() {
+        for (int i = 0; i < num_entries; ++i)
+        {
+          std::string key = "group_key_" + std::to_string(t) + "_" + std::to_string(i);
+
+          if (!combiner.insert(key, "group_value"))
+            num_failed[t]++;
+
+          // Every thread tries to insert the same key, only one succeeds
+          (void) combiner.insert("group_shared_" + std::to_string(i), std::to_string(t));
+
+          if ((i % 2) && !combiner.erase(key))
+            num_failed[t]++;
+        }
+      });
+  }
+
+  for (auto&& thread: threads)
+    thread.join();
+
+  for (auto&& failed: num_failed)
+    ASSERT_EQ(0, failed);
+
+  ASSERT_EQ(num_threads * num_entries / 2 + num_entries, (int)map.size());
+  rados::map<std::string, std::string> map_check(mBackend,
+                                                 obj_name, mConfig["cookie"]);
+  ASSERT_EQ(map.size(), map_check.size());
+}
+
+//------------------------------------------------------------------------------
+// Aggregate insert throughput depending on the number of threads
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, DISABLED_GroupCommitThroughput)
+{
+  int num_entries {2000};
+  std::string obj_name = mConfig["obj_name"] + "_group_tput";
+
+  for (bool use_combiner: {false, true})
+  {
+    for (int num_threads: {1, 2, 4, 8, 16, 32})
+    {
+      rados::map<std::string, std::string> map(mBackend,
+                                               obj_name, mConfig["cookie"], false);
+      rados::group_commit<std::string, std::string> combiner(map);
+      std::mutex mutex;
+      std::vector<std::thread> threads;
+
+      auto duration = timethis([&] {
+          for (int t = 0; t < num_threads; ++t)
+          {
+            threads.emplace_back([&, t]() {
+                for (int i = 0; i < num_entries; ++i)
+                {
+                  std::string key = "tput_key_" + std::to_string(t) + "_" +
+                    std::to_string(i);
+
+                  if (use_combiner)
+                  {
+                    (void) combiner.insert(key, "tput_value");
+                  }
+                  else
+                  {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    (void) map.insert(key, "tput_value");
+                  }
+                }
+              });
+          }
+
+          for (auto&& thread: threads)
+            thread.join();
+        });
+
+      fprintf(stdout, "Insert group_commit=%i, num_threads=%i, "
+              "throughput=%f keys/sec\n", use_combiner, num_threads,
+              num_threads * num_entries / (duration / 1e9));
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// Map spread over several objects
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, ShardedMap)
+{
+  int num_shards {4};
+  int num_entries {200};
+  std::string obj_name = mConfig["obj_name"] + "_sharded";
+  rados::sharded_map<std::string, std::string> map(mBackend,
+                                                   obj_name, mConfig["cookie"],
+                                                   num_shards, false);
+  std::vector<std::pair<std::string, std::string>> entries;
+  std::vector<std::string> keys;
+  std::vector<int> per_shard(num_shards, 0);
+
+  for (int i = 0; i < num_entries; ++i)
+  {
+    std::string key = "shard_key_" + std::to_string(i);
+    entries.push_back(std::make_pair(key, "value_" + std::to_string(i)));
+    per_shard[map.shard_of(key)]++;
+
+    if (i % 2)
+      keys.push_back(key);
+  }
+
+  // Keys are spread over all the shards
+  for (auto&& num: per_shard)
+    ASSERT_LT(0, num);
+
+  ASSERT_TRUE(map.insert_many(entries));
+  ASSERT_TRUE(map.erase_many(keys));
+  ASSERT_FALSE(map.insert("shard_key_0", "other_value"));
+  ASSERT_TRUE(map.insert("single_key", "single_value"));
+  ASSERT_TRUE(map.erase("shard_key_2"));
+  ASSERT_FALSE(map.erase("shard_key_1"));
+  ASSERT_EQ(num_entries / 2, (int)map.size());
+
+  // Each shard has its own object
+
+  for (int i = 0; i < num_shards; ++i)
+  {
+    uint64_t psize;
+    std::string obj_id = "/map/" + obj_name + "/shard" + std::to_string(i) +
+      "/" + mConfig["cookie"];
+    ASSERT_EQ(0, mBackend->stat(obj_id, &psize));
+  }
+
+  // Concurrent writers of all the shards
+  std::vector<std::thread> threads;
+
+  for (int t = 0; t < 4; ++t)
+  {
+    threads.emplace_back([&, t]() {
+        for (int i = 0; i < 50; ++i)
+          (void) map.insert("thread_key_" + std::to_string(t) + "_" +
+                            std::to_string(i), "value");
+      });
+  }
+
+  for (auto&& thread: threads)
+    thread.join();
+
+  rados::sharded_map<std::string, std::string> map_check(mBackend,
+                                                         obj_name, mConfig["cookie"],
+                                                         num_shards);
+  std::string value;
+  ASSERT_EQ(map.size(), map_check.size());
+  ASSERT_TRUE(map_check.get("shard_key_0", value));
+  ASSERT_EQ("value_0", value);
+  ASSERT_TRUE(map_check.get("single_key", value));
+  ASSERT_EQ(0u, map_check.count("shard_key_2"));
+
+  // All the instances must use the same number of shards
+  ASSERT_THROW((rados::sharded_map<std::string, std::string>(
+                  mBackend, obj_name, mConfig["cookie"],
+                  num_shards + 1)), rados::RadosContainerException);
+}
+
+//------------------------------------------------------------------------------
+// Aggregate insert throughput depending on the number of shards
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, DISABLED_ShardedInsertThroughput)
+{
+  int num_threads {16};
+  int num_entries {1000};
+
+  for (int num_shards: {1, 2, 4, 8, 16})
+  {
+    std::string obj_name = mConfig["obj_name"] + "_sharded_tput_" +
+      std::to_string(num_shards);
+    std::unique_ptr<rados::sharded_map<std::string, std::string>> map;
+    std::vector<std::thread> threads;
+
+    // Time the initial load separately from the inserts
+    double load_ms = timethis([&] {
+        map.reset(new rados::sharded_map<std::string, std::string>(
+                    mBackend, obj_name, mConfig["cookie"],
+                    num_shards, false));
+      }) / 1e6;
+
+    auto duration = timethis([&] {
+        for (int t = 0; t < num_threads; ++t)
+        {
+          threads.emplace_back([&, t]() {
+              for (int i = 0; i < num_entries; ++i)
+                (void) map->insert("tput_key_" + std::to_string(t) + "_" +
+                                   std::to_string(i), "tput_value");
+            });
+        }
+
+        for (auto&& thread: threads)
+          thread.join();
+      });
+
+    fprintf(stdout, "Insert num_shards=%i, num_threads=%i, load=%f ms, "
+            "throughput=%f keys/sec\n", num_shards, num_threads, load_ms,
+            num_threads * num_entries / (duration / 1e9));
+  }
+}
+
+//------------------------------------------------------------------------------
+// Binary changelog encoding and decoding
+//------------------------------------------------------------------------------
+TEST(ChangeLogTest, BinaryRecords)
+{
+  std::string data = rados::ChangeLog::Header();
+  rados::ChangeLog::EncodeInsert(std::string("key with spaces\n"), 1.5, data);
+  rados::ChangeLog::EncodeInsert(std::string(""), (uint64_t)0xffffffffffffffff, data);
+  rados::ChangeLog::EncodeErase(std::string(300, 'k'), data);
+
+  uint64_t hdr_len;
+  rados::ChangeLog::Format format;
+  ASSERT_TRUE(rados::ChangeLog::ParseHeader(data.c_str(), data.length(),
+                                            format, hdr_len));
+  ASSERT_TRUE(format == rados::ChangeLog::Format::Binary);
+
+  double val_double;
+  uint64_t val_uint64;
+  rados::ChangeLog::Record rec;
+  const char* pos = data.c_str() + hdr_len;
+  const char* end = data.c_str() + data.length();
+  ASSERT_EQ(0, rados::ChangeLog::DecodeRecord(pos, end, rec));
+  ASSERT_EQ(rados::ChangeLog::OP_INSERT, rec.mOp);
+  ASSERT_EQ("key with spaces\n", rec.mKey);
+  ASSERT_TRUE(rados::ChangeLog::DecodeField(rec.mValue, val_double));
+  ASSERT_DOUBLE_EQ(1.5, val_double);
+  ASSERT_EQ(0, rados::ChangeLog::DecodeRecord(pos, end, rec));
+  ASSERT_EQ(0, rec.mKey.length());
+  ASSERT_TRUE(rados::ChangeLog::DecodeField(rec.mValue, val_uint64));
+  ASSERT_EQ((uint64_t)0xffffffffffffffff, val_uint64);
+  ASSERT_FALSE(rados::ChangeLog::DecodeField(rec.mValue.substr(1), val_uint64));
+
+  // Truncated record is reported as incomplete
+  const char* last = pos;
+  ASSERT_EQ(-EAGAIN, rados::ChangeLog::DecodeRecord(pos, end - 1, rec));
+  ASSERT_TRUE(pos == last);
+  ASSERT_EQ(0, rados::ChangeLog::DecodeRecord(pos, end, rec));
+  ASSERT_EQ(rados::ChangeLog::OP_ERASE, rec.mOp);
+  ASSERT_EQ(300, rec.mKey.length());
+  ASSERT_TRUE(pos == end);
+
+  // No header means text format
+  std::string text = "+ key value\n";
+  ASSERT_TRUE(rados::ChangeLog::ParseHeader(text.c_str(), text.length(),
+                                            format, hdr_len));
+  ASSERT_TRUE(format == rados::ChangeLog::Format::Text);
+  ASSERT_EQ(0, hdr_len);
+}
+
+//------------------------------------------------------------------------------
+// Decode changelog records spread over several bufferlist segments
+//------------------------------------------------------------------------------
+TEST(ChangeLogTest, SegmentedReader)
+{
+  std::string binary, text;
+  std::vector<std::pair<std::string, std::string>> expected;
+
+  for (int i = 0; i < 200; ++i)
+  {
+    std::string key = "key_" + std::to_string(i);
+    std::string value = std::string(i % 17, 'v') + std::to_string(i);
+    expected.push_back(std::make_pair(key, value));
+    rados::ChangeLog::EncodeInsert(key, value, binary);
+    text += "+ " + key + "  " + value + "\n\n";
+  }
+
+  // Last text entry is not terminated by a newline
+  text.pop_back();
+  text.pop_back();
+
+  for (auto format: {rados::ChangeLog::Format::Binary,
+        rados::ChangeLog::Format::Text})
+  {
+    const std::string& data = (format == rados::ChangeLog::Format::Binary ?
+                                binary : text);
+
+    // Feed the data in small bufferlists made of segments of various sizes
+    // so that records straddle the segment boundaries
+    rados::ChangeLogReader reader(format);
+    rados::ChangeLog::Record rec;
+    uint64_t off {0}, seg_len {1}, num {0};
+
+    while (off < data.length())
+    {
+      librados::bufferlist bl;
+
+      for (int i = 0; (i < 3) && (off < data.length()); ++i)
+      {
+        librados::bufferlist seg;
+        seg_len = std::min<uint64_t>(seg_len % 23 + 1, data.length() - off);
+        seg.append(data.substr(off, seg_len));
+        bl.claim_append(seg);
+        off += seg_len;
+      }
+
+      reader.Append(bl);
+
+      if (off == data.length())
+        reader.Finish();
+
+      int ret;
+
+      while ((ret = reader.Next(rec)) == 0)
+      {
+        if (rec.mOp == 0)
+          continue; // empty text line
+
+        ASSERT_EQ(rados::ChangeLog::OP_INSERT, rec.mOp);
+        ASSERT_LT(num, expected.size());
+        ASSERT_EQ(expected[num].first, rec.mKey);
+        ASSERT_EQ(expected[num].second, rec.mValue);
+        num++;
+      }
+
+      ASSERT_EQ(-EAGAIN, ret);
+    }
+
+    ASSERT_EQ(expected.size(), num);
+    ASSERT_TRUE(reader.Empty());
+  }
+
+  // Truncated data is reported as corrupted once no more data can come
+  rados::ChangeLogReader reader(rados::ChangeLog::Format::Binary);
+  rados::ChangeLog::Record rec;
+  librados::bufferlist bl;
+  bl.append(binary.substr(0, binary.length() - 1));
+  reader.Append(bl);
+  reader.Finish();
+
+  for (size_t i = 0; i < expected.size() - 1; ++i)
+    ASSERT_EQ(0, reader.Next(rec));
+
+  ASSERT_EQ(-EINVAL, reader.Next(rec));
+}
+
+//------------------------------------------------------------------------------
+// Load a text changelog and migrate it to the binary format
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, TextChangeLogMigration)
+{
+  std::string obj_name = mConfig["obj_name"] + "_text";
+  std::string obj_id = "/map/" + obj_name + "/" + mConfig["cookie"];
+  std::string text;
+
+  for (int i = 0; i < 10; ++i)
+    text += "+ text_key text_value_" + std::to_string(i) + "\n";
+
+  text += "+ other_key other_value\n- other_key\n";
+  librados::bufferlist chlog_data;
+  chlog_data.append(text);
+  std::map<std::string, librados::bufferlist> omap;
+  omap["obj_epoch_key"].append("12");
+  (void) mBackend->remove(obj_id);
+  ASSERT_EQ(0, mBackend->write_full(obj_id, chlog_data));
+  ASSERT_EQ(0, mBackend->omap_set(obj_id, omap));
+
+  rados::map<std::string, std::string> map(mBackend,
+                                           obj_name, mConfig["cookie"], false);
+  ASSERT_EQ(1, map.size());
+  ASSERT_EQ("text_value_9", map.find("text_key")->second);
+
+  // Few live entries compared to the changelog length trigger a compaction
+  // which rewrites the changelog in binary format
+  ASSERT_TRUE(map.insert("new_key", "new_value").second);
+  ASSERT_TRUE(map.compact());
+  librados::bufferlist hdr_data;
+  ASSERT_LE(0, mBackend->read(obj_id, hdr_data, rados::ChangeLog::MAGIC.length(), 0));
+  ASSERT_EQ(rados::ChangeLog::MAGIC, std::string(hdr_data.c_str(), hdr_data.length()));
+
+  // Keys which can not be represented in the text format work once migrated
+  std::string key {"key with spaces\tand\nnewline"};
+  ASSERT_TRUE(map.insert(key, "value with spaces").second);
+
+  rados::map<std::string, std::string> map_check(mBackend,
+                                                 obj_name, mConfig["cookie"]);
+  ASSERT_EQ(3, map_check.size());
+  ASSERT_EQ("value with spaces", map_check.find(key)->second);
+  ASSERT_EQ("text_value_9", map_check.find("text_key")->second);
+}
+
+//------------------------------------------------------------------------------
+// Background compaction while mutations keep coming
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, BackgroundCompaction)
+{
+  std::string obj_name = mConfig["obj_name"] + "_compact";
+  std::string obj_id = "/map/" + obj_name + "/" + mConfig["cookie"];
+  rados::map<std::string, std::string> map(mBackend, obj_name,
+                                           mConfig["cookie"], false);
+  rados::map<std::string, std::string> follower(mBackend,
+                                                obj_name, mConfig["cookie"]);
+  std::vector<std::pair<std::string, std::string>> entries;
+
+  for (int i = 0; i < 100; ++i)
+    entries.push_back(std::make_pair("key_" + std::to_string(i), "value"));
+
+  ASSERT_TRUE(map.insert_many(entries));
+
+  // Churn on a few keys triggers compactions in the background while the
+  // writer keeps appending to the changelog
+  for (int i = 0; i < 2000; ++i)
+  {
+    std::string key = "churn_" + std::to_string(i % 10);
+    ASSERT_TRUE(map.insert(key, std::to_string(i)).second);
+    map.erase(key);
+  }
+
+  ASSERT_TRUE(map.insert("last_key", "last_value").second);
+  ASSERT_TRUE(map.compact());
+  uint64_t psize;
+  ASSERT_EQ(0, mBackend->stat(obj_id, &psize));
+  ASSERT_GT(2000u, psize);
+
+  // The follower notices the rewritten changelog on its next update
+  ASSERT_TRUE(follower.insert("follower_key", "value").second);
+  ASSERT_EQ(map.size() + 1, follower.size());
+  ASSERT_EQ("last_value", follower.find("last_key")->second);
+
+  rados::map<std::string, std::string> map_check(mBackend,
+                                                 obj_name, mConfig["cookie"]);
+  ASSERT_EQ(follower.size(), map_check.size());
+  ASSERT_EQ(0u, map_check.count("churn_0"));
+}
+
+//------------------------------------------------------------------------------
+// Compaction saves a snapshot and trims the changelog to the entries after it
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, SnapshotCompaction)
+{
+  std::string obj_name = mConfig["obj_name"] + "_snapshot";
+  std::string obj_id = "/map/" + obj_name + "/" + mConfig["cookie"];
+  rados::map<std::string, std::string> map(mBackend, obj_name,
+                                           mConfig["cookie"], false);
+  rados::map<std::string, std::string> follower(mBackend,
+                                                obj_name, mConfig["cookie"]);
+  std::vector<std::pair<std::string, std::string>> entries;
+
+  for (int i = 0; i < 100; ++i)
+    entries.push_back(std::make_pair("key_" + std::to_string(i), "value"));
+
+  ASSERT_TRUE(map.insert_many(entries));
+  ASSERT_TRUE(map.insert("writer_key", "value").second);
+  map.erase("key_0");
+  ASSERT_TRUE(follower.insert("follower_key", "value").second);
+
+  // Snapshot is tagged with the epoch it covers and the changelog only keeps
+  // the header afterwards
+  auto get_epochs = [&]() {
+    std::set<std::string> keys {"obj_epoch_key", "obj_base_epoch_key"};
+    std::map<std::string, librados::bufferlist> omap;
+    EXPECT_EQ(0, mBackend->omap_get_vals_by_keys(obj_id, keys, &omap));
+    return std::make_pair(std::stoull(omap["obj_epoch_key"].to_str()),
+                          std::stoull(omap["obj_base_epoch_key"].to_str()));
+  };
+
+  ASSERT_TRUE(map.compact());
+  auto epochs = get_epochs();
+  uint64_t psize;
+  ASSERT_EQ(4u, epochs.second);
+  ASSERT_EQ(5u, epochs.first);
+  ASSERT_EQ(0, mBackend->stat(obj_id, &psize));
+  ASSERT_EQ(rados::ChangeLog::Header().length(), psize);
+  std::string snap_id = obj_id + ".snapshot." + std::to_string(epochs.second);
+  ASSERT_EQ(0, mBackend->stat(snap_id, &psize));
+
+  // Follower covers the snapshot and catches up from the trimmed changelog
+  ASSERT_TRUE(map.insert("tail_key", "value").second);
+  ASSERT_TRUE(follower.insert("other_key", "value").second);
+  ASSERT_EQ(map.size() + 1, follower.size());
+  ASSERT_EQ(0u, follower.count("key_0"));
+  ASSERT_EQ(1u, follower.count("tail_key"));
+
+  // Second compaction replaces the snapshot and drops the previous one
+  ASSERT_TRUE(map.insert("last_key", "value").second);
+  ASSERT_TRUE(map.compact());
+  ASSERT_EQ(-ENOENT, mBackend->stat(snap_id, &psize));
+  snap_id = obj_id + ".snapshot." + std::to_string(get_epochs().second);
+  ASSERT_EQ(0, mBackend->stat(snap_id, &psize));
+
+  // Startup loads the snapshot and replays the tail
+  ASSERT_TRUE(map.insert("after_key", "value").second);
+  rados::map<std::string, std::string> map_check(mBackend,
+                                                 obj_name, mConfig["cookie"]);
+  ASSERT_EQ(map.size(), map_check.size());
+  ASSERT_EQ(1u, map_check.count("follower_key"));
+  ASSERT_EQ(1u, map_check.count("after_key"));
+  ASSERT_EQ(0u, map_check.count("key_0"));
+}
+
+//------------------------------------------------------------------------------
+// A reader shifted into a trimmed changelog only counts the entries left
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, TrimShiftEntries)
+{
+  std::string obj_name = mConfig["obj_name"] + "_trim_shift";
+  std::string obj_id = "/map/" + obj_name + "/" + mConfig["cookie"];
+  rados::map<std::string, std::string> map(mBackend, obj_name,
+                                           mConfig["cookie"], false);
+  std::string tail {rados::ChangeLog::Header()};
+  uint64_t trim_off {0};
+
+  for (int i = 0; i < 5; ++i)
+  {
+    std::string key = "key_" + std::to_string(i);
+    ASSERT_TRUE(map.insert(key, "value").second);
+
+    if (i < 3)
+    {
+      std::string rec;
+      rados::ChangeLog::EncodeInsert(key, std::string("value"), rec);
+      trim_off += rec.length();
+    }
+    else
+      rados::ChangeLog::EncodeInsert(key, std::string("value"), tail);
+  }
+
+  ASSERT_EQ(5u, map.stats().mLogEntries);
+
+  // Trim done by another instance with a snapshot covering the first three
+  // entries, the last two already applied locally stay in the changelog
+  librados::bufferlist chlog_data;
+  chlog_data.append(tail);
+  std::map<std::string, librados::bufferlist> omap;
+  omap["obj_epoch_key"].append("6");
+  omap["obj_base_epoch_key"].append("3");
+  omap["obj_prev_base_epoch_key"].append("0");
+  omap["obj_trim_off_key"].append(std::to_string(trim_off));
+  omap["obj_trim_entries_key"].append("3");
+  ASSERT_EQ(0, mBackend->write_full(obj_id, chlog_data));
+  ASSERT_EQ(0, mBackend->omap_set(obj_id, omap));
+
+  ASSERT_EQ(5u, map.size(rados::map<std::string, std::string>::consistency::linearizable));
+  rados::map_stats stats = map.stats();
+  ASSERT_EQ(6u, stats.mEpoch);
+  ASSERT_EQ(2u, stats.mLogEntries);
+  ASSERT_EQ(0u, stats.mFullReloads);
+}
+
+//------------------------------------------------------------------------------
+// Readers in watch mode follow the writer without doing any update
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, WatchRefresh)
+{
+  // Wait for the background refresh to make the condition true
+  auto wait_for = [](std::function<bool()> pred) {
+    for (int i = 0; (i < 5000) && !pred(); ++i)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    return pred();
+  };
+
+  for (bool use_rados: {false, true})
+  {
+    std::string obj_name = mConfig["obj_name"] + "_watch_" + std::to_string(use_rados);
+    std::shared_ptr<rados::update_channel> channel;
+
+    if (!use_rados)
+      channel = std::make_shared<rados::local_channel>();
+
+    rados::map<std::string, std::string> writer(mBackend,
+                                                obj_name, mConfig["cookie"], false);
+    rados::map<std::string, std::string> reader(mBackend,
+                                                obj_name, mConfig["cookie"]);
+    ASSERT_TRUE(writer.watch(channel));
+    ASSERT_TRUE(reader.watch(channel));
+    ASSERT_TRUE(writer.insert("watch_key", "watch_value").second);
+    ASSERT_TRUE(wait_for([&]() { return (reader.count("watch_key") == 1); }));
+    ASSERT_EQ("watch_value", reader.find("watch_key")->second);
+
+    std::vector<std::pair<std::string, std::string>> entries;
+    std::vector<std::string> keys;
+
+    for (int i = 0; i < 50; ++i)
+    {
+      entries.push_back(std::make_pair("key_" + std::to_string(i), "value"));
+      keys.push_back("key_" + std::to_string(i));
+    }
+
+    writer.erase("watch_key");
+    ASSERT_TRUE(writer.insert_many(entries));
+    ASSERT_TRUE(wait_for([&]() { return (reader.size() == 50); }));
+    ASSERT_EQ(0u, reader.count("watch_key"));
+
+    // Compaction done by the writer is picked up as well
+    ASSERT_TRUE(writer.erase_many(keys));
+    ASSERT_TRUE(writer.compact());
+    ASSERT_TRUE(writer.insert("compact_key", "value").second);
+    ASSERT_TRUE(wait_for([&]() { return (reader.count("compact_key") == 1); }));
+    ASSERT_EQ(writer.size(), reader.size());
+  }
+}
+
+//------------------------------------------------------------------------------
+// Followers never write and keep up with the writer, its compactions and a
+// map object created again
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, FollowerMode)
+{
+  typedef rados::map<std::string, std::string> map_t;
+  auto wait_for = [](std::function<bool()> pred) {
+    for (int i = 0; (i < 5000) && !pred(); ++i)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    return pred();
+  };
+  std::string obj_name = mConfig["obj_name"] + "_follower";
+  std::unique_ptr<map_t> writer(new map_t(mBackend, obj_name, mConfig["cookie"],
+                                          false));
+  ASSERT_TRUE(writer->insert("key_0", "value").second);
+  map_t follower(mBackend, obj_name, mConfig["cookie"], false);
+  ASSERT_TRUE(follower.follow(map_t::follow_options(std::chrono::milliseconds(1),
+                                                    std::chrono::milliseconds(20))));
+  ASSERT_TRUE(follower.is_read_only());
+  ASSERT_EQ(1u, follower.size());
+
+  // Nothing reaches the changelog
+  uint64_t epoch = writer->epoch();
+  ASSERT_FALSE(follower.insert("follower_key", "value").second);
+  ASSERT_FALSE(follower.compact());
+  ASSERT_EQ(0u, follower.count("follower_key"));
+  ASSERT_EQ(1u, writer->size(map_t::consistency::linearizable));
+  ASSERT_EQ(epoch, writer->epoch());
+
+  // The entries polled are applied by the lookups
+  auto last_sync = follower.last_sync();
+
+  for (int i = 1; i < 20; ++i)
+    ASSERT_TRUE(writer->insert("key_" + std::to_string(i), "value").second);
+
+  ASSERT_TRUE(wait_for([&]() { return (follower.size() == 20); }));
+  ASSERT_TRUE(wait_for([&]() { return (follower.size() && follower.last_sync() > last_sync); }));
+  rados::map_stats stats = follower.stats();
+  uint64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+  ASSERT_EQ(writer->epoch(), stats.mEpoch);
+  ASSERT_EQ(0u, stats.mFullReloads);
+  ASSERT_LE(stats.mLastSyncTime, now_ms);
+  ASSERT_GE(stats.mLastSyncTime + 1000, now_ms);
+
+  // An up to date follower only rereads the trimmed changelog
+  ASSERT_TRUE(writer->compact());
+  ASSERT_TRUE(writer->insert("compact_key", "value").second);
+  ASSERT_TRUE(wait_for([&]() { return (follower.count("compact_key") == 1); }));
+  ASSERT_EQ(writer->size(), follower.size());
+  ASSERT_EQ(0u, follower.stats().mFullReloads);
+
+  // Map object removed and created again with a lower epoch
+  writer.reset();
+  writer.reset(new map_t(mBackend, obj_name, mConfig["cookie"], false));
+  ASSERT_TRUE(writer->insert("new_key", "value").second);
+  ASSERT_TRUE(wait_for([&]() { return (follower.count("new_key") == 1); }));
+  ASSERT_EQ(1u, follower.size());
+  ASSERT_EQ(writer->epoch(), follower.epoch());
+}
+
+//------------------------------------------------------------------------------
+// A follower nobody reads holds a bounded amount of changelog in memory
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, FollowerQueueLimit)
+{
+  typedef rados::map<std::string, std::string> map_t;
+  auto wait_for = [](std::function<bool()> pred) {
+    for (int i = 0; (i < 5000) && !pred(); ++i)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    return pred();
+  };
+  const uint64_t max_queued {4096};
+  std::string obj_name = mConfig["obj_name"] + "_follower_limit";
+  map_t writer(mBackend, obj_name, mConfig["cookie"], false);
+  ASSERT_TRUE(writer.insert("key_0", "value").second);
+  map_t follower(mBackend, obj_name, mConfig["cookie"]);
+  ASSERT_TRUE(follower.follow(map_t::follow_options(std::chrono::milliseconds(1),
+                                                    std::chrono::milliseconds(1),
+                                                    max_queued)));
+  uint64_t max_seen {0};
+
+  // No lookup applies what the follower fetches
+  for (int i = 1; i < 2000; ++i)
+  {
+    ASSERT_TRUE(writer.insert("key_" + std::to_string(i),
+                              std::string(64, 'v')).second);
+    max_seen = std::max(max_seen, follower.stats().mQueuedBytes);
+  }
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  max_seen = std::max(max_seen, follower.stats().mQueuedBytes);
+  ASSERT_LT(20 * max_queued, writer.stats().mBytesAppended);
+  ASSERT_GE(max_queued, max_seen);
+
+  // The next lookup catches up with a single update from the remote epoch,
+  // there is no need to reload the map
+  ASSERT_TRUE(wait_for([&]() { return (follower.size() == 2000); }));
+  ASSERT_EQ(0u, follower.stats().mFullReloads);
+  ASSERT_EQ(0u, follower.stats().mQueuedBytes);
+}
+
+//------------------------------------------------------------------------------
+// Lookups with different consistency levels
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, ReadConsistency)
+{
+  typedef rados::map<std::string, std::string> map_t;
+  std::string obj_name = mConfig["obj_name"] + "_consistency";
+  map_t writer(mBackend, obj_name, mConfig["cookie"], false);
+  map_t reader(mBackend, obj_name, mConfig["cookie"]);
+  ASSERT_TRUE(writer.insert("key_1", "value").second);
+
+  // Local lookups never go to the backend
+  ASSERT_EQ(0u, reader.count("key_1"));
+  ASSERT_EQ(0u, reader.size(map_t::consistency::local));
+  ASSERT_EQ(2u, reader.get_read_stats(map_t::consistency::local).mReads);
+  ASSERT_EQ(0u, reader.get_read_stats(map_t::consistency::local).mChecks);
+
+  // Linearizable lookups check the epoch every time and catch up if behind
+  ASSERT_EQ(1u, reader.count("key_1", map_t::consistency::linearizable));
+  ASSERT_EQ(1u, reader.size(map_t::consistency::linearizable));
+  auto stats = reader.get_read_stats(map_t::consistency::linearizable);
+  ASSERT_EQ(2u, stats.mReads);
+  ASSERT_EQ(2u, stats.mChecks);
+  ASSERT_EQ(1u, stats.mRefreshes);
+
+  // Bounded lookups only update once the last sync is too old
+  reader.set_read_consistency(map_t::consistency::bounded,
+                              std::chrono::milliseconds(200));
+  ASSERT_TRUE(writer.insert("key_2", "value").second);
+  ASSERT_EQ(0u, reader.count("key_2"));
+  std::this_thread::sleep_for(std::chrono::milliseconds(250));
+  ASSERT_EQ(1u, reader.count("key_2"));
+  ASSERT_EQ(1u, reader.count("key_2"));
+  stats = reader.get_read_stats(map_t::consistency::bounded);
+  ASSERT_EQ(3u, stats.mReads);
+  ASSERT_EQ(1u, stats.mChecks);
+  ASSERT_EQ(1u, stats.mRefreshes);
+  ASSERT_EQ("value", reader.find("key_2")->second);
+}
+
+//------------------------------------------------------------------------------
+// Backoff delays and admission control
+//------------------------------------------------------------------------------
+TEST(RetryPolicyTest, BackoffAndAdmission)
+{
+  using std::chrono::microseconds;
+  rados::immediate_retry immediate;
+  ASSERT_EQ(0, immediate.delay(5).count());
+  ASSERT_EQ(0u, immediate.max_retries());
+
+  // Delays are jittered below a bound which doubles up to the cap
+  rados::exponential_backoff backoff(microseconds(100), microseconds(1000), 4);
+  ASSERT_EQ(4u, backoff.max_retries());
+
+  for (int i = 0; i < 100; ++i)
+  {
+    ASSERT_LE(backoff.delay(1).count(), 100);
+    ASSERT_LE(backoff.delay(3).count(), 400);
+    ASSERT_LE(backoff.delay(64).count(), 1000);
+  }
+
+  // No more than max_inflight holders at any time
+  rados::admission_control ctrl(2);
+  std::atomic<int> inflight {0};
+  std::atomic<int> max_seen {0};
+  std::vector<std::thread> threads;
+
+  for (int t = 0; t < 8; ++t)
+  {
+    threads.emplace_back([&]() {
+        for (int i = 0; i < 20; ++i)
+        {
+          rados::admission_control::guard admit(&ctrl);
+          int now = ++inflight;
+          int seen = max_seen;
+
+          while ((now > seen) && !max_seen.compare_exchange_weak(seen, now));
+
+          std::this_thread::sleep_for(microseconds(50));
+          --inflight;
+        }
+      });
+  }
+
+  for (auto&& thread: threads)
+    thread.join();
+
+  ASSERT_LE(max_seen.load(), 2);
+  ASSERT_EQ(0, inflight.load());
+}
+
+//------------------------------------------------------------------------------
+// Concurrent writers on the same map with backoff and admission control
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, ContendedWriters)
+{
+  typedef rados::map<std::string, std::string> map_t;
+  int num_threads {4};
+  int num_entries {50};
+  std::string obj_name = mConfig["obj_name"] + "_contended";
+  map_t owner(mBackend, obj_name, mConfig["cookie"], false);
+  auto policy = std::make_shared<rados::exponential_backoff>();
+  auto ctrl = std::make_shared<rados::admission_control>(2);
+  std::vector<std::thread> threads;
+  std::atomic<uint64_t> num_retries {0};
+
+  for (int t = 0; t < num_threads; ++t)
+  {
+    threads.emplace_back([&, t]() {
+        map_t writer(mBackend, obj_name, mConfig["cookie"]);
+        writer.set_retry_policy(policy);
+        writer.set_admission_control(ctrl);
+
+        for (int i = 0; i < num_entries; ++i)
+          ASSERT_TRUE(writer.insert("key_" + std::to_string(t) + "_" +
+                                    std::to_string(i), "value").second);
+
+        num_retries += writer.get_num_retries();
+      });
+  }
+
+  for (auto&& thread: threads)
+    thread.join();
+
+  ASSERT_EQ((uint64_t)(num_threads * num_entries),
+            owner.size(map_t::consistency::linearizable));
+  fprintf(stdout, "Contended writers retries=%lu, admission waits=%lu\n",
+          num_retries.load(), ctrl->waits());
+
+  // A conflict costs one retry of the bounded policy
+  map_t stale(mBackend, obj_name, mConfig["cookie"]);
+  stale.set_retry_policy(std::make_shared<rados::exponential_backoff>(
+                           std::chrono::microseconds(10),
+                           std::chrono::microseconds(10), 1));
+  ASSERT_TRUE(owner.insert("key_owner", "value").second);
+  ASSERT_TRUE(stale.insert("key_stale", "value").second);
+  ASSERT_EQ(1u, stale.get_num_retries());
+}
+
+//------------------------------------------------------------------------------
+// Runtime statistics of writers and readers
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, RuntimeStats)
+{
+  typedef rados::map<std::string, std::string> map_t;
+  std::string obj_name = mConfig["obj_name"] + "_stats";
+  map_t writer(mBackend, obj_name, mConfig["cookie"], false);
+  map_t reader(mBackend, obj_name, mConfig["cookie"]);
+  ASSERT_TRUE(writer.insert_many({{"key_1", "v"}, {"key_2", "v"}, {"key_3", "v"}}));
+  writer.erase("key_1");
+  rados::map_stats stats = writer.stats();
+  ASSERT_EQ(3u, stats.mInserts);
+  ASSERT_EQ(1u, stats.mErases);
+  ASSERT_EQ(2u, stats.mBatches);
+  ASSERT_EQ(2u, stats.mCommits);
+  ASSERT_EQ(0u, stats.mConflicts);
+  ASSERT_EQ(2u, stats.mEpoch);
+  ASSERT_EQ(4u, stats.mLogEntries);
+  ASSERT_EQ(2u, stats.mMapSize);
+  ASSERT_EQ(stats.mLogSize - rados::ChangeLog::Header().length(),
+            stats.mBytesAppended);
+
+  // The reader catches up by replaying the new entries
+  ASSERT_EQ(2u, reader.size(map_t::consistency::linearizable));
+  stats = reader.stats();
+  ASSERT_EQ(1u, stats.mLookups);
+  ASSERT_EQ(1u, stats.mCatchUps);
+  ASSERT_EQ(4u, stats.mReplayEntries);
+  ASSERT_EQ(writer.stats().mLogSize, stats.mBytesRead);
+  ASSERT_EQ(0u, stats.mFullReloads);
+
+  // A stale commit fails once on the epoch check
+  ASSERT_TRUE(writer.insert("key_4", "v").second);
+  ASSERT_TRUE(reader.insert("key_5", "v").second);
+  stats = reader.stats();
+  ASSERT_EQ(1u, stats.mConflicts);
+  ASSERT_EQ(1u, stats.mRetries);
+  ASSERT_EQ(1u, stats.mCommits);
+  ASSERT_EQ(2u, stats.mCatchUps);
+
+  ASSERT_EQ(4u, writer.size(map_t::consistency::linearizable));
+  ASSERT_TRUE(writer.compact());
+  stats = writer.stats();
+  ASSERT_EQ(1u, stats.mCompactions);
+  ASSERT_EQ(stats.mEpoch - 1, stats.mBaseEpoch);
+
+  // Export in the text format
+  std::string text = stats.to_string("rvm_");
+  ASSERT_NE(std::string::npos, text.find("rvm_compactions 1\n"));
+  ASSERT_NE(std::string::npos, text.find("rvm_map_size 4\n"));
+  uint64_t num_counters {0};
+  stats.for_each([&](const std::string&, uint64_t, bool is_counter) {
+      num_counters += is_counter;
+    });
+  ASSERT_EQ(15u, num_counters);
+}
+
+//------------------------------------------------------------------------------
+// Percentiles and reset of the latency histograms
+//------------------------------------------------------------------------------
+TEST(LatencyHistogramTest, Percentiles)
+{
+  // Every bucket holds only its value below 16 and spans at most 1/16th of
+  // its lower bound above it
+  for (uint64_t value: {0ull, 15ull, 16ull, 1000ull, 123456789ull, ~0ull})
+  {
+    uint64_t idx = rados::latency_buckets::index(value);
+    ASSERT_LT(idx, rados::latency_buckets::NUM_BUCKETS);
+    ASSERT_GE(rados::latency_buckets::highest(idx), value);
+    ASSERT_LE(rados::latency_buckets::highest(idx) - value, value / 16);
+  }
+
+  rados::latency_histogram hist;
+  ASSERT_EQ(0u, hist.snapshot().percentile(0.99));
+  std::vector<std::thread> threads;
+
+  // Values 1us to 1000us recorded concurrently by 4 threads
+  for (int t = 0; t < 4; ++t)
+  {
+    threads.emplace_back([&, t]() {
+        for (uint64_t i = t; i < 1000; i += 4)
+          hist.record((i + 1) * 1000);
+      });
+  }
+
+  for (auto&& thread: threads)
+    thread.join();
+
+  rados::latency_snapshot snap = hist.snapshot(true);
+  ASSERT_EQ(1000u, snap.mCount);
+  ASSERT_EQ(1000000u, snap.mMax);
+  ASSERT_EQ(500500u, snap.mean());
+  ASSERT_NEAR(500000.0, snap.percentile(0.5), 500000 / 16);
+  ASSERT_NEAR(990000.0, snap.percentile(0.99), 990000 / 16);
+  ASSERT_NEAR(999000.0, snap.percentile(0.999), 999000 / 16);
+  ASSERT_EQ(1000000u, snap.percentile(1));
+  ASSERT_NE(std::string::npos, snap.to_string("insert_").find("insert_max_us 1000\n"));
+
+  // The reset started a new interval
+  hist.record(42);
+  snap = hist.snapshot();
+  ASSERT_EQ(1u, snap.mCount);
+  ASSERT_EQ(42u, snap.percentile(0.99));
+}
+
+//------------------------------------------------------------------------------
+// Latency histograms of the map tell the backend latency apart from the
+// local work
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, LatencyStages)
+{
+  typedef rados::map<std::string, std::string> map_t;
+  auto store = std::make_shared<rados::memory_backend>(std::chrono::microseconds(500));
+  std::string obj_name = mConfig["obj_name"] + "_latency";
+  map_t writer(store, obj_name, mConfig["cookie"], false);
+  map_t reader(store, obj_name, mConfig["cookie"]);
+  int num_entries {20};
+
+  for (int i = 0; i < num_entries; ++i)
+    ASSERT_TRUE(writer.insert("key_" + std::to_string(i), "value").second);
+
+  writer.erase("key_0");
+  rados::latency_snapshot insert = writer.latency(map_t::stage::insert);
+  rados::latency_snapshot rtt = writer.latency(map_t::stage::round_trip);
+  rados::latency_snapshot local = writer.latency(map_t::stage::local_update);
+  ASSERT_EQ((uint64_t)num_entries, insert.mCount);
+  ASSERT_EQ(1u, writer.latency(map_t::stage::erase).mCount);
+  ASSERT_EQ((uint64_t)num_entries + 1, rtt.mCount);
+  ASSERT_EQ((uint64_t)num_entries + 1, local.mCount);
+  ASSERT_GE(rtt.percentile(0.5), 500000u);
+  ASSERT_GE(insert.percentile(0.5), rtt.percentile(0.5) / 2);
+  ASSERT_LT(local.percentile(0.99), 500000u);
+
+  // A stale writer catches up after the epoch missmatch, in one round trip
+  // between the failed and the successful commit
+  uint64_t reader_rtt = reader.latency(map_t::stage::round_trip).mCount;
+  ASSERT_TRUE(reader.insert("key_reader", "value").second);
+  ASSERT_EQ(1u, reader.latency(map_t::stage::catch_up).mCount);
+  ASSERT_EQ(reader_rtt + 3, reader.latency(map_t::stage::round_trip).mCount);
+  ASSERT_GE(reader.latency(map_t::stage::update).mCount, 1u);
+  ASSERT_GE(reader.latency(map_t::stage::replay).mCount, 2u);
+
+  ASSERT_TRUE(writer.compact());
+  ASSERT_EQ(1u, writer.latency(map_t::stage::compaction).mCount);
+
+  // Reset at the end of a reporting interval
+  ASSERT_EQ((uint64_t)num_entries, writer.latency(map_t::stage::insert, true).mCount);
+  ASSERT_EQ(0u, writer.latency(map_t::stage::insert).mCount);
+}
+
+//------------------------------------------------------------------------------
+// Random operations on the local indexes give the same result as on std::map
+//------------------------------------------------------------------------------
+template <typename Index>
+void CheckLocalIndex()
+{
+  Index index;
+  std::map<std::string, uint64_t> ref;
+  std::minstd_rand rng(42);
+
+  for (uint64_t i = 0; i < 20000; ++i)
+  {
+    std::string key = "key_" + std::to_string(rng() % 2000);
+
+    switch (rng() % 4)
+    {
+      case 0:
+        ASSERT_EQ(ref.insert(std::make_pair(key, i)).second,
+                  index.insert(std::make_pair(key, i)).second);
+        break;
+      case 1:
+        ASSERT_EQ(ref.erase(key), index.erase(key));
+        break;
+      case 2:
+      {
+        auto iter = index.find(key);
+        ASSERT_EQ(ref.count(key), index.count(key));
+
+        if (iter != index.end())
+        {
+          ASSERT_EQ(ref[key], iter->second);
+          index.erase(iter);
+          ref.erase(key);
+        }
+
+        break;
+      }
+      default:
+        ref[key] = i;
+        index.insert_or_assign(key, uint64_t(i));
+        break;
+    }
+
+    ASSERT_EQ(ref.size(), index.size());
+  }
+
+  std::map<std::string, uint64_t> content;
+
+  for (auto&& entry: index)
+    content.insert(entry);
+
+  ASSERT_EQ(ref, content);
+  index.clear();
+  ASSERT_EQ(0u, index.size());
+  ASSERT_TRUE(index.find("key_1") == index.end());
+}
+
+TEST(LocalIndexTest, MatchesStdMap)
+{
+  CheckLocalIndex<rados::flat_map<std::string, uint64_t>>();
+  CheckLocalIndex<rados::hash_map<std::string, uint64_t>>();
+  CheckLocalIndex<rados::arena_map<std::string, uint64_t>>();
+}
+
+//------------------------------------------------------------------------------
+// Arena index interns the values and reclaims the dead slab space
+//------------------------------------------------------------------------------
+TEST(LocalIndexTest, ArenaInterning)
+{
+  rados::arena_map<std::string, std::string> index;
+  std::map<std::string, std::string> ref;
+  std::string long_value(rados::arena_map<std::string, std::string>::SLAB_SIZE,
+                         'v');
+
+  for (uint64_t i = 0; i < 10000; ++i)
+  {
+    std::string key = "key_" + std::to_string(i);
+    std::string value = "value_" + std::to_string(i % 10);
+    ref[key] = value;
+    ASSERT_TRUE(index.insert(std::make_pair(key, value)).second);
+  }
+
+  ASSERT_EQ(10u, index.interned_values());
+  ASSERT_EQ(0u, index.dead_bytes());
+  // Empty values stay out of the arena, long ones get a slab of their own
+  index.insert_or_assign("empty", std::string());
+  index.insert_or_assign("long", std::string(long_value));
+  ref["empty"] = "";
+  ref["long"] = long_value;
+  ASSERT_EQ("", index.find("empty")->second);
+  ASSERT_EQ(long_value, index.find("long")->second);
+
+  for (uint64_t i = 0; i < 10000; i += 2)
+  {
+    std::string key = "key_" + std::to_string(i);
+    ASSERT_EQ(1u, index.erase(key));
+    ref.erase(key);
+  }
+
+  index.insert_or_assign("long", "short");
+  ref["long"] = "short";
+  // Only the odd values are left
+  ASSERT_EQ(6u + 1u, index.interned_values());
+  ASSERT_LT(long_value.length(), index.dead_bytes());
+  rados::index_memory before = rados::index_memory_usage(index);
+  ASSERT_TRUE(rados::index_reclaim(index));
+  rados::index_memory after = rados::index_memory_usage(index);
+  ASSERT_EQ(0u, after.mDeadBytes);
+  ASSERT_LT(after.mArenaBytes, before.mArenaBytes);
+  ASSERT_EQ(before.mPayloadBytes, after.mPayloadBytes);
+  ASSERT_FALSE(rados::index_reclaim(index));
+  ASSERT_EQ(ref.size(), index.size());
+
+  for (auto&& entry: ref)
+  {
+    auto iter = index.find(entry.first);
+    ASSERT_TRUE(iter != index.end());
+    ASSERT_EQ(entry.second, iter->second);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Maps using different local indexes share the same object
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, LocalIndexPolicies)
+{
+  typedef rados::map<std::string, std::string> map_t;
+  typedef rados::map<std::string, std::string,
+                     rados::flat_map<std::string, std::string>> flat_map_t;
+  typedef rados::map<std::string, std::string,
+                     rados::hash_map<std::string, std::string>> hash_map_t;
+  std::string obj_name = mConfig["obj_name"] + "_index";
+  uint64_t num_entries {300};
+  hash_map_t writer(mBackend, obj_name, mConfig["cookie"], false);
+  flat_map_t flat_reader(mBackend, obj_name, mConfig["cookie"]);
+
+  for (uint64_t i = 0; i < num_entries; ++i)
+    ASSERT_TRUE(writer.insert("key_" + std::to_string(i), "value").second);
+
+  for (uint64_t i = 0; i < num_entries; i += 3)
+    writer.erase("key_" + std::to_string(i));
+
+  ASSERT_EQ(num_entries * 2 / 3, writer.size());
+  ASSERT_EQ(writer.size(), flat_reader.size(flat_map_t::consistency::linearizable));
+
+  // The snapshot of the unordered index is dumped in key order
+  ASSERT_TRUE(writer.compact());
+  map_t reader(mBackend, obj_name, mConfig["cookie"]);
+  flat_map_t flat_loader(mBackend, obj_name, mConfig["cookie"]);
+  ASSERT_EQ(writer.size(), reader.size());
+  ASSERT_EQ(writer.size(), flat_loader.size());
+  auto iter = flat_loader.begin();
+  auto ref_iter = reader.begin();
+
+  for (; iter != flat_loader.end(); ++iter, ++ref_iter)
+  {
+    ASSERT_EQ(ref_iter->first, iter->first);
+    ASSERT_EQ(1u, writer.count(iter->first));
+  }
+
+  ASSERT_TRUE(flat_reader.find("key_1", flat_map_t::consistency::linearizable) !=
+              flat_reader.end());
+  ASSERT_TRUE(flat_reader.find("key_0") == flat_reader.end());
+}
+
+//------------------------------------------------------------------------------
+// Lookups by std::string_view and mutations moving their arguments, for all
+// the local indexes
+//------------------------------------------------------------------------------
+template <typename Index>
+void CheckKeyViews(std::shared_ptr<rados::backend> store, const std::string& obj_name,
+                   const std::string& cookie)
+{
+  typedef rados::map<std::string, std::string, Index> map_t;
+  map_t map(store, obj_name, cookie, false);
+  std::string buffer = "key_1|key_2|key_3";
+  std::string_view key1(buffer.data(), 5);
+  std::string_view key3(buffer.data() + 12, 5);
+
+  ASSERT_TRUE(map.emplace("key_1", "value_1").second);
+  std::string key = "key_2";
+  std::string value(100, 'v');
+  ASSERT_TRUE(map.insert(std::move(key), std::move(value)).second);
+  std::vector<std::pair<std::string, std::string>> entries {{"key_3", "value_3"},
+                                                            {"key_4", "value_4"}};
+  ASSERT_TRUE(map.insert_many(std::move(entries)));
+  ASSERT_TRUE(entries.empty());
+  ASSERT_EQ(4u, map.size());
+  ASSERT_TRUE(map.find(key1) != map.end());
+  ASSERT_EQ("value_1", map.find(key1)->second);
+  ASSERT_EQ(std::string(100, 'v'), map.find("key_2")->second);
+  ASSERT_EQ(1u, map.count(key3));
+  ASSERT_EQ(0u, map.count(std::string_view(buffer.data(), 4)));
+  map.erase(key3);
+  ASSERT_EQ(0u, map.count("key_3"));
+  // Another instance replays the same entries
+  map_t reader(store, obj_name, cookie);
+  ASSERT_EQ(3u, reader.size());
+  ASSERT_EQ("value_4", reader.find(std::string_view("key_4"))->second);
+}
+
+TEST_F(RadosMapTest, KeyViews)
+{
+  std::string obj_name = mConfig["obj_name"] + "_views";
+  CheckKeyViews<std::map<std::string, std::string, std::less<>>>(
+    mBackend, obj_name + "_std", mConfig["cookie"]);
+  CheckKeyViews<std::map<std::string, std::string>>(
+    mBackend, obj_name + "_opaque", mConfig["cookie"]);
+  CheckKeyViews<rados::flat_map<std::string, std::string>>(
+    mBackend, obj_name + "_flat", mConfig["cookie"]);
+  CheckKeyViews<rados::hash_map<std::string, std::string>>(
+    mBackend, obj_name + "_hash", mConfig["cookie"]);
+  CheckKeyViews<rados::arena_map<std::string, std::string>>(
+    mBackend, obj_name + "_arena", mConfig["cookie"]);
+}
+
+//------------------------------------------------------------------------------
+// Arena-backed replica follows the changelog and uses less memory than the
+// default index for repeated values
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, ArenaIndexMemory)
+{
+  typedef rados::map<std::string, std::string> map_t;
+  typedef rados::map<std::string, std::string,
+                     rados::arena_map<std::string, std::string>> arena_map_t;
+  std::string obj_name = mConfig["obj_name"] + "_arena";
+  std::string value(64, 'v');
+  uint64_t num_entries {2000};
+  arena_map_t writer(mBackend, obj_name, mConfig["cookie"], false);
+  map_t reader(mBackend, obj_name, mConfig["cookie"]);
+
+  for (uint64_t i = 0; i < num_entries; ++i)
+    ASSERT_TRUE(writer.insert("key_with_a_long_prefix_" + std::to_string(i),
+                              value + std::to_string(i % 4)).second);
+
+  for (uint64_t i = 0; i < num_entries; i += 2)
+    writer.erase("key_with_a_long_prefix_" + std::to_string(i));
+
+  ASSERT_EQ(writer.size(), reader.size(map_t::consistency::linearizable));
+  rados::index_memory arena_usage = writer.memory_usage();
+  rados::index_memory ref_usage = reader.memory_usage();
+  ASSERT_EQ(num_entries / 2, arena_usage.mEntries);
+  ASSERT_EQ(ref_usage.mEntries, arena_usage.mEntries);
+  ASSERT_EQ(ref_usage.mPayloadBytes, arena_usage.mPayloadBytes);
+  // Only the odd keys are left, with two distinct values
+  ASSERT_EQ(2u, arena_usage.mInternedValues);
+  ASSERT_LT(0u, arena_usage.mDeadBytes);
+  ASSERT_LT(0u, ref_usage.mHeapBytes);
+  // The erased keys are reclaimed once the changelog is compacted
+  ASSERT_TRUE(writer.compact());
+  ASSERT_EQ(0u, writer.memory_usage().mDeadBytes);
+  ASSERT_EQ(num_entries / 2, writer.size());
+
+  for (auto&& entry: reader)
+  {
+    auto iter = writer.find(entry.first);
+    ASSERT_TRUE(iter != writer.end());
+    ASSERT_EQ(entry.second, iter->second);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Readers of a shared map never block and only see published versions while
+// a writer keeps inserting
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, SharedMapReaders)
+{
+  typedef rados::shared_map<std::string, std::string> shared_map_t;
+  std::string obj_name = mConfig["obj_name"] + "_shared";
+  int num_entries {500};
+  int num_readers {4};
+  shared_map_t map(mBackend, obj_name, mConfig["cookie"], false);
+  std::atomic<bool> done {false};
+  std::atomic<int> num_errors {0};
+  std::vector<std::thread> readers;
+
+  for (int t = 0; t < num_readers; ++t)
+  {
+    readers.emplace_back([&]() {
+        uint64_t last_size {0}, last_epoch {0};
+
+        while (!done)
+        {
+          {
+            shared_map_t::view_t view = map.read();
+            uint64_t size = view.size();
+
+            // Keys are inserted in order, a version holds all the previous ones
+            if ((size < last_size) || (view.tag() < last_epoch) ||
+                (size && !view.count("key_" + std::to_string(size - 1))) ||
+                view.count("key_" + std::to_string(size)))
+              num_errors++;
+
+            last_size = size;
+            last_epoch = view.tag();
+          }
+
+          std::this_thread::yield();
+        }
+      });
+  }
+
+  for (int i = 0; i < num_entries; ++i)
+    ASSERT_TRUE(map.insert("key_" + std::to_string(i), "value_" + std::to_string(i)));
+
+  done = true;
+
+  for (auto&& thread: readers)
+    thread.join();
+
+  ASSERT_EQ(0, num_errors);
+  ASSERT_EQ(num_entries, (int)map.size());
+  std::string value;
+  ASSERT_TRUE(map.get("key_7", value));
+  ASSERT_EQ("value_7", value);
+  ASSERT_FALSE(map.insert("key_7", "other_value"));
+  ASSERT_TRUE(map.erase("key_7"));
+  ASSERT_FALSE(map.erase("key_7"));
+  ASSERT_EQ(0u, map.count("key_7"));
+
+  // Changes of other instances are published once synced
+  rados::map<std::string, std::string> other(mBackend, obj_name, mConfig["cookie"]);
+  ASSERT_TRUE(other.insert("remote_key", "remote_value").second);
+  ASSERT_EQ(0u, map.count("remote_key"));
+  map.sync();
+  ASSERT_TRUE(map.get("remote_key", value));
+  ASSERT_EQ("remote_value", value);
+  ASSERT_EQ(other.epoch(), map.epoch());
+
+  // Both copies of the index follow the map
+  uint64_t num_keys = map.write([](shared_map_t::map_t& mp) {
+      uint64_t num {0};
+
+      for (auto iter = mp.begin(); iter != mp.end(); ++iter)
+        num++;
+
+      return num;
+    });
+  ASSERT_EQ(map.size(), num_keys);
+  ASSERT_EQ(2 * map.size(), map.write([](shared_map_t::map_t& mp) {
+        return mp.memory_usage().mEntries;
+      }));
+}
+
+//------------------------------------------------------------------------------
+// Warm start from the local cache file reads only the changelog tail and
+// falls back to a full load when the cache is unusable
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, CacheWarmStart)
+{
+  typedef rados::map<std::string, std::string> map_t;
+  char dir_tmpl[] = "/tmp/rvmap_cache_XXXXXX";
+  ASSERT_NE(nullptr, mkdtemp(dir_tmpl));
+  std::string cache_path = std::string(dir_tmpl) + "/replica";
+  std::string obj_name = mConfig["obj_name"] + "_cache";
+  map_t owner(mBackend, obj_name, mConfig["cookie"], false);
+  auto check_same = [&](map_t& mp) {
+    map_t ref(mBackend, obj_name, mConfig["cookie"]);
+    ASSERT_EQ(ref.size(), mp.size());
+
+    for (auto&& entry: ref)
+    {
+      auto iter = mp.find(entry.first);
+      ASSERT_TRUE(iter != mp.end());
+      ASSERT_EQ(entry.second, iter->second);
+    }
+  };
+
+  for (int i = 0; i < 100; ++i)
+    ASSERT_TRUE(owner.insert("key_" + std::to_string(i), "value").second);
+
+  {
+    // The cache is saved when the map goes away
+    map_t cached(mBackend, obj_name, mConfig["cookie"], true, false, cache_path);
+    ASSERT_EQ(0u, cached.stats().mCacheLoads);
+    ASSERT_EQ(100u, cached.size());
+  }
+
+  ASSERT_TRUE(std::filesystem::exists(cache_path));
+  owner.erase("key_0");
+  ASSERT_TRUE(owner.insert("key_100", "value").second);
+
+  {
+    // Only the entries appended since the cache was saved are read
+    map_t cached(mBackend, obj_name, mConfig["cookie"], true, false, cache_path);
+    rados::map_stats stats = cached.stats();
+    ASSERT_EQ(1u, stats.mCacheLoads);
+    ASSERT_EQ(0u, stats.mFullReloads);
+    ASSERT_EQ(2u, stats.mReplayEntries);
+    ASSERT_LT(stats.mBytesRead, owner.stats().mLogSize / 10);
+    ASSERT_EQ(owner.epoch(), cached.epoch());
+    check_same(cached);
+    ASSERT_TRUE(cached.insert("key_cached", "value").second);
+    ASSERT_TRUE(cached.save_cache());
+  }
+
+  // A compaction dropped the changelog entries the cache does not cover
+  ASSERT_TRUE(owner.insert("key_101", "value").second);
+  ASSERT_TRUE(owner.compact());
+  ASSERT_TRUE(owner.insert("key_102", "value").second);
+
+  {
+    map_t cached(mBackend, obj_name, mConfig["cookie"], true, false, cache_path);
+    ASSERT_EQ(1u, cached.stats().mFullReloads);
+    check_same(cached);
+  }
+
+  // Truncated cache file
+  std::filesystem::resize_file(cache_path, std::filesystem::file_size(cache_path) - 3);
+
+  {
+    map_t cached(mBackend, obj_name, mConfig["cookie"], true, false, cache_path);
+    ASSERT_EQ(0u, cached.stats().mCacheLoads);
+    check_same(cached);
+  }
+
+  // Cache of another map
+  {
+    map_t other(mBackend, obj_name + "_other", mConfig["cookie"], false, false,
+                cache_path);
+    ASSERT_EQ(0u, other.stats().mCacheLoads);
+    ASSERT_EQ(0u, other.size());
+  }
+
+  std::filesystem::remove_all(dir_tmpl);
+}
+
+//------------------------------------------------------------------------------
+// Full loads streamed in small chunks match the map, also while entries get
+// appended during the load
+//------------------------------------------------------------------------------
+TEST(StreamingLoadTest, ChunkedLoad)
+{
+  typedef rados::map<std::string, std::string> map_t;
+  auto store = std::make_shared<rados::memory_backend>(std::chrono::microseconds(200));
+  map_t writer(store, "chunked_load", "cookie", false);
+  map_t::load_options load(64, 3);
+  auto check_same = [&](map_t& mp) {
+    ASSERT_EQ(writer.size(), mp.size(map_t::consistency::linearizable));
+
+    for (auto&& entry: writer)
+    {
+      auto iter = mp.find(entry.first);
+      ASSERT_TRUE(iter != mp.end());
+      ASSERT_EQ(entry.second, iter->second);
+    }
+  };
+
+  for (int batch = 0; batch < 2; ++batch)
+  {
+    std::vector<std::pair<std::string, std::string>> entries;
+
+    for (int i = 0; i < 400; ++i)
+      entries.push_back(std::make_pair("key_" + std::to_string(batch) + "_" +
+                                       std::to_string(i), "value"));
+
+    ASSERT_TRUE(writer.insert_many(entries));
+  }
+
+  uint64_t log_size = writer.stats().mLogSize;
+
+  {
+    // Keep appending while the changelog is loaded
+    std::atomic<bool> done {false};
+    std::thread appender([&]() {
+        for (int i = 0; !done && (i < 100); ++i)
+          ASSERT_TRUE(writer.insert("appended_" + std::to_string(i), "value").second);
+      });
+    map_t loader(store, "chunked_load", "cookie", true, false, "", load);
+    done = true;
+    appender.join();
+    rados::map_stats stats = loader.stats();
+    ASSERT_EQ(0u, stats.mFullReloads);
+    ASSERT_LE(log_size, stats.mBytesRead);
+    check_same(loader);
+  }
+
+  // Snapshot read in chunks as well
+  ASSERT_TRUE(writer.compact());
+  ASSERT_TRUE(writer.insert("after_compaction", "value").second);
+  map_t loader(store, "chunked_load", "cookie", true, false, "", load);
+  ASSERT_EQ(0u, loader.stats().mFullReloads);
+  check_same(loader);
+}
+
+//------------------------------------------------------------------------------
+// Changelogs replayed by several threads give the same map as a sequential
+// replay, whatever the format and the number of threads
+//------------------------------------------------------------------------------
+TEST(StreamingLoadTest, ParallelReplay)
+{
+  typedef rados::map<std::string, std::string> map_t;
+  auto store = std::make_shared<rados::memory_backend>();
+  std::string binary = rados::ChangeLog::Header();
+  std::string text;
+  std::map<std::string, std::string> expected;
+  std::mt19937 gen(42);
+
+  // Overwrites and erases of the same keys spread over the whole changelog
+  for (int i = 0; i < 20000; ++i)
+  {
+    std::string key = "key_" + std::to_string(gen() % 3000);
+
+    if (gen() % 4 == 0)
+    {
+      rados::ChangeLog::EncodeErase(key, binary);
+      text += "- " + key + "\n";
+      expected.erase(key);
+    }
+    else
+    {
+      std::string value = "value_" + std::to_string(i);
+      rados::ChangeLog::EncodeInsert(key, value, binary);
+      text += "+ " + key + " " + value + "\n";
+      expected[key] = value;
+    }
+  }
+
+  for (const std::string* data: {&binary, &text})
+  {
+    std::string obj_id = "/map/parallel_replay/cookie";
+    librados::bufferlist chlog_data;
+    chlog_data.append(*data);
+    std::map<std::string, librados::bufferlist> omap;
+    omap["obj_epoch_key"].append("20000");
+    (void) store->remove(obj_id);
+    ASSERT_EQ(0, store->write_full(obj_id, chlog_data));
+    ASSERT_EQ(0, store->omap_set(obj_id, omap));
+    ASSERT_LT(4 * 64 * 1024u, data->length());
+
+    for (uint64_t threads: {1, 3, 4})
+    {
+      // Chunks smaller than the changelog leave records across chunks
+      map_t::load_options load(200 * 1024, 2, threads);
+      map_t mp(store, "parallel_replay", "cookie", true, false, "", load);
+      ASSERT_EQ(20000u, mp.stats().mReplayEntries);
+      ASSERT_EQ(expected.size(), mp.size());
+
+      for (auto&& entry: expected)
+      {
+        auto iter = mp.find(entry.first);
+        ASSERT_TRUE(iter != mp.end());
+        ASSERT_EQ(entry.second, iter->second);
+      }
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// Load an update-heavy map into the given local index and compare it
+//------------------------------------------------------------------------------
+template <typename Index>
+void CheckLastWriterWins(std::shared_ptr<rados::backend> store,
+                         const std::string& obj_name,
+                         const std::map<std::string, std::string>& expected)
+{
+  rados::map<std::string, std::string, Index> mp(store, obj_name, "cookie");
+  ASSERT_EQ(expected.size(), mp.size());
+
+  for (auto&& entry: expected)
+  {
+    auto iter = mp.find(entry.first);
+    ASSERT_TRUE(iter != mp.end());
+    ASSERT_EQ(entry.second, iter->second);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Only the last record of each key is applied when loading a changelog,
+// whether the map is built from scratch or on top of a snapshot
+//------------------------------------------------------------------------------
+TEST(StreamingLoadTest, LastWriterWins)
+{
+  typedef rados::map<std::string, std::string> map_t;
+  auto store = std::make_shared<rados::memory_backend>();
+  std::string binary = rados::ChangeLog::Header();
+  std::map<std::string, std::string> expected;
+  // Hot keys rewritten over and over, some keys erased for good
+  auto mutate = [&](map_t* writer) {
+    for (int i = 0; i < 100; ++i)
+    {
+      std::string key = "base_" + std::to_string(i);
+      expected[key] = "value";
+
+      if (!writer)
+      {
+        rados::ChangeLog::EncodeInsert(key, expected[key], binary);
+        continue;
+      }
+
+      ASSERT_TRUE(writer->insert(key, "value").second);
+    }
+
+    if (writer)
+    {
+      ASSERT_TRUE(writer->compact());
+    }
+
+    for (int round = 0; round < 30; ++round)
+    {
+      for (int i = 0; i < 10; ++i)
+      {
+        std::string key = "hot_" + std::to_string(i);
+        std::string value = "value_" + std::to_string(round);
+        expected[key] = value;
+
+        if (writer)
+        {
+          writer->erase(key);
+          ASSERT_TRUE(writer->insert(key, value).second);
+        }
+        else
+        {
+          rados::ChangeLog::EncodeErase(key, binary);
+          rados::ChangeLog::EncodeInsert(key, value, binary);
+        }
+      }
+    }
+
+    for (int i = 0; i < 100; i += 3)
+    {
+      std::string key = "base_" + std::to_string(i);
+      expected.erase(key);
+
+      if (writer)
+        writer->erase(key);
+      else
+        rados::ChangeLog::EncodeErase(key, binary);
+    }
+  };
+
+  for (bool snapshot: {false, true})
+  {
+    std::string obj_name = (snapshot ? "lww_snapshot" : "lww");
+    std::unique_ptr<map_t> writer;
+    expected.clear();
+
+    if (snapshot)
+    {
+      writer.reset(new map_t(store, obj_name, "cookie", false));
+      mutate(writer.get());
+    }
+    else
+    {
+      mutate(nullptr);
+      librados::bufferlist chlog_data;
+      chlog_data.append(binary);
+      std::map<std::string, librados::bufferlist> omap;
+      omap["obj_epoch_key"].append("734");
+      ASSERT_EQ(0, store->write_full("/map/lww/cookie", chlog_data));
+      ASSERT_EQ(0, store->omap_set("/map/lww/cookie", omap));
+    }
+
+    CheckLastWriterWins<std::map<std::string, std::string, std::less<>>>(
+      store, obj_name, expected);
+    CheckLastWriterWins<rados::flat_map<std::string, std::string>>(
+      store, obj_name, expected);
+    CheckLastWriterWins<rados::hash_map<std::string, std::string>>(
+      store, obj_name, expected);
+    CheckLastWriterWins<rados::arena_map<std::string, std::string>>(
+      store, obj_name, expected);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Goodput and tail latency of writers contending on the same map with and
+// without backoff and admission control
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, DISABLED_ContentionThroughput)
+{
+  typedef rados::map<std::string, std::string> map_t;
+  int num_entries {200};
+  std::vector<std::string> configs {"immediate", "backoff", "backoff+admission"};
+
+  for (auto&& config: configs)
+  {
+    for (int num_threads: {1, 2, 4, 8, 16})
+    {
+      std::string obj_name = mConfig["obj_name"] + "_contention_" +
+        std::to_string(num_threads);
+      map_t owner(mBackend, obj_name, mConfig["cookie"], false);
+      std::shared_ptr<rados::retry_policy> policy;
+      std::shared_ptr<rados::admission_control> ctrl;
+
+      if (config != "immediate")
+        policy = std::make_shared<rados::exponential_backoff>();
+
+      if (config == "backoff+admission")
+        ctrl = std::make_shared<rados::admission_control>(2);
+
+      std::vector<std::unique_ptr<map_t>> writers;
+
+      for (int t = 0; t < num_threads; ++t)
+      {
+        writers.emplace_back(new map_t(mBackend, obj_name,
+                                       mConfig["cookie"]));
+        writers.back()->set_retry_policy(policy);
+        writers.back()->set_admission_control(ctrl);
+      }
+
+      std::mutex mutex;
+      std::vector<double> tm_ops; // in microseconds
+      std::vector<std::thread> threads;
+
+      auto duration = timethis([&] {
+          for (int t = 0; t < num_threads; ++t)
+          {
+            threads.emplace_back([&, t]() {
+                std::vector<double> tm_local;
+
+                for (int i = 0; i < num_entries; ++i)
+                {
+                  std::string key = "key_" + std::to_string(t) + "_" +
+                    std::to_string(i);
+                  tm_local.push_back(timethis([&] {
+                        (void) writers[t]->insert(key, "value");
+                      }) / 1000.0);
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+                tm_ops.insert(tm_ops.end(), tm_local.begin(), tm_local.end());
+              });
+          }
+
+          for (auto&& thread: threads)
+            thread.join();
+        });
+
+      uint64_t num_retries {0};
+
+      for (auto&& writer: writers)
+        num_retries += writer->get_num_retries();
+
+      std::sort(tm_ops.begin(), tm_ops.end());
+      fprintf(stdout, "Contention policy=%s, num_writers=%i, goodput=%f "
+              "commits/sec, retries=%lu, p50=%f, p99=%f (microsec)\n",
+              config.c_str(), num_threads,
+              num_threads * num_entries / (duration / 1e9), num_retries,
+              tm_ops[tm_ops.size() / 2], tm_ops[tm_ops.size() * 99 / 100]);
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// Compare and mutate semantics of the local backends
+//------------------------------------------------------------------------------
+TEST(BackendTest, CompareAndMutate)
+{
+  char dir_tmpl[] = "/tmp/rvmap_backend_XXXXXX";
+  ASSERT_NE(nullptr, mkdtemp(dir_tmpl));
+  std::vector<std::shared_ptr<rados::backend>> backends {
+    std::make_shared<rados::memory_backend>(),
+    std::make_shared<rados::file_backend>(dir_tmpl)};
+
+  for (auto&& store: backends)
+  {
+    std::string obj_id {"/map/backend/test"};
+    librados::bufferlist data, epoch;
+    data.append("header");
+    epoch.append("0");
+    rados::backend::omap_t omap {{"epoch", epoch}};
+    rados::backend::write_op create_op;
+    create_op.create(true);
+    create_op.write_full(data);
+    create_op.omap_set(omap);
+    ASSERT_EQ(0, store->operate(obj_id, create_op));
+    ASSERT_EQ(-EEXIST, store->operate(obj_id, create_op));
+
+    // A failed comparison leaves the object untouched
+    int prval_cmp {0};
+    librados::bufferlist stale, entry;
+    stale.append("5");
+    entry.append("entry");
+    rados::backend::write_op wr_op;
+    wr_op.omap_cmp({{"epoch", std::make_pair(stale, LIBRADOS_CMPXATTR_OP_EQ)}},
+                   &prval_cmp);
+    wr_op.append(entry);
+    ASSERT_EQ(-ECANCELED, store->operate(obj_id, wr_op));
+    ASSERT_EQ(-ECANCELED, prval_cmp);
+    uint64_t psize {0};
+    ASSERT_EQ(0, store->stat(obj_id, &psize));
+    ASSERT_EQ(data.length(), psize);
+
+    // A matching one applies all the mutations
+    rados::backend::write_op ok_op;
+    librados::bufferlist next;
+    next.append("1");
+    ok_op.omap_cmp({{"epoch", std::make_pair(epoch, LIBRADOS_CMPXATTR_OP_EQ)}},
+                   &prval_cmp);
+    ok_op.omap_set({{"epoch", next}});
+    ok_op.append(entry);
+    ASSERT_EQ(0, store->operate(obj_id, ok_op));
+    ASSERT_EQ(0, prval_cmp);
+
+    // Read the tail together with the epoch it matches
+    int prval_get, prval_rd;
+    rados::backend::omap_t vals;
+    librados::bufferlist tail;
+    rados::backend::read_op rd_op;
+    rd_op.omap_get_vals_by_keys({"epoch", "missing"}, &vals, &prval_get);
+    rd_op.read(data.length(), 0, &tail, &prval_rd);
+    ASSERT_EQ(0, store->operate(obj_id, rd_op));
+    ASSERT_EQ(1u, vals.size());
+    ASSERT_EQ("1", vals["epoch"].to_str());
+    ASSERT_EQ("entry", tail.to_str());
+
+    ASSERT_EQ(0, store->remove(obj_id));
+    ASSERT_EQ(-ENOENT, store->stat(obj_id, &psize));
+    ASSERT_EQ(-ENOENT, store->remove(obj_id));
+  }
+
+  std::filesystem::remove_all(dir_tmpl);
+}
+
+//------------------------------------------------------------------------------
+// Maps stored with the local-file backend survive the backend
+//------------------------------------------------------------------------------
+TEST(BackendTest, FileBackendReload)
+{
+  typedef rados::map<std::string, std::string> map_t;
+  char dir_tmpl[] = "/tmp/rvmap_backend_XXXXXX";
+  ASSERT_NE(nullptr, mkdtemp(dir_tmpl));
+
+  {
+    auto store = std::make_shared<rados::file_backend>(dir_tmpl);
+    map_t map(store, "reload", "test");
+
+    for (int i = 0; i < 100; ++i)
+      ASSERT_TRUE(map.insert("key_" + std::to_string(i), "value").second);
+
+    map.erase("key_0");
+    ASSERT_TRUE(map.compact());
+    ASSERT_TRUE(map.insert("tail_key", "value").second);
+  }
+
+  // Bytes appended without their omap update are dropped on load
+  std::string data_path;
+
+  for (auto&& entry: std::filesystem::directory_iterator(dir_tmpl))
+  {
+    if (entry.path().string().find("reload%2Ftest.data") != std::string::npos)
+      data_path = entry.path().string();
+  }
+
+  ASSERT_FALSE(data_path.empty());
+  FILE* fdata = fopen(data_path.c_str(), "ab");
+  ASSERT_NE(nullptr, fdata);
+  ASSERT_EQ(7u, fwrite("garbage", 1, 7, fdata));
+  fclose(fdata);
+
+  {
+    auto store = std::make_shared<rados::file_backend>(dir_tmpl);
+    map_t map(store, "reload", "test", false);
+    ASSERT_EQ(100u, map.size());
+    ASSERT_EQ(0u, map.count("key_0"));
+    ASSERT_EQ(1u, map.count("tail_key"));
+  }
+
+  // A write which does not reach the files is not reported as committed
+  {
+    uint64_t psize;
+    librados::bufferlist data;
+    data.append("data");
+    auto store = std::make_shared<rados::file_backend>(dir_tmpl);
+    ASSERT_EQ(0, store->write_full("lost_obj", data));
+    std::filesystem::remove_all(dir_tmpl);
+    rados::backend::write_op op;
+    op.append(data);
+    ASSERT_EQ(-EIO, store->operate("lost_obj", op));
+    ASSERT_EQ(-ENOENT, store->stat("lost_obj", &psize));
+  }
+
+  std::filesystem::remove_all(dir_tmpl);
+}
+
+//------------------------------------------------------------------------------
+// Injected latency overlaps for the operations in flight
+//------------------------------------------------------------------------------
+TEST(BackendTest, LatencyInjection)
+{
+  using std::chrono::milliseconds;
+  auto store = std::make_shared<rados::memory_backend>(milliseconds(5));
+  librados::bufferlist entry;
+  entry.append("entry");
+
+  // Synchronous operations pay the full latency
+  auto duration = timethis([&] {
+      ASSERT_EQ(0, store->write_full("latency_obj", entry));
+    });
+  ASSERT_LE(milliseconds(5).count(), duration / 1e6);
+
+  // Asynchronous ones are pipelined and complete in submission order
+  std::vector<rados::backend::completion_ptr> comps;
+  std::vector<int> order;
+  std::mutex mutex;
+
+  duration = timethis([&] {
+      for (int i = 0; i < 20; ++i)
+      {
+        rados::backend::write_op wr_op;
+        wr_op.append(entry);
+        comps.push_back(std::make_shared<rados::backend::completion>([&, i](int ret) {
+              std::lock_guard<std::mutex> lock(mutex);
+              order.push_back(ret ? -1 : i);
+            }));
+        ASSERT_EQ(0, store->aio_operate("latency_obj", wr_op, comps.back()));
+      }
+
+      for (auto&& comp: comps)
+        comp->wait_for_complete();
+    });
+
+  ASSERT_GT(milliseconds(20 * 5).count(), duration / 1e6);
+  ASSERT_EQ(20u, order.size());
+  ASSERT_TRUE(std::is_sorted(order.begin(), order.end()));
+  ASSERT_EQ(0, order.front());
+  uint64_t psize {0};
+  ASSERT_EQ(0, store->stat("latency_obj", &psize));
+  ASSERT_EQ(21 * entry.length(), psize);
+}
+
+//------------------------------------------------------------------------------
+// Tail latency of inserts and erases while compactions happen
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, DISABLED_CompactionTailLatency)
+{
+  int num_entries {20000};
+  int num_ops {400000};
+  std::string obj_name = mConfig["obj_name"] + "_compact_lat";
+  rados::map<std::string, std::string> map(mBackend, obj_name,
+                                           mConfig["cookie"], false);
+  std::vector<std::pair<std::string, std::string>> entries;
+
+  for (int i = 0; i < num_entries; ++i)
+    entries.push_back(std::make_pair("key_" + std::to_string(i), "value"));
+
+  ASSERT_TRUE(map.insert_many(entries));
+  std::vector<double> tm_ops; // in microseconds
+
+  for (int i = 0; i < num_ops; ++i)
+  {
+    std::string key = "churn_" + std::to_string((i / 2) % 100);
+    auto duration = timethis([&] {
+        if (i % 2)
+          map.erase(key);
+        else
+          (void) map.insert(key, "value");
+      });
+    tm_ops.push_back((double)duration / 1000.0);
+  }
+
+  auto info_stat = compute_statistics(tm_ops);
+  std::sort(tm_ops.begin(), tm_ops.end());
+  fprintf(stdout, "Mutations with compaction num_ops=%i, map size=%i, "
+          "mean=%f, p50=%f, p99=%f, p999=%f, max=%f (microsec)\n", num_ops,
+          num_entries, info_stat.first, tm_ops[tm_ops.size() / 2],
+          tm_ops[tm_ops.size() * 99 / 100], tm_ops[tm_ops.size() * 999 / 1000],
+          tm_ops.back());
+}
+
+//------------------------------------------------------------------------------
+// Replay speed and peak memory of text versus binary changelogs. The number
+// of entries can be set through RVMAP_REPLAY_ENTRIES, the peak is the one of
+// the load alone if the kernel can reset it.
+//------------------------------------------------------------------------------
+TEST_F(RadosMapTest, DISABLED_ReplayThroughput)
+{
+  int num_entries {getenv("RVMAP_REPLAY_ENTRIES") ?
+                   atoi(getenv("RVMAP_REPLAY_ENTRIES")) : 1000000};
+  // Peak resident set size in KB
+  auto peak_rss = []() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    long hwm {0};
+
+    while (std::getline(status, line))
+    {
+      if (line.compare(0, 6, "VmHWM:") == 0)
+        hwm = atol(line.c_str() + 6);
+    }
+
+    if (hwm == 0)
+    {
+      struct rusage usage;
+      (void) getrusage(RUSAGE_SELF, &usage);
+      hwm = usage.ru_maxrss;
+    }
+
+    return hwm;
+  };
+  std::string obj_name = mConfig["obj_name"] + "_replay";
+  std::string obj_id = "/map/" + obj_name + "/" + mConfig["cookie"];
+
+  for (bool binary: {false, true})
+  {
+    std::string data = (binary ? rados::ChangeLog::Header() : "");
+
+    for (int i = 0; i < num_entries; ++i)
+    {
+      std::string key = "replay_key_" + std::to_string(i % (num_entries / 2));
+
+      if (binary)
+        rados::ChangeLog::EncodeInsert(key, std::string("replay_value"), data);
+      else
+        data += "+ " + key + " replay_value\n";
+    }
+
+    librados::bufferlist chlog_data;
+    chlog_data.append(data);
+    std::map<std::string, librados::bufferlist> omap;
+    omap["obj_epoch_key"].append(std::to_string(num_entries));
+    (void) mBackend->remove(obj_id);
+    ASSERT_EQ(0, mBackend->write_full(obj_id, chlog_data));
+    ASSERT_EQ(0, mBackend->omap_set(obj_id, omap));
+    uint64_t map_size {0};
+    uint64_t log_size = data.length();
+    std::string().swap(data);
+    chlog_data.clear();
+    // Give the memory freed back and reset the peak to the current resident
+    // set size
+    (void) malloc_trim(0);
+    std::ofstream("/proc/self/clear_refs") << "5";
+    long rss_before = peak_rss();
+
+    auto duration = timethis([&] {
+        rados::map<std::string, std::string> map(mBackend,
+                                                 obj_name, mConfig["cookie"]);
+        map_size = map.size();
+      });
+
+    long rss_after = peak_rss();
+    ASSERT_EQ(num_entries / 2, (int)map_size);
+    fprintf(stdout, "Replay binary=%i, num_entries=%i, log size=%lu, "
+            "time=%f ms, throughput=%f MB/s, peak rss=%ld KB (+%ld KB)\n",
+            binary, num_entries, log_size, duration / 1e6,
+            log_size / (duration / 1e3), rss_after, rss_after - rss_before);
+  }
+
+  (void) mBackend->remove(obj_id);
+}
+
 //------------------------------------------------------------------------------
 // Test conversion from different objects to string
 //------------------------------------------------------------------------------